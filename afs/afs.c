@@ -18,13 +18,26 @@
 	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <dirent.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "afs.h"
+#include "../nbl/compat.h"
+#include "../nbl/manifest.h"
+#include "../nbl/probes.h"
 
 #define AFS_READ_INT(buf, pos) (*((int*)(buf + pos)))
 #define AFS_READ_UINT(buf, pos) (*((unsigned int*)(buf + pos)))
+#define AFS_READ_USHORT(buf, pos) (*((unsigned short*)(buf + pos)))
+#define AFS_WRITE_UINT(buf, pos, val) (*((unsigned int*)(buf + pos)) = (val))
+#define AFS_WRITE_USHORT(buf, pos, val) (*((unsigned short*)(buf + pos)) = (val))
+
+#define AFS_ALIGN(size) (((size) + AFS_PADDING_SIZE - 1) & ~(AFS_PADDING_SIZE - 1))
 
 /**
  * Open a .afs file and check its identifier for validity.
@@ -35,7 +48,8 @@ char* afs_load(char* pstrFilename)
 {
 	FILE* pFile = NULL;
 	char* pstrBuffer = NULL;
-	int iRead, iSize;
+	size_t iRead;
+	off_t iSize;
 
 	if (pstrFilename == NULL)
 		return NULL;
@@ -44,17 +58,17 @@ char* afs_load(char* pstrFilename)
 	if (pFile == NULL)
 		return NULL;
 
-	fseek(pFile, 0, SEEK_END);
-	iSize = ftell(pFile);
+	fseeko(pFile, 0, SEEK_END);
+	iSize = ftello(pFile);
 
-	if (iSize < 4)
+	if (iSize < 4 || (unsigned long long)iSize > (size_t)-1)
 		goto nbl_load_ret;
 
 	pstrBuffer = malloc(iSize);
 	if (pstrBuffer == NULL)
 		goto nbl_load_ret;
 
-	fseek(pFile, 0, SEEK_SET);
+	fseeko(pFile, 0, SEEK_SET);
 	iRead = fread(pstrBuffer, sizeof(char), 4, pFile);
 
 	if (iRead != 4) {
@@ -71,7 +85,7 @@ char* afs_load(char* pstrFilename)
 
 	iRead = fread(pstrBuffer + 4, sizeof(char), iSize - 4, pFile);
 
-	if (iRead != iSize - 4) {
+	if (iRead != (size_t)(iSize - 4)) {
 		free(pstrBuffer);
 		pstrBuffer = NULL;
 		/* goto nbl_load_ret; */
@@ -86,9 +100,9 @@ nbl_load_ret:
  * Return the position of the filenames list.
  */
 
-static inline int afs_get_filenames_pos(char* pstrBuffer)
+static inline unsigned int afs_get_filenames_pos(char* pstrBuffer)
 {
-	return AFS_READ_INT(pstrBuffer, AFS_HEADER_CHUNKS + AFS_READ_INT(pstrBuffer, AFS_HEADER_NB_CHUNKS) * AFS_CHUNK_HEADER_SIZE);
+	return AFS_READ_UINT(pstrBuffer, AFS_HEADER_CHUNKS + AFS_READ_INT(pstrBuffer, AFS_HEADER_NB_CHUNKS) * AFS_CHUNK_HEADER_SIZE);
 }
 
 /**
@@ -97,13 +111,14 @@ static inline int afs_get_filenames_pos(char* pstrBuffer)
 
 void afs_list_files(char* pstrBuffer)
 {
-	int i, iFilenamesPos, iNbChunks;
+	unsigned int iFilenamesPos;
+	int i, iNbChunks;
 
 	iFilenamesPos = afs_get_filenames_pos(pstrBuffer);
 	iNbChunks = AFS_READ_INT(pstrBuffer, AFS_HEADER_NB_CHUNKS);
 
 	for (i = 0; i < iNbChunks; i++)
-		printf("%s\n", pstrBuffer + iFilenamesPos + i * 0x30);
+		printf("%s\n", pstrBuffer + iFilenamesPos + i * AFS_FILENAME_SIZE);
 }
 
 /**
@@ -112,7 +127,8 @@ void afs_list_files(char* pstrBuffer)
 
 void afs_extract_all(char* pstrBuffer, char* pstrDestPath)
 {
-	int i, iFilenamesPos, iNbChunks, iLen;
+	unsigned int iFilenamesPos;
+	int i, iNbChunks, iLen;
 	FILE* pFile;
 	char* pstrFilename;
 
@@ -130,9 +146,10 @@ void afs_extract_all(char* pstrBuffer, char* pstrDestPath)
 
 	iFilenamesPos = afs_get_filenames_pos(pstrBuffer);
 	iNbChunks = AFS_READ_INT(pstrBuffer, AFS_HEADER_NB_CHUNKS);
+	NBL_PROBE2(afs_extract_all__start, pstrBuffer, iNbChunks);
 
 	for (i = 0; i < iNbChunks; i++) {
-		strncpy(pstrFilename + iLen, pstrBuffer + iFilenamesPos + i * 0x30, AFS_CHUNK_FILENAME_SIZE);
+		strncpy(pstrFilename + iLen, pstrBuffer + iFilenamesPos + i * AFS_FILENAME_SIZE, AFS_CHUNK_FILENAME_SIZE);
 
 		pFile = fopen(pstrFilename, "wb");
 		if (pFile) {
@@ -142,5 +159,612 @@ void afs_extract_all(char* pstrBuffer, char* pstrDestPath)
 		}
 	}
 
+	NBL_PROBE2(afs_extract_all__end, pstrBuffer, iNbChunks);
 	free(pstrFilename);
 }
+
+/**
+ * Read the chunks table, including the filenames list position, and the filenames list.
+ * Returns 0 on success with new buffers in ppstrChunks and ppstrFilenames.
+ */
+
+int afs_read_tables(int iFd, int* piNbChunks, char** ppstrChunks, char** ppstrFilenames)
+{
+	char pstrHeader[AFS_HEADER_CHUNKS];
+	int iNbChunks, iTableSize;
+
+	if (pread(iFd, pstrHeader, AFS_HEADER_CHUNKS, 0) != AFS_HEADER_CHUNKS
+		|| AFS_READ_UINT(pstrHeader, AFS_HEADER_IDENTIFIER) != AFS_ID)
+		return -1;
+
+	iNbChunks = AFS_READ_INT(pstrHeader, AFS_HEADER_NB_CHUNKS);
+	if (iNbChunks <= 0)
+		return -1;
+
+	iTableSize = (iNbChunks + 1) * AFS_CHUNK_HEADER_SIZE;
+	*ppstrChunks = malloc(iTableSize);
+	*ppstrFilenames = malloc(iNbChunks * AFS_FILENAME_SIZE);
+
+	if (*ppstrChunks == NULL || *ppstrFilenames == NULL
+		|| pread(iFd, *ppstrChunks, iTableSize, AFS_HEADER_CHUNKS) != iTableSize
+		|| pread(iFd, *ppstrFilenames, iNbChunks * AFS_FILENAME_SIZE,
+			AFS_READ_UINT(*ppstrChunks, iNbChunks * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS)) != iNbChunks * AFS_FILENAME_SIZE) {
+		free(*ppstrChunks);
+		free(*ppstrFilenames);
+		return -1;
+	}
+
+	*piNbChunks = iNbChunks;
+	return 0;
+}
+
+/**
+ * Write the whole buffer at the given position, zero-filling up to uPaddedSize.
+ */
+
+static int afs_write_at(int iFd, char* pstrData, unsigned int uSize, unsigned int uPaddedSize, off_t iPos)
+{
+	char pstrZero[AFS_PADDING_SIZE];
+	unsigned int uWritten = 0;
+	ssize_t iRet;
+
+	while (uWritten < uSize) {
+		iRet = pwrite(iFd, pstrData + uWritten, uSize - uWritten, iPos + uWritten);
+		if (iRet <= 0)
+			return -1;
+		uWritten += iRet;
+	}
+
+	memset(pstrZero, 0, AFS_PADDING_SIZE);
+	while (uWritten < uPaddedSize) {
+		iRet = pwrite(iFd, pstrZero, uPaddedSize - uWritten < AFS_PADDING_SIZE ? uPaddedSize - uWritten : AFS_PADDING_SIZE, iPos + uWritten);
+		if (iRet <= 0)
+			return -1;
+		uWritten += iRet;
+	}
+
+	return 0;
+}
+
+/**
+ * Copy uSize bytes from one file to another.
+ * When pSum is given the data is also added to it, one window at a time.
+ */
+
+static int afs_copy_range(int iFdIn, off_t iPosIn, int iFdOut, off_t iPosOut, unsigned int uSize,
+	struct manifest_ctx* pManifest, struct manifest_sum* pSum)
+{
+	char* pstrBuffer;
+	unsigned int uChunk;
+	int ret = 0;
+
+	pstrBuffer = malloc(AFS_PADDING_SIZE * 512);
+	if (pstrBuffer == NULL)
+		return -3;
+
+	while (uSize > 0) {
+		uChunk = uSize < AFS_PADDING_SIZE * 512 ? uSize : AFS_PADDING_SIZE * 512;
+		if (pread(iFdIn, pstrBuffer, uChunk, iPosIn) != (ssize_t)uChunk
+			|| afs_write_at(iFdOut, pstrBuffer, uChunk, uChunk, iPosOut) != 0) {
+			ret = -1;
+			break;
+		}
+
+		if (pSum)
+			manifest_sum_update(pManifest, pSum, pstrBuffer, uChunk);
+
+		iPosIn += uChunk;
+		iPosOut += uChunk;
+		uSize -= uChunk;
+	}
+
+	free(pstrBuffer);
+	return ret;
+}
+
+/**
+ * Extract all the files directly from the afs file.
+ * Only the tables are kept in memory; the data is copied one window at a time.
+ * When pManifest is given each file is hashed as it is copied and added to it.
+ */
+
+int afs_extract(char* pstrFilename, char* pstrDestPath, struct manifest_ctx* pManifest)
+{
+	struct manifest_sum sum;
+	char* pstrChunks;
+	char* pstrFilenames;
+	char pstrPath[FILENAME_MAX];
+	int i, iFd, iFdOut, iLen, iNbChunks, ret = 0;
+
+	iFd = open(pstrFilename, O_RDONLY | O_BINARY);
+	if (iFd < 0)
+		return -1;
+
+	NBL_PROBE1(afs_extract__start, pstrFilename);
+
+	if (afs_read_tables(iFd, &iNbChunks, &pstrChunks, &pstrFilenames) != 0) {
+		close(iFd);
+		NBL_PROBE2(afs_extract__end, pstrFilename, -1);
+		return -1;
+	}
+
+	iLen = 0;
+	if (pstrDestPath != NULL) {
+		iLen = snprintf(pstrPath, FILENAME_MAX - AFS_CHUNK_FILENAME_SIZE - 1, "%s", pstrDestPath);
+		if (iLen > 0 && pstrPath[iLen - 1] != '/' && pstrPath[iLen - 1] != '\\')
+			pstrPath[iLen++] = '/';
+	}
+
+	for (i = 0; i < iNbChunks; i++) {
+		memcpy(pstrPath + iLen, pstrFilenames + i * AFS_FILENAME_SIZE + AFS_FILENAME_NAME, AFS_CHUNK_FILENAME_SIZE);
+		pstrPath[iLen + AFS_CHUNK_FILENAME_SIZE] = 0;
+
+		iFdOut = open(pstrPath, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC, 0644);
+		if (iFdOut < 0) {
+			ret = -1;
+			continue;
+		}
+
+		manifest_sum_init(&sum);
+		if (afs_copy_range(iFd, AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS), iFdOut, 0,
+			AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE), pManifest, pManifest ? &sum : NULL) != 0)
+			ret = -1;
+		else if (pManifest && manifest_add(pManifest, pstrPath + iLen,
+			AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS), &sum) != 0)
+			ret = -1;
+
+		if (close(iFdOut) != 0)
+			ret = -1;
+	}
+
+	free(pstrChunks);
+	free(pstrFilenames);
+	close(iFd);
+
+	NBL_PROBE2(afs_extract__end, pstrFilename, ret);
+	return ret;
+}
+
+/**
+ * List the files directly from the afs file, reading only the tables.
+ * With iDetails, also print the position, size and date of each file.
+ */
+
+int afs_list(char* pstrFilename, int iDetails)
+{
+	char* pstrChunks;
+	char* pstrFilenames;
+	char* pstrName;
+	int i, iFd, iNbChunks;
+
+	iFd = open(pstrFilename, O_RDONLY | O_BINARY);
+	if (iFd < 0)
+		return -1;
+
+	if (afs_read_tables(iFd, &iNbChunks, &pstrChunks, &pstrFilenames) != 0) {
+		close(iFd);
+		return -1;
+	}
+
+	for (i = 0; i < iNbChunks; i++) {
+		pstrName = pstrFilenames + i * AFS_FILENAME_SIZE;
+		if (iDetails)
+			printf("%08x %10u %04u-%02u-%02u %02u:%02u:%02u %.*s\n",
+				AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS),
+				AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE),
+				AFS_READ_USHORT(pstrName, AFS_FILENAME_DATE), AFS_READ_USHORT(pstrName, AFS_FILENAME_DATE + 2),
+				AFS_READ_USHORT(pstrName, AFS_FILENAME_DATE + 4), AFS_READ_USHORT(pstrName, AFS_FILENAME_DATE + 6),
+				AFS_READ_USHORT(pstrName, AFS_FILENAME_DATE + 8), AFS_READ_USHORT(pstrName, AFS_FILENAME_DATE + 10),
+				AFS_CHUNK_FILENAME_SIZE, pstrName + AFS_FILENAME_NAME);
+		else
+			printf("%.*s\n", AFS_CHUNK_FILENAME_SIZE, pstrName + AFS_FILENAME_NAME);
+	}
+
+	free(pstrChunks);
+	free(pstrFilenames);
+	close(iFd);
+
+	return 0;
+}
+
+/**
+ * Rewrite the whole file with the entry i replaced and all the entries packed again.
+ * The new file is written next to the old one and renamed over it when complete.
+ */
+
+static int afs_rebuild(char* pstrFilename, int iFd, int iNbChunks, char* pstrChunks, char* pstrFilenames,
+	int iEntry, char* pstrData, unsigned int uSize)
+{
+	char pstrTmpFilename[FILENAME_MAX];
+	char* pstrHeader;
+	unsigned int uHeaderSize, uPos, uChunkSize;
+	int i, iFdOut, ret = 0;
+
+	snprintf(pstrTmpFilename, FILENAME_MAX, "%s.tmp", pstrFilename);
+	iFdOut = open(pstrTmpFilename, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC, 0644);
+	if (iFdOut < 0)
+		return -1;
+
+	uHeaderSize = AFS_ALIGN(AFS_HEADER_CHUNKS + (iNbChunks + 1) * AFS_CHUNK_HEADER_SIZE);
+	pstrHeader = calloc(uHeaderSize, 1);
+	if (pstrHeader == NULL) {
+		ret = -3;
+		goto afs_rebuild_ret;
+	}
+
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_IDENTIFIER, AFS_ID);
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_NB_CHUNKS, iNbChunks);
+
+	uPos = uHeaderSize;
+	for (i = 0; i < iNbChunks; i++) {
+		uChunkSize = i == iEntry ? uSize : AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE);
+
+		if (i == iEntry)
+			ret = afs_write_at(iFdOut, pstrData, uSize, AFS_ALIGN(uSize), uPos);
+		else
+			ret = afs_copy_range(iFd, AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS), iFdOut, uPos, uChunkSize, NULL, NULL);
+		if (ret != 0)
+			goto afs_rebuild_ret;
+
+		/* Empty entries are left at position 0 like in afs_create. */
+		if (uChunkSize > 0)
+			AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS, uPos);
+		AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE, uChunkSize);
+		uPos += AFS_ALIGN(uChunkSize);
+	}
+
+	if (AFS_READ_UINT(pstrFilenames, iEntry * AFS_FILENAME_SIZE + AFS_FILENAME_FILE_SIZE) == AFS_READ_UINT(pstrChunks, iEntry * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE))
+		AFS_WRITE_UINT(pstrFilenames, iEntry * AFS_FILENAME_SIZE + AFS_FILENAME_FILE_SIZE, uSize);
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + iNbChunks * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS, uPos);
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + iNbChunks * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE, iNbChunks * AFS_FILENAME_SIZE);
+
+	ret = afs_write_at(iFdOut, pstrFilenames, iNbChunks * AFS_FILENAME_SIZE, AFS_ALIGN(iNbChunks * AFS_FILENAME_SIZE), uPos);
+	if (ret == 0)
+		ret = afs_write_at(iFdOut, pstrHeader, uHeaderSize, uHeaderSize, 0);
+
+afs_rebuild_ret:
+	free(pstrHeader);
+	if (close(iFdOut) != 0 && ret == 0)
+		ret = -1;
+
+	if (ret == 0 && rename(pstrTmpFilename, pstrFilename) != 0)
+		ret = -1;
+	if (ret != 0)
+		unlink(pstrTmpFilename);
+
+	return ret;
+}
+
+/**
+ * Replace the contents of an entry of the given file.
+ *
+ * When the new data fits in the space allocated to the entry, that is up to the next
+ * entry or filenames list, it is written in place and only the size fields are updated.
+ * Otherwise the entry is moved to the end of the file, leaving its old space unused.
+ * Empty entries and entries starting at the same position as another have no space
+ * of their own and are always moved.
+ * If iRebuild is set the whole file is rewritten instead.
+ */
+
+int afs_replace(char* pstrFilename, char* pstrEntry, char* pstrData, unsigned int uSize, int iRebuild)
+{
+	char* pstrChunks;
+	char* pstrFilenames;
+	char pstrField[AFS_CHUNK_HEADER_SIZE];
+	unsigned int uPos, uOldSize, uNext, uTmp;
+	off_t iEnd;
+	int i, iEntry, iFd, iNbChunks, ret = 0;
+
+	iFd = open(pstrFilename, (iRebuild ? O_RDONLY : O_RDWR) | O_BINARY);
+	if (iFd < 0)
+		return -1;
+
+	if (afs_read_tables(iFd, &iNbChunks, &pstrChunks, &pstrFilenames) != 0) {
+		close(iFd);
+		return -1;
+	}
+
+	for (iEntry = 0; iEntry < iNbChunks; iEntry++)
+		if (strncmp(pstrFilenames + iEntry * AFS_FILENAME_SIZE + AFS_FILENAME_NAME, pstrEntry, AFS_CHUNK_FILENAME_SIZE) == 0)
+			break;
+
+	if (iEntry == iNbChunks) {
+		ret = -2;
+		goto afs_replace_ret;
+	}
+
+	if (iRebuild) {
+		ret = afs_rebuild(pstrFilename, iFd, iNbChunks, pstrChunks, pstrFilenames, iEntry, pstrData, uSize);
+		goto afs_replace_ret;
+	}
+
+	uPos = AFS_READ_UINT(pstrChunks, iEntry * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS);
+	uOldSize = AFS_READ_UINT(pstrChunks, iEntry * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE);
+
+	/* The entry owns everything up to the closest following entry or the filenames list. */
+	iEnd = lseek(iFd, 0, SEEK_END);
+	uNext = iEnd > 0xFFFFFFFF ? 0xFFFFFFFF : (unsigned int)iEnd;
+	if (uOldSize == 0)
+		uNext = uPos;
+	for (i = 0; i <= iNbChunks; i++) {
+		uTmp = AFS_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS);
+		if (i != iEntry && uTmp >= uPos && uTmp < uNext)
+			uNext = uTmp;
+	}
+
+	if (uNext > uPos && uSize <= uNext - uPos)
+		ret = afs_write_at(iFd, pstrData, uSize, uSize < uOldSize ? uOldSize : uSize, uPos);
+	else {
+		if ((off_t)AFS_ALIGN(iEnd) + uSize > 0xFFFFFFFF) {
+			ret = -2;
+			goto afs_replace_ret;
+		}
+
+		uPos = AFS_ALIGN(iEnd);
+		ret = afs_write_at(iFd, pstrData, uSize, AFS_ALIGN(uSize), uPos);
+	}
+
+	if (ret != 0)
+		goto afs_replace_ret;
+
+	/* Update the size field in the filenames list when it is used, then the chunks table. */
+	if (AFS_READ_UINT(pstrFilenames, iEntry * AFS_FILENAME_SIZE + AFS_FILENAME_FILE_SIZE) == uOldSize) {
+		AFS_WRITE_UINT(pstrField, 0, uSize);
+		ret = afs_write_at(iFd, pstrField, 4, 4, AFS_READ_UINT(pstrChunks, iNbChunks * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS)
+			+ iEntry * AFS_FILENAME_SIZE + AFS_FILENAME_FILE_SIZE);
+	}
+
+	if (ret == 0) {
+		AFS_WRITE_UINT(pstrField, AFS_CHUNK_POS, uPos);
+		AFS_WRITE_UINT(pstrField, AFS_CHUNK_SIZE, uSize);
+		ret = afs_write_at(iFd, pstrField, AFS_CHUNK_HEADER_SIZE, AFS_CHUNK_HEADER_SIZE, AFS_HEADER_CHUNKS + iEntry * AFS_CHUNK_HEADER_SIZE);
+	}
+
+afs_replace_ret:
+	free(pstrChunks);
+	free(pstrFilenames);
+	if (close(iFd) != 0 && ret == 0)
+		ret = -1;
+
+	return ret;
+}
+
+/**
+ * Files to be copied by the afs_create threads.
+ * Each thread takes the next file index until all the files are copied.
+ */
+
+typedef struct {
+	nbl_mutex mutex;
+	int iNext;
+	int iNbFiles;
+	char** ppstrPaths;
+	char* pstrChunks;
+	int iFdOut;
+	int iError;
+} afs_create_struct;
+
+/**
+ * Copy a whole input file to the given position of the output file.
+ * The kernel does the copy when possible; otherwise fall back to a read/write loop.
+ */
+
+static int afs_copy_file(char* pstrPath, int iFdOut, off_t iPosOut, unsigned int uSize)
+{
+	int iFdIn, ret = 0;
+#ifdef __linux__
+	loff_t iPosIn = 0;
+	loff_t iPos = iPosOut;
+	ssize_t iRet;
+#endif
+
+	iFdIn = open(pstrPath, O_RDONLY | O_BINARY);
+	if (iFdIn < 0)
+		return -1;
+
+#ifdef __linux__
+	while (uSize > 0) {
+		iRet = copy_file_range(iFdIn, &iPosIn, iFdOut, &iPos, uSize, 0);
+		if (iRet <= 0)
+			break;
+		uSize -= iRet;
+	}
+
+	if (uSize > 0)
+		ret = afs_copy_range(iFdIn, iPosIn, iFdOut, iPos, uSize, NULL, NULL);
+#else
+	ret = afs_copy_range(iFdIn, 0, iFdOut, iPosOut, uSize, NULL, NULL);
+#endif
+
+	close(iFdIn);
+	return ret;
+}
+
+static void* afs_create_thread(void* pArg)
+{
+	afs_create_struct* p = pArg;
+	int i;
+
+	while (1) {
+		nbl_mutex_lock(&p->mutex);
+		i = p->iError ? p->iNbFiles : p->iNext++;
+		nbl_mutex_unlock(&p->mutex);
+
+		if (i >= p->iNbFiles)
+			break;
+
+		if (afs_copy_file(p->ppstrPaths[i], p->iFdOut,
+			AFS_READ_UINT(p->pstrChunks, AFS_HEADER_CHUNKS + i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS),
+			AFS_READ_UINT(p->pstrChunks, AFS_HEADER_CHUNKS + i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE)) != 0) {
+			nbl_mutex_lock(&p->mutex);
+			p->iError = -1;
+			nbl_mutex_unlock(&p->mutex);
+			fprintf(stderr, "Error copying file %s\n", p->ppstrPaths[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Create an afs file from the files found in the source path.
+ *
+ * All the positions are computed first so that the headers are written once and
+ * the files can be copied directly at their final position by iNbThreads threads.
+ * Each file is aligned on AFS_PADDING_SIZE, followed by the filenames list.
+ * Empty files are stored at position 0.
+ */
+
+int afs_create(char* pstrSrcPath, char* pstrFilename, int iNbThreads)
+{
+	afs_create_struct p;
+	struct dirent** ppEntries;
+	struct stat st;
+	struct tm tm;
+	nbl_thread* pThreads = NULL;
+	char* pstrHeader = NULL;
+	char* pstrFilenames = NULL;
+	char pstrPath[FILENAME_MAX];
+	unsigned int uHeaderSize;
+	off_t iPos;
+	int i, iNbEntries, iNbFiles = 0, ret = 0;
+
+	iNbEntries = scandir(pstrSrcPath, &ppEntries, NULL, alphasort);
+	if (iNbEntries < 0)
+		return -1;
+
+	memset(&p, 0, sizeof(p));
+	p.iFdOut = -1;
+	p.ppstrPaths = calloc(iNbEntries, sizeof(char*));
+	uHeaderSize = AFS_ALIGN(AFS_HEADER_CHUNKS + (iNbEntries + 1) * AFS_CHUNK_HEADER_SIZE);
+	pstrHeader = calloc(uHeaderSize, 1);
+	pstrFilenames = calloc(iNbEntries, AFS_FILENAME_SIZE);
+	if (p.ppstrPaths == NULL || pstrHeader == NULL || pstrFilenames == NULL) {
+		ret = -3;
+		goto afs_create_ret;
+	}
+
+	/* Compute the layout. */
+
+	iPos = uHeaderSize;
+	for (i = 0; i < iNbEntries; i++) {
+		snprintf(pstrPath, FILENAME_MAX, "%s/%s", pstrSrcPath, ppEntries[i]->d_name);
+		if (stat(pstrPath, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (strlen(ppEntries[i]->d_name) >= AFS_CHUNK_FILENAME_SIZE) {
+			fprintf(stderr, "Filename too long: %s\n", ppEntries[i]->d_name);
+			ret = -2;
+			goto afs_create_ret;
+		}
+
+		p.ppstrPaths[iNbFiles] = strdup(pstrPath);
+		if (p.ppstrPaths[iNbFiles] == NULL) {
+			ret = -3;
+			goto afs_create_ret;
+		}
+
+		/* Empty files take no space; their position is left to 0 so it isn't shared with the next file. */
+		if (st.st_size > 0)
+			AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + iNbFiles * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS, iPos);
+		AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + iNbFiles * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE, st.st_size);
+
+		strcpy(pstrFilenames + iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_NAME, ppEntries[i]->d_name);
+		localtime_r(&st.st_mtime, &tm);
+		AFS_WRITE_USHORT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_DATE, tm.tm_year + 1900);
+		AFS_WRITE_USHORT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_DATE + 2, tm.tm_mon + 1);
+		AFS_WRITE_USHORT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_DATE + 4, tm.tm_mday);
+		AFS_WRITE_USHORT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_DATE + 6, tm.tm_hour);
+		AFS_WRITE_USHORT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_DATE + 8, tm.tm_min);
+		AFS_WRITE_USHORT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_DATE + 10, tm.tm_sec);
+		AFS_WRITE_UINT(pstrFilenames, iNbFiles * AFS_FILENAME_SIZE + AFS_FILENAME_FILE_SIZE, st.st_size);
+
+		iPos += AFS_ALIGN((off_t)st.st_size);
+		iNbFiles++;
+	}
+
+	if (iNbFiles == 0) {
+		fprintf(stderr, "No files found in %s\n", pstrSrcPath);
+		ret = -2;
+		goto afs_create_ret;
+	}
+
+	/* Positions are 32-bit. */
+	if (iPos + AFS_ALIGN(iNbFiles * AFS_FILENAME_SIZE) > 0xFFFFFFFF) {
+		fprintf(stderr, "Files too large for an afs file\n");
+		ret = -2;
+		goto afs_create_ret;
+	}
+
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_IDENTIFIER, AFS_ID);
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_NB_CHUNKS, iNbFiles);
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + iNbFiles * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS, iPos);
+	AFS_WRITE_UINT(pstrHeader, AFS_HEADER_CHUNKS + iNbFiles * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE, iNbFiles * AFS_FILENAME_SIZE);
+
+	/* Write the headers; the padding is left to the sparse file. */
+
+	p.iFdOut = open(pstrFilename, O_WRONLY | O_BINARY | O_CREAT | O_TRUNC, 0644);
+	if (p.iFdOut < 0) {
+		ret = -1;
+		goto afs_create_ret;
+	}
+
+	if (ftruncate(p.iFdOut, iPos + AFS_ALIGN(iNbFiles * AFS_FILENAME_SIZE)) != 0
+		|| afs_write_at(p.iFdOut, pstrHeader, uHeaderSize, uHeaderSize, 0) != 0
+		|| afs_write_at(p.iFdOut, pstrFilenames, iNbFiles * AFS_FILENAME_SIZE, iNbFiles * AFS_FILENAME_SIZE, iPos) != 0) {
+		ret = -1;
+		goto afs_create_ret;
+	}
+
+	/* Copy the files. */
+
+	if (iNbThreads < 1)
+		iNbThreads = 1;
+	if (iNbThreads > iNbFiles)
+		iNbThreads = iNbFiles;
+
+	p.iNbFiles = iNbFiles;
+	p.pstrChunks = pstrHeader;
+	nbl_mutex_init(&p.mutex);
+
+	pThreads = malloc(iNbThreads * sizeof(nbl_thread));
+	if (pThreads == NULL) {
+		ret = -3;
+		goto afs_create_destroy;
+	}
+
+	for (i = 0; i < iNbThreads; i++)
+		if (nbl_thread_create(&pThreads[i], afs_create_thread, &p) != 0)
+			break;
+
+	/* Run the remaining work in this thread if some threads couldn't be started. */
+	if (i < iNbThreads)
+		afs_create_thread(&p);
+
+	iNbThreads = i;
+	for (i = 0; i < iNbThreads; i++)
+		nbl_thread_join(pThreads[i]);
+
+	ret = p.iError;
+
+afs_create_destroy:
+	nbl_mutex_destroy(&p.mutex);
+
+afs_create_ret:
+	if (p.iFdOut >= 0 && close(p.iFdOut) != 0 && ret == 0)
+		ret = -1;
+	if (ret != 0 && p.iFdOut >= 0)
+		unlink(pstrFilename);
+
+	for (i = 0; i < iNbFiles; i++)
+		free(p.ppstrPaths[i]);
+	for (i = 0; i < iNbEntries; i++)
+		free(ppEntries[i]);
+	free(ppEntries);
+	free(p.ppstrPaths);
+	free(pstrHeader);
+	free(pstrFilenames);
+	free(pThreads);
+
+	return ret;
+}
@@ -35,13 +35,36 @@
 #define AFS_CHUNK_SIZE			0x04
 #define AFS_CHUNK_FILENAME_SIZE	0x20
 
+/* Positions from the filenames list */
+
+#define AFS_FILENAME_SIZE		0x30
+#define AFS_FILENAME_NAME		0x00
+#define AFS_FILENAME_DATE		0x20 /* Year, month, day, hour, minute, second as 16-bit values. */
+#define AFS_FILENAME_FILE_SIZE	0x2C
+
+/* Padding */
+
+#define AFS_PADDING_SIZE 0x800
+
 /* Identification and loading */
 
 char* afs_load(char* pstrFilename);
+int afs_read_tables(int iFd, int* piNbChunks, char** ppstrChunks, char** ppstrFilenames);
 
 /* List and extract contents */
 
+struct manifest_ctx;
+
+
 void afs_list_files(char* pstrBuffer);
 void afs_extract_all(char* pstrBuffer, char* pstrDestPath);
+int afs_extract(char* pstrFilename, char* pstrDestPath, struct manifest_ctx* pManifest);
+int afs_list(char* pstrFilename, int iDetails);
+
+/* Create and modify contents */
+
+int afs_create(char* pstrSrcPath, char* pstrFilename, int iNbThreads);
+
+int afs_replace(char* pstrFilename, char* pstrEntry, char* pstrData, unsigned int uSize, int iRebuild);
 
 #endif /* __GASETOOLS_AFS_H__ */
@@ -19,21 +19,152 @@
 */
 
 #include <ctype.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include "afs.h"
+#include "../nbl/compat.h"
+#include "../nbl/manifest.h"
+#include "../nbl/watch.h"
+
+/**
+ * Prototypes.
+ */
+
+int replace(char* pstrFilename, char* pstrEntry, char* pstrInput, int iRebuild);
+int extract_watched(char* pstrFilename, char* pstrDestPath, void* pArg);
+
+/**
+ * Replace an entry of the afs file with the contents of the input file.
+ */
+
+int replace(char* pstrFilename, char* pstrEntry, char* pstrInput, int iRebuild)
+{
+	FILE* pFile;
+	char* pstrData;
+	off_t lSize;
+	int ret;
+
+	pFile = fopen(pstrInput, "rb");
+	if (pFile == NULL) {
+		fprintf(stderr, "Error opening file %s\n", pstrInput);
+		return -1;
+	}
+
+	fseeko(pFile, 0, SEEK_END);
+	lSize = ftello(pFile);
+	fseeko(pFile, 0, SEEK_SET);
+
+	/* Sizes are 32-bit in afs files. */
+	if (lSize < 0 || lSize > 0xFFFFFFFF) {
+		fprintf(stderr, "File too large for an afs entry: %s\n", pstrInput);
+		fclose(pFile);
+		return -2;
+	}
+
+	pstrData = malloc(lSize + 1);
+	if (pstrData == NULL || fread(pstrData, 1, lSize, pFile) != (size_t)lSize) {
+		fprintf(stderr, "Error reading file %s\n", pstrInput);
+		fclose(pFile);
+		free(pstrData);
+		return -1;
+	}
+	fclose(pFile);
+
+	ret = afs_replace(pstrFilename, pstrEntry, pstrData, lSize, iRebuild);
+	if (ret == -2)
+		fprintf(stderr, "Entry %s not found or doesn't fit in %s\n", pstrEntry, pstrFilename);
+	else if (ret != 0)
+		fprintf(stderr, "Error writing file %s\n", pstrFilename);
+
+	free(pstrData);
+	return ret;
+}
+
+/**
+ * Extract a file of the watched tree; see watch_tree.
+ * Returns WATCH_SKIP if it isn't an afs archive.
+ */
+
+int extract_watched(char* pstrFilename, char* pstrDestPath, void* pArg)
+{
+	FILE* pFile;
+	unsigned int uId = 0;
+	int ret;
+
+	(void)pArg;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return -1;
+	ret = fread(&uId, 1, 4, pFile);
+	fclose(pFile);
+
+	if (ret != 4 || uId != AFS_ID)
+		return WATCH_SKIP;
+
+	return afs_extract(pstrFilename, pstrDestPath, NULL);
+}
 
 int main(int argc, char** argv)
 {
-	char* pstrBuffer;
 	char* pstrDestPath = NULL;
+	char* pstrEntry = NULL;
+	char* pstrInput = NULL;
+	char* pstrManifest = NULL;
+	char* pstrSrcPath = NULL;
+	char* pstrWatchPath = NULL;
+	struct manifest_ctx* pManifest = NULL;
+	struct option aLongOptions[] = {
+		{"verify", no_argument, NULL, 'V'},
+		{"watch", required_argument, NULL, 'W'},
+		{NULL, 0, NULL, 0}
+	};
+	int iDetails = 0;
+	int iFlags = 0;
 	int iListOnly = 0;
-	int i;
+	int iVerbose = 0;
+	int iVerify = 0;
+	int iNbThreads = NBL_NB_CPUS();
+	int iRebuild = 0;
+	int i, ret;
 
 	opterr = 0;
-	while ((i = getopt(argc, argv, "o:t")) != -1) {
+	while ((i = getopt_long(argc, argv, "c:FHi:j:lm:o:r:tvVW:", aLongOptions, NULL)) != -1) {
 		switch (i) {
+			case 'c':
+				pstrSrcPath = optarg;
+				break;
+
+			case 'F':
+				iRebuild = 1;
+				break;
+
+			case 'H':
+				iFlags |= MANIFEST_HASH64;
+				break;
+
+			case 'i':
+				pstrInput = optarg;
+				break;
+
+			case 'j':
+				iNbThreads = atoi(optarg);
+				break;
+
+			case 'l':
+				iDetails = 1;
+				break;
+
+			case 'm':
+				pstrManifest = optarg;
+				break;
+
+			case 'r':
+				pstrEntry = optarg;
+				break;
+
 			case 'o':
 				pstrDestPath = optarg;
 				break;
@@ -42,8 +173,20 @@ int main(int argc, char** argv)
 				iListOnly = 1;
 				break;
 
+			case 'v':
+				iVerbose = 1;
+				break;
+
+			case 'V':
+				iVerify = 1;
+				break;
+
+			case 'W':
+				pstrWatchPath = optarg;
+				break;
+
 			case '?':
-				if (optopt == 'o')
+				if (optopt == 'c' || optopt == 'i' || optopt == 'j' || optopt == 'm' || optopt == 'o' || optopt == 'r' || optopt == 'W')
 					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 				else if (isprint(optopt))
 					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -57,24 +200,66 @@ int main(int argc, char** argv)
 	}
 
 	i = optind;
-	if (i + 1 != argc) {
-		fprintf(stderr, "Usage: %s [-o destpath] file.afs\n", argv[0]);
+	if (iVerify && pstrManifest != NULL && i == argc) {
+		i = manifest_verify(pstrManifest, pstrDestPath);
+		if (i < 0)
+			fprintf(stderr, "Error opening manifest %s\n", pstrManifest);
+		return i == 0 ? 0 : 1;
+	}
+
+	if (pstrWatchPath) {
+		if (i != argc || pstrDestPath == NULL || pstrSrcPath || pstrEntry || pstrInput || pstrManifest || iListOnly || iVerify) {
+			fprintf(stderr, "Option --watch requires a destination path and no file, and only applies with -v.\n");
+			return 1;
+		}
+
+		return watch_tree(pstrWatchPath, pstrDestPath, extract_watched, NULL, iVerbose) == 0 ? 0 : -1;
+	}
+
+	if (i + 1 != argc || (pstrEntry == NULL) != (pstrInput == NULL) || iVerify) {
+		fprintf(stderr, "Usage: %s [-t [-l]] [-o destpath] [-m manifest [-H]] file.afs\n", argv[0]);
+		fprintf(stderr, "       %s -r entry -i file [-F] file.afs\n", argv[0]);
+		fprintf(stderr, "       %s -c srcpath [-j threads] file.afs\n", argv[0]);
+		fprintf(stderr, "       %s --verify -m manifest [-o destpath]\n", argv[0]);
+		fprintf(stderr, "       %s --watch srcpath -o destpath [-v]\n", argv[0]);
 		return 2;
 	}
 
-	pstrBuffer = afs_load(argv[i]);
-	if (pstrBuffer == NULL)
-		return -1;
+	if (pstrSrcPath) {
+		if (afs_create(pstrSrcPath, argv[i], iNbThreads) != 0) {
+			fprintf(stderr, "Error creating file %s\n", argv[i]);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (pstrEntry)
+		return replace(argv[i], pstrEntry, pstrInput, iRebuild);
 
-	if (iListOnly == 1) {
-		afs_list_files(pstrBuffer);
-		goto main_ret;
+	if (iListOnly) {
+		if (afs_list(argv[i], iDetails) != 0) {
+			fprintf(stderr, "Error opening file %s\n", argv[i]);
+			return -1;
+		}
+		return 0;
 	}
 
-	afs_extract_all(pstrBuffer, pstrDestPath);
+	if (pstrManifest) {
+		pManifest = manifest_open(pstrManifest, iFlags);
+		if (pManifest == NULL) {
+			fprintf(stderr, "Error creating manifest %s\n", pstrManifest);
+			return -1;
+		}
+	}
+
+	ret = afs_extract(argv[i], pstrDestPath, pManifest);
+	if (ret != 0)
+		fprintf(stderr, "Error extracting file %s\n", argv[i]);
 
-main_ret:
-	free(pstrBuffer);
+	if (pManifest && manifest_close(pManifest) != 0) {
+		fprintf(stderr, "Error writing manifest %s\n", pstrManifest);
+		ret = -1;
+	}
 
-	return 0;
+	return ret;
 }
@@ -0,0 +1,547 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../afs/afs.h"
+#include "../nbl/nbl.h"
+
+/**
+ * End-to-end extraction benchmark.
+ *
+ * Synthetic archives are generated for every format, entry count and entry size,
+ * then extracted by the real tools into a tmpfs and a disk directory. The time
+ * includes syncing the output filesystem, so that file creation and writeback
+ * costs show up on disk. No game data is needed.
+ */
+
+/**
+ * Prototypes.
+ */
+
+void bench_fill(char* pstrBuffer, unsigned int uSize, unsigned int uSeed);
+int bench_write_file(char* pstrFilename, char* pstrBuffer, unsigned long long ullSize, int iCount);
+int bench_remove(const char* pstrPath, const struct stat* pStat, int iFlag, struct FTW* pFtw);
+int bench_reset_dir(char* pstrPath);
+int bench_run(char** ppstrArgs, char* pstrDir, char* pstrSyncPath, double* pdTime, long* plRss);
+int bench_generate(int iFormat, int iCount, unsigned int uSize, char** ppstrTargets, int iNbTargets);
+int bench_generate_child(int iFormat, int iCount, unsigned int uSize, char** ppstrTargets, int iNbTargets);
+int bench_selected(char* pstrFormats, char* pstrName);
+
+/**
+ * Archive formats.
+ */
+
+#define BENCH_NBL	0
+#define BENCH_AFS	1
+#define BENCH_FPB	2
+#define BENCH_EXP	3
+
+#define BENCH_KEY_SEED 0x5EED1234
+
+#define EXP_HEADER_SIZE 0x1C /* Sizes and unknown values; see exp/main.c. */
+
+typedef struct {
+	char* pstrName;
+	int iType;
+	int iCompress;
+	unsigned int uKeySeed;
+	char* pstrExtension;
+} bench_format;
+
+static bench_format aFormats[] = {
+	{"nbl", BENCH_NBL, 0, 0, "nbl"},
+	{"nbl-enc", BENCH_NBL, 0, BENCH_KEY_SEED, "nbl"},
+	{"nbl-cmp", BENCH_NBL, 1, 0, "nbl"},
+	{"nbl-cmp-enc", BENCH_NBL, 1, BENCH_KEY_SEED, "nbl"},
+	{"afs", BENCH_AFS, 0, 0, "afs"},
+	{"fpb", BENCH_FPB, 0, 0, "fpb"},
+	{"exp", BENCH_EXP, 1, 0, "exp"}
+};
+
+#define BENCH_NB_FORMATS ((int)(sizeof(aFormats) / sizeof(aFormats[0])))
+
+/**
+ * Entry counts and sizes. Cases larger than the maximum total size are skipped.
+ */
+
+static int aiCounts[] = {1, 10, 100, 1000, 10000};
+static unsigned int auSizes[] = {64, 0x1000, 0x40000, 0x400000, 0x4000000};
+static char* apstrSizes[] = {"64B", "4KB", "256KB", "4MB", "64MB"};
+
+#define BENCH_NB_COUNTS	((int)(sizeof(aiCounts) / sizeof(aiCounts[0])))
+#define BENCH_NB_SIZES	((int)(sizeof(auSizes) / sizeof(auSizes[0])))
+
+/* Entries start at different offsets of a shared pool so that they differ. */
+#define BENCH_POOL_SPREAD 0x1000
+
+#define DEFAULT_MAX_TOTAL 64 /* MB */
+
+#define BENCH_PATH_ROOM 64 /* Room kept after a work directory for the paths made under it. */
+
+/**
+ * Fill the buffer with data that compresses about as well as game files:
+ * half of it repeats a pattern and half of it is noise. The noise never
+ * contains an NMLL identifier, which would confuse fpb.
+ */
+
+void bench_fill(char* pstrBuffer, unsigned int uSize, unsigned int uSeed)
+{
+	unsigned int i, x;
+
+	x = uSeed * 2654435761u + 1;
+	for (i = 0; i < uSize; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		pstrBuffer[i] = (i & 0x40) ? "gasetools "[i % 10] : (char)(0x80 | (x & 0x7F));
+	}
+}
+
+/**
+ * Write the buffer iCount times to a new file.
+ */
+
+int bench_write_file(char* pstrFilename, char* pstrBuffer, unsigned long long ullSize, int iCount)
+{
+	FILE* pFile;
+	int i, ret = 0;
+
+	pFile = fopen(pstrFilename, "wb");
+	if (pFile == NULL)
+		return -1;
+
+	for (i = 0; i < iCount && ret == 0; i++)
+		if (fwrite(pstrBuffer, 1, ullSize, pFile) != ullSize)
+			ret = -1;
+
+	if (fclose(pFile) != 0)
+		ret = -1;
+
+	return ret;
+}
+
+int bench_remove(const char* pstrPath, const struct stat* pStat, int iFlag, struct FTW* pFtw)
+{
+	(void)pStat;
+	(void)iFlag;
+	(void)pFtw;
+
+	return remove(pstrPath);
+}
+
+/**
+ * Empty the directory, creating it if needed.
+ */
+
+int bench_reset_dir(char* pstrPath)
+{
+	if (access(pstrPath, F_OK) == 0 && nftw(pstrPath, bench_remove, 16, FTW_DEPTH | FTW_PHYS) != 0)
+		return -1;
+
+	return mkdir(pstrPath, 0755);
+}
+
+/**
+ * Run a tool, discarding its standard output, then sync the filesystem of pstrSyncPath.
+ * pstrDir is the working directory of the tool, if not NULL.
+ * Returns 0 if the tool succeeded, with its time and peak RSS in KB.
+ */
+
+int bench_run(char** ppstrArgs, char* pstrDir, char* pstrSyncPath, double* pdTime, long* plRss)
+{
+	struct rusage ru;
+	struct timespec tsStart, tsEnd;
+	pid_t pid;
+	int iFd, iStatus;
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &tsStart);
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		if ((pstrDir && chdir(pstrDir) != 0) || freopen("/dev/null", "w", stdout) == NULL)
+			_exit(127);
+		execv(ppstrArgs[0], ppstrArgs);
+		_exit(127);
+	}
+
+	if (wait4(pid, &iStatus, 0, &ru) != pid)
+		return -1;
+
+	iFd = open(pstrSyncPath, O_RDONLY);
+	if (iFd >= 0) {
+		syncfs(iFd);
+		close(iFd);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+
+	*pdTime = (tsEnd.tv_sec - tsStart.tv_sec) + (tsEnd.tv_nsec - tsStart.tv_nsec) / 1e9;
+	*plRss = ru.ru_maxrss;
+
+	return WIFEXITED(iStatus) && WEXITSTATUS(iStatus) == 0 ? 0 : -1;
+}
+
+/**
+ * Generate the input file of a case in every target directory, as in.<extension>.
+ */
+
+int bench_generate(int iFormat, int iCount, unsigned int uSize, char** ppstrTargets, int iNbTargets)
+{
+	bench_format* pFormat = &aFormats[iFormat];
+	char pstrFilename[FILENAME_MAX];
+	char pstrSrcPath[FILENAME_MAX];
+	char** ppstrNames = NULL;
+	char** ppstrFiles = NULL;
+	int* piFileSizes = NULL;
+	char* pstrBuffer = NULL;
+	char* pstrPool;
+	int i, iSize, iNbFiles;
+	int ret = 0;
+
+	pstrPool = malloc(uSize + BENCH_POOL_SPREAD);
+	if (pstrPool == NULL)
+		return -3;
+	bench_fill(pstrPool, uSize + BENCH_POOL_SPREAD, uSize);
+
+	/* fpb extracts whole nbl files: one per entry, each holding a single entry. */
+	iNbFiles = pFormat->iType == BENCH_FPB ? 1 : iCount;
+
+	ppstrNames = calloc(iNbFiles, sizeof(char*));
+	ppstrFiles = calloc(iNbFiles, sizeof(char*));
+	piFileSizes = calloc(iNbFiles, sizeof(int));
+	if (ppstrNames == NULL || ppstrFiles == NULL || piFileSizes == NULL) {
+		ret = -3;
+		goto bench_generate_ret;
+	}
+
+	for (i = 0; i < iNbFiles; i++) {
+		ppstrNames[i] = malloc(NBL_CHUNK_FILENAME_SIZE);
+		if (ppstrNames[i] == NULL) {
+			ret = -3;
+			goto bench_generate_ret;
+		}
+		snprintf(ppstrNames[i], NBL_CHUNK_FILENAME_SIZE, "entry%05d.bin", i);
+		ppstrFiles[i] = pstrPool + (i * 37) % BENCH_POOL_SPREAD;
+		piFileSizes[i] = uSize;
+	}
+
+	switch (pFormat->iType) {
+		case BENCH_NBL:
+		case BENCH_FPB:
+			pstrBuffer = nbl_build(ppstrNames, ppstrFiles, piFileSizes, iNbFiles, pFormat->uKeySeed, pFormat->iCompress, &iSize);
+			if (pstrBuffer == NULL) {
+				ret = -3;
+				goto bench_generate_ret;
+			}
+
+			for (i = 0; i < iNbTargets && ret == 0; i++) {
+				snprintf(pstrFilename, FILENAME_MAX, "%s/in.%s", ppstrTargets[i], pFormat->pstrExtension);
+				ret = bench_write_file(pstrFilename, pstrBuffer, iSize, iCount / iNbFiles);
+			}
+			break;
+
+		case BENCH_AFS:
+			snprintf(pstrSrcPath, FILENAME_MAX, "%s/src", ppstrTargets[0]);
+			ret = bench_reset_dir(pstrSrcPath);
+			for (i = 0; i < iCount && ret == 0; i++) {
+				if (snprintf(pstrFilename, FILENAME_MAX, "%s/%s", pstrSrcPath, ppstrNames[i]) >= FILENAME_MAX)
+					ret = -2;
+				else
+					ret = bench_write_file(pstrFilename, ppstrFiles[i], uSize, 1);
+			}
+
+			for (i = 0; i < iNbTargets && ret == 0; i++) {
+				snprintf(pstrFilename, FILENAME_MAX, "%s/in.%s", ppstrTargets[i], pFormat->pstrExtension);
+				ret = afs_create(pstrSrcPath, pstrFilename, 1);
+			}
+
+			nftw(pstrSrcPath, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+			break;
+
+		case BENCH_EXP:
+			pstrBuffer = calloc(NBL_COMPRESS_BOUND(uSize) + EXP_HEADER_SIZE, 1);
+			if (pstrBuffer == NULL) {
+				ret = -3;
+				goto bench_generate_ret;
+			}
+
+			iSize = nbl_compress(ppstrFiles[0], uSize, pstrBuffer + EXP_HEADER_SIZE, NBL_COMPRESS_BOUND(uSize));
+			if (iSize < 0) {
+				ret = iSize;
+				goto bench_generate_ret;
+			}
+			NBL_WRITE_UINT(pstrBuffer, 0, uSize);
+			NBL_WRITE_UINT(pstrBuffer, 4, iSize);
+
+			for (i = 0; i < iNbTargets && ret == 0; i++) {
+				snprintf(pstrFilename, FILENAME_MAX, "%s/in.%s", ppstrTargets[i], pFormat->pstrExtension);
+				ret = bench_write_file(pstrFilename, pstrBuffer, iSize + EXP_HEADER_SIZE, 1);
+			}
+			break;
+	}
+
+bench_generate_ret:
+	if (ppstrNames)
+		for (i = 0; i < iNbFiles; i++)
+			free(ppstrNames[i]);
+	free(ppstrNames);
+	free(ppstrFiles);
+	free(piFileSizes);
+	free(pstrBuffer);
+	free(pstrPool);
+
+	return ret;
+}
+
+/**
+ * Generate the inputs in a child process. A forked tool starts with the peak RSS
+ * of its parent, so this process must stay small for the measures to be right.
+ */
+
+int bench_generate_child(int iFormat, int iCount, unsigned int uSize, char** ppstrTargets, int iNbTargets)
+{
+	pid_t pid;
+	int iStatus;
+
+	fflush(stdout);
+
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0)
+		_exit(bench_generate(iFormat, iCount, uSize, ppstrTargets, iNbTargets) == 0 ? 0 : 1);
+
+	if (waitpid(pid, &iStatus, 0) != pid)
+		return -1;
+
+	return WIFEXITED(iStatus) && WEXITSTATUS(iStatus) == 0 ? 0 : -1;
+}
+
+/**
+ * Return whether the format is in the comma-separated list.
+ */
+
+int bench_selected(char* pstrFormats, char* pstrName)
+{
+	char* p = pstrFormats;
+	size_t iLen = strlen(pstrName);
+
+	while ((p = strstr(p, pstrName)) != NULL) {
+		if ((p == pstrFormats || p[-1] == ',') && (p[iLen] == 0 || p[iLen] == ','))
+			return 1;
+		p += iLen;
+	}
+
+	return 0;
+}
+
+/**
+ * Entry point.
+ */
+
+int main(int argc, char** argv)
+{
+	char* pstrBinPath = "../build";
+	char* pstrFormats = NULL;
+	char* apstrTargetNames[] = {"tmpfs", "disk"};
+	char* apstrTargetPaths[] = {"/dev/shm", "."};
+	char* apstrTargets[2];
+	char* apstrArgs[6];
+	char pstrTool[FILENAME_MAX];
+	char pstrInput[FILENAME_MAX];
+	char pstrOutput[FILENAME_MAX];
+	char pstrDest[FILENAME_MAX];
+	unsigned long long ullMaxTotal = DEFAULT_MAX_TOTAL;
+	unsigned long long ullTotal;
+	double dTime;
+	long lRss;
+	int i, iFormat, iCount, iSize, iTarget, iNbTargets = 0;
+	int ret = 0;
+
+	opterr = 0;
+	while ((i = getopt(argc, argv, "b:d:f:m:t:")) != -1) {
+		switch (i) {
+			case 'b':
+				pstrBinPath = optarg;
+				break;
+
+			case 'd':
+				apstrTargetPaths[1] = optarg;
+				break;
+
+			case 'f':
+				pstrFormats = optarg;
+				break;
+
+			case 'm':
+				ullMaxTotal = strtoull(optarg, NULL, 10);
+				break;
+
+			case 't':
+				apstrTargetPaths[0] = optarg;
+				break;
+
+			case '?':
+				if (optopt == 'b' || optopt == 'd' || optopt == 'f' || optopt == 'm' || optopt == 't')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 1;
+
+			default:
+				abort();
+		}
+	}
+
+	if (optind != argc || ullMaxTotal == 0) {
+		fprintf(stderr, "Usage: %s [-b bindir] [-t tmpfsdir] [-d diskdir] [-m maxtotal] [-f format,...]\n", argv[0]);
+		fprintf(stderr, "       maxtotal is the largest total entry size of a case, in MB (default %d).\n", DEFAULT_MAX_TOTAL);
+		return 1;
+	}
+	ullMaxTotal <<= 20;
+
+	/* A work directory in each target; a missing tmpfs is skipped. The tools run
+	   from the output directory, so all the paths are made absolute. A target too
+	   deep to build the paths of the work directory is skipped as well. */
+	for (i = 0; i < 2; i++) {
+		if (realpath(apstrTargetPaths[i], pstrOutput) == NULL
+			|| snprintf(pstrDest, FILENAME_MAX, "%s/gasebench-XXXXXX", pstrOutput) >= FILENAME_MAX - BENCH_PATH_ROOM) {
+			fprintf(stderr, "Skipping %s target %s\n", apstrTargetNames[i], apstrTargetPaths[i]);
+			continue;
+		}
+
+		apstrTargets[iNbTargets] = strdup(pstrDest);
+		if (apstrTargets[iNbTargets] == NULL || mkdtemp(apstrTargets[iNbTargets]) == NULL) {
+			fprintf(stderr, "Skipping %s target %s\n", apstrTargetNames[i], apstrTargetPaths[i]);
+			free(apstrTargets[iNbTargets]);
+			continue;
+		}
+		apstrTargetNames[iNbTargets++] = apstrTargetNames[i];
+	}
+
+	if (iNbTargets == 0)
+		return 1;
+
+	printf("%-12s %-6s %8s %6s %9s %11s %9s %9s\n", "format", "target", "entries", "size", "time(s)", "entries/s", "MB/s", "rss(KB)");
+
+	for (iFormat = 0; iFormat < BENCH_NB_FORMATS; iFormat++) {
+		if (pstrFormats && !bench_selected(pstrFormats, aFormats[iFormat].pstrName))
+			continue;
+
+		snprintf(pstrInput, FILENAME_MAX, "%s/%s", pstrBinPath, aFormats[iFormat].iType == BENCH_NBL ? "nbl"
+			: aFormats[iFormat].iType == BENCH_AFS ? "afs" : aFormats[iFormat].iType == BENCH_FPB ? "fpb" : "exp");
+		if (realpath(pstrInput, pstrTool) == NULL || access(pstrTool, X_OK) != 0) {
+			fprintf(stderr, "Tool %s not found; build it first\n", pstrInput);
+			ret = 1;
+			goto main_ret;
+		}
+
+		for (iCount = 0; iCount < BENCH_NB_COUNTS; iCount++) {
+			/* exp files hold a single entry. */
+			if (aFormats[iFormat].iType == BENCH_EXP && aiCounts[iCount] != 1)
+				continue;
+
+			for (iSize = 0; iSize < BENCH_NB_SIZES; iSize++) {
+				ullTotal = (unsigned long long)aiCounts[iCount] * auSizes[iSize];
+				if (ullTotal > ullMaxTotal)
+					continue;
+
+				if (bench_generate_child(iFormat, aiCounts[iCount], auSizes[iSize], apstrTargets, iNbTargets) != 0) {
+					fprintf(stderr, "Error generating %s %d x %s\n", aFormats[iFormat].pstrName, aiCounts[iCount], apstrSizes[iSize]);
+					ret = 1;
+					continue;
+				}
+
+				for (iTarget = 0; iTarget < iNbTargets; iTarget++) {
+					snprintf(pstrInput, FILENAME_MAX, "%s/in.%s", apstrTargets[iTarget], aFormats[iFormat].pstrExtension);
+					snprintf(pstrDest, FILENAME_MAX, "%s/out", apstrTargets[iTarget]);
+					if (bench_reset_dir(pstrDest) != 0) {
+						fprintf(stderr, "Error creating %s\n", pstrDest);
+						ret = 1;
+						continue;
+					}
+
+					apstrArgs[0] = pstrTool;
+					switch (aFormats[iFormat].iType) {
+						case BENCH_FPB:
+							/* fpb writes to its working directory. */
+							apstrArgs[1] = pstrInput;
+							apstrArgs[2] = NULL;
+							break;
+
+						case BENCH_EXP:
+							if (snprintf(pstrOutput, FILENAME_MAX, "%s/out.bin", pstrDest) >= FILENAME_MAX) {
+								fprintf(stderr, "Path too long: %s/out.bin\n", pstrDest);
+								ret = 1;
+								continue;
+							}
+							apstrArgs[1] = "-o";
+							apstrArgs[2] = pstrOutput;
+							apstrArgs[3] = pstrInput;
+							apstrArgs[4] = NULL;
+							break;
+
+						default:
+							apstrArgs[1] = "-o";
+							apstrArgs[2] = pstrDest;
+							apstrArgs[3] = pstrInput;
+							apstrArgs[4] = NULL;
+					}
+
+					if (bench_run(apstrArgs, pstrDest, pstrDest, &dTime, &lRss) != 0) {
+						fprintf(stderr, "Error running %s on %s\n", pstrTool, pstrInput);
+						ret = 1;
+						continue;
+					}
+
+					printf("%-12s %-6s %8d %6s %9.3f %11.0f %9.1f %9ld\n", aFormats[iFormat].pstrName, apstrTargetNames[iTarget],
+						aiCounts[iCount], apstrSizes[iSize], dTime, aiCounts[iCount] / dTime, ullTotal / dTime / (1 << 20), lRss);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+main_ret:
+	for (i = 0; i < iNbTargets; i++) {
+		nftw(apstrTargets[i], bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+		free(apstrTargets[i]);
+	}
+
+	return ret;
+}
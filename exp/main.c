@@ -18,12 +18,23 @@
 	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <ctype.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "../nbl/nbl.h"
 
+/**
+ * Header: expanded size, compressed size, then unknown values up to the compressed data.
+ */
+
+#define EXP_HEADER_SIZE 0x1C
+
 /**
  * Expand the given file using nbl_decompress.
+ * The file is read in a single pass, so "-" can be used to read from stdin;
+ * the output then goes to stdout unless -o is given.
  */
 
 int main(int argc, char** argv)
@@ -31,40 +42,134 @@ int main(int argc, char** argv)
 	FILE* pFile;
 	char* pstrCmp;
 	char* pstrExp;
+	char* pstrManifest = NULL;
+	char* pstrOutput = NULL;
+	char pstrHeader[EXP_HEADER_SIZE];
 	char pstrFilename[FILENAME_MAX];
+	struct manifest_ctx* pManifest;
+	struct option aLongOptions[] = {
+		{"verify", no_argument, NULL, 'V'},
+		{NULL, 0, NULL, 0}
+	};
 	int iCmpSize, iExpSize, iRead;
+	int iFlags = 0, iVerify = 0;
+	int i;
+
+	opterr = 0;
+	while ((i = getopt_long(argc, argv, "Hm:o:V", aLongOptions, NULL)) != -1) {
+		switch (i) {
+			case 'H':
+				iFlags |= MANIFEST_HASH64;
+				break;
+
+			case 'm':
+				pstrManifest = optarg;
+				break;
+
+			case 'o':
+				pstrOutput = optarg;
+				break;
+
+			case 'V':
+				iVerify = 1;
+				break;
+
+			case '?':
+				if (optopt == 'm' || optopt == 'o')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 1;
+
+			default:
+				abort();
+		}
+	}
+
+	if (iVerify && pstrManifest != NULL && optind == argc) {
+		i = manifest_verify(pstrManifest, NULL);
+		if (i < 0)
+			fprintf(stderr, "Error opening manifest %s\n", pstrManifest);
+		return i == 0 ? 0 : 1;
+	}
+
+	if (optind + 1 != argc || iVerify) {
+		fprintf(stderr, "Usage: %s [-o output] [-m manifest [-H]] file\n", argv[0]);
+		fprintf(stderr, "       %s --verify -m manifest\n", argv[0]);
+		fprintf(stderr, "       file can be - for stdin and output - for stdout.\n");
+		return 2;
+	}
+
+	if (pstrOutput)
+		snprintf(pstrFilename, FILENAME_MAX, "%s", pstrOutput);
+	else if (strcmp(argv[optind], "-") == 0)
+		strcpy(pstrFilename, "-");
+	else
+		snprintf(pstrFilename, FILENAME_MAX, "%s.exp", argv[optind]);
 
-	if (2 != argc) {
-		fprintf(stderr, "Usage: %s file\n", argv[0]);
+	if (pstrManifest && strcmp(pstrFilename, "-") == 0) {
+		fprintf(stderr, "A manifest can't be written when expanding to stdout.\n");
 		return 2;
 	}
 
-	pFile = fopen(argv[1], "rb");
+	pFile = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "rb");
 	if (pFile == NULL)
 		return -1;
 
-	iRead = fread(&iExpSize, sizeof(unsigned int), 1, pFile);
-	/* TODO: iRead */
-	iRead = fread(&iCmpSize, sizeof(unsigned int), 1, pFile);
-	/* TODO: iRead */
+	/* The sizes come first, so the data can be read without seeking. */
+	if (fread(pstrHeader, 1, EXP_HEADER_SIZE, pFile) != EXP_HEADER_SIZE) {
+		fprintf(stderr, "Error reading %s\n", argv[optind]);
+		return -1;
+	}
+
+	iExpSize = NBL_READ_INT(pstrHeader, 0);
+	iCmpSize = NBL_READ_INT(pstrHeader, 4);
+	if (iExpSize < 0 || iCmpSize < 0) {
+		fprintf(stderr, "Invalid sizes in %s\n", argv[optind]);
+		return -2;
+	}
 
 	pstrExp = malloc(iExpSize);
-	/* TODO */
 	pstrCmp = malloc(iCmpSize);
-	/* TODO */
+	if (pstrExp == NULL || pstrCmp == NULL) {
+		free(pstrCmp);
+		free(pstrExp);
+		return -3;
+	}
 
-	fseek(pFile, 0x1C, SEEK_SET);
 	iRead = fread(pstrCmp, 1, iCmpSize, pFile);
-	/* TODO */
-	fclose(pFile);
-
-	nbl_decompress(pstrCmp, iCmpSize, pstrExp, iExpSize);
+	if (pFile != stdin)
+		fclose(pFile);
+
+	/* A short read is reported by the decompressor as a truncated stream. */
+	iRead = nbl_decompress(pstrCmp, iRead, pstrExp, iExpSize);
+	if (iRead < 0) {
+		fprintf(stderr, "Error decompressing %s (%d)\n", argv[optind], iRead);
+		free(pstrCmp);
+		free(pstrExp);
+		return -2;
+	}
 
-	sprintf(pstrFilename, "%s.exp", argv[1]);
-	pFile = fopen(pstrFilename, "wb");
-	fwrite(pstrExp, 1, iExpSize, pFile);
-	/* TODO */
-	fclose(pFile);
+	pFile = strcmp(pstrFilename, "-") == 0 ? stdout : fopen(pstrFilename, "wb");
+	if (pFile == NULL || fwrite(pstrExp, 1, iExpSize, pFile) != (size_t)iExpSize || fflush(pFile) != 0) {
+		fprintf(stderr, "Error writing %s\n", pstrFilename);
+		if (pFile && pFile != stdout)
+			fclose(pFile);
+		free(pstrCmp);
+		free(pstrExp);
+		return -1;
+	}
+	if (pFile != stdout)
+		fclose(pFile);
+
+	if (pstrManifest) {
+		pManifest = manifest_open(pstrManifest, iFlags);
+		i = pManifest ? manifest_add_buffer(pManifest, pstrFilename, 0, pstrExp, iExpSize) : -1;
+		if ((pManifest && manifest_close(pManifest) != 0) || i != 0)
+			fprintf(stderr, "Error writing manifest %s\n", pstrManifest);
+	}
 
 	free(pstrCmp);
 	free(pstrExp);
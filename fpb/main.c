@@ -18,72 +18,635 @@
 	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
 #include "../nbl/nbl.h"
+#include "../nbl/probes.h"
 
 /**
- * We're just going through every NBL_CHUNK_PADDING_SIZE and extract all the nbl files we find.
+ * Prototypes.
  */
 
-int main(int argc, char** argv)
+int extract(char* pstrFilename, char* pstrManifest, int iFlags);
+int replace(char* pstrFilename, int iIndex, char* pstrInput);
+
+/* Size of the window used to scan and copy the file. */
+#define FPB_WINDOW_SIZE 0x100000
+
+/* Archives start on NBL_CHUNK_PADDING_SIZE boundaries. */
+#define FPB_ALIGN(pos) (((pos) + NBL_CHUNK_PADDING_SIZE - 1) & ~(off_t)(NBL_CHUNK_PADDING_SIZE - 1))
+
+/**
+ * Remap table, saved as file.fpb.remap next to the image.
+ *
+ * Archives are numbered in the order they are found in the original image.
+ * When a replacement doesn't fit in the slot of an archive, it is written at
+ * the end of the image instead and its old slot is cleared; the table keeps
+ * its number and both positions, one "index original-pos pos" line per moved
+ * archive, positions in hex. Without it, the archives would be numbered
+ * differently once moved.
+ *
+ * While a move is in progress, the position of the copy that is not in use,
+ * the new one until it is written and the old one until it is cleared, is
+ * also kept as a "-1 pos pos" line so that it is never numbered.
+ */
+
+#define FPB_REMAP_SUFFIX ".remap"
+#define FPB_REMAP_STALE -1
+
+typedef struct {
+	int iIndex;
+	off_t iOriginalPos;
+	off_t iPos;
+} fpb_remap;
+
+/**
+ * Copy iSize bytes starting at iPos from the input file to the output file.
+ * When pSum is given the data is also added to it, one window at a time.
+ */
+
+static int fpb_copy(FILE* pFile, off_t iPos, off_t iSize, FILE* pOut, char* pstrBuffer,
+	struct manifest_ctx* pManifest, struct manifest_sum* pSum)
 {
-	FILE* pFile;
-	FILE* pOut;
-	char* pstrBuffer;
-	char pstrFilename[32];
-	int iCurrentPos = 0;
-	int i, iRead, iTotal;
-	int iNMLL = 0, iTMLL = 0;
-	int aFiles[10000];
+	size_t iChunk;
+
+	if (fseeko(pFile, iPos, SEEK_SET) != 0)
+		return -1;
+
+	while (iSize > 0) {
+		iChunk = iSize < FPB_WINDOW_SIZE ? (size_t)iSize : FPB_WINDOW_SIZE;
+		if (fread(pstrBuffer, 1, iChunk, pFile) != iChunk || fwrite(pstrBuffer, 1, iChunk, pOut) != iChunk)
+			return -1;
+		if (pSum)
+			manifest_sum_update(pManifest, pSum, pstrBuffer, iChunk);
+		iSize -= iChunk;
+	}
+
+	return 0;
+}
+
+/**
+ * We're going through every 4 bytes and list the position of all the nbl files we find.
+ * The file is read one window at a time so that full disc images can be processed.
+ * Returns the positions, with room for one more, or NULL if out of memory.
+ */
+
+static off_t* fpb_scan(FILE* pFile, char* pstrBuffer, int* piTotal)
+{
+	off_t iCurrentPos = 0;
+	off_t* aFiles;
+	off_t* aTmp;
+	size_t iRead, j;
+	int iMax = 1024, iTotal = 0;
 	unsigned int iTmp;
 
-	if (2 != argc) {
-		fprintf(stderr, "Usage: %s file.fpb\n", argv[0]);
-		return 2;
+	aFiles = malloc(iMax * sizeof(off_t));
+	if (aFiles == NULL)
+		return NULL;
+
+	/* The window size is a multiple of 4 so identifiers never straddle two windows. */
+	fseeko(pFile, 0, SEEK_SET);
+	while ((iRead = fread(pstrBuffer, 1, FPB_WINDOW_SIZE, pFile)) >= 4) {
+		for (j = 0; j + 4 <= iRead; j += 4) {
+			iTmp = NBL_READ_UINT(pstrBuffer, j);
+			if (iTmp != NBL_ID_NMLL && iTmp != NBL_ID_NMLB)
+				continue;
+
+			/* Keep room for the end of file position. */
+			if (iTotal + 1 >= iMax) {
+				iMax *= 2;
+				aTmp = realloc(aFiles, iMax * sizeof(off_t));
+				if (aTmp == NULL) {
+					free(aFiles);
+					return NULL;
+				}
+				aFiles = aTmp;
+			}
+
+			aFiles[iTotal++] = iCurrentPos + j;
+		}
+
+		iCurrentPos += iRead;
+		if (iRead < FPB_WINDOW_SIZE)
+			break;
+	}
+
+	*piTotal = iTotal;
+	return aFiles;
+}
+
+/**
+ * Load the remap table of the image. An image without one gives an empty table.
+ * Returns 0 on success.
+ */
+
+static int fpb_remap_load(char* pstrFilename, fpb_remap** ppRemap, int* piCount)
+{
+	FILE* pFile;
+	fpb_remap* pTmp;
+	char pstrRemap[FILENAME_MAX];
+	unsigned long long ullOriginalPos, ullPos;
+	int iIndex, iMax = 0;
+
+	*ppRemap = NULL;
+	*piCount = 0;
+
+	snprintf(pstrRemap, FILENAME_MAX, "%s%s", pstrFilename, FPB_REMAP_SUFFIX);
+	pFile = fopen(pstrRemap, "r");
+	if (pFile == NULL)
+		return 0;
+
+	while (fscanf(pFile, "%d %llx %llx", &iIndex, &ullOriginalPos, &ullPos) == 3) {
+		if (*piCount == iMax) {
+			iMax = iMax ? iMax * 2 : 16;
+			pTmp = realloc(*ppRemap, iMax * sizeof(fpb_remap));
+			if (pTmp == NULL) {
+				fclose(pFile);
+				return -3;
+			}
+			*ppRemap = pTmp;
+		}
+
+		(*ppRemap)[*piCount].iIndex = iIndex;
+		(*ppRemap)[*piCount].iOriginalPos = ullOriginalPos;
+		(*ppRemap)[*piCount].iPos = ullPos;
+		(*piCount)++;
 	}
 
-	pFile = fopen(argv[1], "rb");
+	fclose(pFile);
+	return 0;
+}
+
+/**
+ * Save the remap table through a temporary file renamed over the previous one.
+ */
+
+static int fpb_remap_save(char* pstrFilename, fpb_remap* pRemap, int iCount)
+{
+	FILE* pFile;
+	char pstrRemap[FILENAME_MAX];
+	char pstrTmp[FILENAME_MAX];
+	int i, ret = 0;
+
+	snprintf(pstrRemap, FILENAME_MAX, "%s%s", pstrFilename, FPB_REMAP_SUFFIX);
+	snprintf(pstrTmp, FILENAME_MAX, "%s%s.tmp", pstrFilename, FPB_REMAP_SUFFIX);
+
+	pFile = fopen(pstrTmp, "w");
 	if (pFile == NULL)
 		return -1;
 
-	iTotal = 0;
-	while (1) {
-		fseek(pFile, iCurrentPos, SEEK_SET);
-		iRead = fread(&iTmp, sizeof(unsigned int), 1, pFile);
+	for (i = 0; i < iCount; i++)
+		fprintf(pFile, "%d %llx %llx\n", pRemap[i].iIndex,
+			(unsigned long long)pRemap[i].iOriginalPos, (unsigned long long)pRemap[i].iPos);
 
-		if (iRead <= 0)
-			break;
+	if (fclose(pFile) != 0)
+		ret = -1;
+	if (ret == 0 && rename(pstrTmp, pstrRemap) != 0)
+		ret = -1;
+	if (ret != 0)
+		remove(pstrTmp);
 
-		if (iTmp == NBL_ID_NMLL || iTmp == NBL_ID_NMLB) {
-			aFiles[iTotal] = iCurrentPos;
-			iTotal++;
-		}
+	return ret;
+}
+
+/**
+ * Find the position and end of every archive, numbered as in the original image.
+ * An archive ends where the next one starts, or where the slot of a moved
+ * archive started since it is now empty, or at the end of the file.
+ * Returns the number of archives or a negative value on error.
+ */
+
+static int fpb_layout(FILE* pFile, char* pstrBuffer, fpb_remap* pRemap, int iNbRemap,
+	off_t** ppStarts, off_t** ppEnds)
+{
+	off_t* aFound;
+	off_t* aStarts = NULL;
+	off_t* aEnds = NULL;
+	off_t iEnd, iSize;
+	int i, j, k, iTotal, iCount, ret;
+
+	aFound = fpb_scan(pFile, pstrBuffer, &iTotal);
+	if (aFound == NULL)
+		return -3;
+
+	fseeko(pFile, 0, SEEK_END);
+	iSize = ftello(pFile);
+
+	/* Copies found at a stale position are not archives of the image. */
+	iCount = iTotal;
+	for (i = 0; i < iTotal; i++) {
+		for (k = 0; k < iNbRemap; k++)
+			if (pRemap[k].iIndex == FPB_REMAP_STALE && pRemap[k].iPos == aFound[i])
+				break;
+		if (k < iNbRemap)
+			iCount--;
+	}
+
+	aStarts = calloc(iCount + 1, sizeof(off_t));
+	aEnds = calloc(iCount + 1, sizeof(off_t));
+	if (aStarts == NULL || aEnds == NULL) {
+		ret = -3;
+		goto fpb_layout_ret;
+	}
+
+	/* Moved archives keep their number; the others fill the remaining ones in order. */
+	for (i = 0; i < iCount; i++)
+		aStarts[i] = -1;
+
+	ret = iCount;
+	for (k = 0; k < iNbRemap; k++) {
+		if (pRemap[k].iIndex == FPB_REMAP_STALE)
+			continue;
+		if (pRemap[k].iIndex < 0 || pRemap[k].iIndex >= iCount || aStarts[pRemap[k].iIndex] != -1)
+			ret = -2;
+		else
+			aStarts[pRemap[k].iIndex] = pRemap[k].iPos;
+	}
+
+	for (i = 0, j = 0; i < iTotal && ret >= 0; i++) {
+		for (k = 0; k < iNbRemap; k++)
+			if (pRemap[k].iPos == aFound[i])
+				break;
+		if (k < iNbRemap)
+			continue;
+
+		while (j < iCount && aStarts[j] != -1)
+			j++;
+		if (j == iCount)
+			ret = -2;
+		else
+			aStarts[j] = aFound[i];
+	}
+
+	if (ret < 0)
+		goto fpb_layout_ret;
+
+	for (i = 0; i < iCount; i++) {
+		iEnd = iSize;
+		for (j = 0; j < iTotal; j++)
+			if (aFound[j] > aStarts[i] && aFound[j] < iEnd)
+				iEnd = aFound[j];
+		for (k = 0; k < iNbRemap; k++)
+			if (pRemap[k].iOriginalPos > aStarts[i] && pRemap[k].iOriginalPos < iEnd)
+				iEnd = pRemap[k].iOriginalPos;
+		aEnds[i] = iEnd;
+	}
+
+fpb_layout_ret:
+	free(aFound);
+	if (ret < 0) {
+		free(aStarts);
+		free(aEnds);
+	} else {
+		*ppStarts = aStarts;
+		*ppEnds = aEnds;
+	}
+
+	return ret;
+}
+
+/**
+ * Write the buffer at the given position, then zeroes up to iEnd.
+ */
+
+static int fpb_write_at(int iFd, char* pstrData, size_t iSize, off_t iPos, off_t iEnd)
+{
+	char pstrZero[NBL_CHUNK_PADDING_SIZE];
+	size_t iChunk;
+	ssize_t iRet;
+
+	while (iSize > 0) {
+		iRet = pwrite(iFd, pstrData, iSize, iPos);
+		if (iRet <= 0)
+			return -1;
+		pstrData += iRet;
+		iSize -= iRet;
+		iPos += iRet;
+	}
+
+	memset(pstrZero, 0, NBL_CHUNK_PADDING_SIZE);
+	while (iPos < iEnd) {
+		iChunk = iEnd - iPos < NBL_CHUNK_PADDING_SIZE ? (size_t)(iEnd - iPos) : NBL_CHUNK_PADDING_SIZE;
+		iRet = pwrite(iFd, pstrZero, iChunk, iPos);
+		if (iRet <= 0)
+			return -1;
+		iPos += iRet;
+	}
+
+	return 0;
+}
+
+/**
+ * Extract all the nbl files of the image as nmll-N.nbl.
+ */
+
+int extract(char* pstrFilename, char* pstrManifest, int iFlags)
+{
+	FILE* pFile;
+	FILE* pOut;
+	char* pstrBuffer;
+	char pstrOutput[32];
+	struct manifest_ctx* pManifest = NULL;
+	struct manifest_sum sum;
+	fpb_remap* pRemap = NULL;
+	off_t* aStarts = NULL;
+	off_t* aEnds = NULL;
+	int i, iNbRemap, iTotal;
+	int ret = 0;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return -1;
+
+	pstrBuffer = malloc(FPB_WINDOW_SIZE);
+	if (pstrBuffer == NULL) {
+		fclose(pFile);
+		return -3;
+	}
+
+	if (fpb_remap_load(pstrFilename, &pRemap, &iNbRemap) != 0) {
+		fprintf(stderr, "Error reading the remap table of %s\n", pstrFilename);
+		ret = -1;
+		goto extract_ret;
+	}
 
-		iCurrentPos += 4;
+	NBL_PROBE1(fpb_scan__start, pstrFilename);
+	iTotal = fpb_layout(pFile, pstrBuffer, pRemap, iNbRemap, &aStarts, &aEnds);
+	NBL_PROBE3(fpb_scan__end, pstrFilename, iTotal, (long long)ftello(pFile));
+	if (iTotal < 0) {
+		fprintf(stderr, iTotal == -2 ? "The remap table doesn't match %s\n" : "Out of memory\n", pstrFilename);
+		ret = iTotal;
+		goto extract_ret;
 	}
 
-	fseek(pFile, 0, SEEK_END);
-	aFiles[iTotal] = ftell(pFile);
+	if (pstrManifest) {
+		pManifest = manifest_open(pstrManifest, iFlags);
+		if (pManifest == NULL) {
+			fprintf(stderr, "Error creating manifest %s\n", pstrManifest);
+			ret = -1;
+			goto extract_ret;
+		}
+	}
 
 	for (i = 0; i < iTotal; i++) {
-		fseek(pFile, aFiles[i], SEEK_SET);
-		pstrBuffer = malloc(aFiles[i + 1] - aFiles[i]);
-		iRead = fread(pstrBuffer, 1, aFiles[i + 1] - aFiles[i], pFile);
-		if (iRead > 0) {
-			if (pstrBuffer[5])
-				sprintf(pstrFilename, "nmll-%d-new-format.nbl", iNMLL++);
-			else
-				sprintf(pstrFilename, "nmll-%d.nbl", iNMLL++);
-			pOut = fopen(pstrFilename, "wb");
-			fwrite(pstrBuffer, 1, aFiles[i + 1] - aFiles[i], pOut);
+		/* Only the format byte of the header is needed to name the file. */
+		fseeko(pFile, aStarts[i], SEEK_SET);
+		if (fread(pstrBuffer, 1, 8, pFile) != 8)
+			continue;
+
+		if (pstrBuffer[5])
+			sprintf(pstrOutput, "nmll-%d-new-format.nbl", i);
+		else
+			sprintf(pstrOutput, "nmll-%d.nbl", i);
+
+		manifest_sum_init(&sum);
+		pOut = fopen(pstrOutput, "wb");
+		if (pOut == NULL || fpb_copy(pFile, aStarts[i], aEnds[i] - aStarts[i], pOut, pstrBuffer, pManifest, pManifest ? &sum : NULL) != 0)
+			fprintf(stderr, "Error writing file %s\n", pstrOutput);
+		else if (pManifest)
+			manifest_add(pManifest, pstrOutput, aStarts[i], &sum);
+		if (pOut)
 			fclose(pOut);
-		}
+	}
+
+	if (pManifest && manifest_close(pManifest) != 0)
+		fprintf(stderr, "Error writing manifest %s\n", pstrManifest);
+
+extract_ret:
+	free(aStarts);
+	free(aEnds);
+	free(pRemap);
+	free(pstrBuffer);
+	fclose(pFile);
 
-		free(pstrBuffer);
+	return ret;
+}
+
+/**
+ * Replace the nbl file number iIndex of the image, as numbered by extract.
+ *
+ * Only the slot of the archive is written when the new one fits in it, the rest
+ * being zero-filled; the last archive of the image may also grow. Otherwise the
+ * new archive is written at the end of the image, the old slot is cleared and
+ * the move is added to the remap table. The archives that follow are never
+ * shifted, since that would mean rewriting the rest of the image.
+ */
+
+int replace(char* pstrFilename, int iIndex, char* pstrInput)
+{
+	FILE* pFile;
+	char* pstrBuffer = NULL;
+	char* pstrData = NULL;
+	fpb_remap* pRemap = NULL;
+	fpb_remap* pTmp;
+	off_t* aStarts = NULL;
+	off_t* aEnds = NULL;
+	off_t iSize, iEnd, iPos;
+	int i, iStale, iFd = -1, iNbRemap, iTotal;
+	int ret = 0;
+
+	pFile = fopen(pstrInput, "rb");
+	if (pFile == NULL) {
+		fprintf(stderr, "Error opening file %s\n", pstrInput);
+		return -1;
 	}
 
+	fseeko(pFile, 0, SEEK_END);
+	iSize = ftello(pFile);
+	fseeko(pFile, 0, SEEK_SET);
+
+	pstrData = iSize >= 4 ? malloc(iSize) : NULL;
+	if (pstrData == NULL || fread(pstrData, 1, iSize, pFile) != (size_t)iSize || NBL_READ_UINT(pstrData, 0) != NBL_ID_NMLL) {
+		fprintf(stderr, "Error reading nbl file %s\n", pstrInput);
+		fclose(pFile);
+		free(pstrData);
+		return -1;
+	}
 	fclose(pFile);
 
-	return 0;
+	pFile = fopen(pstrFilename, "rb");
+	pstrBuffer = malloc(FPB_WINDOW_SIZE);
+	if (pFile == NULL || pstrBuffer == NULL || fpb_remap_load(pstrFilename, &pRemap, &iNbRemap) != 0) {
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+		ret = -1;
+		goto replace_ret;
+	}
+
+	iTotal = fpb_layout(pFile, pstrBuffer, pRemap, iNbRemap, &aStarts, &aEnds);
+	if (iTotal < 0 || iIndex < 0 || iIndex >= iTotal) {
+		fprintf(stderr, iTotal == -3 ? "Out of memory\n" : "nbl file %d not found in %s\n", iIndex, pstrFilename);
+		ret = iTotal < 0 ? iTotal : -2;
+		goto replace_ret;
+	}
+
+	fseeko(pFile, 0, SEEK_END);
+	iEnd = ftello(pFile);
+
+	iFd = open(pstrFilename, O_RDWR | O_BINARY);
+	if (iFd < 0) {
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+		ret = -1;
+		goto replace_ret;
+	}
+
+	if (iSize <= aEnds[iIndex] - aStarts[iIndex] || aEnds[iIndex] == iEnd) {
+		if (fpb_write_at(iFd, pstrData, iSize, aStarts[iIndex], aEnds[iIndex]) != 0)
+			ret = -1;
+		goto replace_ret;
+	}
+
+	/*
+	 * Every step saves the table first, so that an interrupted move always leaves
+	 * either the old or the new copy in use and the other one at a stale position.
+	 */
+	iPos = FPB_ALIGN(iEnd);
+	for (iStale = 0; iStale < iNbRemap; iStale++)
+		if (pRemap[iStale].iIndex == FPB_REMAP_STALE && pRemap[iStale].iPos == iPos)
+			break;
+
+	pTmp = realloc(pRemap, (iNbRemap + 2) * sizeof(fpb_remap));
+	if (pTmp == NULL) {
+		ret = -3;
+		goto replace_ret;
+	}
+	pRemap = pTmp;
+
+	if (iStale == iNbRemap) {
+		pRemap[iStale].iIndex = FPB_REMAP_STALE;
+		pRemap[iStale].iOriginalPos = iPos;
+		pRemap[iStale].iPos = iPos;
+		iNbRemap++;
+	}
+
+	for (i = 0; i < iNbRemap; i++)
+		if (pRemap[i].iIndex == iIndex)
+			break;
+
+	if (fpb_remap_save(pstrFilename, pRemap, iNbRemap) != 0) {
+		fprintf(stderr, "Error writing the remap table of %s\n", pstrFilename);
+		ret = -1;
+		goto replace_ret;
+	}
+
+	if (fpb_write_at(iFd, pstrData, iSize, iPos, FPB_ALIGN(iPos + iSize)) != 0) {
+		ret = -1;
+		goto replace_ret;
+	}
+
+	if (i == iNbRemap) {
+		pRemap[i].iIndex = iIndex;
+		pRemap[i].iOriginalPos = aStarts[iIndex];
+		iNbRemap++;
+	}
+	pRemap[i].iPos = iPos;
+	pRemap[iStale].iOriginalPos = aStarts[iIndex];
+	pRemap[iStale].iPos = aStarts[iIndex];
+
+	if (fpb_remap_save(pstrFilename, pRemap, iNbRemap) != 0) {
+		fprintf(stderr, "Error writing the remap table of %s\n", pstrFilename);
+		ret = -1;
+		goto replace_ret;
+	}
+
+	if (fpb_write_at(iFd, NULL, 0, aStarts[iIndex], aEnds[iIndex]) != 0) {
+		ret = -1;
+		goto replace_ret;
+	}
+
+	pRemap[iStale] = pRemap[--iNbRemap];
+	if (fpb_remap_save(pstrFilename, pRemap, iNbRemap) != 0) {
+		fprintf(stderr, "Error writing the remap table of %s\n", pstrFilename);
+		ret = -1;
+	}
+
+replace_ret:
+	if (ret == -1)
+		fprintf(stderr, "Error writing file %s\n", pstrFilename);
+	if (iFd >= 0 && close(iFd) != 0 && ret == 0) {
+		fprintf(stderr, "Error writing file %s\n", pstrFilename);
+		ret = -1;
+	}
+	if (pFile)
+		fclose(pFile);
+	free(aStarts);
+	free(aEnds);
+	free(pRemap);
+	free(pstrBuffer);
+	free(pstrData);
+
+	return ret;
+}
+
+int main(int argc, char** argv)
+{
+	char* pstrInput = NULL;
+	char* pstrManifest = NULL;
+	struct option aLongOptions[] = {
+		{"verify", no_argument, NULL, 'V'},
+		{NULL, 0, NULL, 0}
+	};
+	int i, iIndex = -1;
+	int iFlags = 0, iVerify = 0;
+
+	opterr = 0;
+	while ((i = getopt_long(argc, argv, "Hi:m:r:V", aLongOptions, NULL)) != -1) {
+		switch (i) {
+			case 'H':
+				iFlags |= MANIFEST_HASH64;
+				break;
+
+			case 'i':
+				pstrInput = optarg;
+				break;
+
+			case 'm':
+				pstrManifest = optarg;
+				break;
+
+			case 'r':
+				iIndex = atoi(optarg);
+				break;
+
+			case 'V':
+				iVerify = 1;
+				break;
+
+			case '?':
+				if (optopt == 'i' || optopt == 'm' || optopt == 'r')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 1;
+
+			default:
+				abort();
+		}
+	}
+
+	if (iVerify && pstrManifest != NULL && optind == argc) {
+		i = manifest_verify(pstrManifest, NULL);
+		if (i < 0)
+			fprintf(stderr, "Error opening manifest %s\n", pstrManifest);
+		return i == 0 ? 0 : 1;
+	}
+
+	if (optind + 1 != argc || iVerify || (iIndex < 0) != (pstrInput == NULL) || (pstrInput && pstrManifest)) {
+		fprintf(stderr, "Usage: %s [-m manifest [-H]] file.fpb\n", argv[0]);
+		fprintf(stderr, "       %s -r N -i nmll-N.nbl file.fpb\n", argv[0]);
+		fprintf(stderr, "       %s --verify -m manifest\n", argv[0]);
+		return 2;
+	}
+
+	if (pstrInput)
+		return replace(argv[optind], iIndex, pstrInput);
+
+	return extract(argv[optind], pstrManifest, iFlags);
 }
@@ -0,0 +1,1305 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * Long-running extraction daemon.
+ *
+ * Jobs are sent over a Unix socket as one JSON object per line and each is
+ * answered with one JSON line, in order. A connection can send any number of jobs:
+ *
+ *   {"op":"list","file":"a.nbl"}
+ *   {"op":"extract","file":"a.nbl","dest":"out"}
+ *   {"op":"extract-entry","file":"a.nbl","entry":"b.bin","dest":"out"}
+ *   {"op":"expand","file":"a.cmp","dest":"a.exp"}
+ *   {"op":"stats"}
+ *
+ * Without a dest, extract-entry and expand answer {"status":"ok","size":N}
+ * followed by the N bytes of data. Errors are answered with
+ * {"status":"error","code":N,"message":"..."}.
+ *
+ * Connections waiting for input are polled by the main thread; a connection
+ * with input is queued and its jobs are run by the next free worker. Each worker
+ * keeps its own cipher contexts and buffers between jobs.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "../afs/afs.h"
+#include "../nbl/nbl.h"
+
+/**
+ * Default number of workers.
+ */
+
+#define GASED_DEFAULT_WORKERS 4
+
+/**
+ * Limits.
+ */
+
+#define GASED_QUEUE_SIZE		256		/* Connections waiting for a worker. */
+#define GASED_LINE_MAX			0x1000	/* Maximum size of a job. */
+#define GASED_KEY_CACHE_SIZE	8		/* Cipher contexts kept by each worker. */
+
+/**
+ * Size of the header of expandable files: expanded size, compressed size, then unknown values.
+ */
+
+#define GASED_EXP_HEADER_SIZE 0x1C
+
+/**
+ * Jobs.
+ */
+
+#define GASED_OP_LIST			0
+#define GASED_OP_EXTRACT		1
+#define GASED_OP_EXTRACT_ENTRY	2
+#define GASED_OP_EXPAND			3
+#define GASED_OP_STATS			4
+#define GASED_NB_OPS			5
+
+static const char* apstrOps[GASED_NB_OPS] = {"list", "extract", "extract-entry", "expand", "stats"};
+
+typedef struct {
+	int iFd;
+	int iLen;
+	char pstrBuffer[GASED_LINE_MAX];
+} gased_conn;
+
+typedef struct {
+	unsigned long long ullCount;
+	unsigned long long ullErrors;
+	unsigned long long ullTotalUs;
+	unsigned long long ullMaxUs;
+} gased_stats;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t condQueued;
+	pthread_cond_t condFree;
+	gased_conn* apQueue[GASED_QUEUE_SIZE];
+	int iHead;
+	int iQueued;
+	int iNbWorkers;
+	int iBusy;
+	int iVerbose;
+	int aiPipe[2]; /* Connections handed back to the main thread. */
+	unsigned long long ullConnections;
+	gased_stats aStats[GASED_NB_OPS];
+	struct timespec tsStart;
+} gased_server;
+
+typedef struct {
+	unsigned int uSeed;
+	int iValid;
+	struct bf_ctx ctx;
+} gased_key;
+
+typedef struct {
+	gased_server* pServer;
+	pthread_t thread;
+	gased_key aKeys[GASED_KEY_CACHE_SIZE];
+	int iNextKey;
+	char* pstrFile; /* Recycled between jobs. */
+	int iFileAlloc;
+	char* pstrData;
+	int iDataAlloc;
+	struct stat stCached; /* Nbl archive still decoded in the buffers, if any. */
+	char* pstrCachedData;
+	char* pstrOut; /* Response line. */
+	int iOutAlloc;
+	int iOutLen;
+	char* pstrStream; /* Data sent after the response line. */
+	int iStreamSize;
+	const char* pstrError;
+} gased_worker;
+
+/**
+ * Prototypes.
+ */
+
+char* json_skip_ws(char* p);
+char* json_parse_string(char* p, char* pstrValue, int iSize);
+int json_get_string(char* pstrJson, const char* pstrKey, char* pstrValue, int iSize);
+int gased_reserve(char** ppstrBuffer, int* piAlloc, int iSize);
+void gased_out_printf(gased_worker* w, const char* pstrFormat, ...);
+void gased_out_string(gased_worker* w, const char* pstrString, int iMaxLen);
+struct bf_ctx* gased_get_key(gased_worker* w, unsigned int uSeed);
+int gased_load(gased_worker* w, char* pstrFilename, int* piSize);
+int gased_nbl_prepare(gased_worker* w, int iSize, char** ppstrData);
+int gased_nbl_open(gased_worker* w, char* pstrFilename, char** ppstrData);
+int gased_save(gased_worker* w, char* pstrDestPath, const char* pstrName, char* pstrData, int iSize);
+int gased_op_list(gased_worker* w, char* pstrJob);
+int gased_op_extract(gased_worker* w, char* pstrJob);
+int gased_op_extract_entry(gased_worker* w, char* pstrJob);
+int gased_op_expand(gased_worker* w, char* pstrJob);
+int gased_op_stats(gased_worker* w, char* pstrJob);
+int gased_write_all(int iFd, char* pstrBuffer, int iSize);
+int gased_job(gased_worker* w, gased_conn* pConn, char* pstrJob);
+int gased_serve(gased_worker* w, gased_conn* pConn);
+void* gased_worker_thread(void* pArg);
+void gased_enqueue(gased_server* pServer, gased_conn* pConn);
+int gased_listen(char* pstrSocket);
+int gased_run(gased_server* pServer, int iListenFd);
+void gased_signal(int iSignal);
+
+static volatile sig_atomic_t iStop = 0;
+
+/**
+ * Skip the whitespace.
+ */
+
+char* json_skip_ws(char* p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/**
+ * Parse the string starting at the opening quote into pstrValue, or skip it when pstrValue is NULL.
+ * Only ASCII escapes are supported. Returns the position after the closing quote or NULL on error.
+ */
+
+char* json_parse_string(char* p, char* pstrValue, int iSize)
+{
+	char pstrHex[5];
+	int i, iLen = 0;
+	char c;
+
+	if (*p++ != '"')
+		return NULL;
+
+	while (*p != '"') {
+		c = *p++;
+		if ((unsigned char)c < 0x20)
+			return NULL;
+
+		if (c == '\\') {
+			switch (*p++) {
+				case '"':	c = '"'; break;
+				case '\\':	c = '\\'; break;
+				case '/':	c = '/'; break;
+				case 'b':	c = '\b'; break;
+				case 'f':	c = '\f'; break;
+				case 'n':	c = '\n'; break;
+				case 'r':	c = '\r'; break;
+				case 't':	c = '\t'; break;
+
+				case 'u':
+					for (i = 0; i < 4; i++) {
+						if (!isxdigit((unsigned char)p[i]))
+							return NULL;
+						pstrHex[i] = p[i];
+					}
+					pstrHex[4] = 0;
+					i = strtol(pstrHex, NULL, 16);
+					if (i == 0 || i > 0x7F)
+						return NULL;
+					c = i;
+					p += 4;
+					break;
+
+				default:
+					return NULL;
+			}
+		}
+
+		if (pstrValue) {
+			if (iLen + 1 >= iSize)
+				return NULL;
+			pstrValue[iLen++] = c;
+		}
+	}
+
+	if (pstrValue)
+		pstrValue[iLen] = 0;
+
+	return p + 1;
+}
+
+/**
+ * Find the string member of the given name in a flat JSON object.
+ * Returns 0 if found, -1 if missing or not a string and -2 if the object is invalid.
+ */
+
+int json_get_string(char* pstrJson, const char* pstrKey, char* pstrValue, int iSize)
+{
+	char pstrName[64];
+	char* p;
+
+	p = json_skip_ws(pstrJson);
+	if (*p++ != '{')
+		return -2;
+
+	p = json_skip_ws(p);
+	if (*p == '}')
+		return -1;
+
+	while (1) {
+		p = json_parse_string(p, pstrName, sizeof(pstrName));
+		if (p == NULL)
+			return -2;
+
+		p = json_skip_ws(p);
+		if (*p++ != ':')
+			return -2;
+		p = json_skip_ws(p);
+
+		if (strcmp(pstrName, pstrKey) == 0) {
+			if (*p != '"')
+				return -1;
+			return json_parse_string(p, pstrValue, iSize) == NULL ? -2 : 0;
+		}
+
+		/* Skip the value; nested objects and arrays aren't used by any job. */
+		if (*p == '"')
+			p = json_parse_string(p, NULL, 0);
+		else if (*p == '{' || *p == '[')
+			return -2;
+		else
+			while (*p != 0 && *p != ',' && *p != '}' && *p != ' ' && *p != '\t')
+				p++;
+
+		if (p == NULL)
+			return -2;
+
+		p = json_skip_ws(p);
+		if (*p == '}')
+			return -1;
+		if (*p++ != ',')
+			return -2;
+		p = json_skip_ws(p);
+	}
+}
+
+/**
+ * Grow the buffer to hold at least iSize bytes. The buffer is never shrunk.
+ */
+
+int gased_reserve(char** ppstrBuffer, int* piAlloc, int iSize)
+{
+	char* pstrTmp;
+
+	if (iSize <= *piAlloc)
+		return 0;
+
+	pstrTmp = realloc(*ppstrBuffer, iSize);
+	if (pstrTmp == NULL)
+		return -3;
+
+	*ppstrBuffer = pstrTmp;
+	*piAlloc = iSize;
+	return 0;
+}
+
+/**
+ * Append to the response line.
+ */
+
+void gased_out_printf(gased_worker* w, const char* pstrFormat, ...)
+{
+	va_list args;
+	int iLen;
+
+	va_start(args, pstrFormat);
+	iLen = vsnprintf(w->pstrOut + w->iOutLen, w->iOutAlloc - w->iOutLen, pstrFormat, args);
+	va_end(args);
+
+	if (iLen < 0)
+		return;
+
+	if (w->iOutLen + iLen >= w->iOutAlloc) {
+		if (gased_reserve(&w->pstrOut, &w->iOutAlloc, (w->iOutLen + iLen + 1) * 2) != 0)
+			return;
+
+		va_start(args, pstrFormat);
+		vsnprintf(w->pstrOut + w->iOutLen, w->iOutAlloc - w->iOutLen, pstrFormat, args);
+		va_end(args);
+	}
+
+	w->iOutLen += iLen;
+}
+
+/**
+ * Append a quoted and escaped string to the response line, reading at most iMaxLen characters.
+ */
+
+void gased_out_string(gased_worker* w, const char* pstrString, int iMaxLen)
+{
+	unsigned char c;
+	int i;
+
+	gased_out_printf(w, "\"");
+
+	for (i = 0; i < iMaxLen && pstrString[i] != 0; i++) {
+		c = pstrString[i];
+		if (c == '"' || c == '\\')
+			gased_out_printf(w, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7F)
+			gased_out_printf(w, "\\u%04x", c);
+		else
+			gased_out_printf(w, "%c", c);
+	}
+
+	gased_out_printf(w, "\"");
+}
+
+/**
+ * Return the cipher context for the given key seed, computing it only if it isn't cached.
+ */
+
+struct bf_ctx* gased_get_key(gased_worker* w, unsigned int uSeed)
+{
+	gased_key* pKey;
+	int i;
+
+	for (i = 0; i < GASED_KEY_CACHE_SIZE; i++)
+		if (w->aKeys[i].iValid && w->aKeys[i].uSeed == uSeed)
+			return &w->aKeys[i].ctx;
+
+	pKey = &w->aKeys[w->iNextKey];
+	w->iNextKey = (w->iNextKey + 1) % GASED_KEY_CACHE_SIZE;
+
+	nbl_setkey(&pKey->ctx, uSeed);
+	pKey->uSeed = uSeed;
+	pKey->iValid = 1;
+
+	return &pKey->ctx;
+}
+
+/**
+ * Load a whole file in the worker's file buffer.
+ */
+
+int gased_load(gased_worker* w, char* pstrFilename, int* piSize)
+{
+	struct stat st;
+	int iFd, ret = 0;
+
+	/* The buffers are about to be overwritten. */
+	w->pstrCachedData = NULL;
+
+	iFd = open(pstrFilename, O_RDONLY);
+	if (iFd < 0) {
+		w->pstrError = "can't open file";
+		return -1;
+	}
+
+	if (fstat(iFd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > INT_MAX) {
+		w->pstrError = "not a regular file or too large";
+		ret = -2;
+		goto gased_load_ret;
+	}
+
+	/* Keep one byte so that empty files still get a valid pointer. */
+	if (gased_reserve(&w->pstrFile, &w->iFileAlloc, st.st_size + 1) != 0) {
+		w->pstrError = "out of memory";
+		ret = -3;
+		goto gased_load_ret;
+	}
+
+	if (pread(iFd, w->pstrFile, st.st_size, 0) != st.st_size) {
+		w->pstrError = "can't read file";
+		ret = -1;
+		goto gased_load_ret;
+	}
+
+	*piSize = st.st_size;
+
+gased_load_ret:
+	close(iFd);
+	return ret;
+}
+
+/**
+ * Check the nbl archive loaded in the file buffer against its size, then decrypt
+ * and decompress its NMLL data. Unlike the command line tools, a malformed archive
+ * must not bring the daemon down, so every position is checked first.
+ */
+
+int gased_nbl_prepare(gased_worker* w, int iSize, char** ppstrData)
+{
+	struct bf_ctx* pCtx = NULL;
+	char* pstrBuffer = w->pstrFile;
+	unsigned long long ullEnd;
+	unsigned int uDataSize;
+	int i, iNbChunks, iDataPos, ret;
+
+	if (iSize < NBL_HEADER_CHUNKS || !nbl_is_nmll(pstrBuffer)) {
+		w->pstrError = "not an nbl archive";
+		return -2;
+	}
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+	iDataPos = NBL_READ_INT(pstrBuffer, NBL_HEADER_SIZE);
+	if (iNbChunks < 0 || iNbChunks > (iSize - NBL_HEADER_CHUNKS) / NBL_CHUNK_SIZE || iDataPos < 0 || iDataPos > iSize) {
+		w->pstrError = "invalid headers";
+		return -2;
+	}
+
+	/* Same as nbl_get_data_pos, within the file. */
+	while (iDataPos <= iSize - 4 && NBL_READ_INT(pstrBuffer, iDataPos) == 0)
+		iDataPos += 16;
+
+	uDataSize = NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE);
+	ullEnd = (unsigned long long)iDataPos
+		+ (nbl_is_compressed(pstrBuffer) ? NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE) : uDataSize);
+	if (ullEnd > (unsigned long long)iSize || uDataSize > INT_MAX) {
+		w->pstrError = "truncated data";
+		return -2;
+	}
+
+	if (NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED) != 0) {
+		pCtx = gased_get_key(w, NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED));
+		nbl_decrypt_headers(pCtx, pstrBuffer, NBL_HEADER_CHUNKS);
+	}
+
+	for (i = 0; i < iNbChunks; i++) {
+		ullEnd = (unsigned long long)NBL_READ_UINT(pstrBuffer, NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS)
+			+ NBL_READ_UINT(pstrBuffer, NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE);
+		if (ullEnd > uDataSize) {
+			w->pstrError = "entry out of the data";
+			return -2;
+		}
+	}
+
+	if (!nbl_is_compressed(pstrBuffer)) {
+		if (pCtx)
+			nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos, uDataSize);
+
+		*ppstrData = pstrBuffer + iDataPos;
+		return 0;
+	}
+
+	if (pCtx)
+		nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos, NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE));
+
+	if (gased_reserve(&w->pstrData, &w->iDataAlloc, uDataSize + 1) != 0) {
+		w->pstrError = "out of memory";
+		return -3;
+	}
+
+	ret = nbl_decompress(pstrBuffer + iDataPos, NBL_READ_INT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE), w->pstrData, uDataSize);
+	if (ret < 0) {
+		w->pstrError = "error decompressing data";
+		return ret;
+	}
+
+	*ppstrData = w->pstrData;
+	return 0;
+}
+
+/**
+ * Load, decrypt and decompress an nbl archive, unless it is the one the previous
+ * job of this worker left in the buffers and the file hasn't changed since.
+ */
+
+int gased_nbl_open(gased_worker* w, char* pstrFilename, char** ppstrData)
+{
+	struct stat st;
+	int iSize, ret;
+
+	if (stat(pstrFilename, &st) != 0) {
+		w->pstrError = "can't open file";
+		return -1;
+	}
+
+	if (w->pstrCachedData && st.st_dev == w->stCached.st_dev && st.st_ino == w->stCached.st_ino
+		&& st.st_size == w->stCached.st_size && st.st_mtim.tv_sec == w->stCached.st_mtim.tv_sec
+		&& st.st_mtim.tv_nsec == w->stCached.st_mtim.tv_nsec) {
+		*ppstrData = w->pstrCachedData;
+		return 0;
+	}
+
+	ret = gased_load(w, pstrFilename, &iSize);
+	if (ret == 0)
+		ret = gased_nbl_prepare(w, iSize, ppstrData);
+	if (ret != 0)
+		return ret;
+
+	w->stCached = st;
+	w->pstrCachedData = *ppstrData;
+	return 0;
+}
+
+/**
+ * Save data to the destination, or queue it to be streamed back when there is none.
+ * With a name, the destination is a directory and the file is created inside it.
+ */
+
+int gased_save(gased_worker* w, char* pstrDestPath, const char* pstrName, char* pstrData, int iSize)
+{
+	FILE* pFile;
+	char pstrFilename[FILENAME_MAX];
+
+	if (pstrDestPath[0] == 0) {
+		w->pstrStream = pstrData;
+		w->iStreamSize = iSize;
+		gased_out_printf(w, ",\"size\":%d", iSize);
+		return 0;
+	}
+
+	if (pstrName)
+		snprintf(pstrFilename, FILENAME_MAX, "%s/%.*s", pstrDestPath, NBL_CHUNK_FILENAME_SIZE, pstrName);
+	else
+		snprintf(pstrFilename, FILENAME_MAX, "%s", pstrDestPath);
+
+	pFile = fopen(pstrFilename, "wb");
+	if (pFile == NULL) {
+		w->pstrError = "can't create file";
+		return -1;
+	}
+
+	if (fwrite(pstrData, 1, iSize, pFile) != (size_t)iSize) {
+		fclose(pFile);
+		w->pstrError = "can't write file";
+		return -1;
+	}
+
+	if (fclose(pFile) != 0) {
+		w->pstrError = "can't write file";
+		return -1;
+	}
+
+	gased_out_printf(w, ",\"size\":%d", iSize);
+	return 0;
+}
+
+/**
+ * List the entries of an nbl or afs archive, reading only the headers.
+ */
+
+int gased_op_list(gased_worker* w, char* pstrJob)
+{
+	struct bf_ctx* pCtx;
+	char pstrFilename[FILENAME_MAX];
+	char* pstrHeaders;
+	char* pstrTMLL;
+	char* pstrChunks;
+	char* pstrFilenames;
+	char* pstrTable;
+	int i, j, iFd, iNbChunks, iTMLLPos;
+
+	if (json_get_string(pstrJob, "file", pstrFilename, FILENAME_MAX) != 0) {
+		w->pstrError = "missing file";
+		return -2;
+	}
+
+	gased_out_printf(w, ",\"entries\":[");
+
+	pstrHeaders = nbl_load_headers(pstrFilename, &pstrTMLL, &iTMLLPos);
+	if (pstrHeaders) {
+		if (NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED) != 0) {
+			pCtx = gased_get_key(w, NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED));
+			nbl_decrypt_headers(pCtx, pstrHeaders, NBL_HEADER_CHUNKS);
+			if (pstrTMLL)
+				nbl_decrypt_headers(pCtx, pstrTMLL, NBL_TMLL_HEADER_CHUNKS);
+		}
+
+		for (j = 0; j < 2; j++) {
+			pstrTable = j == 0 ? pstrHeaders + NBL_HEADER_CHUNKS : pstrTMLL + NBL_TMLL_HEADER_CHUNKS;
+			iNbChunks = j == 0 ? NBL_READ_INT(pstrHeaders, NBL_HEADER_NB_CHUNKS) : (pstrTMLL ? NBL_READ_INT(pstrTMLL, NBL_HEADER_NB_CHUNKS) : 0);
+
+			for (i = 0; i < iNbChunks; i++) {
+				gased_out_printf(w, (j == 0 && i == 0) || w->pstrOut[w->iOutLen - 1] == '[' ? "{\"name\":" : ",{\"name\":");
+				gased_out_string(w, pstrTable + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILENAME, NBL_CHUNK_FILENAME_SIZE);
+				gased_out_printf(w, ",\"pos\":%u,\"size\":%u%s}",
+					NBL_READ_UINT(pstrTable, i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS),
+					NBL_READ_UINT(pstrTable, i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE),
+					j == 0 ? "" : ",\"tmll\":true");
+			}
+		}
+
+		free(pstrTMLL);
+		free(pstrHeaders);
+		gased_out_printf(w, "]");
+		return 0;
+	}
+
+	iFd = open(pstrFilename, O_RDONLY);
+	if (iFd < 0) {
+		w->pstrError = "can't open file";
+		return -1;
+	}
+
+	if (afs_read_tables(iFd, &iNbChunks, &pstrChunks, &pstrFilenames) != 0) {
+		close(iFd);
+		w->pstrError = "not an nbl or afs archive";
+		return -2;
+	}
+	close(iFd);
+
+	for (i = 0; i < iNbChunks; i++) {
+		gased_out_printf(w, i == 0 ? "{\"name\":" : ",{\"name\":");
+		gased_out_string(w, pstrFilenames + i * AFS_FILENAME_SIZE + AFS_FILENAME_NAME, AFS_CHUNK_FILENAME_SIZE);
+		gased_out_printf(w, ",\"pos\":%u,\"size\":%u}",
+			NBL_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS),
+			NBL_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE));
+	}
+
+	free(pstrChunks);
+	free(pstrFilenames);
+	gased_out_printf(w, "]");
+	return 0;
+}
+
+/**
+ * Extract all the entries of an nbl or afs archive to the destination directory.
+ * Only the NMLL entries of nbl archives are extracted.
+ */
+
+int gased_op_extract(gased_worker* w, char* pstrJob)
+{
+	struct stat st;
+	char pstrFilename[FILENAME_MAX];
+	char pstrDestPath[FILENAME_MAX];
+	char* pstrData;
+	unsigned int uId;
+	int iFd, ret;
+
+	if (json_get_string(pstrJob, "file", pstrFilename, FILENAME_MAX) != 0
+		|| json_get_string(pstrJob, "dest", pstrDestPath, FILENAME_MAX - NBL_CHUNK_FILENAME_SIZE - 1) != 0) {
+		w->pstrError = "missing file or dest";
+		return -2;
+	}
+
+	if (stat(pstrDestPath, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		w->pstrError = "dest is not a directory";
+		return -1;
+	}
+
+	iFd = open(pstrFilename, O_RDONLY);
+	if (iFd < 0) {
+		w->pstrError = "can't open file";
+		return -1;
+	}
+
+	if (read(iFd, &uId, sizeof(uId)) != sizeof(uId))
+		uId = 0;
+	close(iFd);
+
+	if (uId == AFS_ID) {
+		if (afs_extract(pstrFilename, pstrDestPath, NULL) != 0) {
+			w->pstrError = "error extracting files";
+			return -1;
+		}
+		return 0;
+	}
+
+	ret = gased_nbl_open(w, pstrFilename, &pstrData);
+	if (ret != 0)
+		return ret;
+
+	nbl_extract_all(w->pstrFile, NBL_HEADER_CHUNKS, pstrData, pstrDestPath, NULL);
+	gased_out_printf(w, ",\"entries\":%d", NBL_READ_INT(w->pstrFile, NBL_HEADER_NB_CHUNKS));
+	return 0;
+}
+
+/**
+ * Extract a single entry of an nbl or afs archive.
+ */
+
+int gased_op_extract_entry(gased_worker* w, char* pstrJob)
+{
+	char pstrFilename[FILENAME_MAX];
+	char pstrDestPath[FILENAME_MAX];
+	char pstrEntry[NBL_CHUNK_FILENAME_SIZE + 1];
+	char* pstrChunks;
+	char* pstrFilenames;
+	char* pstrData;
+	unsigned int uPos, uSize;
+	int i, iFd, iNbChunks, ret;
+
+	if (json_get_string(pstrJob, "file", pstrFilename, FILENAME_MAX) != 0
+		|| json_get_string(pstrJob, "entry", pstrEntry, sizeof(pstrEntry)) != 0) {
+		w->pstrError = "missing file or entry";
+		return -2;
+	}
+
+	if (json_get_string(pstrJob, "dest", pstrDestPath, FILENAME_MAX - NBL_CHUNK_FILENAME_SIZE - 1) != 0)
+		pstrDestPath[0] = 0;
+
+	iFd = open(pstrFilename, O_RDONLY);
+	if (iFd < 0) {
+		w->pstrError = "can't open file";
+		return -1;
+	}
+
+	/* Afs entries are read directly from the file. */
+	if (afs_read_tables(iFd, &iNbChunks, &pstrChunks, &pstrFilenames) == 0) {
+		for (i = 0; i < iNbChunks; i++)
+			if (strncmp(pstrFilenames + i * AFS_FILENAME_SIZE + AFS_FILENAME_NAME, pstrEntry, AFS_CHUNK_FILENAME_SIZE) == 0)
+				break;
+
+		uPos = i < iNbChunks ? NBL_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS) : 0;
+		uSize = i < iNbChunks ? NBL_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE) : 0;
+		free(pstrChunks);
+		free(pstrFilenames);
+
+		if (i == iNbChunks) {
+			close(iFd);
+			w->pstrError = "entry not found";
+			return -2;
+		}
+
+		w->pstrCachedData = NULL;
+		if (uSize > INT_MAX || gased_reserve(&w->pstrFile, &w->iFileAlloc, uSize + 1) != 0) {
+			close(iFd);
+			w->pstrError = "out of memory";
+			return -3;
+		}
+
+		if (pread(iFd, w->pstrFile, uSize, uPos) != (ssize_t)uSize) {
+			close(iFd);
+			w->pstrError = "can't read file";
+			return -1;
+		}
+
+		close(iFd);
+		return gased_save(w, pstrDestPath, pstrEntry, w->pstrFile, uSize);
+	}
+
+	close(iFd);
+
+	ret = gased_nbl_open(w, pstrFilename, &pstrData);
+	if (ret != 0)
+		return ret;
+
+	i = nbl_find_file(w->pstrFile, NBL_HEADER_CHUNKS, pstrEntry);
+	if (i < 0) {
+		w->pstrError = "entry not found";
+		return -2;
+	}
+
+	return gased_save(w, pstrDestPath, pstrEntry,
+		pstrData + NBL_READ_UINT(w->pstrFile, NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS),
+		NBL_READ_INT(w->pstrFile, NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE));
+}
+
+/**
+ * Expand a compressed file, as exp does.
+ */
+
+int gased_op_expand(gased_worker* w, char* pstrJob)
+{
+	char pstrFilename[FILENAME_MAX];
+	char pstrDestPath[FILENAME_MAX];
+	int iCmpSize, iExpSize, iSize, ret;
+
+	if (json_get_string(pstrJob, "file", pstrFilename, FILENAME_MAX) != 0) {
+		w->pstrError = "missing file";
+		return -2;
+	}
+
+	if (json_get_string(pstrJob, "dest", pstrDestPath, FILENAME_MAX) != 0)
+		pstrDestPath[0] = 0;
+
+	ret = gased_load(w, pstrFilename, &iSize);
+	if (ret != 0)
+		return ret;
+
+	if (iSize < GASED_EXP_HEADER_SIZE) {
+		w->pstrError = "truncated file";
+		return -2;
+	}
+
+	iExpSize = NBL_READ_INT(w->pstrFile, 0);
+	iCmpSize = NBL_READ_INT(w->pstrFile, 4);
+	if (iExpSize < 0 || iCmpSize < 0 || iCmpSize > iSize - GASED_EXP_HEADER_SIZE) {
+		w->pstrError = "invalid sizes";
+		return -2;
+	}
+
+	/* gased_load already dropped the cached archive. */
+	if (gased_reserve(&w->pstrData, &w->iDataAlloc, iExpSize + 1) != 0) {
+		w->pstrError = "out of memory";
+		return -3;
+	}
+
+	ret = nbl_decompress(w->pstrFile + GASED_EXP_HEADER_SIZE, iCmpSize, w->pstrData, iExpSize);
+	if (ret < 0) {
+		w->pstrError = "error decompressing data";
+		return ret;
+	}
+
+	return gased_save(w, pstrDestPath, NULL, w->pstrData, iExpSize);
+}
+
+/**
+ * Report the queue depth and the latency of each job type since startup.
+ */
+
+int gased_op_stats(gased_worker* w, char* pstrJob)
+{
+	gased_server* pServer = w->pServer;
+	gased_stats* pStats;
+	struct timespec ts;
+	int i;
+
+	(void)pstrJob;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	pthread_mutex_lock(&pServer->mutex);
+
+	gased_out_printf(w, ",\"uptime\":%ld,\"workers\":%d,\"busy\":%d,\"queue\":%d,\"connections\":%llu,\"ops\":{",
+		(long)(ts.tv_sec - pServer->tsStart.tv_sec), pServer->iNbWorkers, pServer->iBusy, pServer->iQueued, pServer->ullConnections);
+
+	for (i = 0; i < GASED_NB_OPS; i++) {
+		pStats = &pServer->aStats[i];
+		gased_out_printf(w, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,\"avg_us\":%llu,\"max_us\":%llu}",
+			i == 0 ? "" : ",", apstrOps[i], pStats->ullCount, pStats->ullErrors,
+			pStats->ullCount ? pStats->ullTotalUs / pStats->ullCount : 0, pStats->ullMaxUs);
+	}
+
+	pthread_mutex_unlock(&pServer->mutex);
+
+	gased_out_printf(w, "}");
+	return 0;
+}
+
+/**
+ * Write the whole buffer to the socket.
+ */
+
+int gased_write_all(int iFd, char* pstrBuffer, int iSize)
+{
+	ssize_t iWritten;
+
+	while (iSize > 0) {
+		iWritten = write(iFd, pstrBuffer, iSize);
+		if (iWritten < 0 && errno == EINTR)
+			continue;
+		if (iWritten <= 0)
+			return -1;
+
+		pstrBuffer += iWritten;
+		iSize -= iWritten;
+	}
+
+	return 0;
+}
+
+/**
+ * Run one job and send its response.
+ * Returns 0 when the response was sent, -1 if the connection must be closed.
+ */
+
+int gased_job(gased_worker* w, gased_conn* pConn, char* pstrJob)
+{
+	gased_server* pServer = w->pServer;
+	gased_stats* pStats;
+	struct timespec tsStart, tsEnd;
+	unsigned long long ullUs;
+	char pstrOp[32];
+	int iOp, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &tsStart);
+
+	w->iOutLen = 0;
+	w->pstrStream = NULL;
+	w->iStreamSize = 0;
+	w->pstrError = NULL;
+	gased_out_printf(w, "{\"status\":\"ok\"");
+
+	iOp = GASED_NB_OPS;
+	if (json_get_string(pstrJob, "op", pstrOp, sizeof(pstrOp)) == 0)
+		for (iOp = 0; iOp < GASED_NB_OPS; iOp++)
+			if (strcmp(pstrOp, apstrOps[iOp]) == 0)
+				break;
+
+	switch (iOp) {
+		case GASED_OP_LIST:				ret = gased_op_list(w, pstrJob); break;
+		case GASED_OP_EXTRACT:			ret = gased_op_extract(w, pstrJob); break;
+		case GASED_OP_EXTRACT_ENTRY:	ret = gased_op_extract_entry(w, pstrJob); break;
+		case GASED_OP_EXPAND:			ret = gased_op_expand(w, pstrJob); break;
+		case GASED_OP_STATS:			ret = gased_op_stats(w, pstrJob); break;
+
+		default:
+			w->pstrError = "missing or unknown op";
+			ret = -2;
+	}
+
+	if (ret != 0) {
+		w->iOutLen = 0;
+		w->pstrStream = NULL;
+		gased_out_printf(w, "{\"status\":\"error\",\"code\":%d,\"message\":", ret);
+		gased_out_string(w, w->pstrError ? w->pstrError : "error", INT_MAX);
+	}
+
+	gased_out_printf(w, "}\n");
+
+	if (gased_write_all(pConn->iFd, w->pstrOut, w->iOutLen) != 0
+		|| (w->pstrStream && gased_write_all(pConn->iFd, w->pstrStream, w->iStreamSize) != 0))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+	ullUs = (tsEnd.tv_sec - tsStart.tv_sec) * 1000000ULL + tsEnd.tv_nsec / 1000 - tsStart.tv_nsec / 1000;
+
+	if (iOp < GASED_NB_OPS) {
+		pthread_mutex_lock(&pServer->mutex);
+		pStats = &pServer->aStats[iOp];
+		pStats->ullCount++;
+		pStats->ullTotalUs += ullUs;
+		if (ullUs > pStats->ullMaxUs)
+			pStats->ullMaxUs = ullUs;
+		if (ret != 0)
+			pStats->ullErrors++;
+		pthread_mutex_unlock(&pServer->mutex);
+	}
+
+	if (pServer->iVerbose)
+		fprintf(stderr, "%s %d %lluus\n", iOp < GASED_NB_OPS ? apstrOps[iOp] : "?", ret, ullUs);
+
+	return 0;
+}
+
+/**
+ * Read the available input of a connection and run all the complete jobs found in it.
+ * Returns 0 when the connection can wait for more input, -1 if it must be closed.
+ */
+
+int gased_serve(gased_worker* w, gased_conn* pConn)
+{
+	ssize_t iRead;
+	char* pstrEnd;
+	int iLineLen;
+
+	iRead = read(pConn->iFd, pConn->pstrBuffer + pConn->iLen, GASED_LINE_MAX - 1 - pConn->iLen);
+	if (iRead <= 0)
+		return -1;
+
+	pConn->iLen += iRead;
+	pConn->pstrBuffer[pConn->iLen] = 0;
+
+	while ((pstrEnd = memchr(pConn->pstrBuffer, '\n', pConn->iLen)) != NULL) {
+		*pstrEnd = 0;
+		iLineLen = pstrEnd - pConn->pstrBuffer + 1;
+
+		if (pConn->pstrBuffer[0] != 0 && gased_job(w, pConn, pConn->pstrBuffer) != 0)
+			return -1;
+
+		memmove(pConn->pstrBuffer, pConn->pstrBuffer + iLineLen, pConn->iLen - iLineLen);
+		pConn->iLen -= iLineLen;
+		pConn->pstrBuffer[pConn->iLen] = 0;
+	}
+
+	/* A job that doesn't fit in the buffer can never complete. */
+	if (pConn->iLen == GASED_LINE_MAX - 1) {
+		w->iOutLen = 0;
+		gased_out_printf(w, "{\"status\":\"error\",\"code\":-2,\"message\":\"job too long\"}\n");
+		gased_write_all(pConn->iFd, w->pstrOut, w->iOutLen);
+		return -1;
+	}
+
+	return 0;
+}
+
+void* gased_worker_thread(void* pArg)
+{
+	gased_worker* w = pArg;
+	gased_server* pServer = w->pServer;
+	gased_conn* pConn;
+	int ret;
+
+	while (1) {
+		pthread_mutex_lock(&pServer->mutex);
+		while (pServer->iQueued == 0)
+			pthread_cond_wait(&pServer->condQueued, &pServer->mutex);
+
+		pConn = pServer->apQueue[pServer->iHead];
+		pServer->iHead = (pServer->iHead + 1) % GASED_QUEUE_SIZE;
+		pServer->iQueued--;
+		pServer->iBusy++;
+		pthread_cond_signal(&pServer->condFree);
+		pthread_mutex_unlock(&pServer->mutex);
+
+		ret = gased_serve(w, pConn);
+
+		pthread_mutex_lock(&pServer->mutex);
+		pServer->iBusy--;
+		pthread_mutex_unlock(&pServer->mutex);
+
+		if (ret == 0) {
+			/* Hand the connection back to the main thread to wait for its next jobs. */
+			if (write(pServer->aiPipe[1], &pConn, sizeof(pConn)) != sizeof(pConn)) {
+				close(pConn->iFd);
+				free(pConn);
+			}
+		} else {
+			close(pConn->iFd);
+			free(pConn);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Queue a connection with input, waiting for room when all the workers are behind.
+ */
+
+void gased_enqueue(gased_server* pServer, gased_conn* pConn)
+{
+	pthread_mutex_lock(&pServer->mutex);
+	while (pServer->iQueued == GASED_QUEUE_SIZE)
+		pthread_cond_wait(&pServer->condFree, &pServer->mutex);
+
+	pServer->apQueue[(pServer->iHead + pServer->iQueued) % GASED_QUEUE_SIZE] = pConn;
+	pServer->iQueued++;
+	pthread_cond_signal(&pServer->condQueued);
+	pthread_mutex_unlock(&pServer->mutex);
+}
+
+/**
+ * Create the listening socket, readable and writable by the current user only.
+ */
+
+int gased_listen(char* pstrSocket)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int iFd;
+
+	if (strlen(pstrSocket) >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, pstrSocket);
+
+	iFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (iFd < 0)
+		return -1;
+
+	unlink(pstrSocket);
+
+	mask = umask(0077);
+	if (bind(iFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(iFd, SOMAXCONN) != 0) {
+		umask(mask);
+		close(iFd);
+		return -1;
+	}
+	umask(mask);
+
+	return iFd;
+}
+
+/**
+ * Wait for new connections and for input on the idle ones, until stopped by a signal.
+ */
+
+int gased_run(gased_server* pServer, int iListenFd)
+{
+	struct pollfd* pFds = NULL;
+	gased_conn** ppConns = NULL;
+	gased_conn* pConn;
+	void* pTmp;
+	int i, iFd, iNbConns = 0, iMax = 0, iNbFds;
+
+	while (!iStop) {
+		/* Room for the idle connections, plus one handed back and one accepted. */
+		if (iNbConns + 4 > iMax) {
+			iMax = iMax ? iMax * 2 : 64;
+			pTmp = realloc(pFds, iMax * sizeof(struct pollfd));
+			if (pTmp == NULL)
+				return -3;
+			pFds = pTmp;
+			pTmp = realloc(ppConns, iMax * sizeof(gased_conn*));
+			if (pTmp == NULL)
+				return -3;
+			ppConns = pTmp;
+		}
+
+		pFds[0].fd = iListenFd;
+		pFds[0].events = POLLIN;
+		pFds[1].fd = pServer->aiPipe[0];
+		pFds[1].events = POLLIN;
+		for (i = 0; i < iNbConns; i++) {
+			pFds[i + 2].fd = ppConns[i]->iFd;
+			pFds[i + 2].events = POLLIN;
+		}
+		iNbFds = iNbConns + 2;
+
+		if (poll(pFds, iNbFds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		/* Connections with input go to the workers; the others stay here. */
+		for (i = iNbFds - 1; i >= 2; i--) {
+			if (pFds[i].revents == 0)
+				continue;
+
+			gased_enqueue(pServer, ppConns[i - 2]);
+			ppConns[i - 2] = ppConns[--iNbConns];
+		}
+
+		if (pFds[1].revents & POLLIN) {
+			if (read(pServer->aiPipe[0], &pConn, sizeof(pConn)) == sizeof(pConn))
+				ppConns[iNbConns++] = pConn;
+		}
+
+		if (pFds[0].revents & POLLIN) {
+			iFd = accept(iListenFd, NULL, NULL);
+			if (iFd < 0)
+				continue;
+
+			pConn = calloc(1, sizeof(gased_conn));
+			if (pConn == NULL) {
+				close(iFd);
+				continue;
+			}
+
+			pConn->iFd = iFd;
+			ppConns[iNbConns++] = pConn;
+
+			pthread_mutex_lock(&pServer->mutex);
+			pServer->ullConnections++;
+			pthread_mutex_unlock(&pServer->mutex);
+		}
+	}
+
+	free(pFds);
+	free(ppConns);
+	return 0;
+}
+
+void gased_signal(int iSignal)
+{
+	(void)iSignal;
+	iStop = 1;
+}
+
+/**
+ * Entry point.
+ */
+
+int main(int argc, char** argv)
+{
+	/* Static so that it outlives main while the workers end. */
+	static gased_server server;
+	gased_worker* pWorkers;
+	struct sigaction sa;
+	int i, iListenFd, ret;
+
+	memset(&server, 0, sizeof(server));
+	server.iNbWorkers = GASED_DEFAULT_WORKERS;
+
+	opterr = 0;
+	while ((i = getopt(argc, argv, "vw:")) != -1) {
+		switch (i) {
+			case 'v':
+				server.iVerbose = 1;
+				break;
+
+			case 'w':
+				server.iNbWorkers = atoi(optarg);
+				if (server.iNbWorkers <= 0) {
+					fprintf(stderr, "Invalid number of workers %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case '?':
+				if (optopt == 'w')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 1;
+
+			default:
+				abort();
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Usage: %s [-v] [-w workers] socket\n", argv[0]);
+		return 1;
+	}
+
+	/* Clients that go away are noticed on write. */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = gased_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	iListenFd = gased_listen(argv[optind]);
+	if (iListenFd < 0) {
+		fprintf(stderr, "Error listening on %s\n", argv[optind]);
+		return -1;
+	}
+
+	if (pipe(server.aiPipe) != 0) {
+		close(iListenFd);
+		return -1;
+	}
+
+	pthread_mutex_init(&server.mutex, NULL);
+	pthread_cond_init(&server.condQueued, NULL);
+	pthread_cond_init(&server.condFree, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &server.tsStart);
+
+	pWorkers = calloc(server.iNbWorkers, sizeof(gased_worker));
+	if (pWorkers == NULL) {
+		close(iListenFd);
+		return -3;
+	}
+
+	for (i = 0; i < server.iNbWorkers; i++) {
+		pWorkers[i].pServer = &server;
+		if (pthread_create(&pWorkers[i].thread, NULL, gased_worker_thread, &pWorkers[i]) != 0) {
+			fprintf(stderr, "Error creating worker %d\n", i);
+			close(iListenFd);
+			return -1;
+		}
+	}
+
+	if (server.iVerbose)
+		fprintf(stderr, "Listening on %s with %d workers\n", argv[optind], server.iNbWorkers);
+
+	ret = gased_run(&server, iListenFd);
+
+	/* Workers may be in the middle of a job; exiting ends them. */
+	close(iListenFd);
+	unlink(argv[optind]);
+
+	return ret;
+}
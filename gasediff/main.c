@@ -0,0 +1,990 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../afs/afs.h"
+#include "../nbl/nbl.h"
+
+/**
+ * Archive types.
+ */
+
+#define ARCHIVE_UNKNOWN	0
+#define ARCHIVE_NBL		1
+#define ARCHIVE_AFS		2
+
+/**
+ * Entry flags.
+ */
+
+#define ENTRY_HASH		0x1 /* Same size in both versions; the contents must be compared. */
+#define ENTRY_SAVE		0x2 /* Added or modified; the payload is saved with -o. */
+#define ENTRY_MODIFIED	0x4
+#define ENTRY_SAVED		0x8
+
+/**
+ * Sections of nbl archives. The names of TMLL entries get the TMLL_PREFIX.
+ */
+
+#define SECTION_NMLL	0
+#define SECTION_TMLL	1
+
+#define TMLL_PREFIX		"tmll/"
+
+/**
+ * Options masks.
+ */
+
+#define OPTION_VERBOSE	0x1
+
+/**
+ * Size of the window used to read afs entries.
+ */
+
+#define DIFF_WINDOW_SIZE 0x100000
+
+typedef struct {
+	char pstrName[sizeof(TMLL_PREFIX) + NBL_CHUNK_FILENAME_SIZE];
+	unsigned long long ullPos;
+	unsigned int uSize;
+	int iSection;
+	int iIndex; /* Position in the chunk table, to keep duplicate names in order. */
+	int iFlags;
+	int iOther; /* Matching entry in the other version, or -1. */
+	struct manifest_sum sum;
+	int iTodo; /* ENTRY_HASH and ENTRY_SAVE flags of the pass in progress. */
+	unsigned int uDone; /* Bytes processed in the pass in progress. */
+	FILE* pFile; /* Payload being saved. */
+} gasediff_entry;
+
+typedef struct {
+	char* pstrFilename; /* NULL when the archive doesn't exist in this version. */
+	int iType;
+	int iNbEntries;
+	gasediff_entry* pEntries;
+	int iSkippedTMLL; /* The TMLL section is compressed and its entries weren't read. */
+} gasediff_archive;
+
+typedef struct {
+	int iOld;
+	int iNew;
+} gasediff_pair;
+
+typedef struct {
+	unsigned int uOptions;
+	char* pstrDestPath;
+	int iArchives;
+	int iAdded;
+	int iRemoved;
+	int iModified;
+	unsigned long long ullHashed;
+} gasediff_state;
+
+typedef struct {
+	gasediff_state* pState;
+	gasediff_archive* pOld;
+	char* pstrRelPath;
+	gasediff_entry** ppEntries; /* Entries of the section being decoded, sorted by position. */
+	int iNbEntries;
+	int iFirst; /* First entry not processed completely. */
+} gasediff_stream;
+
+/**
+ * Prototypes.
+ */
+
+int archive_type(char* pstrFilename);
+int archive_load_entries(gasediff_archive* p);
+int archive_load_section(gasediff_archive* p, char* pstrHeaders, int iHeaderChunksPos, int iSection, int iFirst);
+int archive_process(gasediff_state* pState, gasediff_archive* p, gasediff_archive* pOld, char* pstrRelPath);
+int archive_process_nbl(gasediff_stream* pStream, gasediff_archive* p);
+int archive_drop_section(gasediff_archive* p, int iSection);
+int compare_entries(const void* a, const void* b);
+int compare_positions(const void* a, const void* b);
+int compare_strings(const void* a, const void* b);
+int diff_archives(gasediff_state* pState, char* pstrOld, char* pstrNew, char* pstrRelPath);
+int collect_files(char* pstrRoot, char* pstrRelPath, char*** pppstrFiles, int* piNbFiles, int* piMax);
+int diff_trees(gasediff_state* pState, char* pstrOld, char* pstrNew);
+int make_path(char* pstrPath);
+FILE* save_open(gasediff_state* pState, char* pstrRelPath, char* pstrName);
+int save_payload(gasediff_state* pState, char* pstrRelPath, char* pstrName, unsigned int uSize, int iFd, unsigned long long ullPos);
+int stream_process(void* pArg, unsigned int uPos, char* pstrData, unsigned int uSize);
+
+static struct manifest_ctx hashctx = {NULL, MANIFEST_HASH64};
+
+/**
+ * Return the type of the archive from its identifier.
+ */
+
+int archive_type(char* pstrFilename)
+{
+	FILE* pFile;
+	unsigned int uId = 0;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return ARCHIVE_UNKNOWN;
+
+	if (fread(&uId, sizeof(unsigned int), 1, pFile) != 1)
+		uId = 0;
+	fclose(pFile);
+
+	if (uId == NBL_ID_NMLL)
+		return ARCHIVE_NBL;
+	if (uId == AFS_ID)
+		return ARCHIVE_AFS;
+	return ARCHIVE_UNKNOWN;
+}
+
+int compare_entries(const void* a, const void* b)
+{
+	const gasediff_entry* pA = a;
+	const gasediff_entry* pB = b;
+	int ret;
+
+	ret = strcmp(pA->pstrName, pB->pstrName);
+	if (ret == 0)
+		ret = pA->iIndex - pB->iIndex;
+	return ret;
+}
+
+int compare_positions(const void* a, const void* b)
+{
+	const gasediff_entry* pA = *(gasediff_entry* const*)a;
+	const gasediff_entry* pB = *(gasediff_entry* const*)b;
+
+	if (pA->ullPos != pB->ullPos)
+		return pA->ullPos < pB->ullPos ? -1 : 1;
+	return 0;
+}
+
+int compare_strings(const void* a, const void* b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Add the entries of a section of an nbl archive from its decrypted chunk table.
+ * The entries of the TMLL section get the TMLL_PREFIX.
+ */
+
+int archive_load_section(gasediff_archive* p, char* pstrHeaders, int iHeaderChunksPos, int iSection, int iFirst)
+{
+	gasediff_entry* pEntry;
+	int i;
+
+	for (i = 0; i < NBL_READ_INT(pstrHeaders, NBL_HEADER_NB_CHUNKS); i++) {
+		pEntry = &p->pEntries[iFirst + i];
+		snprintf(pEntry->pstrName, sizeof(pEntry->pstrName), "%s%.*s", iSection == SECTION_TMLL ? TMLL_PREFIX : "",
+			NBL_CHUNK_FILENAME_SIZE, pstrHeaders + iHeaderChunksPos + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILENAME);
+		pEntry->ullPos = NBL_READ_UINT(pstrHeaders, iHeaderChunksPos + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS);
+		pEntry->uSize = NBL_READ_UINT(pstrHeaders, iHeaderChunksPos + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE);
+		pEntry->iSection = iSection;
+	}
+
+	return i;
+}
+
+/**
+ * Read the names, positions and sizes of the entries from the chunk tables only.
+ * The entries of a compressed TMLL section are left out with a warning, since it
+ * can't be decompressed yet. The entries are sorted by name.
+ */
+
+int archive_load_entries(gasediff_archive* p)
+{
+	struct bf_ctx ctx;
+	char* pstrHeaders;
+	char* pstrTMLL;
+	char* pstrChunks;
+	char* pstrFilenames;
+	int i, iFd, iTMLLPos, iNbTMLL = 0;
+
+	p->iNbEntries = 0;
+	p->pEntries = NULL;
+
+	if (p->pstrFilename == NULL)
+		return 0;
+
+	if (p->iType == ARCHIVE_NBL) {
+		pstrHeaders = nbl_load_headers(p->pstrFilename, &pstrTMLL, &iTMLLPos);
+		if (pstrHeaders == NULL || (nbl_has_tmll(pstrHeaders) && pstrTMLL == NULL)) {
+			free(pstrHeaders);
+			return -1;
+		}
+
+		if (NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED) != 0) {
+			nbl_setkey(&ctx, NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED));
+			nbl_decrypt_headers(&ctx, pstrHeaders, NBL_HEADER_CHUNKS);
+			if (pstrTMLL)
+				nbl_decrypt_headers(&ctx, pstrTMLL, NBL_TMLL_HEADER_CHUNKS);
+		}
+
+		if (pstrTMLL && nbl_is_compressed(pstrTMLL)) {
+			fprintf(stderr, "Entries of the compressed TMLL section of %s not compared: its decompression algorithm is unknown\n", p->pstrFilename);
+			p->iSkippedTMLL = 1;
+		} else if (pstrTMLL)
+			iNbTMLL = NBL_READ_INT(pstrTMLL, NBL_HEADER_NB_CHUNKS);
+
+		p->iNbEntries = NBL_READ_INT(pstrHeaders, NBL_HEADER_NB_CHUNKS) + iNbTMLL;
+		p->pEntries = calloc(p->iNbEntries + 1, sizeof(gasediff_entry));
+		if (p->pEntries == NULL) {
+			free(pstrHeaders);
+			free(pstrTMLL);
+			return -3;
+		}
+
+		i = archive_load_section(p, pstrHeaders, NBL_HEADER_CHUNKS, SECTION_NMLL, 0);
+		if (iNbTMLL)
+			archive_load_section(p, pstrTMLL, NBL_TMLL_HEADER_CHUNKS, SECTION_TMLL, i);
+
+		free(pstrHeaders);
+		free(pstrTMLL);
+	} else {
+		iFd = open(p->pstrFilename, O_RDONLY | O_BINARY);
+		if (iFd < 0)
+			return -1;
+
+		if (afs_read_tables(iFd, &p->iNbEntries, &pstrChunks, &pstrFilenames) != 0) {
+			close(iFd);
+			return -1;
+		}
+		close(iFd);
+
+		p->pEntries = calloc(p->iNbEntries + 1, sizeof(gasediff_entry));
+		if (p->pEntries == NULL) {
+			free(pstrChunks);
+			free(pstrFilenames);
+			return -3;
+		}
+
+		for (i = 0; i < p->iNbEntries; i++) {
+			strncpy(p->pEntries[i].pstrName, pstrFilenames + i * AFS_FILENAME_SIZE + AFS_FILENAME_NAME, AFS_CHUNK_FILENAME_SIZE);
+			p->pEntries[i].ullPos = NBL_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_POS);
+			p->pEntries[i].uSize = NBL_READ_UINT(pstrChunks, i * AFS_CHUNK_HEADER_SIZE + AFS_CHUNK_SIZE);
+		}
+
+		free(pstrChunks);
+		free(pstrFilenames);
+	}
+
+	for (i = 0; i < p->iNbEntries; i++) {
+		p->pEntries[i].iIndex = i;
+		p->pEntries[i].iOther = -1;
+	}
+
+	qsort(p->pEntries, p->iNbEntries, sizeof(gasediff_entry), compare_entries);
+	return 0;
+}
+
+/**
+ * Create all the missing directories of the given file path.
+ */
+
+int make_path(char* pstrPath)
+{
+	char* pstrTmp;
+
+	for (pstrTmp = strchr(pstrPath + 1, '/'); pstrTmp != NULL; pstrTmp = strchr(pstrTmp + 1, '/')) {
+		*pstrTmp = 0;
+		mkdir(pstrPath, 0755);
+		*pstrTmp = '/';
+	}
+
+	return 0;
+}
+
+/**
+ * Open the file destpath/archive/entry to save the payload of an entry.
+ */
+
+FILE* save_open(gasediff_state* pState, char* pstrRelPath, char* pstrName)
+{
+	FILE* pFile;
+	char pstrFilename[FILENAME_MAX];
+
+	if (snprintf(pstrFilename, FILENAME_MAX, "%s/%s/%s", pState->pstrDestPath, pstrRelPath, pstrName) >= FILENAME_MAX) {
+		fprintf(stderr, "Path too long: %s/%s/%s\n", pState->pstrDestPath, pstrRelPath, pstrName);
+		return NULL;
+	}
+	make_path(pstrFilename);
+
+	pFile = fopen(pstrFilename, "wb");
+	if (pFile == NULL)
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+
+	return pFile;
+}
+
+/**
+ * Save the payload of an afs entry in destpath/archive/entry, copying it from the file descriptor.
+ */
+
+int save_payload(gasediff_state* pState, char* pstrRelPath, char* pstrName, unsigned int uSize, int iFd, unsigned long long ullPos)
+{
+	FILE* pFile;
+	char* pstrWindow;
+	unsigned int uChunk;
+	int ret = 0;
+
+	pFile = save_open(pState, pstrRelPath, pstrName);
+	if (pFile == NULL)
+		return -1;
+
+	pstrWindow = malloc(DIFF_WINDOW_SIZE);
+	if (pstrWindow == NULL)
+		ret = -3;
+
+	while (ret == 0 && uSize > 0) {
+		uChunk = uSize < DIFF_WINDOW_SIZE ? uSize : DIFF_WINDOW_SIZE;
+		if (pread(iFd, pstrWindow, uChunk, ullPos) != (ssize_t)uChunk || fwrite(pstrWindow, 1, uChunk, pFile) != uChunk)
+			ret = -1;
+		ullPos += uChunk;
+		uSize -= uChunk;
+	}
+
+	free(pstrWindow);
+
+	if (fclose(pFile) != 0)
+		ret = -1;
+	if (ret != 0)
+		fprintf(stderr, "Error writing the payload of %s:%s\n", pstrRelPath, pstrName);
+
+	return ret;
+}
+
+/**
+ * Hash and save the decoded data found at position uPos for the entries it covers;
+ * a nbl_stream_func. Each entry does what its iTodo flags say. Once hashed, an entry
+ * of the new version is compared with the old one and flagged to be saved if it changed.
+ */
+
+int stream_process(void* pArg, unsigned int uPos, char* pstrData, unsigned int uSize)
+{
+	gasediff_stream* pStream = pArg;
+	gasediff_entry* pEntry;
+	gasediff_entry* pOther;
+	unsigned long long ullStart, ullEnd;
+	int i;
+
+	for (i = pStream->iFirst; i < pStream->iNbEntries && pStream->ppEntries[i]->ullPos <= uPos + uSize; i++) {
+		pEntry = pStream->ppEntries[i];
+		if (pEntry->iTodo == 0)
+			continue;
+
+		ullStart = pEntry->ullPos > uPos ? pEntry->ullPos : uPos;
+		ullEnd = pEntry->ullPos + pEntry->uSize < uPos + uSize ? pEntry->ullPos + pEntry->uSize : uPos + uSize;
+		if (ullStart >= ullEnd && pEntry->uSize != 0)
+			continue;
+
+		if (pEntry->iTodo & ENTRY_SAVE && pEntry->pFile == NULL) {
+			pEntry->pFile = save_open(pStream->pState, pStream->pstrRelPath, pEntry->pstrName);
+			if (pEntry->pFile == NULL)
+				return -1;
+		}
+
+		if (ullStart < ullEnd) {
+			if (pEntry->iTodo & ENTRY_HASH)
+				manifest_sum_update(&hashctx, &pEntry->sum, pstrData + (ullStart - uPos), ullEnd - ullStart);
+			if (pEntry->iTodo & ENTRY_SAVE && fwrite(pstrData + (ullStart - uPos), 1, ullEnd - ullStart, pEntry->pFile) != ullEnd - ullStart) {
+				fprintf(stderr, "Error writing the payload of %s:%s\n", pStream->pstrRelPath, pEntry->pstrName);
+				return -1;
+			}
+			pEntry->uDone += ullEnd - ullStart;
+		}
+
+		if (pEntry->uDone < pEntry->uSize)
+			continue;
+
+		if (pEntry->iTodo & ENTRY_HASH) {
+			pStream->pState->ullHashed += pEntry->uSize;
+
+			if (pStream->pOld) {
+				pOther = &pStream->pOld->pEntries[pEntry->iOther];
+				if (pEntry->sum.uCrc != pOther->sum.uCrc || pEntry->sum.ullHash != pOther->sum.ullHash)
+					pEntry->iFlags |= ENTRY_MODIFIED | ENTRY_SAVE;
+			}
+		}
+
+		if (pEntry->iTodo & ENTRY_SAVE) {
+			pEntry->iFlags |= ENTRY_SAVED;
+			if (fclose(pEntry->pFile) != 0) {
+				pEntry->pFile = NULL;
+				fprintf(stderr, "Error writing the payload of %s:%s\n", pStream->pstrRelPath, pEntry->pstrName);
+				return -1;
+			}
+			pEntry->pFile = NULL;
+		}
+
+		pEntry->iTodo = 0;
+	}
+
+	while (pStream->iFirst < pStream->iNbEntries && pStream->ppEntries[pStream->iFirst]->iTodo == 0)
+		pStream->iFirst++;
+
+	return 0;
+}
+
+/**
+ * Decode the sections of an nbl archive that have entries to process, without holding
+ * more than a window of data; see nbl_decode_stream.
+ */
+
+int archive_process_nbl(gasediff_stream* pStream, gasediff_archive* p)
+{
+	FILE* pFile;
+	struct bf_ctx ctx;
+	struct bf_ctx* pCtx = NULL;
+	char* pstrHeaders;
+	char* pstrTMLL;
+	char* pstrSection;
+	off_t iSectionPos;
+	int i, iSection, iTMLLPos, ret = 0;
+
+	pstrHeaders = nbl_load_headers(p->pstrFilename, &pstrTMLL, &iTMLLPos);
+	pFile = fopen(p->pstrFilename, "rb");
+	pStream->ppEntries = malloc((p->iNbEntries + 1) * sizeof(gasediff_entry*));
+	if (pstrHeaders == NULL || pFile == NULL || pStream->ppEntries == NULL) {
+		ret = -1;
+		goto archive_process_nbl_ret;
+	}
+
+	if (NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED) != 0) {
+		pCtx = &ctx;
+		nbl_setkey(pCtx, NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED));
+	}
+
+	for (iSection = SECTION_NMLL; iSection <= SECTION_TMLL; iSection++) {
+		pStream->iNbEntries = 0;
+		pStream->iFirst = 0;
+		for (i = 0; i < p->iNbEntries; i++)
+			if (p->pEntries[i].iSection == iSection && p->pEntries[i].iTodo)
+				pStream->ppEntries[pStream->iNbEntries++] = &p->pEntries[i];
+
+		if (pStream->iNbEntries == 0)
+			continue;
+
+		pstrSection = iSection == SECTION_TMLL ? pstrTMLL : pstrHeaders;
+		iSectionPos = iSection == SECTION_TMLL ? iTMLLPos : 0;
+
+		for (i = 0; i < pStream->iNbEntries; i++) {
+			if (pStream->ppEntries[i]->ullPos + pStream->ppEntries[i]->uSize > NBL_READ_UINT(pstrSection, NBL_HEADER_DATA_SIZE)) {
+				fprintf(stderr, "Entry %s out of the data of %s\n", pStream->ppEntries[i]->pstrName, p->pstrFilename);
+				ret = -1;
+				goto archive_process_nbl_ret;
+			}
+		}
+
+		qsort(pStream->ppEntries, pStream->iNbEntries, sizeof(gasediff_entry*), compare_positions);
+
+		if (fseeko(pFile, iSectionPos + NBL_READ_UINT(pstrSection, NBL_HEADER_SIZE), SEEK_SET) != 0
+			|| (ret = nbl_decode_stream(pFile, pstrSection, pCtx, stream_process, pStream)) != 0) {
+			fprintf(stderr, "Error decoding file %s\n", p->pstrFilename);
+			ret = -1;
+			goto archive_process_nbl_ret;
+		}
+	}
+
+archive_process_nbl_ret:
+	for (i = 0; i < p->iNbEntries; i++) {
+		if (p->pEntries[i].pFile) {
+			fclose(p->pEntries[i].pFile);
+			p->pEntries[i].pFile = NULL;
+		}
+	}
+	free(pStream->ppEntries);
+	pStream->ppEntries = NULL;
+	if (pFile)
+		fclose(pFile);
+	free(pstrHeaders);
+	free(pstrTMLL);
+
+	return ret;
+}
+
+/**
+ * Hash the entries flagged ENTRY_HASH and, with -o, save those flagged ENTRY_SAVE.
+ * When pOld is given the hashes are compared with it as they are computed. nbl
+ * archives are decoded as a stream; the entries found to be modified only then
+ * are saved in a second pass. Nothing is read if no entry is flagged.
+ */
+
+int archive_process(gasediff_state* pState, gasediff_archive* p, gasediff_archive* pOld, char* pstrRelPath)
+{
+	gasediff_stream stream;
+	gasediff_entry* pEntry;
+	gasediff_entry* pOther;
+	char* pstrWindow = NULL;
+	unsigned long long ullPos;
+	unsigned int uSize, uChunk;
+	int i, iPass, iFd = -1, iNeeded, ret = 0;
+
+	if (p->iType == ARCHIVE_NBL) {
+		memset(&stream, 0, sizeof(stream));
+		stream.pState = pState;
+		stream.pOld = pOld;
+		stream.pstrRelPath = pstrRelPath;
+
+		for (iPass = 0; ret == 0; iPass++) {
+			iNeeded = 0;
+			for (i = 0; i < p->iNbEntries; i++) {
+				pEntry = &p->pEntries[i];
+				pEntry->iTodo = 0;
+				pEntry->uDone = 0;
+				if (iPass == 0 && pEntry->iFlags & ENTRY_HASH) {
+					pEntry->iTodo |= ENTRY_HASH;
+					manifest_sum_init(&pEntry->sum);
+				}
+				if (pEntry->iFlags & ENTRY_SAVE && !(pEntry->iFlags & ENTRY_SAVED) && pState->pstrDestPath)
+					pEntry->iTodo |= ENTRY_SAVE;
+				iNeeded |= pEntry->iTodo;
+			}
+
+			if (!iNeeded)
+				break;
+
+			ret = archive_process_nbl(&stream, p);
+		}
+
+		return ret;
+	}
+
+	iNeeded = 0;
+	for (i = 0; i < p->iNbEntries; i++)
+		if (p->pEntries[i].iFlags & ENTRY_HASH || (p->pEntries[i].iFlags & ENTRY_SAVE && pState->pstrDestPath))
+			iNeeded = 1;
+
+	if (!iNeeded)
+		return 0;
+
+	iFd = open(p->pstrFilename, O_RDONLY | O_BINARY);
+	pstrWindow = malloc(DIFF_WINDOW_SIZE);
+	if (iFd < 0 || pstrWindow == NULL) {
+		ret = -1;
+		goto archive_process_ret;
+	}
+
+	for (i = 0; i < p->iNbEntries; i++) {
+		pEntry = &p->pEntries[i];
+
+		if (pEntry->iFlags & ENTRY_HASH) {
+			manifest_sum_init(&pEntry->sum);
+
+			ullPos = pEntry->ullPos;
+			uSize = pEntry->uSize;
+			while (uSize > 0) {
+				uChunk = uSize < DIFF_WINDOW_SIZE ? uSize : DIFF_WINDOW_SIZE;
+				if (pread(iFd, pstrWindow, uChunk, ullPos) != (ssize_t)uChunk) {
+					fprintf(stderr, "Error reading file %s\n", p->pstrFilename);
+					ret = -1;
+					goto archive_process_ret;
+				}
+				manifest_sum_update(&hashctx, &pEntry->sum, pstrWindow, uChunk);
+				ullPos += uChunk;
+				uSize -= uChunk;
+			}
+
+			pState->ullHashed += pEntry->uSize;
+
+			if (pOld) {
+				pOther = &pOld->pEntries[pEntry->iOther];
+				if (pEntry->sum.uCrc != pOther->sum.uCrc || pEntry->sum.ullHash != pOther->sum.ullHash)
+					pEntry->iFlags |= ENTRY_MODIFIED | ENTRY_SAVE;
+			}
+		}
+
+		if (pEntry->iFlags & ENTRY_SAVE && pState->pstrDestPath) {
+			ret = save_payload(pState, pstrRelPath, pEntry->pstrName, pEntry->uSize, iFd, pEntry->ullPos);
+			if (ret != 0)
+				goto archive_process_ret;
+		}
+	}
+
+archive_process_ret:
+	free(pstrWindow);
+	if (iFd >= 0)
+		close(iFd);
+
+	return ret;
+}
+
+/**
+ * Remove the entries of a section, which is skipped in the other version of the archive.
+ */
+
+int archive_drop_section(gasediff_archive* p, int iSection)
+{
+	int i, j = 0;
+
+	for (i = 0; i < p->iNbEntries; i++)
+		if (p->pEntries[i].iSection != iSection)
+			p->pEntries[j++] = p->pEntries[i];
+
+	p->iNbEntries = j;
+	return 0;
+}
+
+/**
+ * Compare the entries of two versions of an archive and print the differences.
+ * Either file may be NULL when the archive was added or removed.
+ * Returns the number of differences or a negative value on error.
+ */
+
+int diff_archives(gasediff_state* pState, char* pstrOld, char* pstrNew, char* pstrRelPath)
+{
+	gasediff_archive old, new;
+	gasediff_pair* pPairs = NULL;
+	gasediff_entry* pOld;
+	gasediff_entry* pNew;
+	int i, j, iCmp, iNbPairs = 0, ret = 0;
+
+	memset(&old, 0, sizeof(old));
+	memset(&new, 0, sizeof(new));
+	old.pstrFilename = pstrOld;
+	new.pstrFilename = pstrNew;
+	old.iType = pstrOld ? archive_type(pstrOld) : ARCHIVE_UNKNOWN;
+	new.iType = pstrNew ? archive_type(pstrNew) : ARCHIVE_UNKNOWN;
+
+	/* A missing version takes the type of the other one. */
+	if (pstrOld == NULL)
+		old.iType = new.iType;
+	if (pstrNew == NULL)
+		new.iType = old.iType;
+
+	if (old.iType == ARCHIVE_UNKNOWN || new.iType == ARCHIVE_UNKNOWN || old.iType != new.iType)
+		return 0;
+
+	pState->iArchives++;
+
+	if (archive_load_entries(&old) != 0 || archive_load_entries(&new) != 0) {
+		fprintf(stderr, "Error reading the tables of %s\n", pstrRelPath);
+		ret = -1;
+		goto diff_archives_ret;
+	}
+
+	/* Without a way to decode both, the TMLL entries are left out of the diff. */
+	if (old.iSkippedTMLL != new.iSkippedTMLL) {
+		if (old.iSkippedTMLL)
+			archive_drop_section(&new, SECTION_TMLL);
+		else
+			archive_drop_section(&old, SECTION_TMLL);
+		fprintf(stderr, "Entries of the TMLL section of %s not compared: it is compressed in one version only\n", pstrRelPath);
+	}
+
+	pPairs = malloc((old.iNbEntries + new.iNbEntries + 1) * sizeof(gasediff_pair));
+	if (pPairs == NULL) {
+		ret = -3;
+		goto diff_archives_ret;
+	}
+
+	/* Match the entries by name. Sizes are compared first; only same-size entries are decoded. */
+
+	i = j = 0;
+	while (i < old.iNbEntries || j < new.iNbEntries) {
+		if (i == old.iNbEntries)
+			iCmp = 1;
+		else if (j == new.iNbEntries)
+			iCmp = -1;
+		else
+			iCmp = strcmp(old.pEntries[i].pstrName, new.pEntries[j].pstrName);
+
+		if (iCmp < 0) {
+			pPairs[iNbPairs].iOld = i++;
+			pPairs[iNbPairs++].iNew = -1;
+		} else if (iCmp > 0) {
+			new.pEntries[j].iFlags |= ENTRY_SAVE;
+			pPairs[iNbPairs].iOld = -1;
+			pPairs[iNbPairs++].iNew = j++;
+		} else {
+			old.pEntries[i].iOther = j;
+			new.pEntries[j].iOther = i;
+
+			if (old.pEntries[i].uSize != new.pEntries[j].uSize)
+				new.pEntries[j].iFlags |= ENTRY_MODIFIED | ENTRY_SAVE;
+			else {
+				old.pEntries[i].iFlags |= ENTRY_HASH;
+				new.pEntries[j].iFlags |= ENTRY_HASH;
+			}
+
+			pPairs[iNbPairs].iOld = i++;
+			pPairs[iNbPairs++].iNew = j++;
+		}
+	}
+
+	ret = archive_process(pState, &old, NULL, pstrRelPath);
+	if (ret == 0)
+		ret = archive_process(pState, &new, &old, pstrRelPath);
+	if (ret != 0)
+		goto diff_archives_ret;
+
+	for (i = 0; i < iNbPairs; i++) {
+		pOld = pPairs[i].iOld < 0 ? NULL : &old.pEntries[pPairs[i].iOld];
+		pNew = pPairs[i].iNew < 0 ? NULL : &new.pEntries[pPairs[i].iNew];
+
+		if (pOld == NULL) {
+			printf("A %s:%s\n", pstrRelPath, pNew->pstrName);
+			pState->iAdded++;
+			ret++;
+		} else if (pNew == NULL) {
+			printf("D %s:%s\n", pstrRelPath, pOld->pstrName);
+			pState->iRemoved++;
+			ret++;
+		} else if (pNew->iFlags & ENTRY_MODIFIED) {
+			printf("M %s:%s\n", pstrRelPath, pNew->pstrName);
+			pState->iModified++;
+			ret++;
+		}
+	}
+
+diff_archives_ret:
+	free(pPairs);
+	free(old.pEntries);
+	free(new.pEntries);
+
+	return ret;
+}
+
+/**
+ * Add the regular files found under pstrRoot/pstrRelPath to the list, recursively.
+ * Paths that don't fit in FILENAME_MAX are an error rather than being left out of the diff.
+ */
+
+int collect_files(char* pstrRoot, char* pstrRelPath, char*** pppstrFiles, int* piNbFiles, int* piMax)
+{
+	struct dirent** ppEntries;
+	struct stat st;
+	char pstrPath[FILENAME_MAX];
+	char pstrRel[FILENAME_MAX];
+	char** ppstrTmp;
+	int i, iLen, iNbEntries, ret = 0;
+
+	if (snprintf(pstrPath, FILENAME_MAX, "%s/%s", pstrRoot, pstrRelPath) >= FILENAME_MAX)
+		return -2;
+	iNbEntries = scandir(pstrPath, &ppEntries, NULL, alphasort);
+	if (iNbEntries < 0)
+		return -1;
+
+	for (i = 0; i < iNbEntries; i++) {
+		if (ret != 0 || strcmp(ppEntries[i]->d_name, ".") == 0 || strcmp(ppEntries[i]->d_name, "..") == 0) {
+			free(ppEntries[i]);
+			continue;
+		}
+
+		if (pstrRelPath[0])
+			iLen = snprintf(pstrRel, FILENAME_MAX, "%s/%s", pstrRelPath, ppEntries[i]->d_name);
+		else
+			iLen = snprintf(pstrRel, FILENAME_MAX, "%s", ppEntries[i]->d_name);
+		if (iLen < FILENAME_MAX)
+			iLen = snprintf(pstrPath, FILENAME_MAX, "%s/%s", pstrRoot, pstrRel);
+		if (iLen >= FILENAME_MAX) {
+			fprintf(stderr, "Path too long: %s/%s/%s\n", pstrRoot, pstrRelPath, ppEntries[i]->d_name);
+			free(ppEntries[i]);
+			ret = -2;
+			continue;
+		}
+		free(ppEntries[i]);
+
+		if (stat(pstrPath, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			ret = collect_files(pstrRoot, pstrRel, pppstrFiles, piNbFiles, piMax);
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		if (*piNbFiles == *piMax) {
+			*piMax = *piMax ? *piMax * 2 : 256;
+			ppstrTmp = realloc(*pppstrFiles, *piMax * sizeof(char*));
+			if (ppstrTmp == NULL) {
+				ret = -3;
+				continue;
+			}
+			*pppstrFiles = ppstrTmp;
+		}
+
+		(*pppstrFiles)[*piNbFiles] = strdup(pstrRel);
+		if ((*pppstrFiles)[*piNbFiles] == NULL)
+			ret = -3;
+		else
+			(*piNbFiles)++;
+	}
+
+	free(ppEntries);
+	return ret;
+}
+
+/**
+ * Compare all the archives found in two directory trees, matching them by relative path.
+ * Returns the number of differences or a negative value on error.
+ */
+
+int diff_trees(gasediff_state* pState, char* pstrOld, char* pstrNew)
+{
+	char** ppstrOld = NULL;
+	char** ppstrNew = NULL;
+	char pstrOldPath[FILENAME_MAX];
+	char pstrNewPath[FILENAME_MAX];
+	int i, j, iCmp, iNbOld = 0, iNbNew = 0, iMax, iDiff, ret = 0;
+
+	iMax = 0;
+	if (collect_files(pstrOld, "", &ppstrOld, &iNbOld, &iMax) != 0) {
+		fprintf(stderr, "Error reading directory %s\n", pstrOld);
+		ret = -1;
+		goto diff_trees_ret;
+	}
+
+	iMax = 0;
+	if (collect_files(pstrNew, "", &ppstrNew, &iNbNew, &iMax) != 0) {
+		fprintf(stderr, "Error reading directory %s\n", pstrNew);
+		ret = -1;
+		goto diff_trees_ret;
+	}
+
+	qsort(ppstrOld, iNbOld, sizeof(char*), compare_strings);
+	qsort(ppstrNew, iNbNew, sizeof(char*), compare_strings);
+
+	i = j = 0;
+	while (i < iNbOld || j < iNbNew) {
+		if (i == iNbOld)
+			iCmp = 1;
+		else if (j == iNbNew)
+			iCmp = -1;
+		else
+			iCmp = strcmp(ppstrOld[i], ppstrNew[j]);
+
+		/* The paths were checked to fit by collect_files. */
+		if (iCmp <= 0)
+			snprintf(pstrOldPath, FILENAME_MAX, "%s/%s", pstrOld, ppstrOld[i]);
+		if (iCmp >= 0)
+			snprintf(pstrNewPath, FILENAME_MAX, "%s/%s", pstrNew, ppstrNew[j]);
+
+		iDiff = diff_archives(pState, iCmp <= 0 ? pstrOldPath : NULL, iCmp >= 0 ? pstrNewPath : NULL,
+			iCmp <= 0 ? ppstrOld[i] : ppstrNew[j]);
+
+		/* Keep going on errors; they are reported at the end. */
+		if (iDiff < 0)
+			ret = iDiff;
+		else if (ret >= 0)
+			ret += iDiff;
+
+		if (iCmp <= 0)
+			i++;
+		if (iCmp >= 0)
+			j++;
+	}
+
+diff_trees_ret:
+	for (i = 0; i < iNbOld; i++)
+		free(ppstrOld[i]);
+	for (i = 0; i < iNbNew; i++)
+		free(ppstrNew[i]);
+	free(ppstrOld);
+	free(ppstrNew);
+
+	return ret;
+}
+
+/**
+ * Compare two archives, or two directories of archives, entry by entry.
+ * Exits with 0 when there are no differences, 1 when there are and 2 on error.
+ */
+
+int main(int argc, char** argv)
+{
+	gasediff_state state;
+	struct stat stOld, stNew;
+	char* pstrRelPath;
+	int i, ret;
+
+	memset(&state, 0, sizeof(state));
+
+	opterr = 0;
+	while ((i = getopt(argc, argv, "o:v")) != -1) {
+		switch (i) {
+			case 'o':
+				state.pstrDestPath = optarg;
+				break;
+
+			case 'v':
+				state.uOptions |= OPTION_VERBOSE;
+				break;
+
+			case '?':
+				if (optopt == 'o')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 2;
+
+			default:
+				abort();
+		}
+	}
+
+	i = optind;
+	if (i + 2 != argc) {
+		fprintf(stderr, "Usage: %s [-v] [-o destpath] old new\n", argv[0]);
+		fprintf(stderr, "       old and new are both archives or both directories of archives.\n");
+		return 2;
+	}
+
+	if (stat(argv[i], &stOld) != 0 || stat(argv[i + 1], &stNew) != 0) {
+		fprintf(stderr, "Error opening %s or %s\n", argv[i], argv[i + 1]);
+		return 2;
+	}
+
+	if (S_ISDIR(stOld.st_mode) && S_ISDIR(stNew.st_mode))
+		ret = diff_trees(&state, argv[i], argv[i + 1]);
+	else if (!S_ISDIR(stOld.st_mode) && !S_ISDIR(stNew.st_mode)) {
+		/* Payloads are saved under the name of the new archive. */
+		pstrRelPath = strrchr(argv[i + 1], '/');
+		pstrRelPath = pstrRelPath ? pstrRelPath + 1 : argv[i + 1];
+
+		if (archive_type(argv[i]) == ARCHIVE_UNKNOWN || archive_type(argv[i]) != archive_type(argv[i + 1])) {
+			fprintf(stderr, "%s and %s are not archives of the same type\n", argv[i], argv[i + 1]);
+			return 2;
+		}
+
+		ret = diff_archives(&state, argv[i], argv[i + 1], pstrRelPath);
+	} else {
+		fprintf(stderr, "%s and %s must both be archives or both be directories\n", argv[i], argv[i + 1]);
+		return 2;
+	}
+
+	if (state.uOptions & OPTION_VERBOSE)
+		fprintf(stderr, "%d archives, %d added, %d removed, %d modified entries, %llu bytes hashed\n",
+			state.iArchives, state.iAdded, state.iRemoved, state.iModified, state.ullHashed);
+
+	if (ret < 0)
+		return 2;
+	return ret == 0 ? 0 : 1;
+}
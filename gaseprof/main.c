@@ -0,0 +1,412 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../nbl/nbl.h"
+
+/**
+ * Profile the compressed streams of a corpus of nbl and exp files.
+ *
+ * Every stream is decoded token by token and the token kinds, literal runs,
+ * match lengths and distances are counted, for each stream and in total.
+ * The report is written as JSON:
+ *
+ * {"streams": [{"file": ..., "section": "nmll"|"tmll"|"exp", <profile>}, ...],
+ *  "total": <profile>}
+ *
+ * Histograms are objects mapping a value, or a "low-high" range for the
+ * power-of-two buckets, to a count. Empty buckets are left out.
+ */
+
+/**
+ * Prototypes.
+ */
+
+void json_string(FILE* pOut, const char* pstrString);
+void json_histogram(FILE* pOut, char* pstrName, unsigned long long* pCounts, int iNbCounts, int iBuckets);
+void print_profile(FILE* pOut, nbl_profile* pProfile);
+int profile_stream(char* pstrFilename, char* pstrSection, char* pstrSrc, int iSrcSize, int iDestSize);
+int profile_nbl(char* pstrFilename, char* pstrBuffer, int iSize);
+int profile_exp(char* pstrFilename, char* pstrBuffer, int iSize);
+int profile_file(char* pstrFilename);
+int profile_path(char* pstrPath);
+char* load_file(char* pstrFilename, int* piSize);
+
+/**
+ * Header of exp files: expanded size, compressed size, then unknown values. See exp/main.c.
+ */
+
+#define EXP_HEADER_SIZE 0x1C
+
+static FILE* pReport;
+static nbl_profile total;
+static int iNbStreams = 0;
+static int iNbErrors = 0;
+static int iTMLL = 0; /* Profile compressed TMLL sections; see --tmll-experimental in nbl. */
+
+/**
+ * Write a string with JSON escaping.
+ */
+
+void json_string(FILE* pOut, const char* pstrString)
+{
+	const unsigned char* p;
+
+	fputc('"', pOut);
+	for (p = (const unsigned char*)pstrString; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(pOut, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(pOut, "\\u%04x", *p);
+		else
+			fputc(*p, pOut);
+	}
+	fputc('"', pOut);
+}
+
+/**
+ * Write a histogram as an object. With iBuckets, entry i is the power-of-two
+ * bucket from 2^i to 2^(i+1) - 1; otherwise it is the value i itself.
+ */
+
+void json_histogram(FILE* pOut, char* pstrName, unsigned long long* pCounts, int iNbCounts, int iBuckets)
+{
+	int i, iFirst = 1;
+
+	fprintf(pOut, ", \"%s\": {", pstrName);
+	for (i = 0; i < iNbCounts; i++) {
+		if (pCounts[i] == 0)
+			continue;
+
+		if (!iBuckets || i == 0)
+			fprintf(pOut, "%s\"%d\": %llu", iFirst ? "" : ", ", i == 0 && iBuckets ? 1 : i, pCounts[i]);
+		else if (i == iNbCounts - 1)
+			fprintf(pOut, "%s\"%u+\": %llu", iFirst ? "" : ", ", 1u << i, pCounts[i]);
+		else
+			fprintf(pOut, "%s\"%u-%u\": %llu", iFirst ? "" : ", ", 1u << i, (2u << i) - 1, pCounts[i]);
+		iFirst = 0;
+	}
+	fputc('}', pOut);
+}
+
+/**
+ * Write the fields of a profile, after the opening brace of its object.
+ * Control bits aren't counted while decoding: each token kind has a fixed number of them.
+ */
+
+void print_profile(FILE* pOut, nbl_profile* pProfile)
+{
+	unsigned long long ullControlBits;
+
+	ullControlBits = pProfile->ullLiterals + 2 * pProfile->ullLongMatches
+		+ 4 * pProfile->ullShortMatches + 2 * pProfile->ullEndMarkers;
+
+	fprintf(pOut, "\"streams\": %llu, \"src_size\": %llu, \"dest_size\": %llu, \"ratio\": %.4f",
+		pProfile->ullStreams, pProfile->ullSrcSize, pProfile->ullDestSize,
+		pProfile->ullSrcSize ? (double)pProfile->ullDestSize / pProfile->ullSrcSize : 0.0);
+	fprintf(pOut, ", \"literals\": %llu, \"short_matches\": %llu, \"long_matches\": %llu, \"extended_matches\": %llu",
+		pProfile->ullLiterals, pProfile->ullShortMatches, pProfile->ullLongMatches, pProfile->ullExtendedMatches);
+	fprintf(pOut, ", \"control_bits\": %llu, \"control_bits_per_byte\": %.4f, \"control_byte_share\": %.4f",
+		ullControlBits,
+		pProfile->ullDestSize ? (double)ullControlBits / pProfile->ullDestSize : 0.0,
+		pProfile->ullSrcSize ? (double)((ullControlBits + 7) / 8) / pProfile->ullSrcSize : 0.0);
+
+	json_histogram(pOut, "literal_runs", pProfile->aLiteralRuns, NBL_PROFILE_BUCKETS, 1);
+	json_histogram(pOut, "match_lengths", pProfile->aMatchLengths, NBL_MAX_COUNT + 1, 0);
+	json_histogram(pOut, "short_distances", pProfile->aShortDistances, NBL_PROFILE_BUCKETS, 1);
+	json_histogram(pOut, "long_distances", pProfile->aLongDistances, NBL_PROFILE_BUCKETS, 1);
+}
+
+/**
+ * Decode a stream, write its profile and add it to the total.
+ */
+
+int profile_stream(char* pstrFilename, char* pstrSection, char* pstrSrc, int iSrcSize, int iDestSize)
+{
+	nbl_profile profile;
+	char* pstrDest;
+	int ret;
+
+	pstrDest = malloc(iDestSize);
+	if (pstrDest == NULL)
+		return -3;
+
+	memset(&profile, 0, sizeof(profile));
+	ret = nbl_decompress_profile(pstrSrc, iSrcSize, pstrDest, iDestSize, &profile);
+	free(pstrDest);
+
+	if (ret < 0) {
+		fprintf(stderr, "Error decompressing %s (%s, %d)\n", pstrFilename, pstrSection, ret);
+		return ret;
+	}
+
+	nbl_profile_merge(&total, &profile);
+
+	fprintf(pReport, "%s\n\t\t{\"file\": ", iNbStreams++ ? "," : "");
+	json_string(pReport, pstrFilename);
+	fprintf(pReport, ", \"section\": \"%s\", ", pstrSection);
+	print_profile(pReport, &profile);
+	fputc('}', pReport);
+
+	return 0;
+}
+
+/**
+ * Profile the compressed sections of an nbl file. Stored sections are skipped.
+ * The decompression algorithm of the TMLL section is unknown; compressed TMLL
+ * sections are only profiled with iTMLL, as if they were NMLL streams.
+ */
+
+int profile_nbl(char* pstrFilename, char* pstrBuffer, int iSize)
+{
+	struct bf_ctx ctx;
+	char* pstrSection;
+	int i, iDataPos, iCmpSize;
+	int ret = 0;
+
+	if (NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED) != 0)
+		nbl_setkey(&ctx, NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED));
+
+	for (i = 0; i < 2 && ret == 0; i++) {
+		if (i == 0)
+			pstrSection = pstrBuffer;
+		else if (nbl_has_tmll(pstrBuffer))
+			pstrSection = pstrBuffer + nbl_get_tmll_pos(pstrBuffer);
+		else
+			break;
+
+		if (!nbl_is_compressed(pstrSection))
+			continue;
+
+		if (i == 1 && !iTMLL) {
+			fprintf(stderr, "Skipping the compressed TMLL section of %s: its decompression algorithm is unknown (see --tmll-experimental)\n", pstrFilename);
+			continue;
+		}
+
+		/* The sizes come from the file; don't trust them. */
+		iDataPos = nbl_get_data_pos(pstrSection);
+		iCmpSize = NBL_READ_INT(pstrSection, NBL_HEADER_COMPRESSED_DATA_SIZE);
+		if (iCmpSize <= 0 || NBL_READ_INT(pstrSection, NBL_HEADER_DATA_SIZE) <= 0
+			|| iDataPos > iSize - (pstrSection - pstrBuffer) || iCmpSize > iSize - (pstrSection - pstrBuffer) - iDataPos) {
+			fprintf(stderr, "Invalid sizes in %s\n", pstrFilename);
+			return -2;
+		}
+
+		if (NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED) != 0)
+			nbl_decrypt_buffer(&ctx, pstrSection + iDataPos, iCmpSize);
+
+		ret = profile_stream(pstrFilename, i == 0 ? "nmll" : "tmll", pstrSection + iDataPos, iCmpSize,
+			NBL_READ_INT(pstrSection, NBL_HEADER_DATA_SIZE));
+	}
+
+	return ret;
+}
+
+int profile_exp(char* pstrFilename, char* pstrBuffer, int iSize)
+{
+	int iExpSize, iCmpSize;
+
+	iExpSize = NBL_READ_INT(pstrBuffer, 0);
+	iCmpSize = NBL_READ_INT(pstrBuffer, 4);
+	if (iExpSize <= 0 || iCmpSize <= 0 || iCmpSize > iSize - EXP_HEADER_SIZE) {
+		fprintf(stderr, "Skipping %s: neither an nbl nor an exp file\n", pstrFilename);
+		return 0;
+	}
+
+	return profile_stream(pstrFilename, "exp", pstrBuffer + EXP_HEADER_SIZE, iCmpSize, iExpSize);
+}
+
+/**
+ * Profile a single file. Files that aren't nbl files are tried as exp files.
+ */
+
+int profile_file(char* pstrFilename)
+{
+	char* pstrBuffer;
+	int iSize, ret;
+
+	pstrBuffer = load_file(pstrFilename, &iSize);
+	if (pstrBuffer == NULL) {
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+		return -1;
+	}
+
+	if (iSize >= NBL_HEADER_CHUNKS && nbl_is_nmll(pstrBuffer))
+		ret = profile_nbl(pstrFilename, pstrBuffer, iSize);
+	else if (iSize >= EXP_HEADER_SIZE)
+		ret = profile_exp(pstrFilename, pstrBuffer, iSize);
+	else {
+		fprintf(stderr, "Skipping %s: neither an nbl nor an exp file\n", pstrFilename);
+		ret = 0;
+	}
+
+	free(pstrBuffer);
+	return ret;
+}
+
+/**
+ * Profile a file, or all the files of a directory recursively, in name order.
+ */
+
+int profile_path(char* pstrPath)
+{
+	struct dirent** ppEntries;
+	struct stat st;
+	char pstrChild[FILENAME_MAX];
+	int i, iNbEntries;
+
+	if (stat(pstrPath, &st) != 0) {
+		fprintf(stderr, "Error opening file %s\n", pstrPath);
+		iNbErrors++;
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		if (S_ISREG(st.st_mode) && profile_file(pstrPath) != 0)
+			iNbErrors++;
+		return 0;
+	}
+
+	iNbEntries = scandir(pstrPath, &ppEntries, NULL, alphasort);
+	if (iNbEntries < 0) {
+		fprintf(stderr, "Error opening directory %s\n", pstrPath);
+		iNbErrors++;
+		return -1;
+	}
+
+	for (i = 0; i < iNbEntries; i++) {
+		if (strcmp(ppEntries[i]->d_name, ".") != 0 && strcmp(ppEntries[i]->d_name, "..") != 0) {
+			snprintf(pstrChild, FILENAME_MAX, "%s/%s", pstrPath, ppEntries[i]->d_name);
+			profile_path(pstrChild);
+		}
+		free(ppEntries[i]);
+	}
+
+	free(ppEntries);
+	return 0;
+}
+
+/**
+ * Load a whole file in memory.
+ */
+
+char* load_file(char* pstrFilename, int* piSize)
+{
+	FILE* pFile;
+	char* pstrBuffer;
+	off_t lSize;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return NULL;
+
+	fseeko(pFile, 0, SEEK_END);
+	lSize = ftello(pFile);
+	fseeko(pFile, 0, SEEK_SET);
+
+	/* Sizes inside the files are 32-bit. */
+	if (lSize < 0 || lSize > INT_MAX) {
+		fclose(pFile);
+		return NULL;
+	}
+
+	/* Keep one byte so that empty files still get a valid pointer. */
+	pstrBuffer = malloc(lSize + 1);
+	if (pstrBuffer != NULL && fread(pstrBuffer, 1, lSize, pFile) != (size_t)lSize) {
+		free(pstrBuffer);
+		pstrBuffer = NULL;
+	}
+
+	fclose(pFile);
+	*piSize = lSize;
+	return pstrBuffer;
+}
+
+/**
+ * Entry point.
+ */
+
+int main(int argc, char** argv)
+{
+	char* pstrOutput = NULL;
+	struct option aLongOptions[] = {
+		{"tmll-experimental", no_argument, NULL, 'T'},
+		{NULL, 0, NULL, 0}
+	};
+	int i;
+
+	opterr = 0;
+	while ((i = getopt_long(argc, argv, "o:", aLongOptions, NULL)) != -1) {
+		switch (i) {
+			case 'o':
+				pstrOutput = optarg;
+				break;
+
+			case 'T':
+				iTMLL = 1;
+				break;
+
+			case '?':
+				if (optopt == 'o')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 2;
+
+			default:
+				abort();
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "Usage: %s [-o report.json] [--tmll-experimental] file|directory...\n", argv[0]);
+		return 2;
+	}
+
+	pReport = pstrOutput ? fopen(pstrOutput, "w") : stdout;
+	if (pReport == NULL) {
+		fprintf(stderr, "Error creating %s\n", pstrOutput);
+		return 2;
+	}
+
+	fprintf(pReport, "{\n\t\"streams\": [");
+	for (i = optind; i < argc; i++)
+		profile_path(argv[i]);
+	fprintf(pReport, "%s],\n\t\"total\": {", iNbStreams ? "\n\t" : "");
+	print_profile(pReport, &total);
+	fprintf(pReport, "}\n}\n");
+
+	if (pReport != stdout && fclose(pReport) != 0) {
+		fprintf(stderr, "Error writing %s\n", pstrOutput);
+		return 2;
+	}
+
+	return iNbErrors ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "capture.h"
+#include "compat.h"
+
+/**
+ * Return the position of every record.
+ * The index at the end of the file is used when present; a capture that wasn't
+ * closed properly has no index, in which case the records are walked instead.
+ */
+
+long long* capture_load_index(int iFd, unsigned int* puNbRecords)
+{
+	char pstrBuffer[CAP_RECORD_HEADER_SIZE];
+	long long* pIndex = NULL;
+	long long* pTmp;
+	off_t iEnd, iPos;
+	unsigned int uMax = 0, uCount = 0;
+
+	if (pread(iFd, pstrBuffer, CAP_HEADER_SIZE, 0) != CAP_HEADER_SIZE || CAP_READ_UINT(pstrBuffer, 0) != CAP_ID)
+		return NULL;
+
+	iEnd = lseek(iFd, 0, SEEK_END);
+
+	if (iEnd >= CAP_HEADER_SIZE + CAP_FOOTER_SIZE
+		&& pread(iFd, pstrBuffer, CAP_FOOTER_SIZE, iEnd - CAP_FOOTER_SIZE) == CAP_FOOTER_SIZE
+		&& CAP_READ_UINT(pstrBuffer, CAP_FOOTER_IDENTIFIER) == CAP_INDEX_ID) {
+		uCount = CAP_READ_UINT(pstrBuffer, CAP_FOOTER_NB_RECORDS);
+		pIndex = malloc((uCount + 1) * sizeof(long long));
+		if (pIndex == NULL)
+			return NULL;
+
+		if (pread(iFd, pIndex, uCount * sizeof(long long), CAP_READ_ULONG(pstrBuffer, CAP_FOOTER_INDEX_POS)) == (ssize_t)(uCount * sizeof(long long))) {
+			*puNbRecords = uCount;
+			return pIndex;
+		}
+
+		free(pIndex);
+		pIndex = NULL;
+		uCount = 0;
+	}
+
+	iPos = CAP_HEADER_SIZE;
+	while (pread(iFd, pstrBuffer, CAP_RECORD_HEADER_SIZE, iPos) == CAP_RECORD_HEADER_SIZE) {
+		if (iPos + CAP_RECORD_HEADER_SIZE + (off_t)CAP_READ_UINT(pstrBuffer, CAP_RECORD_RAW_SIZE)
+			+ CAP_READ_UINT(pstrBuffer, CAP_RECORD_DEC_SIZE) > iEnd)
+			break;
+
+		if (uCount == uMax) {
+			uMax = uMax ? uMax * 2 : 1024;
+			pTmp = realloc(pIndex, uMax * sizeof(long long));
+			if (pTmp == NULL) {
+				free(pIndex);
+				return NULL;
+			}
+			pIndex = pTmp;
+		}
+
+		pIndex[uCount++] = iPos;
+		iPos += CAP_RECORD_HEADER_SIZE + (off_t)CAP_READ_UINT(pstrBuffer, CAP_RECORD_RAW_SIZE) + CAP_READ_UINT(pstrBuffer, CAP_RECORD_DEC_SIZE);
+	}
+
+	*puNbRecords = uCount;
+	return pIndex ? pIndex : malloc(sizeof(long long));
+}
@@ -0,0 +1,51 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GASETOOLS_CAPTURE_H__
+#define __GASETOOLS_CAPTURE_H__
+
+/*
+ * Capture log format, as written by proxy/psu_capture.erl.
+ * All integers are little endian.
+ */
+
+#define CAP_ID		0x43555350 /* PSUC */
+#define CAP_INDEX_ID	0x49555350 /* PSUI */
+
+#define CAP_HEADER_SIZE	0x08
+
+#define CAP_RECORD_TIMESTAMP	0x00
+#define CAP_RECORD_NUMBER		0x08
+#define CAP_RECORD_DIRECTION	0x0C /* 0 for packets sent by the client, 1 for the server. */
+#define CAP_RECORD_RAW_SIZE		0x10
+#define CAP_RECORD_DEC_SIZE		0x14
+#define CAP_RECORD_HEADER_SIZE	0x18
+
+#define CAP_FOOTER_INDEX_POS	0x00
+#define CAP_FOOTER_NB_RECORDS	0x08
+#define CAP_FOOTER_IDENTIFIER	0x0C
+#define CAP_FOOTER_SIZE			0x10
+
+#define CAP_READ_UINT(buf, pos) (*((unsigned int*)(buf + pos)))
+#define CAP_READ_ULONG(buf, pos) (*((unsigned long long*)(buf + pos)))
+
+long long* capture_load_index(int iFd, unsigned int* puNbRecords);
+
+#endif /* __GASETOOLS_CAPTURE_H__ */
@@ -0,0 +1,158 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GASETOOLS_COMPAT_H__
+#define __GASETOOLS_COMPAT_H__
+
+/*
+ * POSIX functions used by the tools, with replacements for the Windows builds.
+ * Threads aren't available there: starting one always fails so that the work
+ * is done by the caller, as when a thread can't be started, and mutexes do nothing.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+
+#include <io.h>
+
+typedef int nbl_thread;
+#define nbl_thread_create(thread, func, arg) (-1)
+#define nbl_thread_join(thread) ((void)(thread))
+
+typedef int nbl_mutex;
+#define nbl_mutex_init(mutex) ((void)(mutex))
+#define nbl_mutex_destroy(mutex) ((void)(mutex))
+#define nbl_mutex_lock(mutex) ((void)(mutex))
+#define nbl_mutex_unlock(mutex) ((void)(mutex))
+
+#define NBL_NB_CPUS() 1
+
+#define mkdir(path, mode) mkdir(path)
+#define ftruncate(fd, size) chsize(fd, size)
+#define localtime_r compat_localtime_r
+#define pread compat_pread
+#define pwrite compat_pwrite
+#define scandir compat_scandir
+#define alphasort compat_alphasort
+
+/* Without threads, moving the file position is harmless. */
+
+static inline int compat_pread(int iFd, void* pBuffer, size_t iSize, off_t iPos)
+{
+	if (lseek(iFd, iPos, SEEK_SET) != iPos)
+		return -1;
+	return read(iFd, pBuffer, iSize);
+}
+
+static inline int compat_pwrite(int iFd, const void* pBuffer, size_t iSize, off_t iPos)
+{
+	if (lseek(iFd, iPos, SEEK_SET) != iPos)
+		return -1;
+	return write(iFd, pBuffer, iSize);
+}
+
+static inline struct tm* compat_localtime_r(const time_t* pTime, struct tm* pTm)
+{
+	*pTm = *localtime(pTime);
+	return pTm;
+}
+
+static inline int compat_alphasort(const void* pA, const void* pB)
+{
+	return strcmp((*(struct dirent* const*)pA)->d_name, (*(struct dirent* const*)pB)->d_name);
+}
+
+/* The filter isn't supported. */
+
+static inline int compat_scandir(const char* pstrPath, struct dirent*** pppEntries, void* pFilter,
+	int (*pCompare)(const void*, const void*))
+{
+	struct dirent* pDirEntry;
+	struct dirent** ppTmp;
+	DIR* pDir;
+	int iNbEntries = 0, iMax = 0;
+
+	(void)pFilter;
+
+	pDir = opendir(pstrPath);
+	if (pDir == NULL)
+		return -1;
+
+	*pppEntries = NULL;
+	while ((pDirEntry = readdir(pDir)) != NULL) {
+		if (iNbEntries == iMax) {
+			iMax = iMax ? iMax * 2 : 64;
+			ppTmp = realloc(*pppEntries, iMax * sizeof(struct dirent*));
+			if (ppTmp == NULL)
+				break;
+			*pppEntries = ppTmp;
+		}
+
+		(*pppEntries)[iNbEntries] = malloc(sizeof(struct dirent));
+		if ((*pppEntries)[iNbEntries] == NULL)
+			break;
+		memcpy((*pppEntries)[iNbEntries++], pDirEntry, sizeof(struct dirent));
+	}
+
+	closedir(pDir);
+
+	if (pDirEntry != NULL) {
+		while (iNbEntries > 0)
+			free((*pppEntries)[--iNbEntries]);
+		free(*pppEntries);
+		return -1;
+	}
+
+	qsort(*pppEntries, iNbEntries, sizeof(struct dirent*), pCompare);
+	return iNbEntries;
+}
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_t nbl_thread;
+#define nbl_thread_create(thread, func, arg) pthread_create(thread, NULL, func, arg)
+#define nbl_thread_join(thread) pthread_join(thread, NULL)
+
+typedef pthread_mutex_t nbl_mutex;
+#define nbl_mutex_init(mutex) pthread_mutex_init(mutex, NULL)
+#define nbl_mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+#define nbl_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define nbl_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+
+#define NBL_NB_CPUS() sysconf(_SC_NPROCESSORS_ONLN)
+
+#endif
+
+/* Files are always opened as binary; O_BINARY only exists on Windows. */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#endif /* __GASETOOLS_COMPAT_H__ */
@@ -341,6 +341,18 @@ static void encrypt_block(struct bf_ctx *bctx, u32 *dst, u32 *src)
 	dst[1] = yl;
 }
 
+/*
+ * Encrypt a 64-bit block, the reverse of bf_decrypt.
+ */
+void bf_encrypt(struct bf_ctx *ctx, u8 *dst, const u8 *src)
+{
+	u32 in_blk[2];
+
+	in_blk[0] = ((const u32 *)src)[0];
+	in_blk[1] = ((const u32 *)src)[1];
+	encrypt_block(ctx, (u32 *)dst, in_blk);
+}
+
 /*
  * NOTE: SEGA's implementation is different here.
  * The endianness is opposite of what's expected.
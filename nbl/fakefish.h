@@ -32,6 +32,7 @@ struct bf_ctx {
 };
 
 void bf_setkey(struct bf_ctx *ctx, const u8 *key, unsigned int keylen);
+void bf_encrypt(struct bf_ctx *ctx, u8 *dst, const u8 *src);
 void bf_decrypt(struct bf_ctx *ctx, u8 *dst, const u8 *src);
 
 #endif /* __FAKEFISH_H__ */
@@ -19,18 +19,34 @@
 */
 
 #include <ctype.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "nbl.h"
+#include "watch.h"
 
 /**
  * Prototypes.
  */
 
 void debug_save_buffer(char* pstrFilename, char* pstrBuffer, int iSize);
-int extract(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrDestPath);
-void list(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx);
+void* extract_section(void* pArg);
+int extract(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrDestPath, struct manifest_ctx* pManifest, char* pstrCachePath, struct stat* pStat, int iCacheSize);
+int extract_stream(unsigned int uOptions, char* pstrFilename, char* pstrDestPath, char* pstrManifest);
+int extract_inplace(unsigned int uOptions, char* pstrFilename, char* pstrDestPath, char* pstrManifest);
+int list(unsigned int uOptions, char* pstrFilename);
+int save_entry(char* pstrDestPath, char* pstrName, char* pstrData, int iSize, struct manifest_ctx* pManifest, int iPos);
+int build_index(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrIndex, int iInterval);
+int extract_entry(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrDestPath, char* pstrEntry, char* pstrIndex, struct manifest_ctx* pManifest);
+char* load_file(char* pstrFilename, int* piSize);
+int create(unsigned int uOptions, char* pstrSrcPath, char* pstrFilename, unsigned int uKeySeed, int iNbThreads);
+int rekey(unsigned int uOptions, char* pstrFilename, char* pstrDestPath, unsigned int uKeySeed);
+int extract_watched(char* pstrFilename, char* pstrDestPath, void* pArg);
 
 /**
  * Options masks.
@@ -39,6 +55,28 @@ void list(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx);
 #define OPTION_LIST		0x1
 #define OPTION_DEBUG	0x2
 #define OPTION_VERBOSE	0x4
+#define OPTION_INDEX	0x8
+#define OPTION_STORE	0x10
+#define OPTION_UPDATE	0x20
+#define OPTION_DETAILS	0x40
+#define OPTION_HASH64	0x80
+#define OPTION_VERIFY	0x100
+#define OPTION_STREAM	0x200
+#define OPTION_INPLACE	0x400
+#define OPTION_REKEY	0x800
+#define OPTION_TMLL		0x1000 /* Try the NMLL decompressor on compressed TMLL sections. */
+
+/**
+ * Default interval between two checkpoints of an index, in KB.
+ */
+
+#define DEFAULT_INDEX_INTERVAL 64
+
+/**
+ * File receiving the TMLL data when it can't be decompressed.
+ */
+
+#define EXTRACT_TMLL_FALLBACK "tmll-data.bin"
 
 /**
  * Save the given buffer in a file. Used for debugging purpose only.
@@ -55,147 +93,1144 @@ void debug_save_buffer(char* pstrFilename, char* pstrBuffer, int iSize)
 	}
 }
 
+/**
+ * Section of the archive decoded by extract_section.
+ * The NMLL and TMLL sections are independent, so they can be decoded at the same time.
+ */
+
+typedef struct {
+	unsigned int uOptions;
+	char* pstrHeader; /* Start of the section. */
+	int iHeaderChunksPos;
+	struct bf_ctx* pCtx;
+	char* pstrDebugPrefix;
+	char* pstrData; /* Decoded data, allocated if the section is compressed. */
+	char* pstrCachePath; /* Cache of decoded data, or NULL. */
+	struct stat* pStat; /* Archive file, identifying it in the cache, or NULL. */
+	char* pstrCacheSection;
+	int iCached; /* pstrData was mapped from the cache. */
+	int iIsCompressed;
+	int iDataPos;
+	int iFallback; /* The data couldn't be decompressed and is kept as is. */
+	int ret;
+} extract_section_struct;
+
+/**
+ * Save a buffer for debugging, prefixing the filename with the section name.
+ */
+
+static void extract_section_debug(extract_section_struct* p, char* pstrName, char* pstrBuffer, int iSize)
+{
+	char pstrFilename[64];
+
+	snprintf(pstrFilename, sizeof(pstrFilename), "%s%s", p->pstrDebugPrefix, pstrName);
+	debug_save_buffer(pstrFilename, pstrBuffer, iSize);
+}
+
+/**
+ * Decrypt and decompress a section in place.
+ * The decompression algorithm of the TMLL section is unknown; compressed TMLL
+ * sections are only given here with OPTION_TMLL, which tries the NMLL one.
+ * Its output is then only accepted when it covers every entry; otherwise the
+ * decrypted data is kept compressed and iFallback is set.
+ * With a cache, the decoded data of compressed or encrypted sections is taken
+ * from it when found, and saved in it otherwise.
+ */
+
+void* extract_section(void* pArg)
+{
+	extract_section_struct* p = pArg;
+	char* pstrHeader = p->pstrHeader;
+	unsigned long long ullKey = 0;
+	unsigned int uEnd, uDataEnd = 0;
+	int i, iCmpSize, iDataSize;
+
+	if (p->pstrCachePath && (nbl_is_compressed(pstrHeader) || p->pCtx))
+		ullKey = nbl_cache_key(pstrHeader, p->pStat);
+	else
+		p->pstrCachePath = NULL;
+
+	if (p->pCtx) {
+		nbl_decrypt_headers(p->pCtx, pstrHeader, p->iHeaderChunksPos);
+
+		if (p->uOptions & OPTION_DEBUG)
+			extract_section_debug(p, "decrypt-headers.dbg", pstrHeader, NBL_READ_UINT(pstrHeader, NBL_HEADER_SIZE));
+	}
+
+	p->iDataPos = nbl_get_data_pos(pstrHeader);
+	p->iIsCompressed = nbl_is_compressed(pstrHeader);
+	iCmpSize = NBL_READ_INT(pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE);
+	iDataSize = NBL_READ_INT(pstrHeader, NBL_HEADER_DATA_SIZE);
+
+	if (p->uOptions & OPTION_VERBOSE)
+		printf("%sdata=%x, compressed=%x, encrypted=%x\n", p->pstrDebugPrefix, p->iDataPos, p->iIsCompressed, p->pCtx != NULL);
+
+	if (p->pstrCachePath) {
+		p->pstrData = nbl_cache_get(p->pstrCachePath, ullKey, p->pstrCacheSection, iDataSize);
+		if (p->pstrData) {
+			if (p->uOptions & OPTION_VERBOSE)
+				printf("%sdata found in cache (%016llx)\n", p->pstrDebugPrefix, ullKey);
+			p->iCached = 1;
+			goto extract_section_ret;
+		}
+	}
+
+	if (!p->iIsCompressed) {
+		if (p->pCtx)
+			nbl_decrypt_buffer(p->pCtx, pstrHeader + p->iDataPos, iDataSize);
+
+		p->pstrData = pstrHeader + p->iDataPos;
+		goto extract_section_ret;
+	}
+
+	if (p->uOptions & OPTION_DEBUG)
+		extract_section_debug(p, "comp-crypt.dbg", pstrHeader + p->iDataPos, iCmpSize);
+
+	if (p->pCtx)
+		nbl_decrypt_buffer(p->pCtx, pstrHeader + p->iDataPos, iCmpSize);
+
+	if (p->uOptions & OPTION_DEBUG)
+		extract_section_debug(p, "comp-decrypt.dbg", pstrHeader + p->iDataPos, iCmpSize);
+
+	p->pstrData = malloc(iDataSize);
+	if (p->pstrData == NULL) {
+		p->ret = -3;
+		return NULL;
+	}
+
+	p->ret = nbl_decompress(pstrHeader + p->iDataPos, iCmpSize, p->pstrData, iDataSize);
+
+	if (p->iHeaderChunksPos == NBL_TMLL_HEADER_CHUNKS) {
+		for (i = 0; i < NBL_READ_INT(pstrHeader, NBL_HEADER_NB_CHUNKS); i++) {
+			uEnd = NBL_READ_UINT(pstrHeader, NBL_TMLL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS)
+				+ NBL_READ_UINT(pstrHeader, NBL_TMLL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE);
+			if (uEnd > uDataEnd)
+				uDataEnd = uEnd;
+		}
+
+		if (p->ret < 0 || (unsigned int)p->ret < uDataEnd) {
+			free(p->pstrData);
+			p->pstrData = NULL;
+			p->iFallback = 1;
+			p->ret = 0;
+			return NULL;
+		}
+	}
+
+	if (p->ret < 0) {
+		free(p->pstrData);
+		p->pstrData = NULL;
+		return NULL;
+	}
+
+	p->ret = 0;
+
+extract_section_ret:
+	if (p->pstrCachePath && !p->iCached
+		&& nbl_cache_put(p->pstrCachePath, ullKey, p->pstrCacheSection, p->pstrData, iDataSize) < 0)
+		fprintf(stderr, "Error saving %sdata in cache %s\n", p->pstrDebugPrefix, p->pstrCachePath);
+
+	if (p->uOptions & OPTION_DEBUG)
+		extract_section_debug(p, "decomp-decrypt.dbg", p->pstrData, iDataSize);
+
+	return NULL;
+}
+
+/**
+ * Free the decoded data of a section.
+ */
+
+static void extract_section_free(extract_section_struct* p)
+{
+	if (p->iCached)
+		nbl_cache_release(p->pstrData, NBL_READ_INT(p->pstrHeader, NBL_HEADER_DATA_SIZE));
+	else if (p->iIsCompressed)
+		free(p->pstrData);
+}
+
+/**
+ * Return whether the TMLL section can be decoded with the given options, warning if not.
+ * The section can't be decompressed without OPTION_TMLL; see extract_section.
+ */
+
+static int extract_tmll_enabled(unsigned int uOptions, char* pstrTMLL)
+{
+	if (!nbl_is_compressed(pstrTMLL) || uOptions & OPTION_TMLL)
+		return 1;
+
+	fprintf(stderr, "Compressed TMLL section not extracted: its decompression algorithm is unknown (see --tmll-experimental)\n");
+	return 0;
+}
+
 /**
  * Extract the files from the nbl archive.
+ * The TMLL section, if any, is decoded in another thread while the NMLL section
+ * is decoded in this one; the files of both are then written.
+ * Decoded data is cached in pstrCachePath if it isn't NULL, up to iCacheSize MB;
+ * pStat is the stat of the archive file, or NULL if it was read from a pipe.
  */
 
-int extract(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrDestPath)
+int extract(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrDestPath, struct manifest_ctx* pManifest, char* pstrCachePath, struct stat* pStat, int iCacheSize)
 {
-	char* pstrData;
-	int iIsCompressed = 0;
-	int iDataPos;
-	int iTMLLPos;
+	extract_section_struct nmll, tmll;
+	nbl_thread thread;
+	char* pstrFilename;
+	int iHasTMLL, iThreaded = 0;
+	int ret = 0;
 
-	if (pCtx) {
-		nbl_decrypt_headers(pCtx, pstrBuffer, NBL_HEADER_CHUNKS);
+	memset(&nmll, 0, sizeof(nmll));
+	nmll.uOptions = uOptions;
+	nmll.pstrHeader = pstrBuffer;
+	nmll.iHeaderChunksPos = NBL_HEADER_CHUNKS;
+	nmll.pCtx = pCtx;
+	nmll.pstrDebugPrefix = "";
+	nmll.pstrCachePath = pstrCachePath;
+	nmll.pStat = pStat;
+	nmll.pstrCacheSection = "nmll";
+
+	iHasTMLL = nbl_has_tmll(pstrBuffer);
+	if (iHasTMLL) {
+		tmll = nmll;
+		tmll.pstrHeader = pstrBuffer + nbl_get_tmll_pos(pstrBuffer);
+		tmll.iHeaderChunksPos = NBL_TMLL_HEADER_CHUNKS;
+		tmll.pstrDebugPrefix = "tmll-";
+		tmll.pstrCacheSection = "tmll";
+
+		if (uOptions & OPTION_VERBOSE)
+			printf("TMLL section found at position 0x%x!\n", (int)(tmll.pstrHeader - pstrBuffer));
+
+		iHasTMLL = extract_tmll_enabled(uOptions, tmll.pstrHeader);
+	}
+
+	if (iHasTMLL) {
+		/* Unverified output isn't cached. */
+		if (nbl_is_compressed(tmll.pstrHeader))
+			tmll.pstrCachePath = NULL;
 
-		if (uOptions & OPTION_DEBUG)
-			debug_save_buffer("decrypt-headers.dbg", pstrBuffer, NBL_READ_UINT(pstrBuffer, NBL_HEADER_SIZE));
+		/* Decode it in this thread after the NMLL section if no thread can be started. */
+		iThreaded = nbl_thread_create(&thread, extract_section, &tmll) == 0;
 	}
 
-	iDataPos = nbl_get_data_pos(pstrBuffer);
-	iIsCompressed = nbl_is_compressed(pstrBuffer);
+	extract_section(&nmll);
 
-	if (uOptions & OPTION_VERBOSE)
-		printf("data=%x, compressed=%x, encrypted=%x\n", iDataPos, iIsCompressed, pCtx != NULL);
+	if (iHasTMLL) {
+		if (iThreaded)
+			nbl_thread_join(thread);
+		else
+			extract_section(&tmll);
+	}
 
-	if (iIsCompressed) {
-		if (pCtx)
-			nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos, NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE));
-
-		if (uOptions & OPTION_DEBUG)
-			debug_save_buffer("comp-decrypt.dbg", pstrBuffer + iDataPos, NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE));
-
-		pstrData = malloc(NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE));
-		if (pstrData == NULL)
-			return -3;
-
-		nbl_decompress(
-			pstrBuffer + iDataPos,
-			NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE),
-			pstrData,
-			NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE)
-		);
-		/* TODO: check the return value */
+	/* Evicted once both sections are saved, rather than by each of them at the same time. */
+	if (pstrCachePath && nbl_cache_evict(pstrCachePath, (unsigned long long)iCacheSize << 20) < 0)
+		fprintf(stderr, "Error evicting entries from cache %s\n", pstrCachePath);
+
+	if (nmll.ret < 0) {
+		fprintf(stderr, "Error decompressing data (%d)\n", nmll.ret);
+		ret = nmll.ret;
+	} else
+		nbl_extract_all(nmll.pstrHeader, NBL_HEADER_CHUNKS, nmll.pstrData, pstrDestPath, pManifest);
+
+	if (!iHasTMLL)
+		goto extract_ret;
+
+	if (tmll.ret < 0) {
+		fprintf(stderr, "Error decompressing TMLL data (%d)\n", tmll.ret);
+		if (ret == 0)
+			ret = tmll.ret;
+	} else if (tmll.iFallback) {
+		/* Keep the data for analysis rather than writing entries from garbage. */
+		pstrFilename = malloc((pstrDestPath ? strlen(pstrDestPath) : 0) + sizeof(EXTRACT_TMLL_FALLBACK) + 1);
+		if (pstrFilename) {
+			if (pstrDestPath)
+				sprintf(pstrFilename, "%s/%s", pstrDestPath, EXTRACT_TMLL_FALLBACK);
+			else
+				strcpy(pstrFilename, EXTRACT_TMLL_FALLBACK);
+			debug_save_buffer(pstrFilename, tmll.pstrHeader + tmll.iDataPos, NBL_READ_INT(tmll.pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE));
+			fprintf(stderr, "TMLL data couldn't be decompressed; its decrypted stream was saved to %s\n", pstrFilename);
+			free(pstrFilename);
+		}
 	} else {
-		if (pCtx)
-			nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos, NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE));
+		if (tmll.iIsCompressed)
+			fprintf(stderr, "TMLL entries were decompressed with the experimental decoder and may be wrong\n");
+		nbl_extract_all(tmll.pstrHeader, NBL_TMLL_HEADER_CHUNKS, tmll.pstrData, pstrDestPath, pManifest);
+	}
+
+	extract_section_free(&tmll);
+
+extract_ret:
+	extract_section_free(&nmll);
+
+	return ret;
+}
+
+/**
+ * Extract the files while reading the nbl archive, without loading it.
+ * Memory use doesn't depend on the size of the archive.
+ */
+
+int extract_stream(unsigned int uOptions, char* pstrFilename, char* pstrDestPath, char* pstrManifest)
+{
+	FILE* pFile;
+	struct manifest_ctx* pManifest = NULL;
+	int ret;
+
+	if (strcmp(pstrFilename, "-") == 0)
+		pFile = stdin;
+	else {
+		pFile = fopen(pstrFilename, "rb");
+		if (pFile == NULL) {
+			fprintf(stderr, "Error opening file %s\n", pstrFilename);
+			return -1;
+		}
+	}
+
+	if (pstrManifest) {
+		pManifest = manifest_open(pstrManifest, uOptions & OPTION_HASH64 ? MANIFEST_HASH64 : 0);
+		if (pManifest == NULL) {
+			fprintf(stderr, "Error creating manifest %s\n", pstrManifest);
+			ret = -1;
+			goto extract_stream_ret;
+		}
+	}
+
+	ret = nbl_extract_stream(pFile, pstrDestPath, pManifest);
+	if (ret < 0)
+		fprintf(stderr, "Error extracting %s (%d)\n", pstrFilename, ret);
+
+	if (pManifest && manifest_close(pManifest) != 0 && ret == 0) {
+		fprintf(stderr, "Error writing manifest %s\n", pstrManifest);
+		ret = -1;
+	}
+
+extract_stream_ret:
+	if (pFile != stdin)
+		fclose(pFile);
+
+	return ret;
+}
+
+/**
+ * Extract the files, decoding each section in a single buffer of about its
+ * decompressed size; see nbl_load_data_inplace. Only the headers are loaded
+ * besides, and the TMLL section is decoded after the NMLL section is written,
+ * so the peak memory use is about the size of the largest section.
+ */
+
+int extract_inplace(unsigned int uOptions, char* pstrFilename, char* pstrDestPath, char* pstrManifest)
+{
+	FILE* pFile = NULL;
+	struct bf_ctx ctx;
+	struct bf_ctx* pCtx = NULL;
+	struct manifest_ctx* pManifest = NULL;
+	char* pstrHeader;
+	char* pstrTMLL = NULL;
+	char* pstrData;
+	char* pstrFallback;
+	unsigned int uEnd, uDataEnd = 0;
+	off_t iDataPos;
+	int i, iTMLLPos = 0, iSize;
+	int ret = 0;
 
-		pstrData = pstrBuffer + iDataPos;
+	pstrHeader = nbl_load_headers(pstrFilename, &pstrTMLL, &iTMLLPos);
+	if (pstrHeader)
+		pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL) {
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+		ret = -1;
+		goto extract_inplace_ret;
 	}
 
-	if (uOptions & OPTION_DEBUG)
-		debug_save_buffer("decomp-decrypt.dbg", pstrData, NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE));
+	if (pstrManifest) {
+		pManifest = manifest_open(pstrManifest, uOptions & OPTION_HASH64 ? MANIFEST_HASH64 : 0);
+		if (pManifest == NULL) {
+			fprintf(stderr, "Error creating manifest %s\n", pstrManifest);
+			ret = -1;
+			goto extract_inplace_ret;
+		}
+	}
 
-	nbl_extract_all(pstrBuffer, pstrData, pstrDestPath);
+	if (NBL_READ_UINT(pstrHeader, NBL_HEADER_KEY_SEED) != 0) {
+		pCtx = &ctx;
+		nbl_setkey(pCtx, NBL_READ_UINT(pstrHeader, NBL_HEADER_KEY_SEED));
+		nbl_decrypt_headers(pCtx, pstrHeader, NBL_HEADER_CHUNKS);
+		if (pstrTMLL)
+			nbl_decrypt_headers(pCtx, pstrTMLL, NBL_TMLL_HEADER_CHUNKS);
+	}
 
-	if (iIsCompressed)
+	pstrData = nbl_load_data_inplace(pFile, 0, pstrHeader, pCtx, &iSize);
+	if (pstrData == NULL) {
+		fprintf(stderr, "Error decompressing data (%d)\n", iSize);
+		ret = iSize;
+	} else {
+		nbl_extract_all(pstrHeader, NBL_HEADER_CHUNKS, pstrData, pstrDestPath, pManifest);
 		free(pstrData);
+	}
 
-	/* TMLL part (incomplete) */
+	if (nbl_has_tmll(pstrHeader) && pstrTMLL == NULL)
+		fprintf(stderr, "TMLL section not found in %s\n", pstrFilename);
 
-	if (!nbl_has_tmll(pstrBuffer))
-		return 0;
+	if (pstrTMLL == NULL)
+		goto extract_inplace_ret;
 
-	iTMLLPos = nbl_get_tmll_pos(pstrBuffer);
 	if (uOptions & OPTION_VERBOSE)
 		printf("TMLL section found at position 0x%x!\n", iTMLLPos);
 
-	if (pCtx)
-		nbl_decrypt_headers(pCtx, pstrBuffer + iTMLLPos, NBL_TMLL_HEADER_CHUNKS);
+	if (!extract_tmll_enabled(uOptions, pstrTMLL))
+		goto extract_inplace_ret;
 
-	iDataPos = nbl_get_data_pos(pstrBuffer + iTMLLPos);
-	iIsCompressed = nbl_is_compressed(pstrBuffer + iTMLLPos);
+	/* Same check as extract_section: the output must cover every entry. */
+	pstrData = nbl_load_data_inplace(pFile, iTMLLPos, pstrTMLL, pCtx, &iSize);
+	for (i = 0; i < NBL_READ_INT(pstrTMLL, NBL_HEADER_NB_CHUNKS); i++) {
+		uEnd = NBL_READ_UINT(pstrTMLL, NBL_TMLL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS)
+			+ NBL_READ_UINT(pstrTMLL, NBL_TMLL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE);
+		if (uEnd > uDataEnd)
+			uDataEnd = uEnd;
+	}
 
-	if (uOptions & OPTION_VERBOSE)
-		printf("data=%x, compressed=%x, encrypted=%x\n", iDataPos, iIsCompressed, pCtx != NULL);
+	if (pstrData != NULL && (unsigned int)iSize >= uDataEnd) {
+		if (nbl_is_compressed(pstrTMLL))
+			fprintf(stderr, "TMLL entries were decompressed with the experimental decoder and may be wrong\n");
+		nbl_extract_all(pstrTMLL, NBL_TMLL_HEADER_CHUNKS, pstrData, pstrDestPath, pManifest);
+		free(pstrData);
+		goto extract_inplace_ret;
+	}
 
-	if (iIsCompressed) {
-		if (uOptions & OPTION_DEBUG)
-			debug_save_buffer("tmll-comp-crypt.dbg", pstrBuffer + iTMLLPos, NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_COMPRESSED_DATA_SIZE));
+	free(pstrData);
 
+	/* The stream was overwritten while decoding it; it is read again to keep it for analysis. */
+	iSize = NBL_READ_INT(pstrTMLL, NBL_HEADER_COMPRESSED_DATA_SIZE);
+	iDataPos = nbl_find_data_pos(pFile, iTMLLPos, pstrTMLL);
+	pstrData = iSize > 0 && iDataPos >= 0 ? malloc(iSize) : NULL;
+	pstrFallback = malloc((pstrDestPath ? strlen(pstrDestPath) : 0) + sizeof(EXTRACT_TMLL_FALLBACK) + 1);
+	if (pstrData && pstrFallback && fseeko(pFile, iDataPos, SEEK_SET) == 0 && fread(pstrData, 1, iSize, pFile) == (size_t)iSize) {
 		if (pCtx)
-			nbl_decrypt_buffer(pCtx, pstrBuffer + iTMLLPos + iDataPos, NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_COMPRESSED_DATA_SIZE));
+			nbl_decrypt_buffer(pCtx, pstrData, iSize);
+
+		if (pstrDestPath)
+			sprintf(pstrFallback, "%s/%s", pstrDestPath, EXTRACT_TMLL_FALLBACK);
+		else
+			strcpy(pstrFallback, EXTRACT_TMLL_FALLBACK);
+		debug_save_buffer(pstrFallback, pstrData, iSize);
+		fprintf(stderr, "TMLL data couldn't be decompressed; its decrypted stream was saved to %s\n", pstrFallback);
+	} else
+		fprintf(stderr, "TMLL data couldn't be decompressed\n");
+
+	free(pstrFallback);
+	free(pstrData);
+
+extract_inplace_ret:
+	if (pManifest && manifest_close(pManifest) != 0 && ret == 0) {
+		fprintf(stderr, "Error writing manifest %s\n", pstrManifest);
+		ret = -1;
+	}
 
-		if (uOptions & OPTION_DEBUG)
-			debug_save_buffer("tmll-comp-decrypt.dbg", pstrBuffer + iTMLLPos, NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_COMPRESSED_DATA_SIZE));
+	if (pFile)
+		fclose(pFile);
+	free(pstrTMLL);
+	free(pstrHeader);
 
-		/* TODO: find out the correct decompress algorithm for the TMLL chunk; disabled meanwhile */
-		return 0;
+	return ret;
+}
 
-		pstrData = malloc(NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_DATA_SIZE));
-		if (pstrData == NULL) {
-			free(pstrBuffer);
-			return -3;
+/**
+ * List the files inside the nbl archive.
+ * Only the headers are read from the file. Standard input can't seek past
+ * the data, so it is read whole instead.
+ */
+
+int list(unsigned int uOptions, char* pstrFilename)
+{
+	struct bf_ctx ctx;
+	char* pstrBuffer;
+	char* pstrTMLL = NULL;
+	int iStream, iTMLLPos = 0;
+
+	iStream = strcmp(pstrFilename, "-") == 0;
+	if (iStream) {
+		pstrBuffer = nbl_load_stream(stdin);
+		if (pstrBuffer && nbl_has_tmll(pstrBuffer)) {
+			iTMLLPos = nbl_get_tmll_pos(pstrBuffer);
+			pstrTMLL = pstrBuffer + iTMLLPos;
 		}
+	} else
+		pstrBuffer = nbl_load_headers(pstrFilename, &pstrTMLL, &iTMLLPos);
 
-		nbl_decompress(
-			pstrBuffer + iTMLLPos + iDataPos,
-			NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_COMPRESSED_DATA_SIZE),
-			pstrData,
-			NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_DATA_SIZE)
-		);
-		/* TODO: check the return value */
-	} else {
-		if (pCtx)
-			nbl_decrypt_buffer(pCtx, pstrBuffer + iTMLLPos + iDataPos, NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_DATA_SIZE));
+	if (pstrBuffer == NULL) {
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+		return -1;
+	}
 
-		pstrData = pstrBuffer + iTMLLPos + iDataPos;
+	if (NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED) != 0) {
+		nbl_setkey(&ctx, NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED));
+		nbl_decrypt_headers(&ctx, pstrBuffer, NBL_HEADER_CHUNKS);
+		if (pstrTMLL)
+			nbl_decrypt_headers(&ctx, pstrTMLL, NBL_TMLL_HEADER_CHUNKS);
 	}
 
-	if (uOptions & OPTION_DEBUG)
-		debug_save_buffer("tmll-decomp-decrypt.dbg", pstrData, NBL_READ_UINT(pstrBuffer + iTMLLPos, NBL_HEADER_DATA_SIZE));
+	if (uOptions & OPTION_DETAILS)
+		nbl_list_files_details(pstrBuffer, NBL_HEADER_CHUNKS);
+	else
+		nbl_list_files(pstrBuffer, NBL_HEADER_CHUNKS);
 
-	nbl_extract_all(pstrBuffer + iTMLLPos, pstrData, pstrDestPath);
+	if (nbl_has_tmll(pstrBuffer) && pstrTMLL == NULL)
+		fprintf(stderr, "TMLL section not found in %s\n", pstrFilename);
 
-	if (iIsCompressed)
-		free(pstrData);
+	if (pstrTMLL) {
+		if (uOptions & OPTION_VERBOSE)
+			printf("TMLL section found at position 0x%x!\n", iTMLLPos);
+
+		if (uOptions & OPTION_DETAILS)
+			nbl_list_files_details(pstrTMLL, NBL_TMLL_HEADER_CHUNKS);
+		else
+			nbl_list_files(pstrTMLL, NBL_TMLL_HEADER_CHUNKS);
+	}
 
+	if (!iStream)
+		free(pstrTMLL);
+	free(pstrBuffer);
 	return 0;
 }
 
 /**
- * List the files inside the nbl archive.
+ * Save an entry's data in the destination path, or write it to stdout if the path is "-".
  */
 
-void list(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx)
+int save_entry(char* pstrDestPath, char* pstrName, char* pstrData, int iSize, struct manifest_ctx* pManifest, int iPos)
 {
-	int iTMLLPos;
+	FILE* pFile;
+	char pstrFilename[FILENAME_MAX];
+	int iLen = 0;
+
+	if (pstrDestPath != NULL && strcmp(pstrDestPath, "-") == 0) {
+		if (fwrite(pstrData, 1, iSize, stdout) != (size_t)iSize || fflush(stdout) != 0)
+			return -2;
+		goto save_entry_ret;
+	}
+
+	if (pstrDestPath != NULL) {
+		iLen = snprintf(pstrFilename, FILENAME_MAX - NBL_CHUNK_FILENAME_SIZE - 1, "%s", pstrDestPath);
+		if (iLen > 0 && pstrFilename[iLen - 1] != '/' && pstrFilename[iLen - 1] != '\\')
+			pstrFilename[iLen++] = '/';
+	}
+
+	strncpy(pstrFilename + iLen, pstrName, NBL_CHUNK_FILENAME_SIZE);
+	pstrFilename[iLen + NBL_CHUNK_FILENAME_SIZE] = 0;
+
+	pFile = fopen(pstrFilename, "wb");
+	if (pFile == NULL)
+		return -1;
+
+	iLen = fwrite(pstrData, 1, iSize, pFile);
+	fclose(pFile);
+
+	if (iLen != iSize)
+		return -2;
+
+save_entry_ret:
+	if (pManifest)
+		manifest_add_buffer(pManifest, pstrName, iPos, pstrData, iSize);
+
+	return 0;
+}
+
+/**
+ * Build a checkpoint index for the compressed data of the nbl archive.
+ */
+
+int build_index(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrIndex, int iInterval)
+{
+	nbl_checkpoint* pCheckpoints;
+	nbl_index_stamp stamp;
+	char* pstrData;
+	int iCount, iDataPos, ret;
+
+	if (!nbl_is_compressed(pstrBuffer)) {
+		fprintf(stderr, "Only compressed archives can be indexed.\n");
+		return -2;
+	}
+
+	nbl_index_stamp_init(pstrBuffer, &stamp);
+
+	iDataPos = nbl_get_data_pos(pstrBuffer);
+	if (pCtx)
+		nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos, NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE));
+
+	pstrData = malloc(NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE));
+	if (pstrData == NULL)
+		return -3;
+
+	pCheckpoints = nbl_decompress_index(
+		pstrBuffer + iDataPos,
+		NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE),
+		pstrData,
+		NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE),
+		iInterval,
+		&iCount
+	);
+	free(pstrData);
+
+	if (pCheckpoints == NULL) {
+		fprintf(stderr, "Error decompressing data\n");
+		return -3;
+	}
+
+	if (uOptions & OPTION_VERBOSE)
+		printf("%d checkpoints every 0x%x bytes\n", iCount, iInterval);
+
+	ret = nbl_index_save(pstrIndex, &stamp, pCheckpoints, iCount, iInterval);
+	free(pCheckpoints);
+
+	if (ret != 0)
+		fprintf(stderr, "Error writing index %s\n", pstrIndex);
+
+	return ret;
+}
+
+/**
+ * Extract a single entry from the nbl archive.
+ * When an index is given only the blocks between the nearest checkpoints are decrypted and decompressed.
+ */
+
+int extract_entry(unsigned int uOptions, char* pstrBuffer, struct bf_ctx* pCtx, char* pstrDestPath, char* pstrEntry, char* pstrIndex, struct manifest_ctx* pManifest)
+{
+	nbl_checkpoint* pCheckpoints = NULL;
+	nbl_checkpoint* pCheckpoint;
+	nbl_index_stamp stamp;
+	char* pstrData;
+	int i, iCount, iDataPos, iPos, iSize, iSrcSize, iStart, iEnd;
+	int ret;
+
+	/* The stamp covers the headers as stored. */
+	if (pstrIndex)
+		nbl_index_stamp_init(pstrBuffer, &stamp);
 
 	if (pCtx)
 		nbl_decrypt_headers(pCtx, pstrBuffer, NBL_HEADER_CHUNKS);
-	nbl_list_files(pstrBuffer, NBL_HEADER_CHUNKS);
 
-	if (!nbl_has_tmll(pstrBuffer))
-		return;
+	i = nbl_find_file(pstrBuffer, NBL_HEADER_CHUNKS, pstrEntry);
+	if (i < 0) {
+		fprintf(stderr, "Entry %s not found\n", pstrEntry);
+		return -2;
+	}
+
+	iPos = NBL_READ_INT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_FILE_POS + i * NBL_CHUNK_SIZE);
+	iSize = NBL_READ_INT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_FILE_SIZE + i * NBL_CHUNK_SIZE);
+	iDataPos = nbl_get_data_pos(pstrBuffer);
+
+	if (!nbl_is_compressed(pstrBuffer)) {
+		/* Blocks are decrypted independently; only the trailing incomplete block is left in clear. */
+		if (pCtx) {
+			iStart = iPos & ~7;
+			iEnd = (iPos + iSize + 7) & ~7;
+			if (iEnd > NBL_READ_INT(pstrBuffer, NBL_HEADER_DATA_SIZE))
+				iEnd = NBL_READ_INT(pstrBuffer, NBL_HEADER_DATA_SIZE);
+			if (iEnd > iStart)
+				nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos + iStart, iEnd - iStart);
+		}
+
+		return save_entry(pstrDestPath, pstrEntry, pstrBuffer + iDataPos + iPos, iSize, pManifest, iPos);
+	}
+
+	iSrcSize = NBL_READ_INT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE);
+
+	if (pstrIndex) {
+		pCheckpoints = nbl_index_load(pstrIndex, &stamp, &iCount);
+		if (pCheckpoints == NULL) {
+			if (iCount == NBL_ERROR_ARGS)
+				fprintf(stderr, "Index %s doesn't match the archive\n", pstrIndex);
+			else
+				fprintf(stderr, "Error opening index %s\n", pstrIndex);
+			return -1;
+		}
+	}
+
+	pstrData = malloc(pCheckpoints ? iSize : NBL_READ_INT(pstrBuffer, NBL_HEADER_DATA_SIZE));
+	if (pstrData == NULL) {
+		free(pCheckpoints);
+		return -3;
+	}
+
+	if (pCheckpoints) {
+		pCheckpoint = nbl_find_checkpoint(pCheckpoints, iCount, iPos);
+
+		/* The compressed bytes needed end where the first checkpoint past the entry starts. */
+		iStart = pCheckpoint->uSrcPos & ~7;
+		iEnd = iSrcSize;
+		for (i = pCheckpoint - pCheckpoints; i < iCount; i++) {
+			if (pCheckpoints[i].uDestPos >= (unsigned int)(iPos + iSize)) {
+				iEnd = pCheckpoints[i].uSrcPos;
+				break;
+			}
+		}
+
+		if (uOptions & OPTION_VERBOSE)
+			printf("checkpoint=%x, src=%x-%x\n", pCheckpoint->uDestPos, iStart, iEnd);
+
+		if (pCtx) {
+			iEnd = (iEnd + 7) & ~7;
+			if (iEnd > iSrcSize)
+				iEnd = iSrcSize;
+			nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos + iStart, iEnd - iStart);
+		}
+
+		ret = nbl_decompress_range(pstrBuffer + iDataPos, iSrcSize, pCheckpoint, pstrData, iPos, iSize);
+		free(pCheckpoints);
+
+		if (ret < 0) {
+			fprintf(stderr, "Error decompressing data (%d)\n", ret);
+			free(pstrData);
+			return ret;
+		}
+
+		ret = save_entry(pstrDestPath, pstrEntry, pstrData, iSize, pManifest, iPos);
+	} else {
+		if (pCtx)
+			nbl_decrypt_buffer(pCtx, pstrBuffer + iDataPos, iSrcSize);
+
+		ret = nbl_decompress(pstrBuffer + iDataPos, iSrcSize, pstrData, NBL_READ_INT(pstrBuffer, NBL_HEADER_DATA_SIZE));
+		if (ret < 0) {
+			fprintf(stderr, "Error decompressing data (%d)\n", ret);
+			free(pstrData);
+			return ret;
+		}
+
+		ret = save_entry(pstrDestPath, pstrEntry, pstrData + iPos, iSize, pManifest, iPos);
+	}
+
+	free(pstrData);
+	return ret;
+}
+
+/**
+ * Load a whole file in memory.
+ * Returns a new pointer with the file contents and its size in piSize.
+ */
+
+char* load_file(char* pstrFilename, int* piSize)
+{
+	FILE* pFile;
+	char* pstrBuffer;
+	off_t lSize;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return NULL;
+
+	fseeko(pFile, 0, SEEK_END);
+	lSize = ftello(pFile);
+	fseeko(pFile, 0, SEEK_SET);
+
+	/* Entry sizes are 32-bit. */
+	if (lSize < 0 || lSize > INT_MAX) {
+		fclose(pFile);
+		return NULL;
+	}
+
+	/* Keep one byte so that empty files still get a valid pointer. */
+	pstrBuffer = malloc(lSize + 1);
+	if (pstrBuffer != NULL && fread(pstrBuffer, 1, lSize, pFile) != (size_t)lSize) {
+		free(pstrBuffer);
+		pstrBuffer = NULL;
+	}
+
+	fclose(pFile);
+	*piSize = lSize;
+	return pstrBuffer;
+}
+
+/**
+ * Create an nbl archive from the files found in the source path.
+ * The archive is written to stdout if the filename is "-".
+ * The data is compressed using iNbThreads threads; see nbl_compress_parallel.
+ * With OPTION_UPDATE the inputs are hashed and the archive is only rebuilt
+ * when the hash differs from the one saved in the .stamp file next to it.
+ */
+
+int create(unsigned int uOptions, char* pstrSrcPath, char* pstrFilename, unsigned int uKeySeed, int iNbThreads)
+{
+	struct dirent** ppEntries;
+	struct stat st;
+	FILE* pFile;
+	char** ppstrNames = NULL;
+	char** ppstrFiles = NULL;
+	int* piFileSizes = NULL;
+	char* pstrBuffer;
+	char pstrPath[FILENAME_MAX];
+	char pstrStamp[FILENAME_MAX];
+	char pstrHash[17], pstrOldHash[17];
+	unsigned long long ullHash = MANIFEST_HASH64_INIT;
+	int i, iNbEntries, iNbFiles = 0, iSize;
+	int ret = 0;
+
+	iNbEntries = scandir(pstrSrcPath, &ppEntries, NULL, alphasort);
+	if (iNbEntries < 0) {
+		fprintf(stderr, "Error opening directory %s\n", pstrSrcPath);
+		return -1;
+	}
+
+	ppstrNames = malloc(iNbEntries * sizeof(char*));
+	ppstrFiles = malloc(iNbEntries * sizeof(char*));
+	piFileSizes = malloc(iNbEntries * sizeof(int));
+	if (ppstrNames == NULL || ppstrFiles == NULL || piFileSizes == NULL) {
+		ret = -3;
+		goto create_ret;
+	}
+
+	for (i = 0; i < iNbEntries; i++) {
+		snprintf(pstrPath, FILENAME_MAX, "%s/%s", pstrSrcPath, ppEntries[i]->d_name);
+		if (stat(pstrPath, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (strlen(ppEntries[i]->d_name) >= NBL_CHUNK_FILENAME_SIZE) {
+			fprintf(stderr, "Filename too long: %s\n", ppEntries[i]->d_name);
+			ret = -2;
+			goto create_ret;
+		}
+
+		ppstrFiles[iNbFiles] = load_file(pstrPath, &iSize);
+		if (ppstrFiles[iNbFiles] == NULL) {
+			fprintf(stderr, "Error opening file %s\n", pstrPath);
+			ret = -1;
+			goto create_ret;
+		}
+
+		ppstrNames[iNbFiles] = ppEntries[i]->d_name;
+		piFileSizes[iNbFiles] = iSize;
+		iNbFiles++;
+
+		ullHash = manifest_hash64(ullHash, ppEntries[i]->d_name, strlen(ppEntries[i]->d_name) + 1);
+		ullHash = manifest_hash64(ullHash, (char*)&iSize, sizeof(int));
+		ullHash = manifest_hash64(ullHash, ppstrFiles[iNbFiles - 1], iSize);
+	}
+
+	if (iNbFiles == 0) {
+		fprintf(stderr, "No files found in %s\n", pstrSrcPath);
+		ret = -2;
+		goto create_ret;
+	}
+
+	/* The options used to build the archive are part of its contents. */
+	ullHash = manifest_hash64(ullHash, (char*)&uKeySeed, sizeof(unsigned int));
+	ullHash = manifest_hash64(ullHash, (uOptions & OPTION_STORE) ? "s" : "c", 1);
+	sprintf(pstrHash, "%016llx", ullHash);
+	snprintf(pstrStamp, FILENAME_MAX, "%s.stamp", pstrFilename);
+
+	if (uOptions & OPTION_UPDATE && access(pstrFilename, F_OK) == 0) {
+		pFile = fopen(pstrStamp, "rb");
+		if (pFile) {
+			i = fread(pstrOldHash, 1, 16, pFile);
+			pstrOldHash[i] = 0;
+			fclose(pFile);
+
+			if (strcmp(pstrHash, pstrOldHash) == 0) {
+				if (uOptions & OPTION_VERBOSE)
+					printf("%s is up to date\n", pstrFilename);
+				goto create_ret;
+			}
+		}
+	}
+
+	pstrBuffer = nbl_build(ppstrNames, ppstrFiles, piFileSizes, iNbFiles, uKeySeed, (uOptions & OPTION_STORE) ? 0 : iNbThreads, &iSize);
+	if (pstrBuffer == NULL) {
+		fprintf(stderr, "Error building archive %s\n", pstrFilename);
+		ret = -3;
+		goto create_ret;
+	}
 
-	iTMLLPos = nbl_get_tmll_pos(pstrBuffer);
 	if (uOptions & OPTION_VERBOSE)
-		printf("TMLL section found at position 0x%x!\n", iTMLLPos);
+		printf("files=%d, data=%x, compressed=%x, encrypted=%x\n", iNbFiles,
+			NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE), NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE), uKeySeed != 0);
 
-	if (pCtx)
-		nbl_decrypt_headers(pCtx, pstrBuffer + iTMLLPos, NBL_TMLL_HEADER_CHUNKS);
-	nbl_list_files(pstrBuffer + iTMLLPos, NBL_TMLL_HEADER_CHUNKS);
+	pFile = strcmp(pstrFilename, "-") == 0 ? stdout : fopen(pstrFilename, "wb");
+	if (pFile == NULL || fwrite(pstrBuffer, 1, iSize, pFile) != (size_t)iSize || fflush(pFile) != 0) {
+		fprintf(stderr, "Error writing file %s\n", pstrFilename);
+		ret = -1;
+	}
+	if (pFile && pFile != stdout)
+		fclose(pFile);
+	free(pstrBuffer);
+
+	if (ret == 0 && uOptions & OPTION_UPDATE) {
+		pFile = fopen(pstrStamp, "wb");
+		if (pFile) {
+			fputs(pstrHash, pFile);
+			fclose(pFile);
+		}
+	}
+
+create_ret:
+	for (i = 0; i < iNbFiles; i++)
+		free(ppstrFiles[i]);
+	for (i = 0; i < iNbEntries; i++)
+		free(ppEntries[i]);
+	free(ppEntries);
+	free(ppstrNames);
+	free(ppstrFiles);
+	free(piFileSizes);
+
+	return ret;
+}
+
+/**
+ * Part of the archive changed by rekey: either a header, replaced by
+ * its already re-keyed copy, or data re-keyed while it's copied.
+ */
+
+typedef struct {
+	off_t iPos;
+	off_t iSize;
+	char* pstrHeader; /* NULL for data. */
+} rekey_region;
+
+/**
+ * Copy iSize bytes from pIn to pOut one window at a time, changing their key
+ * on the way unless both contexts are NULL.
+ */
+
+static int rekey_copy(FILE* pIn, FILE* pOut, char* pstrWindow, off_t iSize, struct bf_ctx* pOldCtx, struct bf_ctx* pNewCtx)
+{
+	size_t iCount;
+
+	while (iSize > 0) {
+		iCount = iSize < NBL_LOAD_WINDOW_SIZE ? (size_t)iSize : NBL_LOAD_WINDOW_SIZE;
+		if (fread(pstrWindow, 1, iCount, pIn) != iCount)
+			return -2;
+
+		if (pOldCtx || pNewCtx)
+			nbl_rekey_buffer(pOldCtx, pNewCtx, pstrWindow, iCount);
+
+		if (fwrite(pstrWindow, 1, iCount, pOut) != iCount)
+			return -1;
+
+		iSize -= iCount;
+	}
+
+	return 0;
+}
+
+/**
+ * Change the key of the nbl archive to uKeySeed, or remove the encryption if it's 0,
+ * without decompressing anything. The chunk tables are re-keyed in memory; the data
+ * is re-keyed while the archive is copied in a single pass, the rest being copied as is.
+ * The archive is replaced unless another file is given in pstrDestPath.
+ */
+
+int rekey(unsigned int uOptions, char* pstrFilename, char* pstrDestPath, unsigned int uKeySeed)
+{
+	struct bf_ctx oldctx, newctx;
+	struct bf_ctx* pOldCtx = NULL;
+	struct bf_ctx* pNewCtx = NULL;
+	rekey_region aRegions[4];
+	FILE* pIn = NULL;
+	FILE* pOut = NULL;
+	char* pstrHeader;
+	char* pstrTMLL = NULL;
+	char* pstrWindow = NULL;
+	char* pstrSection;
+	char pstrTmp[FILENAME_MAX];
+	off_t iPos, iSize;
+	unsigned int uOldKeySeed;
+	int i, iNbRegions = 0, iTMLLPos;
+	int ret = 0;
+
+	pstrHeader = nbl_load_headers(pstrFilename, &pstrTMLL, &iTMLLPos);
+	if (pstrHeader == NULL) {
+		fprintf(stderr, "Error opening file %s\n", pstrFilename);
+		return -1;
+	}
+
+	if (nbl_has_tmll(pstrHeader) && pstrTMLL == NULL) {
+		fprintf(stderr, "TMLL section not found in %s\n", pstrFilename);
+		ret = -2;
+		goto rekey_ret;
+	}
+
+	pIn = fopen(pstrFilename, "rb");
+	pstrWindow = malloc(NBL_LOAD_WINDOW_SIZE);
+	if (pIn == NULL || pstrWindow == NULL) {
+		ret = -1;
+		goto rekey_ret;
+	}
+
+	uOldKeySeed = NBL_READ_UINT(pstrHeader, NBL_HEADER_KEY_SEED);
+	if (uOldKeySeed != 0) {
+		pOldCtx = &oldctx;
+		nbl_setkey(pOldCtx, uOldKeySeed);
+	}
+	if (uKeySeed != 0) {
+		pNewCtx = &newctx;
+		nbl_setkey(pNewCtx, uKeySeed);
+	}
+
+	if (uOptions & OPTION_VERBOSE)
+		printf("key %x -> %x\n", uOldKeySeed, uKeySeed);
+
+	/* The TMLL section uses the key found in the NMLL header. */
+	NBL_WRITE_UINT(pstrHeader, NBL_HEADER_KEY_SEED, uKeySeed);
+
+	for (i = 0; i < 2; i++) {
+		pstrSection = i == 0 ? pstrHeader : pstrTMLL;
+		if (pstrSection == NULL)
+			break;
+
+		aRegions[iNbRegions].iPos = i == 0 ? 0 : iTMLLPos;
+		aRegions[iNbRegions].iSize = (i == 0 ? NBL_HEADER_CHUNKS : NBL_TMLL_HEADER_CHUNKS)
+			+ NBL_READ_INT(pstrSection, NBL_HEADER_NB_CHUNKS) * NBL_CHUNK_SIZE;
+		aRegions[iNbRegions].pstrHeader = pstrSection;
+		nbl_rekey_headers(pOldCtx, pNewCtx, pstrSection, i == 0 ? NBL_HEADER_CHUNKS : NBL_TMLL_HEADER_CHUNKS);
+		iNbRegions++;
+
+		aRegions[iNbRegions].iPos = nbl_find_data_pos(pIn, aRegions[iNbRegions - 1].iPos, pstrSection);
+		aRegions[iNbRegions].iSize = NBL_READ_UINT(pstrSection, (nbl_is_compressed(pstrSection)
+			? NBL_HEADER_COMPRESSED_DATA_SIZE : NBL_HEADER_DATA_SIZE));
+		aRegions[iNbRegions].pstrHeader = NULL;
+		iNbRegions++;
+	}
+
+	/* Readers find the data as the first non-zero word after the headers; see nbl_get_data_pos. */
+	for (i = 1; i < iNbRegions; i += 2) {
+		memset(pstrWindow, 0, 8);
+		if (aRegions[i].iSize > 0 && (fseeko(pIn, aRegions[i].iPos, SEEK_SET) != 0
+			|| fread(pstrWindow, 1, aRegions[i].iSize < 8 ? (size_t)aRegions[i].iSize : 8, pIn) == 0)) {
+			fprintf(stderr, "Invalid or truncated file %s\n", pstrFilename);
+			ret = -2;
+			goto rekey_ret;
+		}
+
+		if (aRegions[i].iSize >= 8 && (pOldCtx || pNewCtx))
+			nbl_rekey_buffer(pOldCtx, pNewCtx, pstrWindow, 8);
+
+		if (NBL_READ_UINT(pstrWindow, 0) == 0) {
+			fprintf(stderr, "The re-keyed %sdata of %s would start with a zero word, which readers can't find%s\n",
+				i == 1 ? "" : "TMLL ", pstrFilename, uKeySeed ? "; try another key" : "");
+			ret = -2;
+			goto rekey_ret;
+		}
+	}
+
+	if (pstrDestPath)
+		pOut = fopen(pstrDestPath, "wb");
+	else {
+		snprintf(pstrTmp, FILENAME_MAX, "%s.tmp", pstrFilename);
+		pOut = fopen(pstrTmp, "wb");
+	}
+	if (pOut == NULL) {
+		fprintf(stderr, "Error creating file %s\n", pstrDestPath ? pstrDestPath : pstrTmp);
+		ret = -1;
+		goto rekey_ret;
+	}
+
+	/* Single pass over the archive; the regions are in file order. */
+
+	if (fseeko(pIn, 0, SEEK_END) != 0 || (iSize = ftello(pIn)) < 0 || fseeko(pIn, 0, SEEK_SET) != 0) {
+		ret = -1;
+		goto rekey_ret;
+	}
+
+	iPos = 0;
+	for (i = 0; i < iNbRegions && ret == 0; i++) {
+		if (aRegions[i].iPos < iPos || aRegions[i].iSize > iSize - aRegions[i].iPos) {
+			ret = -2;
+			break;
+		}
+
+		ret = rekey_copy(pIn, pOut, pstrWindow, aRegions[i].iPos - iPos, NULL, NULL);
+		if (ret == 0 && aRegions[i].pstrHeader) {
+			if (fwrite(aRegions[i].pstrHeader, 1, aRegions[i].iSize, pOut) != (size_t)aRegions[i].iSize)
+				ret = -1;
+			else if (fseeko(pIn, aRegions[i].iSize, SEEK_CUR) != 0)
+				ret = -2;
+		} else if (ret == 0)
+			ret = rekey_copy(pIn, pOut, pstrWindow, aRegions[i].iSize, pOldCtx, pNewCtx);
+
+		iPos = aRegions[i].iPos + aRegions[i].iSize;
+	}
+
+	if (ret == 0)
+		ret = rekey_copy(pIn, pOut, pstrWindow, iSize - iPos, NULL, NULL);
+
+	if (fclose(pOut) != 0 && ret == 0)
+		ret = -1;
+	pOut = NULL;
+
+	if (ret == -2)
+		fprintf(stderr, "Invalid or truncated file %s\n", pstrFilename);
+	else if (ret < 0)
+		fprintf(stderr, "Error writing file %s\n", pstrDestPath ? pstrDestPath : pstrTmp);
+
+	if (pstrDestPath == NULL) {
+		if (ret == 0 && rename(pstrTmp, pstrFilename) != 0) {
+			fprintf(stderr, "Error replacing file %s\n", pstrFilename);
+			ret = -1;
+		}
+		if (ret < 0)
+			unlink(pstrTmp);
+	}
+
+rekey_ret:
+	if (pOut)
+		fclose(pOut);
+	if (pIn)
+		fclose(pIn);
+	free(pstrWindow);
+	free(pstrTMLL);
+	free(pstrHeader);
+
+	return ret;
+}
+
+/**
+ * Options of the extractions done while watching a tree.
+ */
+
+typedef struct {
+	unsigned int uOptions;
+	char* pstrCachePath;
+	int iCacheSize;
+} extract_watched_struct;
+
+/**
+ * Extract a file of the watched tree; see watch_tree.
+ * Returns WATCH_SKIP if it isn't an nbl archive.
+ */
+
+int extract_watched(char* pstrFilename, char* pstrDestPath, void* pArg)
+{
+	extract_watched_struct* p = pArg;
+	struct bf_ctx ctx;
+	struct bf_ctx* pCtx = NULL;
+	FILE* pFile;
+	struct stat st;
+	char* pstrBuffer;
+	unsigned int uId = 0;
+	int ret;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return -1;
+	ret = fread(&uId, 1, 4, pFile);
+	fclose(pFile);
+
+	if (ret != 4 || uId != NBL_ID_NMLL)
+		return WATCH_SKIP;
+
+	/* Before loading, so that the data is at least as recent as its stat. */
+	if (stat(pstrFilename, &st) != 0)
+		return -1;
+
+	pstrBuffer = nbl_load(pstrFilename);
+	if (pstrBuffer == NULL)
+		return -1;
+
+	if (NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED) != 0) {
+		pCtx = &ctx;
+		nbl_setkey(pCtx, NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED));
+	}
+
+	ret = extract(p->uOptions & ~OPTION_VERBOSE, pstrBuffer, pCtx, pstrDestPath, NULL, p->pstrCachePath, &st, p->iCacheSize);
+
+	free(pstrBuffer);
+	return ret;
 }
 
 /**
@@ -206,24 +1241,131 @@ int main(int argc, char** argv)
 {
 	char* pstrBuffer = NULL;
 	char* pstrDestPath = NULL;
+	char* pstrEntry = NULL;
+	char* pstrIndex = NULL;
+	char* pstrCachePath = NULL;
+	char* pstrManifest = NULL;
+	char* pstrSrcPath = NULL;
+	char* pstrWatchPath = NULL;
+	struct manifest_ctx* pManifest = NULL;
+	struct option aLongOptions[] = {
+		{"verify", no_argument, NULL, 'V'},
+		{"rekey", required_argument, NULL, 'r'},
+		{"decrypt-only", no_argument, NULL, 'D'},
+		{"tmll-experimental", no_argument, NULL, 'T'},
+		{"watch", required_argument, NULL, 'W'},
+		{NULL, 0, NULL, 0}
+	};
 	struct bf_ctx ctx;
 	struct bf_ctx* pCtx = NULL;
-	unsigned char key[4];
+	struct stat st;
+	struct stat* pStat = NULL;
+	extract_watched_struct watched;
 	unsigned int uOptions = 0;
+	unsigned int uKeySeed = 0;
+	int iInterval = DEFAULT_INDEX_INTERVAL;
+	int iNbThreads = 1;
+	int iCacheSize = NBL_CACHE_DEFAULT_SIZE;
 	int i;
 	int ret = 0;
 
 	opterr = 0;
-	while ((i = getopt(argc, argv, "do:tv")) != -1) {
+	while ((i = getopt_long(argc, argv, "c:C:dDe:Hi:Ij:k:lLm:M:nr:s:So:tvVW:x:", aLongOptions, NULL)) != -1) {
 		switch (i) {
+			case 'c':
+				pstrSrcPath = optarg;
+				break;
+
+			case 'C':
+				pstrCachePath = optarg;
+				break;
+
 			case 'd':
 				uOptions |= OPTION_DEBUG;
 				break;
 
+			case 'D':
+				uOptions |= OPTION_REKEY;
+				uKeySeed = 0;
+				break;
+
+			case 'e':
+				pstrEntry = optarg;
+				break;
+
+			case 'H':
+				uOptions |= OPTION_HASH64;
+				break;
+
+			case 'i':
+				pstrIndex = optarg;
+				break;
+
+			case 'I':
+				uOptions |= OPTION_UPDATE;
+				break;
+
+			case 'j':
+				iNbThreads = atoi(optarg);
+				if (iNbThreads <= 0) {
+					fprintf(stderr, "Invalid number of threads %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'k':
+				iInterval = atoi(optarg);
+				if (iInterval <= 0) {
+					fprintf(stderr, "Invalid index interval %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'l':
+				uOptions |= OPTION_DETAILS;
+				break;
+
+			case 'L':
+				uOptions |= OPTION_INPLACE;
+				break;
+
+			case 'm':
+				pstrManifest = optarg;
+				break;
+
+			case 'M':
+				iCacheSize = atoi(optarg);
+				if (iCacheSize <= 0) {
+					fprintf(stderr, "Invalid cache size %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'n':
+				uOptions |= OPTION_STORE;
+				break;
+
 			case 'o':
 				pstrDestPath = optarg;
 				break;
 
+			case 'r':
+				uOptions |= OPTION_REKEY;
+				uKeySeed = strtoul(optarg, NULL, 16);
+				break;
+
+			case 's':
+				uKeySeed = strtoul(optarg, NULL, 16);
+				break;
+
+			case 'S':
+				uOptions |= OPTION_STREAM;
+				break;
+
+			case 'T':
+				uOptions |= OPTION_TMLL;
+				break;
+
 			case 't':
 				uOptions |= OPTION_LIST;
 				break;
@@ -232,8 +1374,21 @@ int main(int argc, char** argv)
 				uOptions |= OPTION_VERBOSE;
 				break;
 
+			case 'V':
+				uOptions |= OPTION_VERIFY;
+				break;
+
+			case 'W':
+				pstrWatchPath = optarg;
+				break;
+
+			case 'x':
+				uOptions |= OPTION_INDEX;
+				pstrIndex = optarg;
+				break;
+
 			case '?':
-				if (optopt == 'o')
+				if (optopt == 'c' || optopt == 'C' || optopt == 'e' || optopt == 'i' || optopt == 'j' || optopt == 'k' || optopt == 'm' || optopt == 'M' || optopt == 'o' || optopt == 'r' || optopt == 's' || optopt == 'W' || optopt == 'x')
 					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
 				else if (isprint(optopt))
 					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
@@ -248,12 +1403,91 @@ int main(int argc, char** argv)
 
 	i = optind;
 
-	if (i + 1 != argc) {
-		fprintf(stderr, "Usage: %s [-d] [-v] [-t] [-o destpath] file.nbl\n", argv[0]);
+	if (uOptions & OPTION_VERIFY && pstrManifest != NULL && i == argc) {
+		ret = manifest_verify(pstrManifest, pstrDestPath);
+		if (ret < 0)
+			fprintf(stderr, "Error opening manifest %s\n", pstrManifest);
+		return ret == 0 ? 0 : 1;
+	}
+
+	if (pstrWatchPath) {
+		if (i != argc || pstrDestPath == NULL || strcmp(pstrDestPath, "-") == 0 || pstrSrcPath || pstrEntry || pstrManifest
+			|| uOptions & (OPTION_LIST | OPTION_INDEX | OPTION_DEBUG | OPTION_STREAM | OPTION_INPLACE | OPTION_REKEY | OPTION_VERIFY)) {
+			fprintf(stderr, "Option --watch requires a destination path and no file, and only applies with -v and -C.\n");
+			return 1;
+		}
+
+		watched.uOptions = uOptions;
+		watched.pstrCachePath = pstrCachePath;
+		watched.iCacheSize = iCacheSize;
+		return watch_tree(pstrWatchPath, pstrDestPath, extract_watched, &watched, uOptions & OPTION_VERBOSE) == 0 ? 0 : -1;
+	}
+
+	if (i + 1 != argc || uOptions & OPTION_VERIFY) {
+		fprintf(stderr, "Usage: %s [-d] [-v] [-t [-l]] [-S | -L | -C cachedir [-M maxsize]] [-o destpath] [-m manifest [-H]] [-e entry [-i index]] [-x index [-k interval]] [--tmll-experimental] file.nbl\n", argv[0]);
+		fprintf(stderr, "       %s -c srcpath [-v] [-n | -j threads] [-s keyseed] [-I] file.nbl\n", argv[0]);
+		fprintf(stderr, "       %s --rekey keyseed | --decrypt-only [-v] [-o dest.nbl] file.nbl\n", argv[0]);
+		fprintf(stderr, "       %s --verify -m manifest [-o destpath]\n", argv[0]);
+		fprintf(stderr, "       %s --watch srcpath -o destpath [-v] [-C cachedir [-M maxsize]]\n", argv[0]);
+		fprintf(stderr, "       file.nbl can be - for stdin, or stdout with -c; destpath can be - for stdout with -e; maxsize is in MB.\n");
 		return 1;
 	}
 
-	pstrBuffer = nbl_load(argv[i]);
+	/* Only a single output can go to stdout, and nothing else may be printed there. */
+	if (pstrDestPath && strcmp(pstrDestPath, "-") == 0 && (pstrEntry == NULL || uOptions & (OPTION_LIST | OPTION_INDEX))) {
+		fprintf(stderr, "Writing to stdout requires extracting a single entry with -e.\n");
+		return 1;
+	}
+
+	if (((pstrDestPath && strcmp(pstrDestPath, "-") == 0) || (pstrSrcPath && strcmp(argv[i], "-") == 0)) && uOptions & (OPTION_VERBOSE | OPTION_UPDATE)) {
+		fprintf(stderr, "Options -v and -I can't be used when writing to stdout.\n");
+		return 1;
+	}
+
+	if (uOptions & OPTION_STREAM && (pstrSrcPath || pstrEntry || uOptions & (OPTION_LIST | OPTION_INDEX | OPTION_DEBUG))) {
+		fprintf(stderr, "Option -S only applies when extracting all the files.\n");
+		return 1;
+	}
+
+	if (uOptions & OPTION_INPLACE && (uOptions & OPTION_STREAM || pstrSrcPath || pstrEntry || strcmp(argv[i], "-") == 0
+		|| uOptions & (OPTION_LIST | OPTION_INDEX | OPTION_DEBUG))) {
+		fprintf(stderr, "Option -L only applies when extracting all the files of a file that isn't stdin.\n");
+		return 1;
+	}
+
+	if (pstrCachePath && (pstrSrcPath || pstrEntry || uOptions & (OPTION_LIST | OPTION_INDEX | OPTION_STREAM | OPTION_INPLACE | OPTION_REKEY))) {
+		fprintf(stderr, "Option -C only applies when extracting all the files.\n");
+		return 1;
+	}
+
+	if (uOptions & OPTION_REKEY && (pstrSrcPath || pstrEntry || pstrManifest || strcmp(argv[i], "-") == 0
+		|| uOptions & (OPTION_LIST | OPTION_INDEX | OPTION_DEBUG | OPTION_STREAM | OPTION_INPLACE))) {
+		fprintf(stderr, "Options --rekey and --decrypt-only only apply to a file that isn't stdin, with -o for another destination.\n");
+		return 1;
+	}
+
+	if (uOptions & OPTION_REKEY)
+		return rekey(uOptions, argv[i], pstrDestPath, uKeySeed);
+
+	if (uOptions & OPTION_STREAM)
+		return extract_stream(uOptions, argv[i], pstrDestPath, pstrManifest);
+
+	if (uOptions & OPTION_INPLACE)
+		return extract_inplace(uOptions, argv[i], pstrDestPath, pstrManifest);
+
+	if (pstrSrcPath)
+		return create(uOptions, pstrSrcPath, argv[i], uKeySeed, iNbThreads);
+
+	if (uOptions & OPTION_LIST && !(uOptions & OPTION_INDEX) && pstrEntry == NULL)
+		return list(uOptions, argv[i]);
+
+	if (strcmp(argv[i], "-") == 0)
+		pstrBuffer = nbl_load_stream(stdin);
+	else if (stat(argv[i], &st) == 0) {
+		pStat = &st;
+		pstrBuffer = nbl_load(argv[i]);
+	} else
+		pstrBuffer = NULL;
 	if (pstrBuffer == NULL) {
 		fprintf(stderr, "Error opening file %s\n", argv[i]);
 		return -1;
@@ -263,17 +1497,29 @@ int main(int argc, char** argv)
 		pCtx = NULL;
 	else {
 		pCtx = &ctx;
-		key[0] = *(unsigned char*)(pstrBuffer + NBL_HEADER_KEY_SEED + 3);
-		key[1] = *(unsigned char*)(pstrBuffer + NBL_HEADER_KEY_SEED + 2);
-		key[2] = *(unsigned char*)(pstrBuffer + NBL_HEADER_KEY_SEED + 1);
-		key[3] = *(unsigned char*)(pstrBuffer + NBL_HEADER_KEY_SEED);
-		bf_setkey(pCtx, key, 4);
+		nbl_setkey(pCtx, NBL_READ_UINT(pstrBuffer, NBL_HEADER_KEY_SEED));
 	}
 
-	if (uOptions & OPTION_LIST)
-		list(uOptions, pstrBuffer, pCtx);
+	if (pstrManifest && !(uOptions & OPTION_INDEX)) {
+		pManifest = manifest_open(pstrManifest, uOptions & OPTION_HASH64 ? MANIFEST_HASH64 : 0);
+		if (pManifest == NULL) {
+			fprintf(stderr, "Error creating manifest %s\n", pstrManifest);
+			free(pstrBuffer);
+			return -1;
+		}
+	}
+
+	if (uOptions & OPTION_INDEX)
+		ret = build_index(uOptions, pstrBuffer, pCtx, pstrIndex, iInterval * 1024);
+	else if (pstrEntry)
+		ret = extract_entry(uOptions, pstrBuffer, pCtx, pstrDestPath, pstrEntry, pstrIndex, pManifest);
 	else
-		ret = extract(uOptions, pstrBuffer, pCtx, pstrDestPath);
+		ret = extract(uOptions, pstrBuffer, pCtx, pstrDestPath, pManifest, pstrCachePath, pStat, iCacheSize);
+
+	if (pManifest && manifest_close(pManifest) != 0 && ret == 0) {
+		fprintf(stderr, "Error writing manifest %s\n", pstrManifest);
+		ret = -1;
+	}
 
 	if (pstrBuffer)
 		free(pstrBuffer);
@@ -0,0 +1,320 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "manifest.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MANIFEST_HAVE_SSE42
+#include <nmmintrin.h>
+#endif
+
+/**
+ * CRC32C (Castagnoli) lookup table for the software implementation, built on first use.
+ */
+
+static unsigned int aCrc32cTable[256];
+static int iCrc32cTableReady = 0;
+
+static void manifest_crc32c_init_table(void)
+{
+	unsigned int i, j, uCrc;
+
+	for (i = 0; i < 256; i++) {
+		uCrc = i;
+		for (j = 0; j < 8; j++)
+			uCrc = (uCrc >> 1) ^ (0x82F63B78 & (0 - (uCrc & 1)));
+		aCrc32cTable[i] = uCrc;
+	}
+
+	iCrc32cTableReady = 1;
+}
+
+static unsigned int manifest_crc32c_sw(unsigned int uCrc, const unsigned char* pBuffer, size_t iSize)
+{
+	if (!iCrc32cTableReady)
+		manifest_crc32c_init_table();
+
+	while (iSize-- > 0)
+		uCrc = aCrc32cTable[(uCrc ^ *pBuffer++) & 0xFF] ^ (uCrc >> 8);
+
+	return uCrc;
+}
+
+#ifdef MANIFEST_HAVE_SSE42
+
+/**
+ * CRC32C using the SSE4.2 crc32 instruction, 8 bytes at a time where possible.
+ */
+
+__attribute__((target("sse4.2")))
+static unsigned int manifest_crc32c_hw(unsigned int uCrc, const unsigned char* pBuffer, size_t iSize)
+{
+#ifdef __x86_64__
+	unsigned long long ullCrc = uCrc, ullData;
+
+	while (iSize >= 8) {
+		memcpy(&ullData, pBuffer, 8);
+		ullCrc = _mm_crc32_u64(ullCrc, ullData);
+		pBuffer += 8;
+		iSize -= 8;
+	}
+	uCrc = (unsigned int)ullCrc;
+#else
+	unsigned int uData;
+
+	while (iSize >= 4) {
+		memcpy(&uData, pBuffer, 4);
+		uCrc = _mm_crc32_u32(uCrc, uData);
+		pBuffer += 4;
+		iSize -= 4;
+	}
+#endif
+
+	while (iSize-- > 0)
+		uCrc = _mm_crc32_u8(uCrc, *pBuffer++);
+
+	return uCrc;
+}
+
+#endif
+
+/**
+ * Update a CRC32C with the given buffer. Start with a CRC of 0.
+ * The crc32 instruction is used when the CPU supports it.
+ */
+
+unsigned int manifest_crc32c(unsigned int uCrc, const char* pstrBuffer, size_t iSize)
+{
+#ifdef MANIFEST_HAVE_SSE42
+	static int iHasSSE42 = -1;
+
+	if (iHasSSE42 == -1)
+		iHasSSE42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+
+	if (iHasSSE42)
+		return ~manifest_crc32c_hw(~uCrc, (const unsigned char*)pstrBuffer, iSize);
+#endif
+
+	return ~manifest_crc32c_sw(~uCrc, (const unsigned char*)pstrBuffer, iSize);
+}
+
+/**
+ * Update a 64-bit FNV-1a hash with the given buffer. Start with MANIFEST_HASH64_INIT.
+ */
+
+unsigned long long manifest_hash64(unsigned long long ullHash, const char* pstrBuffer, size_t iSize)
+{
+	size_t i;
+
+	for (i = 0; i < iSize; i++) {
+		ullHash ^= (unsigned char)pstrBuffer[i];
+		ullHash *= 0x100000001B3ULL;
+	}
+
+	return ullHash;
+}
+
+/**
+ * Create a new manifest file.
+ */
+
+struct manifest_ctx* manifest_open(char* pstrFilename, int iFlags)
+{
+	struct manifest_ctx* pManifest;
+
+	pManifest = malloc(sizeof(struct manifest_ctx));
+	if (pManifest == NULL)
+		return NULL;
+
+	pManifest->pFile = fopen(pstrFilename, "w");
+	if (pManifest->pFile == NULL) {
+		free(pManifest);
+		return NULL;
+	}
+
+	pManifest->iFlags = iFlags;
+	return pManifest;
+}
+
+void manifest_sum_init(struct manifest_sum* pSum)
+{
+	pSum->uCrc = 0;
+	pSum->ullHash = MANIFEST_HASH64_INIT;
+	pSum->ullSize = 0;
+}
+
+/**
+ * Add the next part of a file to its sums.
+ * Meant to be called right after the part is written, while it is still in cache.
+ */
+
+void manifest_sum_update(struct manifest_ctx* pManifest, struct manifest_sum* pSum, const char* pstrBuffer, size_t iSize)
+{
+	pSum->uCrc = manifest_crc32c(pSum->uCrc, pstrBuffer, iSize);
+	if (pManifest->iFlags & MANIFEST_HASH64)
+		pSum->ullHash = manifest_hash64(pSum->ullHash, pstrBuffer, iSize);
+	pSum->ullSize += iSize;
+}
+
+/**
+ * Write the line of a file to the manifest.
+ */
+
+int manifest_add(struct manifest_ctx* pManifest, const char* pstrName, unsigned long long ullOffset, struct manifest_sum* pSum)
+{
+	int ret;
+
+	if (pManifest->iFlags & MANIFEST_HASH64)
+		ret = fprintf(pManifest->pFile, "%s\t%llu\t%llx\t%08x\t%016llx\n", pstrName, pSum->ullSize, ullOffset, pSum->uCrc, pSum->ullHash);
+	else
+		ret = fprintf(pManifest->pFile, "%s\t%llu\t%llx\t%08x\n", pstrName, pSum->ullSize, ullOffset, pSum->uCrc);
+
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Hash a whole file found in memory and write its line to the manifest.
+ */
+
+int manifest_add_buffer(struct manifest_ctx* pManifest, const char* pstrName, unsigned long long ullOffset, const char* pstrBuffer, size_t iSize)
+{
+	struct manifest_sum sum;
+
+	manifest_sum_init(&sum);
+	manifest_sum_update(pManifest, &sum, pstrBuffer, iSize);
+
+	return manifest_add(pManifest, pstrName, ullOffset, &sum);
+}
+
+int manifest_close(struct manifest_ctx* pManifest)
+{
+	int ret;
+
+	ret = fclose(pManifest->pFile);
+	free(pManifest);
+
+	return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Hash a file from the disk.
+ */
+
+static int manifest_sum_file(struct manifest_ctx* pManifest, char* pstrFilename, char* pstrWindow, struct manifest_sum* pSum)
+{
+	FILE* pFile;
+	size_t iRead;
+	int ret = 0;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return -1;
+
+	manifest_sum_init(pSum);
+	while ((iRead = fread(pstrWindow, 1, MANIFEST_WINDOW_SIZE, pFile)) > 0)
+		manifest_sum_update(pManifest, pSum, pstrWindow, iRead);
+
+	if (ferror(pFile))
+		ret = -1;
+
+	fclose(pFile);
+	return ret;
+}
+
+/**
+ * Check the files found in the given path against the manifest.
+ * Each failure is printed. Returns the number of failed files or a negative value on error.
+ */
+
+int manifest_verify(char* pstrFilename, char* pstrPath)
+{
+	struct manifest_ctx ctx;
+	struct manifest_sum sum;
+	FILE* pFile;
+	char* pstrWindow;
+	char* apstrFields[5];
+	char pstrLine[FILENAME_MAX + 128];
+	char pstrFile[FILENAME_MAX];
+	char* pstrTmp;
+	int iFields, iLen = 0, iChecked = 0, ret = 0;
+
+	pFile = fopen(pstrFilename, "r");
+	if (pFile == NULL)
+		return -1;
+
+	pstrWindow = malloc(MANIFEST_WINDOW_SIZE);
+	if (pstrWindow == NULL) {
+		fclose(pFile);
+		return -3;
+	}
+
+	if (pstrPath != NULL) {
+		iLen = snprintf(pstrFile, FILENAME_MAX, "%s", pstrPath);
+		if (iLen > 0 && pstrFile[iLen - 1] != '/' && pstrFile[iLen - 1] != '\\')
+			pstrFile[iLen++] = '/';
+	}
+
+	while (fgets(pstrLine, sizeof(pstrLine), pFile) != NULL) {
+		pstrLine[strcspn(pstrLine, "\r\n")] = 0;
+		if (pstrLine[0] == 0)
+			continue;
+
+		iFields = 0;
+		pstrTmp = pstrLine;
+		while (iFields < 5) {
+			apstrFields[iFields++] = pstrTmp;
+			pstrTmp = strchr(pstrTmp, '\t');
+			if (pstrTmp == NULL)
+				break;
+			*pstrTmp++ = 0;
+		}
+
+		if (iFields < 4) {
+			printf("%s: invalid manifest line\n", pstrLine);
+			ret++;
+			continue;
+		}
+
+		snprintf(pstrFile + iLen, FILENAME_MAX - iLen, "%s", apstrFields[0]);
+		ctx.iFlags = iFields == 5 ? MANIFEST_HASH64 : 0;
+		iChecked++;
+
+		if (manifest_sum_file(&ctx, pstrFile, pstrWindow, &sum) != 0) {
+			printf("%s: FAILED (missing)\n", apstrFields[0]);
+			ret++;
+		} else if (sum.ullSize != strtoull(apstrFields[1], NULL, 10)) {
+			printf("%s: FAILED (size)\n", apstrFields[0]);
+			ret++;
+		} else if (sum.uCrc != strtoul(apstrFields[3], NULL, 16)
+			|| (iFields == 5 && sum.ullHash != strtoull(apstrFields[4], NULL, 16))) {
+			printf("%s: FAILED (checksum)\n", apstrFields[0]);
+			ret++;
+		}
+	}
+
+	printf("%d files checked, %d failed\n", iChecked, ret);
+
+	free(pstrWindow);
+	fclose(pFile);
+	return ret;
+}
@@ -0,0 +1,67 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GASETOOLS_MANIFEST_H__
+#define __GASETOOLS_MANIFEST_H__
+
+#include <stdio.h>
+
+/*
+ * Manifest of extracted files, written while extracting.
+ * Each line is: name, size, offset in the archive (hex), CRC32C (hex)
+ * and optionally a 64-bit FNV-1a hash (hex), separated by tabs.
+ */
+
+#define MANIFEST_HASH64	0x1 /* Also compute the 64-bit hash. */
+
+#define MANIFEST_WINDOW_SIZE 0x100000 /* Read size when verifying. */
+
+struct manifest_ctx {
+	FILE* pFile;
+	int iFlags;
+};
+
+struct manifest_sum {
+	unsigned int uCrc;
+	unsigned long long ullHash;
+	unsigned long long ullSize;
+};
+
+/* Hash functions */
+
+unsigned int manifest_crc32c(unsigned int uCrc, const char* pstrBuffer, size_t iSize);
+unsigned long long manifest_hash64(unsigned long long ullHash, const char* pstrBuffer, size_t iSize);
+
+#define MANIFEST_HASH64_INIT 0xCBF29CE484222325ULL
+
+/* Writing */
+
+struct manifest_ctx* manifest_open(char* pstrFilename, int iFlags);
+void manifest_sum_init(struct manifest_sum* pSum);
+void manifest_sum_update(struct manifest_ctx* pManifest, struct manifest_sum* pSum, const char* pstrBuffer, size_t iSize);
+int manifest_add(struct manifest_ctx* pManifest, const char* pstrName, unsigned long long ullOffset, struct manifest_sum* pSum);
+int manifest_add_buffer(struct manifest_ctx* pManifest, const char* pstrName, unsigned long long ullOffset, const char* pstrBuffer, size_t iSize);
+int manifest_close(struct manifest_ctx* pManifest);
+
+/* Verification */
+
+int manifest_verify(char* pstrFilename, char* pstrPath);
+
+#endif /* __GASETOOLS_MANIFEST_H__ */
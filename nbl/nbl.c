@@ -18,10 +18,22 @@
 	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "nbl.h"
+#include "probes.h"
+
+#ifndef _WIN32
+#include <utime.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
 
 /**
  * Return whether the identifier is valid for a .nbl file.
@@ -58,13 +70,23 @@ int nbl_get_data_pos(char* pstrBuffer)
 /**
  * Return the position of the TMLL chunk.
  * Currently use brute-force to find it since the header values are still unknown.
+ * The search starts at the end of the NMLL data, so that an identifier inside the
+ * data can't be taken for it; only the first word of the NMLL data is read, to find
+ * where it starts. Call it before the NMLL data is decrypted.
  * Do NOT use this function if you don't know whether there is a TMLL chunk,
  * check first using the nbl_has_tmll function.
  */
 
 int nbl_get_tmll_pos(char* pstrBuffer)
 {
-	int ret = 0;
+	int ret;
+
+	ret = nbl_get_data_pos(pstrBuffer);
+	if (nbl_is_compressed(pstrBuffer))
+		ret += NBL_READ_INT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE);
+	else
+		ret += NBL_READ_INT(pstrBuffer, NBL_HEADER_DATA_SIZE);
+	ret &= ~15;
 
 	while (NBL_READ_INT(pstrBuffer, ret) != NBL_ID_TMLL)
 		ret += 16;
@@ -81,7 +103,8 @@ char* nbl_load(char* pstrFilename)
 {
 	FILE* pFile = NULL;
 	char* pstrBuffer = NULL;
-	int iRead, iSize;
+	size_t iRead;
+	off_t iSize;
 
 	if (pstrFilename == NULL)
 		return NULL;
@@ -90,17 +113,20 @@ char* nbl_load(char* pstrFilename)
 	if (pFile == NULL)
 		return NULL;
 
-	fseek(pFile, 0, SEEK_END);
-	iSize = ftell(pFile);
+	NBL_PROBE1(load__start, pstrFilename);
 
-	if (iSize < 4)
+	fseeko(pFile, 0, SEEK_END);
+	iSize = ftello(pFile);
+
+	/* Positions inside nbl files are 32-bit. */
+	if (iSize < 4 || iSize > INT_MAX)
 		goto nbl_load_ret;
 
 	pstrBuffer = malloc(iSize);
 	if (pstrBuffer == NULL)
 		goto nbl_load_ret;
 
-	fseek(pFile, 0, SEEK_SET);
+	fseeko(pFile, 0, SEEK_SET);
 	iRead = fread(pstrBuffer, sizeof(char), 4, pFile);
 
 	if (iRead != 4) {
@@ -117,17 +143,266 @@ char* nbl_load(char* pstrFilename)
 
 	iRead = fread(pstrBuffer + 4, sizeof(char), iSize - 4, pFile);
 
-	if (iRead != iSize - 4) {
+	if (iRead != (size_t)(iSize - 4)) {
 		free(pstrBuffer);
 		pstrBuffer = NULL;
 		/* goto nbl_load_ret; */
 	}
 
 nbl_load_ret:
+	fclose(pFile);
+	NBL_PROBE2(load__end, pstrFilename, pstrBuffer ? (long long)iSize : -1LL);
+	return pstrBuffer;
+}
+
+/**
+ * Read a .nbl file from a stream that can't seek, such as a pipe, in a single pass.
+ * The buffer is allocated up front from the sizes found in the header; anything
+ * following the NMLL data, like a TMLL section, is read up to the end of the stream.
+ * Returns a new pointer with the stream contents.
+ */
+
+char* nbl_load_stream(FILE* pFile)
+{
+	char pstrHeader[NBL_HEADER_CHUNKS];
+	char* pstrBuffer;
+	char* pstrTmp;
+	unsigned long long ullExpected;
+	size_t iAlloc, iSize, iRead;
+
+	if (fread(pstrHeader, 1, NBL_HEADER_CHUNKS, pFile) != NBL_HEADER_CHUNKS || !nbl_is_nmll(pstrHeader))
+		return NULL;
+
+	ullExpected = NBL_READ_UINT(pstrHeader, NBL_HEADER_SIZE);
+	if (nbl_is_compressed(pstrHeader))
+		ullExpected += NBL_READ_UINT(pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE);
+	else
+		ullExpected += NBL_READ_UINT(pstrHeader, NBL_HEADER_DATA_SIZE);
+
+	/* Positions inside nbl files are 32-bit. */
+	if (ullExpected > INT_MAX)
+		return NULL;
+
+	iAlloc = ullExpected < NBL_LOAD_WINDOW_SIZE ? NBL_LOAD_WINDOW_SIZE : ullExpected;
+	pstrBuffer = malloc(iAlloc);
+	if (pstrBuffer == NULL)
+		return NULL;
+
+	memcpy(pstrBuffer, pstrHeader, NBL_HEADER_CHUNKS);
+	iSize = NBL_HEADER_CHUNKS;
+
+	/* A short read means the end of the stream; the buffer only grows past the expected size. */
+	do {
+		if (iSize == iAlloc) {
+			if (iAlloc >= INT_MAX)
+				goto nbl_load_stream_err;
+			iAlloc = iAlloc > INT_MAX / 2 ? INT_MAX : iAlloc * 2;
+			pstrTmp = realloc(pstrBuffer, iAlloc);
+			if (pstrTmp == NULL)
+				goto nbl_load_stream_err;
+			pstrBuffer = pstrTmp;
+		}
+
+		iRead = fread(pstrBuffer + iSize, 1, iAlloc - iSize, pFile);
+		iSize += iRead;
+	} while (iSize == iAlloc);
+
+	if (ferror(pFile) || iSize < ullExpected)
+		goto nbl_load_stream_err;
+
+	return pstrBuffer;
+
+nbl_load_stream_err:
+	free(pstrBuffer);
+	return NULL;
+}
+
+/**
+ * Read iSize bytes at the given position into a new buffer.
+ */
+
+static char* nbl_read_at(FILE* pFile, off_t iPos, int iSize)
+{
+	char* pstrBuffer;
+
+	pstrBuffer = malloc(iSize);
+	if (pstrBuffer == NULL)
+		return NULL;
+
+	if (fseeko(pFile, iPos, SEEK_SET) != 0 || fread(pstrBuffer, 1, iSize, pFile) != (size_t)iSize) {
+		free(pstrBuffer);
+		return NULL;
+	}
+
+	return pstrBuffer;
+}
+
+/**
+ * Return the size of the headers up to the end of the chunk table,
+ * or -1 if the chunk table doesn't fit in the remaining iAvailable bytes.
+ */
+
+static int nbl_get_headers_size(char* pstrHeader, int iHeaderSize, int iHeaderChunksPos, off_t iAvailable)
+{
+	unsigned int uNbChunks;
+	int iSize;
+
+	uNbChunks = NBL_READ_UINT(pstrHeader, NBL_HEADER_NB_CHUNKS);
+	if (iAvailable < iHeaderChunksPos || uNbChunks > (iAvailable - iHeaderChunksPos) / NBL_CHUNK_SIZE)
+		return -1;
+
+	iSize = iHeaderChunksPos + uNbChunks * NBL_CHUNK_SIZE;
+	if (iHeaderSize > iSize && iHeaderSize <= iAvailable)
+		iSize = iHeaderSize;
+
+	return iSize;
+}
+
+/**
+ * Scan a file from iPos in 16-byte steps, one window at a time, for the first word
+ * that equals uWord (iEqual) or differs from it (!iEqual). Returns 0 if none is found.
+ */
+
+static off_t nbl_scan_file(FILE* pFile, char* pstrWindow, off_t iPos, off_t iFileSize, unsigned int uWord, int iEqual)
+{
+	size_t iRead, i;
+
+	while (iPos < iFileSize && fseeko(pFile, iPos, SEEK_SET) == 0) {
+		iRead = fread(pstrWindow, 1, NBL_LOAD_WINDOW_SIZE, pFile);
+		if (iRead < 4)
+			break;
+
+		for (i = 0; i + 4 <= iRead; i += 16) {
+			if ((NBL_READ_UINT(pstrWindow, i) == uWord) == iEqual)
+				return iPos + i;
+		}
+
+		iPos += iRead;
+	}
+
+	return 0;
+}
+
+/**
+ * Find the TMLL section without loading the NMLL data.
+ * Like nbl_get_tmll_pos, the search starts at the end of the NMLL data; only
+ * the words before its start are read, to find where it starts.
+ * Returns 0 if it isn't found.
+ */
+
+static off_t nbl_find_tmll(FILE* pFile, char* pstrHeader, off_t iFileSize)
+{
+	char* pstrWindow;
+	off_t iPos, ret = 0;
+
+	pstrWindow = malloc(NBL_LOAD_WINDOW_SIZE);
+	if (pstrWindow == NULL)
+		return 0;
+
+	iPos = nbl_scan_file(pFile, pstrWindow, NBL_READ_UINT(pstrHeader, NBL_HEADER_SIZE), iFileSize, 0, 0);
+	if (iPos == 0)
+		goto nbl_find_tmll_ret;
+
+	if (nbl_is_compressed(pstrHeader))
+		iPos += NBL_READ_UINT(pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE);
+	else
+		iPos += NBL_READ_UINT(pstrHeader, NBL_HEADER_DATA_SIZE);
+	iPos &= ~(off_t)15;
+
+	ret = nbl_scan_file(pFile, pstrWindow, iPos, iFileSize, NBL_ID_TMLL, 1);
+
+nbl_find_tmll_ret:
+	free(pstrWindow);
+	return ret;
+}
+
+/**
+ * Open a .nbl file and read only its headers and chunk tables, leaving the data on disk.
+ * When the file has a TMLL section its headers are returned in ppstrTMLL and its
+ * position in piTMLLPos; otherwise they are set to NULL and 0.
+ * Returns a new pointer with the NMLL headers.
+ */
+
+char* nbl_load_headers(char* pstrFilename, char** ppstrTMLL, int* piTMLLPos)
+{
+	FILE* pFile;
+	char* pstrHeader = NULL;
+	char* pstrBuffer = NULL;
+	off_t iSize, iTMLLPos;
+	int iHeadersSize;
+
+	*ppstrTMLL = NULL;
+	*piTMLLPos = 0;
+
+	if (pstrFilename == NULL)
+		return NULL;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return NULL;
+
+	fseeko(pFile, 0, SEEK_END);
+	iSize = ftello(pFile);
+
+	/* Positions inside nbl files are 32-bit. */
+	if (iSize < NBL_HEADER_CHUNKS || iSize > INT_MAX)
+		goto nbl_load_headers_ret;
+
+	pstrHeader = nbl_read_at(pFile, 0, NBL_HEADER_CHUNKS);
+	if (pstrHeader == NULL || !nbl_is_nmll(pstrHeader))
+		goto nbl_load_headers_ret;
+
+	iHeadersSize = nbl_get_headers_size(pstrHeader, NBL_READ_INT(pstrHeader, NBL_HEADER_SIZE), NBL_HEADER_CHUNKS, iSize);
+	if (iHeadersSize < 0)
+		goto nbl_load_headers_ret;
+
+	pstrBuffer = nbl_read_at(pFile, 0, iHeadersSize);
+	if (pstrBuffer == NULL || !nbl_has_tmll(pstrBuffer))
+		goto nbl_load_headers_ret;
+
+	/* TMLL section. */
+
+	free(pstrHeader);
+	pstrHeader = NULL;
+
+	iTMLLPos = nbl_find_tmll(pFile, pstrBuffer, iSize);
+	if (iTMLLPos == 0)
+		goto nbl_load_headers_ret;
+
+	pstrHeader = nbl_read_at(pFile, iTMLLPos, NBL_TMLL_HEADER_CHUNKS);
+	if (pstrHeader == NULL)
+		goto nbl_load_headers_ret;
+
+	iHeadersSize = nbl_get_headers_size(pstrHeader, NBL_READ_INT(pstrBuffer, NBL_HEADER_TMLL_HEADER_SIZE),
+		NBL_TMLL_HEADER_CHUNKS, iSize - iTMLLPos);
+	if (iHeadersSize < 0)
+		goto nbl_load_headers_ret;
+
+	*ppstrTMLL = nbl_read_at(pFile, iTMLLPos, iHeadersSize);
+	if (*ppstrTMLL != NULL)
+		*piTMLLPos = iTMLLPos;
+
+nbl_load_headers_ret:
+	free(pstrHeader);
 	fclose(pFile);
 	return pstrBuffer;
 }
 
+/**
+ * Initialize the cipher from the key seed found in the header.
+ */
+
+void nbl_setkey(struct bf_ctx *pCtx, unsigned int uKeySeed)
+{
+	unsigned char key[4];
+
+	key[0] = uKeySeed >> 24;
+	key[1] = uKeySeed >> 16;
+	key[2] = uKeySeed >> 8;
+	key[3] = uKeySeed;
+	bf_setkey(pCtx, key, 4);
+}
+
 /**
  * Decrypt the given buffer.
  * @todo Guess the buffer should be unsigned char* after all.
@@ -135,13 +410,17 @@ nbl_load_ret:
 
 void nbl_decrypt_buffer(struct bf_ctx *pCtx, char* pstrBuffer, int iSize)
 {
+	char* pstrBlock = pstrBuffer;
 	int i;
 
-	iSize /= 8;
-	for (i = 0; i < iSize; i++) {
-		bf_decrypt(pCtx, (unsigned char*)pstrBuffer, (unsigned char*)pstrBuffer);
-		pstrBuffer += 8;
+	NBL_PROBE2(decrypt__start, pstrBuffer, iSize);
+
+	for (i = 0; i < iSize / 8; i++) {
+		bf_decrypt(pCtx, (unsigned char*)pstrBlock, (unsigned char*)pstrBlock);
+		pstrBlock += 8;
 	}
+
+	NBL_PROBE2(decrypt__end, pstrBuffer, iSize);
 }
 
 /**
@@ -153,9 +432,75 @@ void nbl_decrypt_headers(struct bf_ctx *pCtx, char* pstrBuffer, int iHeaderChunk
 	int i, iNbChunks;
 
 	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+	NBL_PROBE2(decrypt_headers__start, pstrBuffer, iNbChunks);
 
 	for (i = 0; i < iNbChunks; i++)
 		nbl_decrypt_buffer(pCtx, pstrBuffer + iHeaderChunksPos + NBL_CHUNK_CRYPTED_HEADER + i * 96, NBL_CHUNK_CRYPTED_SIZE);
+
+	NBL_PROBE2(decrypt_headers__end, pstrBuffer, iNbChunks);
+}
+
+/**
+ * Encrypt the given buffer.
+ */
+
+void nbl_encrypt_buffer(struct bf_ctx *pCtx, char* pstrBuffer, int iSize)
+{
+	int i;
+
+	iSize /= 8;
+	for (i = 0; i < iSize; i++) {
+		bf_encrypt(pCtx, (unsigned char*)pstrBuffer, (unsigned char*)pstrBuffer);
+		pstrBuffer += 8;
+	}
+}
+
+/**
+ * Encrypt the headers.
+ */
+
+void nbl_encrypt_headers(struct bf_ctx *pCtx, char* pstrBuffer, int iHeaderChunksPos)
+{
+	int i, iNbChunks;
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+
+	for (i = 0; i < iNbChunks; i++)
+		nbl_encrypt_buffer(pCtx, pstrBuffer + iHeaderChunksPos + NBL_CHUNK_CRYPTED_HEADER + i * NBL_CHUNK_SIZE, NBL_CHUNK_CRYPTED_SIZE);
+}
+
+/**
+ * Change the key of the given buffer. Each block is decrypted with pOldCtx
+ * and encrypted again with pNewCtx before moving to the next one.
+ * Either context can be NULL to only encrypt or only decrypt.
+ */
+
+void nbl_rekey_buffer(struct bf_ctx *pOldCtx, struct bf_ctx *pNewCtx, char* pstrBuffer, int iSize)
+{
+	int i;
+
+	iSize /= 8;
+	for (i = 0; i < iSize; i++) {
+		if (pOldCtx)
+			bf_decrypt(pOldCtx, (unsigned char*)pstrBuffer, (unsigned char*)pstrBuffer);
+		if (pNewCtx)
+			bf_encrypt(pNewCtx, (unsigned char*)pstrBuffer, (unsigned char*)pstrBuffer);
+		pstrBuffer += 8;
+	}
+}
+
+/**
+ * Change the key of the headers.
+ */
+
+void nbl_rekey_headers(struct bf_ctx *pOldCtx, struct bf_ctx *pNewCtx, char* pstrBuffer, int iHeaderChunksPos)
+{
+	int i, iNbChunks;
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+
+	for (i = 0; i < iNbChunks; i++)
+		nbl_rekey_buffer(pOldCtx, pNewCtx, pstrBuffer + iHeaderChunksPos + NBL_CHUNK_CRYPTED_HEADER + i * NBL_CHUNK_SIZE, NBL_CHUNK_CRYPTED_SIZE);
 }
 
 /**
@@ -169,11 +514,15 @@ int nbl_is_compressed(char* pstrBuffer)
 
 /**
  * Decompress the source buffer into the destination buffer.
- * Both buffers must be allocated with a correct size or a segfault will occur.
+ * Returns the size of the decompressed data or a negative NBL_ERROR_* value.
  *
  * The decompression algorithm uses a control byte followed by data which is
  * processed and saved in the destination buffer. A fixed-size circular buffer
  * is used to access the source data.
+ *
+ * Most of the stream is decoded without any bounds checking: as long as both
+ * buffers have room for the largest possible token, no token can cross their
+ * end. Only the last tokens near either end go through the checked decoder.
  */
 
 typedef struct {
@@ -182,8 +531,19 @@ typedef struct {
 
 	unsigned char* pstrSrc;
 	int iSrcPos;
+	int iSrcSize;
+	int iDestMin; /* Back-references may not point before this position. */
+	int iEnded;
 } nbl_decompress_struct;
 
+/* Largest token: 4 control bits, which fetch at most one control byte, and 3 data bytes. */
+#define NBL_MAX_TOKEN_SRC 4
+
+/* In the checked decoder, fail unless iBytes more source bytes can be read. */
+#define NBL_DECOMPRESS_CHECK_SRC(p, iBytes) \
+	if (iChecked && (unsigned int)(p)->iSrcSize - (unsigned int)(p)->iSrcPos < (unsigned int)(iBytes)) \
+		return NBL_ERROR_TRUNCATED
+
 static unsigned char nbl_decompress_get_next_control_bit(nbl_decompress_struct* p)
 {
 	unsigned char ret;
@@ -200,114 +560,1943 @@ static unsigned char nbl_decompress_get_next_control_bit(nbl_decompress_struct*
 	return ret;
 }
 
-int nbl_decompress(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize)
+/**
+ * Return the power-of-two bucket of a profile histogram for the given value.
+ */
+
+static int nbl_profile_bucket(unsigned int uValue)
 {
-	nbl_decompress_struct p;
-	int iDestPos, iTmpCount, iTmpPos;
-	char a, b;
+	int i = 0;
 
-	if (pstrSrc == NULL || iSrcSize <= 0 || pstrDest == NULL || iDestSize <= 0)
-		return -1;
+	while (uValue >>= 1)
+		i++;
 
-	pstrDest = memset(pstrDest, 0, iDestSize);
-	iDestPos = 0;
+	return i < NBL_PROFILE_BUCKETS ? i : NBL_PROFILE_BUCKETS - 1;
+}
 
-	p.uControlByteCounter = 1;
-	p.ucControlByte = 0;
-	p.pstrSrc = (unsigned char*)pstrSrc;
-	p.iSrcPos = 0;
+static void nbl_profile_end_run(nbl_profile* pProfile)
+{
+	if (pProfile->uLiteralRun > 0)
+		pProfile->aLiteralRuns[nbl_profile_bucket(pProfile->uLiteralRun)]++;
+	pProfile->uLiteralRun = 0;
+}
 
-	while (1) {
-		/* Step 1: Write uncompressed data directly */
+/**
+ * Decode a single token. iChecked is a constant in all callers so that
+ * the compiler generates a checked and an unchecked version of this function.
+ * pProfile is a constant NULL outside of nbl_decompress_profile, where each
+ * token is also recorded. The checked version also accepts a NULL pstrDest,
+ * in which case the tokens are only walked and nothing is written.
+ * Returns the new destination position or a negative NBL_ERROR_* value.
+ */
 
-		while (nbl_decompress_get_next_control_bit(&p)) {
-			pstrDest[iDestPos++] = p.pstrSrc[p.iSrcPos++];
-		}
+static inline int nbl_decompress_token(nbl_decompress_struct* p, char* pstrDest, int iDestPos, int iDestSize, const int iChecked, nbl_profile* const pProfile)
+{
+	int iTmpCount, iTmpPos;
+	char a, b;
 
-		/* Step 2: Calculate the two values used in step 3 */
+	/* Step 1: Write uncompressed data directly */
 
-		if (nbl_decompress_get_next_control_bit(&p)) {
-			iTmpCount = p.pstrSrc[p.iSrcPos++];
-			iTmpPos   = p.pstrSrc[p.iSrcPos++];
+	NBL_DECOMPRESS_CHECK_SRC(p, p->uControlByteCounter == 1);
+	if (nbl_decompress_get_next_control_bit(p)) {
+		NBL_DECOMPRESS_CHECK_SRC(p, 1);
+		if (iChecked && iDestPos >= iDestSize)
+			return NBL_ERROR_OVERFLOW;
+
+		if (iChecked && pstrDest == NULL) {
+			p->iSrcPos++;
+			return iDestPos + 1;
+		}
 
-			if (iTmpCount == 0 && iTmpPos == 0)
-				goto nbl_decompress_ret;
+		pstrDest[iDestPos++] = p->pstrSrc[p->iSrcPos++];
+		if (pProfile) {
+			pProfile->ullLiterals++;
+			pProfile->uLiteralRun++;
+		}
+		return iDestPos;
+	}
 
-			iTmpPos = (iTmpPos << 5) + (iTmpCount >> 3) - 0x2000;
-			iTmpCount &= 7;
+	/* Step 2: Calculate the two values used in step 3 */
 
-			if (iTmpCount == 0)
-				iTmpCount = p.pstrSrc[p.iSrcPos++] + 1;
-			else
-				iTmpCount += 2;
-		} else {
-			a = nbl_decompress_get_next_control_bit(&p);
-			b = nbl_decompress_get_next_control_bit(&p);
+	NBL_DECOMPRESS_CHECK_SRC(p, p->uControlByteCounter == 1);
+	if (nbl_decompress_get_next_control_bit(p)) {
+		NBL_DECOMPRESS_CHECK_SRC(p, 2);
+		iTmpCount = p->pstrSrc[p->iSrcPos++];
+		iTmpPos   = p->pstrSrc[p->iSrcPos++];
 
-			iTmpCount = b + a * 2 + 2;
-			iTmpPos = p.pstrSrc[p.iSrcPos++] - 0x100;
+		if (iTmpCount == 0 && iTmpPos == 0) {
+			p->iEnded = 1;
+			if (pProfile)
+				pProfile->ullEndMarkers++;
+			return iDestPos;
 		}
 
-		iTmpPos += iDestPos;
+		iTmpPos = (iTmpPos << 5) + (iTmpCount >> 3) - 0x2000;
+		iTmpCount &= 7;
 
-		/* Step 3: Use those values to retrieve what we want from the output buffer */
+		if (iTmpCount == 0) {
+			NBL_DECOMPRESS_CHECK_SRC(p, 1);
+			iTmpCount = p->pstrSrc[p->iSrcPos++] + 1;
+			if (pProfile)
+				pProfile->ullExtendedMatches++;
+		} else
+			iTmpCount += 2;
 
-		while (iTmpCount-- > 0) {
-			pstrDest[iDestPos++] = pstrDest[iTmpPos++];
+		if (pProfile) {
+			pProfile->ullLongMatches++;
+			pProfile->aLongDistances[nbl_profile_bucket(-iTmpPos)]++;
+		}
+	} else {
+		NBL_DECOMPRESS_CHECK_SRC(p, p->uControlByteCounter == 1);
+		a = nbl_decompress_get_next_control_bit(p);
+		NBL_DECOMPRESS_CHECK_SRC(p, p->uControlByteCounter == 1);
+		b = nbl_decompress_get_next_control_bit(p);
+
+		NBL_DECOMPRESS_CHECK_SRC(p, 1);
+		iTmpCount = b + a * 2 + 2;
+		iTmpPos = p->pstrSrc[p->iSrcPos++] - 0x100;
+
+		if (pProfile) {
+			pProfile->ullShortMatches++;
+			pProfile->aShortDistances[nbl_profile_bucket(-iTmpPos)]++;
 		}
 	}
 
-nbl_decompress_ret:
+	if (pProfile) {
+		pProfile->aMatchLengths[iTmpCount]++;
+		nbl_profile_end_run(pProfile);
+	}
+
+	iTmpPos += iDestPos;
+
+	/* The source of a back-reference is never covered by the margins. */
+	if (iTmpPos < p->iDestMin)
+		return NBL_ERROR_BACKREF;
+	if (iChecked && (unsigned int)iDestSize - (unsigned int)iDestPos < (unsigned int)iTmpCount)
+		return NBL_ERROR_OVERFLOW;
+
+	if (iChecked && pstrDest == NULL)
+		return iDestPos + iTmpCount;
+
+	/* Step 3: Use those values to retrieve what we want from the output buffer */
+
+	while (iTmpCount-- > 0) {
+		pstrDest[iDestPos++] = pstrDest[iTmpPos++];
+	}
+
 	return iDestPos;
 }
 
 /**
- * List the files from the decrypted headers.
+ * Decode tokens until the destination position reaches iDestStop or the end marker is found.
+ * The position is only checked between tokens so it may go past iDestStop by one token;
+ * it never goes past iDestSize.
+ * Returns the new destination position or a negative NBL_ERROR_* value.
  */
 
-void nbl_list_files(char* pstrBuffer, int iHeaderChunksPos)
+static int nbl_decompress_tokens(nbl_decompress_struct* p, char* pstrDest, int iDestPos, int iDestStop, int iDestSize)
 {
-	int i, iNbChunks;
+	unsigned int uSafe, uDestSafe;
+
+	while (iDestPos < iDestStop && !p->iEnded) {
+		/* Number of tokens that can't reach the end of either buffer. */
+		uSafe = ((unsigned int)p->iSrcSize - (unsigned int)p->iSrcPos) / NBL_MAX_TOKEN_SRC;
+		uDestSafe = ((unsigned int)iDestSize - (unsigned int)iDestPos) / NBL_MAX_COUNT;
+		if (uDestSafe < uSafe)
+			uSafe = uDestSafe;
+
+		if (uSafe == 0) {
+			iDestPos = nbl_decompress_token(p, pstrDest, iDestPos, iDestSize, 1, NULL);
+			if (iDestPos < 0)
+				return iDestPos;
+			continue;
+		}
 
-	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+		while (uSafe-- > 0 && iDestPos < iDestStop && !p->iEnded) {
+			iDestPos = nbl_decompress_token(p, pstrDest, iDestPos, iDestSize, 0, NULL);
+			if (iDestPos < 0)
+				return iDestPos;
+		}
+	}
 
-	for (i = 0; i < iNbChunks; i++)
-		printf("%s\n", pstrBuffer + iHeaderChunksPos + NBL_CHUNK_FILENAME + i * NBL_CHUNK_SIZE);
+	return iDestPos;
+}
+
+static void nbl_decompress_init(nbl_decompress_struct* p, char* pstrSrc, int iSrcSize)
+{
+	p->uControlByteCounter = 1;
+	p->ucControlByte = 0;
+	p->pstrSrc = (unsigned char*)pstrSrc;
+	p->iSrcPos = 0;
+	p->iSrcSize = iSrcSize;
+	p->iDestMin = 0;
+	p->iEnded = 0;
+}
+
+int nbl_decompress(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize)
+{
+	nbl_decompress_struct p;
+	int iDestPos;
+
+	if (pstrSrc == NULL || iSrcSize <= 0 || pstrDest == NULL || iDestSize <= 0)
+		return NBL_ERROR_ARGS;
+
+	NBL_PROBE3(decompress__start, pstrSrc, iSrcSize, iDestSize);
+
+	nbl_decompress_init(&p, pstrSrc, iSrcSize);
+
+	iDestPos = nbl_decompress_tokens(&p, pstrDest, 0, INT_MAX, iDestSize);
+
+	/* Data not covered by the stream reads as zero. */
+	if (iDestPos >= 0)
+		memset(pstrDest + iDestPos, 0, iDestSize - iDestPos);
+
+	NBL_PROBE2(decompress__end, pstrSrc, iDestPos);
+	return iDestPos;
 }
 
 /**
- * Extract all the files from the data.
+ * Return the size of a buffer in which the stream can be decompressed in place:
+ * with the source data at the end of the buffer, nbl_decompress may then be called
+ * to decompress it to the start of the same buffer. The decoder writes each token
+ * after reading it, so this only requires that the output never gets ahead of
+ * the source data left to read; the tokens are walked once to find by how much
+ * the output gets closest to it. The result is never below iDestSize.
+ * Returns the size of the buffer or a negative NBL_ERROR_* value, in which case
+ * nbl_decompress would fail the same way.
  */
 
-void nbl_extract_all(char* pstrBuffer, char* pstrData, char* pstrDestPath)
+int nbl_decompress_inplace_size(char* pstrSrc, int iSrcSize, int iDestSize)
 {
-	int i, iNbChunks, iLen;
-	FILE* pFile;
-	char* pstrFilename;
+	nbl_decompress_struct p;
+	int iDestPos = 0, iLead = 0;
 
-	if (pstrDestPath == NULL) {
-		iLen = 0;
-		pstrFilename = malloc(iLen + NBL_CHUNK_FILENAME_SIZE + 1);
-	} else {
-		iLen = strlen(pstrDestPath);
-		pstrFilename = malloc(iLen + NBL_CHUNK_FILENAME_SIZE + 1);
-		/* TODO: check return value */
-		strcpy(pstrFilename, pstrDestPath);
-		if (pstrDestPath[iLen - 1] != '/' && pstrDestPath[iLen - 1] != '\\')
-			pstrFilename[iLen++] = '/';
-	}
+	if (pstrSrc == NULL || iSrcSize <= 0 || iDestSize <= 0)
+		return NBL_ERROR_ARGS;
 
-	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+	nbl_decompress_init(&p, pstrSrc, iSrcSize);
 
-	for (i = 0; i < iNbChunks; i++) {
-		strncpy(pstrFilename + iLen, pstrBuffer + 0x40 + i * NBL_CHUNK_SIZE, NBL_CHUNK_FILENAME_SIZE);
+	while (!p.iEnded) {
+		iDestPos = nbl_decompress_token(&p, NULL, iDestPos, iDestSize, 1, NULL);
+		if (iDestPos < 0)
+			return iDestPos;
 
-		pFile = fopen(pstrFilename, "wb");
-		if (pFile) {
-			fwrite(pstrData + NBL_READ_UINT(pstrBuffer, 0x60 + i * NBL_CHUNK_SIZE), 1, NBL_READ_UINT(pstrBuffer, 0x64 + i * NBL_CHUNK_SIZE), pFile);
-			fclose(pFile);
-		}
+		if (iDestPos - p.iSrcPos > iLead)
+			iLead = iDestPos - p.iSrcPos;
 	}
 
-	free(pstrFilename);
+	if (iLead > INT_MAX - iSrcSize)
+		return NBL_ERROR_OVERFLOW;
+
+	return iSrcSize + iLead > iDestSize ? iSrcSize + iLead : iDestSize;
 }
+
+/**
+ * Decompress like nbl_decompress while adding every token to the profile.
+ * The stream is fully checked, so this is meant for analysis and not for extraction.
+ * Returns the size of the decompressed data or a negative NBL_ERROR_* value;
+ * the profile is only updated on success.
+ */
+
+int nbl_decompress_profile(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize, nbl_profile* pProfile)
+{
+	nbl_decompress_struct p;
+	nbl_profile profile;
+	int iDestPos = 0;
+
+	if (pstrSrc == NULL || iSrcSize <= 0 || pstrDest == NULL || iDestSize <= 0 || pProfile == NULL)
+		return NBL_ERROR_ARGS;
+
+	memset(&profile, 0, sizeof(profile));
+	nbl_decompress_init(&p, pstrSrc, iSrcSize);
+
+	while (!p.iEnded) {
+		iDestPos = nbl_decompress_token(&p, pstrDest, iDestPos, iDestSize, 1, &profile);
+		if (iDestPos < 0)
+			return iDestPos;
+	}
+
+	nbl_profile_end_run(&profile);
+	profile.ullStreams = 1;
+	profile.ullSrcSize = p.iSrcPos;
+	profile.ullDestSize = iDestPos;
+	nbl_profile_merge(pProfile, &profile);
+
+	return iDestPos;
+}
+
+/**
+ * Add a profile to another one.
+ */
+
+void nbl_profile_merge(nbl_profile* pTotal, nbl_profile* pProfile)
+{
+	int i;
+
+	pTotal->ullStreams += pProfile->ullStreams;
+	pTotal->ullSrcSize += pProfile->ullSrcSize;
+	pTotal->ullDestSize += pProfile->ullDestSize;
+	pTotal->ullLiterals += pProfile->ullLiterals;
+	pTotal->ullShortMatches += pProfile->ullShortMatches;
+	pTotal->ullLongMatches += pProfile->ullLongMatches;
+	pTotal->ullExtendedMatches += pProfile->ullExtendedMatches;
+	pTotal->ullEndMarkers += pProfile->ullEndMarkers;
+
+	for (i = 0; i < NBL_PROFILE_BUCKETS; i++) {
+		pTotal->aLiteralRuns[i] += pProfile->aLiteralRuns[i];
+		pTotal->aShortDistances[i] += pProfile->aShortDistances[i];
+		pTotal->aLongDistances[i] += pProfile->aLongDistances[i];
+	}
+
+	for (i = 0; i <= NBL_MAX_COUNT; i++)
+		pTotal->aMatchLengths[i] += pProfile->aMatchLengths[i];
+}
+
+/**
+ * Save the decoder state and the window preceding iDestPos into a checkpoint.
+ */
+
+static void nbl_checkpoint_save(nbl_checkpoint* pCheckpoint, nbl_decompress_struct* p, char* pstrDest, int iDestPos)
+{
+	int iWindow;
+
+	pCheckpoint->uSrcPos = p->iSrcPos;
+	pCheckpoint->uDestPos = iDestPos;
+	pCheckpoint->uControlByteCounter = p->uControlByteCounter;
+	pCheckpoint->uControlByte = p->ucControlByte;
+
+	iWindow = iDestPos < NBL_WINDOW_SIZE ? iDestPos : NBL_WINDOW_SIZE;
+	memset(pCheckpoint->aWindow, 0, NBL_WINDOW_SIZE - iWindow);
+	memcpy(pCheckpoint->aWindow + NBL_WINDOW_SIZE - iWindow, pstrDest + iDestPos - iWindow, iWindow);
+}
+
+/**
+ * Decompress the source buffer like nbl_decompress while taking a checkpoint
+ * every iInterval bytes of output. The first checkpoint is always at position 0.
+ * Returns a new array of checkpoints and its size in piCount, or NULL on error.
+ */
+
+nbl_checkpoint* nbl_decompress_index(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize, int iInterval, int* piCount)
+{
+	nbl_decompress_struct p;
+	nbl_checkpoint* pCheckpoints;
+	int iCount, iMax, iDestPos;
+
+	if (pstrSrc == NULL || iSrcSize <= 0 || pstrDest == NULL || iDestSize <= 0 || iInterval <= 0)
+		return NULL;
+
+	iMax = iDestSize / iInterval + 1;
+	pCheckpoints = malloc(iMax * sizeof(nbl_checkpoint));
+	if (pCheckpoints == NULL)
+		return NULL;
+
+	nbl_decompress_init(&p, pstrSrc, iSrcSize);
+
+	iCount = 0;
+	iDestPos = 0;
+
+	while (!p.iEnded) {
+		if (iCount == iMax) {
+			iDestPos = nbl_decompress_tokens(&p, pstrDest, iDestPos, INT_MAX, iDestSize);
+			break;
+		}
+
+		nbl_checkpoint_save(&pCheckpoints[iCount++], &p, pstrDest, iDestPos);
+		iDestPos = nbl_decompress_tokens(&p, pstrDest, iDestPos, iCount * iInterval, iDestSize);
+		if (iDestPos < 0)
+			break;
+	}
+
+	if (iDestPos < 0) {
+		free(pCheckpoints);
+		return NULL;
+	}
+
+	memset(pstrDest + iDestPos, 0, iDestSize - iDestPos);
+
+	*piCount = iCount;
+	return pCheckpoints;
+}
+
+/**
+ * Return the last checkpoint located at or before iPos.
+ */
+
+nbl_checkpoint* nbl_find_checkpoint(nbl_checkpoint* pCheckpoints, int iCount, int iPos)
+{
+	unsigned int uLow, uHigh, uMid;
+
+	if (iCount <= 0)
+		return NULL;
+
+	/* The answer is in [uLow, uHigh). */
+	uLow = 0;
+	uHigh = iCount;
+	while (uHigh - uLow > 1) {
+		uMid = uLow + (uHigh - uLow) / 2;
+		if (pCheckpoints[uMid].uDestPos <= (unsigned int)iPos)
+			uLow = uMid;
+		else
+			uHigh = uMid;
+	}
+
+	return &pCheckpoints[uLow];
+}
+
+/**
+ * Decompress iSize bytes starting at position iPos of the uncompressed data,
+ * resuming from the given checkpoint which must be located at or before iPos.
+ * The source buffer is the whole compressed data, as given to nbl_decompress.
+ * Returns the number of bytes copied to pstrDest or a negative value on error.
+ */
+
+int nbl_decompress_range(char* pstrSrc, int iSrcSize, nbl_checkpoint* pCheckpoint, char* pstrDest, int iPos, int iSize)
+{
+	nbl_decompress_struct p;
+	char* pstrWork;
+	int iDestPos, iStart;
+
+	if (pstrSrc == NULL || iSrcSize <= 0 || pCheckpoint == NULL || pstrDest == NULL || iSize < 0
+		|| iPos < (int)pCheckpoint->uDestPos || (int)pCheckpoint->uSrcPos >= iSrcSize
+		|| pCheckpoint->uControlByteCounter == 0 || pCheckpoint->uControlByteCounter > 8)
+		return NBL_ERROR_ARGS;
+
+	iStart = iPos - pCheckpoint->uDestPos;
+
+	/* The last token may write up to NBL_MAX_COUNT bytes past the requested range. */
+	pstrWork = malloc(NBL_WINDOW_SIZE + iStart + iSize + NBL_MAX_COUNT);
+	if (pstrWork == NULL)
+		return NBL_ERROR_MEMORY;
+
+	memcpy(pstrWork, pCheckpoint->aWindow, NBL_WINDOW_SIZE);
+
+	p.uControlByteCounter = pCheckpoint->uControlByteCounter;
+	p.ucControlByte = pCheckpoint->uControlByte;
+	p.pstrSrc = (unsigned char*)pstrSrc;
+	p.iSrcPos = pCheckpoint->uSrcPos;
+	p.iSrcSize = iSrcSize;
+	p.iEnded = 0;
+
+	/* The window is zero-filled before the start of the data. */
+	if (pCheckpoint->uDestPos < NBL_WINDOW_SIZE)
+		p.iDestMin = NBL_WINDOW_SIZE - pCheckpoint->uDestPos;
+	else
+		p.iDestMin = 0;
+
+	iDestPos = nbl_decompress_tokens(&p, pstrWork, NBL_WINDOW_SIZE, NBL_WINDOW_SIZE + iStart + iSize,
+		NBL_WINDOW_SIZE + iStart + iSize + NBL_MAX_COUNT);
+	if (iDestPos < 0) {
+		free(pstrWork);
+		return iDestPos;
+	}
+
+	/* Data not covered by the stream reads as zero, like nbl_decompress. */
+	if (iDestPos < NBL_WINDOW_SIZE + iStart + iSize)
+		memset(pstrWork + iDestPos, 0, NBL_WINDOW_SIZE + iStart + iSize - iDestPos);
+
+	memcpy(pstrDest, pstrWork + NBL_WINDOW_SIZE + iStart, iSize);
+	free(pstrWork);
+
+	return iSize;
+}
+
+/**
+ * Compute the stamp of an archive for its index.
+ * The headers, chunk table and key seed included, are hashed along with
+ * NBL_INDEX_STAMP_BLOCKS blocks spread over the compressed data, so that
+ * the cost doesn't depend on the size of the data.
+ * Must be called before the headers or the data of the archive are decrypted.
+ */
+
+void nbl_index_stamp_init(char* pstrBuffer, nbl_index_stamp* pStamp)
+{
+	unsigned int uCrc, uPos, uStep, uSize;
+	int i, iDataPos;
+
+	pStamp->uDataSize = NBL_READ_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE);
+	pStamp->uCompressedSize = NBL_READ_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE);
+
+	iDataPos = nbl_get_data_pos(pstrBuffer);
+	uCrc = manifest_crc32c(0, pstrBuffer, iDataPos);
+
+	uStep = pStamp->uCompressedSize / NBL_INDEX_STAMP_BLOCKS;
+	if (uStep < NBL_INDEX_STAMP_BLOCK_SIZE)
+		uStep = NBL_INDEX_STAMP_BLOCK_SIZE;
+
+	for (i = 0, uPos = 0; i < NBL_INDEX_STAMP_BLOCKS && uPos < pStamp->uCompressedSize; i++, uPos += uStep) {
+		uSize = pStamp->uCompressedSize - uPos;
+		if (uSize > NBL_INDEX_STAMP_BLOCK_SIZE)
+			uSize = NBL_INDEX_STAMP_BLOCK_SIZE;
+		uCrc = manifest_crc32c(uCrc, pstrBuffer + iDataPos + uPos, uSize);
+	}
+
+	/* The end of the data, where an appended or truncated stream differs. */
+	if (pStamp->uCompressedSize > NBL_INDEX_STAMP_BLOCK_SIZE)
+		uCrc = manifest_crc32c(uCrc, pstrBuffer + iDataPos + pStamp->uCompressedSize - NBL_INDEX_STAMP_BLOCK_SIZE, NBL_INDEX_STAMP_BLOCK_SIZE);
+
+	pStamp->uCrc = uCrc;
+}
+
+/**
+ * Save the checkpoints into an index file.
+ * The index contains a small header, including the stamp of the archive, followed by the checkpoints.
+ */
+
+int nbl_index_save(char* pstrFilename, nbl_index_stamp* pStamp, nbl_checkpoint* pCheckpoints, int iCount, int iInterval)
+{
+	FILE* pFile;
+	unsigned int aHeader[NBL_INDEX_HEADER_SIZE / 4];
+	int ret = 0;
+
+	pFile = fopen(pstrFilename, "wb");
+	if (pFile == NULL)
+		return -1;
+
+	aHeader[0] = NBL_ID_INDEX;
+	aHeader[1] = iCount;
+	aHeader[2] = iInterval;
+	aHeader[3] = NBL_WINDOW_SIZE;
+	aHeader[4] = pStamp->uDataSize;
+	aHeader[5] = pStamp->uCompressedSize;
+	aHeader[6] = pStamp->uCrc;
+	aHeader[7] = 0;
+
+	if (fwrite(aHeader, 1, NBL_INDEX_HEADER_SIZE, pFile) != NBL_INDEX_HEADER_SIZE
+		|| fwrite(pCheckpoints, sizeof(nbl_checkpoint), iCount, pFile) != (size_t)iCount)
+		ret = -2;
+
+	fclose(pFile);
+	return ret;
+}
+
+/**
+ * Load the checkpoints from an index file.
+ * Returns a new array of checkpoints and its size in piCount, or NULL on error.
+ * piCount is set to NBL_ERROR_ARGS when the index wasn't built from the archive of the given stamp.
+ */
+
+nbl_checkpoint* nbl_index_load(char* pstrFilename, nbl_index_stamp* pStamp, int* piCount)
+{
+	FILE* pFile;
+	nbl_checkpoint* pCheckpoints = NULL;
+	unsigned int aHeader[NBL_INDEX_HEADER_SIZE / 4];
+
+	*piCount = 0;
+
+	pFile = fopen(pstrFilename, "rb");
+	if (pFile == NULL)
+		return NULL;
+
+	if (fread(aHeader, 1, NBL_INDEX_HEADER_SIZE, pFile) != NBL_INDEX_HEADER_SIZE
+		|| aHeader[0] != NBL_ID_INDEX || aHeader[3] != NBL_WINDOW_SIZE || aHeader[1] == 0)
+		goto nbl_index_load_ret;
+
+	if (aHeader[4] != pStamp->uDataSize || aHeader[5] != pStamp->uCompressedSize || aHeader[6] != pStamp->uCrc) {
+		*piCount = NBL_ERROR_ARGS;
+		goto nbl_index_load_ret;
+	}
+
+	pCheckpoints = malloc(aHeader[1] * sizeof(nbl_checkpoint));
+	if (pCheckpoints == NULL)
+		goto nbl_index_load_ret;
+
+	if (fread(pCheckpoints, sizeof(nbl_checkpoint), aHeader[1], pFile) != aHeader[1]) {
+		free(pCheckpoints);
+		pCheckpoints = NULL;
+		goto nbl_index_load_ret;
+	}
+
+	*piCount = aHeader[1];
+
+nbl_index_load_ret:
+	fclose(pFile);
+	return pCheckpoints;
+}
+
+/**
+ * Compress the source buffer into the destination buffer in the format read by nbl_decompress.
+ * The destination buffer must be at least NBL_COMPRESS_BOUND(iSrcSize) bytes.
+ *
+ * This is a greedy encoder using hash chains over the window. Matches of 2 to 5 bytes
+ * within 0x100 bytes use the short form, everything else the long form with an
+ * optional count byte. Returns the compressed size or a negative value on error.
+ */
+
+#define NBL_COMPRESS_HASH_BITS	15
+#define NBL_COMPRESS_MAX_CHAIN	64
+#define NBL_COMPRESS_MAX_DIST	(NBL_WINDOW_SIZE - 1) /* The farthest position with a zero count is the end marker. */
+#define NBL_COMPRESS_SHORT_DIST	0x100
+#define NBL_COMPRESS_SHORT_COUNT	5
+#define NBL_COMPRESS_LONG_COUNT	9
+
+#define NBL_COMPRESS_HASH(p) (((((unsigned int)(p)[0] << 16) | ((unsigned int)(p)[1] << 8) | (p)[2]) * 2654435761u) >> (32 - NBL_COMPRESS_HASH_BITS))
+#define NBL_COMPRESS_PAIR(p) (((unsigned int)(p)[0] << 8) | (p)[1])
+
+typedef struct {
+	unsigned char* pstrDest;
+	int iDestPos;
+	int iControlPos;
+	int iControlBits;
+} nbl_compress_struct;
+
+static void nbl_compress_put_control_bit(nbl_compress_struct* p, int iBit)
+{
+	if (p->iControlBits == 8) {
+		p->iControlPos = p->iDestPos++;
+		p->pstrDest[p->iControlPos] = 0;
+		p->iControlBits = 0;
+	}
+
+	p->pstrDest[p->iControlPos] |= iBit << p->iControlBits;
+	p->iControlBits++;
+}
+
+static void nbl_compress_put_match(nbl_compress_struct* p, int iCount, int iDist)
+{
+	int iTmpPos;
+
+	nbl_compress_put_control_bit(p, 0);
+
+	if (iDist <= NBL_COMPRESS_SHORT_DIST && iCount <= NBL_COMPRESS_SHORT_COUNT) {
+		nbl_compress_put_control_bit(p, 0);
+		nbl_compress_put_control_bit(p, ((iCount - 2) >> 1) & 1);
+		nbl_compress_put_control_bit(p, (iCount - 2) & 1);
+		p->pstrDest[p->iDestPos++] = NBL_COMPRESS_SHORT_DIST - iDist;
+		return;
+	}
+
+	nbl_compress_put_control_bit(p, 1);
+	iTmpPos = NBL_WINDOW_SIZE - iDist;
+
+	if (iCount <= NBL_COMPRESS_LONG_COUNT) {
+		p->pstrDest[p->iDestPos++] = ((iTmpPos & 0x1F) << 3) | (iCount - 2);
+		p->pstrDest[p->iDestPos++] = iTmpPos >> 5;
+	} else {
+		p->pstrDest[p->iDestPos++] = (iTmpPos & 0x1F) << 3;
+		p->pstrDest[p->iDestPos++] = iTmpPos >> 5;
+		p->pstrDest[p->iDestPos++] = iCount - 1;
+	}
+}
+
+static int nbl_compress_find_match(const unsigned char* pstrSrc, int iPos, int iSize,
+	const int* aHead, const int* aPrev, const int* aPair, int* piDist)
+{
+	int iCandidate, iChain, iCount, iMax, iBest = 0;
+
+	iMax = iSize - iPos;
+	if (iMax > NBL_MAX_COUNT)
+		iMax = NBL_MAX_COUNT;
+	if (iMax < 2)
+		return 0;
+
+	if (iMax >= 3) {
+		iCandidate = aHead[NBL_COMPRESS_HASH(pstrSrc + iPos)];
+		for (iChain = NBL_COMPRESS_MAX_CHAIN; iChain > 0 && iCandidate >= 0 && iPos - iCandidate <= NBL_COMPRESS_MAX_DIST; iChain--) {
+			if (pstrSrc[iCandidate + iBest] == pstrSrc[iPos + iBest]) {
+				for (iCount = 0; iCount < iMax && pstrSrc[iCandidate + iCount] == pstrSrc[iPos + iCount]; iCount++)
+					;
+
+				if (iCount > iBest) {
+					iBest = iCount;
+					*piDist = iPos - iCandidate;
+					if (iBest == iMax)
+						break;
+				}
+			}
+
+			iCandidate = aPrev[iCandidate & (NBL_WINDOW_SIZE - 1)];
+		}
+
+		if (iBest >= 3)
+			return iBest;
+	}
+
+	/* Two bytes are only worth a match in the short form. */
+	iCandidate = aPair[NBL_COMPRESS_PAIR(pstrSrc + iPos)];
+	if (iCandidate >= 0 && iPos - iCandidate <= NBL_COMPRESS_SHORT_DIST) {
+		*piDist = iPos - iCandidate;
+		return 2;
+	}
+
+	return 0;
+}
+
+static void nbl_compress_insert(const unsigned char* pstrSrc, int iPos, int iSize, int* aHead, int* aPrev, int* aPair)
+{
+	unsigned int uHash;
+
+	if (iSize - iPos >= 3) {
+		uHash = NBL_COMPRESS_HASH(pstrSrc + iPos);
+		aPrev[iPos & (NBL_WINDOW_SIZE - 1)] = aHead[uHash];
+		aHead[uHash] = iPos;
+	}
+
+	if (iSize - iPos >= 2)
+		aPair[NBL_COMPRESS_PAIR(pstrSrc + iPos)] = iPos;
+}
+
+/**
+ * Compress the source from iPos to iEnd. Matches may reach back to iHistoryPos,
+ * the data before iPos being only added to the hash chains. aHead must have
+ * room for NBL_COMPRESS_TABLES_SIZE values. No end marker is written.
+ */
+
+#define NBL_COMPRESS_TABLES_SIZE ((1 << NBL_COMPRESS_HASH_BITS) + NBL_WINDOW_SIZE + 0x10000)
+
+static void nbl_compress_range(const unsigned char* pstrIn, int iHistoryPos, int iPos, int iEnd, int* aHead, nbl_compress_struct* p)
+{
+	int* aPrev;
+	int* aPair;
+	int iCount, iDist = 0;
+
+	aPrev = aHead + (1 << NBL_COMPRESS_HASH_BITS);
+	aPair = aPrev + NBL_WINDOW_SIZE;
+	memset(aHead, 0xFF, NBL_COMPRESS_TABLES_SIZE * sizeof(int));
+
+	for (iCount = iHistoryPos; iCount < iPos; iCount++)
+		nbl_compress_insert(pstrIn, iCount, iEnd, aHead, aPrev, aPair);
+
+	while (iPos < iEnd) {
+		iCount = nbl_compress_find_match(pstrIn, iPos, iEnd, aHead, aPrev, aPair, &iDist);
+
+		if (iCount == 0) {
+			nbl_compress_put_control_bit(p, 1);
+			p->pstrDest[p->iDestPos++] = pstrIn[iPos];
+			iCount = 1;
+		} else
+			nbl_compress_put_match(p, iCount, iDist);
+
+		while (iCount-- > 0)
+			nbl_compress_insert(pstrIn, iPos++, iEnd, aHead, aPrev, aPair);
+	}
+}
+
+static void nbl_compress_init(nbl_compress_struct* p, char* pstrDest)
+{
+	p->pstrDest = (unsigned char*)pstrDest;
+	p->iDestPos = 0;
+	p->iControlPos = 0;
+	p->iControlBits = 8;
+}
+
+/* End marker: a long match with a zero position and count. */
+static void nbl_compress_end(nbl_compress_struct* p)
+{
+	nbl_compress_put_control_bit(p, 0);
+	nbl_compress_put_control_bit(p, 1);
+	p->pstrDest[p->iDestPos++] = 0;
+	p->pstrDest[p->iDestPos++] = 0;
+}
+
+int nbl_compress(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize)
+{
+	nbl_compress_struct p;
+	int* aHead;
+
+	if (pstrSrc == NULL || iSrcSize < 0 || pstrDest == NULL || (unsigned int)iDestSize < (unsigned int)NBL_COMPRESS_BOUND(iSrcSize))
+		return -1;
+
+	aHead = malloc(NBL_COMPRESS_TABLES_SIZE * sizeof(int));
+	if (aHead == NULL)
+		return -3;
+
+	nbl_compress_init(&p, pstrDest);
+	nbl_compress_range((unsigned char*)pstrSrc, 0, 0, iSrcSize, aHead, &p);
+	nbl_compress_end(&p);
+
+	free(aHead);
+	return p.iDestPos;
+}
+
+/**
+ * Compress the source buffer using up to iNbThreads threads.
+ * The source is split in segments of NBL_COMPRESS_SEGMENT_SIZE bytes which are
+ * compressed at the same time, each in its own buffer and without end marker.
+ * The tokens of each segment are then copied in order to the destination buffer,
+ * moving their control bits so that they follow those of the previous segment,
+ * and a single end marker is written. The decoder can't tell the difference.
+ * The segments don't depend on the number of threads, and so neither does the output.
+ *
+ * If iSeed is set, the hash chains of a segment start with the last NBL_WINDOW_SIZE
+ * bytes of the previous one, so that matches can cross the boundary; otherwise
+ * each segment only refers to itself.
+ * The destination buffer must be at least NBL_COMPRESS_BOUND(iSrcSize) bytes.
+ * Returns the compressed size or a negative value on error.
+ */
+
+#define NBL_COMPRESS_SEGMENT_SIZE 0x80000
+
+typedef struct {
+	int iHistoryPos;
+	int iPos;
+	int iEnd;
+	char* pstrDest; /* NBL_COMPRESS_BOUND(iEnd - iPos) bytes. */
+	int ret; /* Compressed size or negative value on error. */
+} nbl_compress_segment;
+
+/* Each worker compresses the segments iFirst, iFirst + iStep and so on. */
+typedef struct {
+	const unsigned char* pstrIn;
+	nbl_compress_segment* pSegments;
+	int iNbSegments;
+	int iFirst;
+	int iStep;
+	int iThreaded;
+} nbl_compress_worker;
+
+static void* nbl_compress_worker_thread(void* pArg)
+{
+	nbl_compress_worker* w = pArg;
+	nbl_compress_segment* s;
+	nbl_compress_struct p;
+	int* aHead;
+	int i;
+
+	aHead = malloc(NBL_COMPRESS_TABLES_SIZE * sizeof(int));
+
+	for (i = w->iFirst; i < w->iNbSegments; i += w->iStep) {
+		s = &w->pSegments[i];
+		if (aHead == NULL) {
+			s->ret = -3;
+			continue;
+		}
+
+		nbl_compress_init(&p, s->pstrDest);
+		nbl_compress_range(w->pstrIn, s->iHistoryPos, s->iPos, s->iEnd, aHead, &p);
+		s->ret = p.iDestPos;
+	}
+
+	free(aHead);
+	return NULL;
+}
+
+/**
+ * Read the next control bit of a segment and write it to the destination.
+ */
+
+typedef struct {
+	const unsigned char* pstrSrc;
+	int iSrcPos;
+	int iControlByte;
+	int iControlBits; /* Bits left in iControlByte. */
+} nbl_compress_reader;
+
+static int nbl_compress_copy_control_bit(nbl_compress_struct* p, nbl_compress_reader* r)
+{
+	int iBit;
+
+	if (r->iControlBits == 0) {
+		r->iControlByte = r->pstrSrc[r->iSrcPos++];
+		r->iControlBits = 8;
+	}
+
+	iBit = r->iControlByte & 1;
+	r->iControlByte >>= 1;
+	r->iControlBits--;
+
+	nbl_compress_put_control_bit(p, iBit);
+	return iBit;
+}
+
+/**
+ * Copy the tokens of a segment to the destination. Every token has at least
+ * one data byte, so the segment ends right after the data of its last token.
+ */
+
+static void nbl_compress_append(nbl_compress_struct* p, const char* pstrSeg, int iSegSize)
+{
+	nbl_compress_reader r;
+	int iBytes;
+
+	r.pstrSrc = (const unsigned char*)pstrSeg;
+	r.iSrcPos = 0;
+	r.iControlByte = 0;
+	r.iControlBits = 0;
+
+	while (r.iSrcPos < iSegSize) {
+		if (nbl_compress_copy_control_bit(p, &r))
+			iBytes = 1;
+		else if (nbl_compress_copy_control_bit(p, &r))
+			iBytes = (r.pstrSrc[r.iSrcPos] & 7) == 0 ? 3 : 2;
+		else {
+			nbl_compress_copy_control_bit(p, &r);
+			nbl_compress_copy_control_bit(p, &r);
+			iBytes = 1;
+		}
+
+		memcpy(p->pstrDest + p->iDestPos, r.pstrSrc + r.iSrcPos, iBytes);
+		p->iDestPos += iBytes;
+		r.iSrcPos += iBytes;
+	}
+}
+
+int nbl_compress_parallel(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize, int iNbThreads, int iSeed)
+{
+	nbl_compress_segment* pSegments;
+	nbl_compress_worker* pWorkers;
+	nbl_compress_struct p;
+	nbl_thread* pThreads;
+	int i, iNbSegments;
+	int ret = 0;
+
+	if (pstrSrc == NULL || iSrcSize < 0 || pstrDest == NULL || (unsigned int)iDestSize < (unsigned int)NBL_COMPRESS_BOUND(iSrcSize))
+		return -1;
+
+	if (iSrcSize <= NBL_COMPRESS_SEGMENT_SIZE)
+		return nbl_compress(pstrSrc, iSrcSize, pstrDest, iDestSize);
+
+	iNbSegments = iSrcSize / NBL_COMPRESS_SEGMENT_SIZE + (iSrcSize % NBL_COMPRESS_SEGMENT_SIZE != 0);
+
+	if (iNbThreads > iNbSegments)
+		iNbThreads = iNbSegments;
+	if (iNbThreads < 1)
+		iNbThreads = 1;
+
+	pSegments = calloc(iNbSegments, sizeof(nbl_compress_segment));
+	pWorkers = calloc(iNbThreads, sizeof(nbl_compress_worker));
+	pThreads = malloc(iNbThreads * sizeof(nbl_thread));
+	if (pSegments == NULL || pWorkers == NULL || pThreads == NULL) {
+		ret = -3;
+		goto nbl_compress_parallel_ret;
+	}
+
+	for (i = 0; i < iNbSegments; i++) {
+		pSegments[i].iPos = i * NBL_COMPRESS_SEGMENT_SIZE;
+		pSegments[i].iEnd = i == iNbSegments - 1 ? iSrcSize : (i + 1) * NBL_COMPRESS_SEGMENT_SIZE;
+		pSegments[i].iHistoryPos = pSegments[i].iPos;
+		if (iSeed && i > 0)
+			pSegments[i].iHistoryPos -= NBL_WINDOW_SIZE;
+
+		pSegments[i].pstrDest = malloc(NBL_COMPRESS_BOUND(pSegments[i].iEnd - pSegments[i].iPos));
+		if (pSegments[i].pstrDest == NULL) {
+			ret = -3;
+			goto nbl_compress_parallel_ret;
+		}
+	}
+
+	for (i = 0; i < iNbThreads; i++) {
+		pWorkers[i].pstrIn = (unsigned char*)pstrSrc;
+		pWorkers[i].pSegments = pSegments;
+		pWorkers[i].iNbSegments = iNbSegments;
+		pWorkers[i].iFirst = i;
+		pWorkers[i].iStep = iNbThreads;
+	}
+
+	/* The first worker runs in this thread, as do those whose thread can't be started. */
+	for (i = 1; i < iNbThreads; i++)
+		pWorkers[i].iThreaded = nbl_thread_create(&pThreads[i], nbl_compress_worker_thread, &pWorkers[i]) == 0;
+
+	nbl_compress_worker_thread(&pWorkers[0]);
+
+	for (i = 1; i < iNbThreads; i++) {
+		if (pWorkers[i].iThreaded)
+			nbl_thread_join(pThreads[i]);
+		else
+			nbl_compress_worker_thread(&pWorkers[i]);
+	}
+
+	/* Stitch the segments; without their own padding bits they take no more room than a single stream. */
+
+	nbl_compress_init(&p, pstrDest);
+	for (i = 0; i < iNbSegments; i++) {
+		if (pSegments[i].ret < 0) {
+			ret = pSegments[i].ret;
+			goto nbl_compress_parallel_ret;
+		}
+
+		nbl_compress_append(&p, pSegments[i].pstrDest, pSegments[i].ret);
+	}
+	nbl_compress_end(&p);
+	ret = p.iDestPos;
+
+nbl_compress_parallel_ret:
+	if (pSegments)
+		for (i = 0; i < iNbSegments; i++)
+			free(pSegments[i].pstrDest);
+	free(pSegments);
+	free(pWorkers);
+	free(pThreads);
+
+	return ret;
+}
+
+/**
+ * Return whether the data built from the given files would start with a zero word.
+ */
+
+static int nbl_build_starts_with_zero(char** ppstrFiles, int* piFileSizes, int iNbFiles)
+{
+	int i, j;
+
+	for (i = 0; i < iNbFiles; i++) {
+		if (piFileSizes[i] == 0)
+			continue;
+
+		/* Files are padded with zeros up to the next one. */
+		for (j = 0; j < 4 && j < piFileSizes[i]; j++)
+			if (ppstrFiles[i][j] != 0)
+				return 0;
+		return 1;
+	}
+
+	return 1;
+}
+
+/**
+ * Build an NMLL archive from the given files.
+ * Files are stored in order, each aligned on NBL_CHUNK_SMALL_PADDING_SIZE inside the data,
+ * while the header and the data are aligned on NBL_CHUNK_PADDING_SIZE in the archive.
+ * The data is compressed if iCompress is set, using iCompress threads; the headers and data
+ * are encrypted if uKeySeed isn't 0.
+ *
+ * Readers find the data as the first non-zero word after the headers (see nbl_get_data_pos).
+ * Uncompressed and unencrypted data that would start with a zero word is preceded by
+ * a slot of NBL_CHUNK_SMALL_PADDING_SIZE starting with NBL_BUILD_LEAD_MARKER, unused
+ * by the entries. Compressed or encrypted data starting with a zero word can't be found
+ * and is refused.
+ * Returns a new buffer with the archive contents and its size in piSize, or NULL on error.
+ */
+
+#define NBL_ALIGN(size, padding) (((size) + (padding) - 1) & ~((padding) - 1))
+#define NBL_BUILD_LEAD_MARKER 0xFFFFFFFF
+
+char* nbl_build(char** ppstrNames, char** ppstrFiles, int* piFileSizes, int iNbFiles, unsigned int uKeySeed, int iCompress, int* piSize)
+{
+	struct bf_ctx ctx;
+	char* pstrBuffer;
+	char* pstrData;
+	unsigned long long ullDataSize, ullStoredSize;
+	int i, iHeaderSize, iDataPos, iDataSize, iStoredSize, iFilePos, iLead;
+
+	if (iNbFiles <= 0 || iNbFiles > (INT_MAX - NBL_HEADER_CHUNKS - NBL_CHUNK_PADDING_SIZE) / NBL_CHUNK_SIZE)
+		return NULL;
+
+	iLead = 0;
+	if (!iCompress && uKeySeed == 0 && nbl_build_starts_with_zero(ppstrFiles, piFileSizes, iNbFiles))
+		iLead = NBL_CHUNK_SMALL_PADDING_SIZE;
+
+	ullDataSize = iLead;
+	for (i = 0; i < iNbFiles; i++) {
+		if (strlen(ppstrNames[i]) >= NBL_CHUNK_FILENAME_SIZE || piFileSizes[i] < 0)
+			return NULL;
+		ullDataSize += NBL_ALIGN((unsigned long long)piFileSizes[i], NBL_CHUNK_SMALL_PADDING_SIZE);
+	}
+
+	iHeaderSize = NBL_HEADER_CHUNKS + iNbFiles * NBL_CHUNK_SIZE;
+	iDataPos = NBL_ALIGN(iHeaderSize, NBL_CHUNK_PADDING_SIZE);
+
+	/* The whole archive must be addressable with an int, even when the data doesn't compress. */
+	ullStoredSize = iCompress ? NBL_COMPRESS_BOUND(ullDataSize) : ullDataSize;
+	if (NBL_ALIGN(ullStoredSize, NBL_CHUNK_PADDING_SIZE) > (unsigned long long)(INT_MAX - iDataPos))
+		return NULL;
+
+	iDataSize = ullDataSize;
+	iStoredSize = ullStoredSize;
+
+	pstrBuffer = calloc(iDataPos + NBL_ALIGN(iStoredSize, NBL_CHUNK_PADDING_SIZE), 1);
+	if (pstrBuffer == NULL)
+		return NULL;
+
+	/* Headers */
+
+	NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_IDENTIFIER, NBL_ID_NMLL);
+	NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_SIZE, iHeaderSize);
+	NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_NB_CHUNKS, iNbFiles);
+	NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_DATA_SIZE, iDataSize);
+	NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_KEY_SEED, uKeySeed);
+
+	iFilePos = iLead;
+	for (i = 0; i < iNbFiles; i++) {
+		NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_IDENTIFIER + i * NBL_CHUNK_SIZE, NBL_ID_STD);
+		NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_HEADER_SIZE + i * NBL_CHUNK_SIZE, NBL_CHUNK_SIZE);
+		strcpy(pstrBuffer + NBL_HEADER_CHUNKS + NBL_CHUNK_FILENAME + i * NBL_CHUNK_SIZE, ppstrNames[i]);
+		NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_FILE_POS + i * NBL_CHUNK_SIZE, iFilePos);
+		NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_FILE_SIZE + i * NBL_CHUNK_SIZE, piFileSizes[i]);
+		iFilePos += NBL_ALIGN(piFileSizes[i], NBL_CHUNK_SMALL_PADDING_SIZE);
+	}
+
+	/* Data */
+
+	if (iCompress) {
+		pstrData = calloc(iDataSize, 1);
+		if (pstrData == NULL) {
+			free(pstrBuffer);
+			return NULL;
+		}
+	} else
+		pstrData = pstrBuffer + iDataPos;
+
+	for (i = 0; i < iNbFiles; i++)
+		memcpy(pstrData + NBL_READ_UINT(pstrBuffer, NBL_HEADER_CHUNKS + NBL_CHUNK_FILE_POS + i * NBL_CHUNK_SIZE), ppstrFiles[i], piFileSizes[i]);
+
+	if (iLead)
+		NBL_WRITE_UINT(pstrData, 0, NBL_BUILD_LEAD_MARKER);
+
+	if (iCompress) {
+		iStoredSize = nbl_compress_parallel(pstrData, iDataSize, pstrBuffer + iDataPos, iStoredSize, iCompress, 1);
+		free(pstrData);
+
+		if (iStoredSize < 0) {
+			free(pstrBuffer);
+			return NULL;
+		}
+
+		NBL_WRITE_UINT(pstrBuffer, NBL_HEADER_COMPRESSED_DATA_SIZE, iStoredSize);
+	}
+
+	if (uKeySeed != 0) {
+		nbl_setkey(&ctx, uKeySeed);
+		nbl_encrypt_headers(&ctx, pstrBuffer, NBL_HEADER_CHUNKS);
+		nbl_encrypt_buffer(&ctx, pstrBuffer + iDataPos, iStoredSize);
+	}
+
+	if (NBL_READ_INT(pstrBuffer, iDataPos) == 0) {
+		free(pstrBuffer);
+		return NULL;
+	}
+
+	*piSize = iDataPos + NBL_ALIGN(iStoredSize, NBL_CHUNK_PADDING_SIZE);
+	return pstrBuffer;
+}
+
+/**
+ * Return the index of the chunk with the given filename, or -1 if not found.
+ */
+
+int nbl_find_file(char* pstrBuffer, int iHeaderChunksPos, char* pstrName)
+{
+	int i, iNbChunks;
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+
+	for (i = 0; i < iNbChunks; i++)
+		if (strncmp(pstrBuffer + iHeaderChunksPos + NBL_CHUNK_FILENAME + i * NBL_CHUNK_SIZE, pstrName, NBL_CHUNK_FILENAME_SIZE) == 0)
+			return i;
+
+	return -1;
+}
+
+/**
+ * List the files from the decrypted headers.
+ */
+
+void nbl_list_files(char* pstrBuffer, int iHeaderChunksPos)
+{
+	int i, iNbChunks;
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+
+	for (i = 0; i < iNbChunks; i++)
+		printf("%s\n", pstrBuffer + iHeaderChunksPos + NBL_CHUNK_FILENAME + i * NBL_CHUNK_SIZE);
+}
+
+/**
+ * List the files from the decrypted headers with their position in the data and their size.
+ */
+
+void nbl_list_files_details(char* pstrBuffer, int iHeaderChunksPos)
+{
+	char* pstrChunk;
+	int i, iNbChunks;
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+
+	for (i = 0; i < iNbChunks; i++) {
+		pstrChunk = pstrBuffer + iHeaderChunksPos + i * NBL_CHUNK_SIZE;
+		printf("%08x %10u %.*s\n", NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_POS), NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_SIZE),
+			NBL_CHUNK_FILENAME_SIZE, pstrChunk + NBL_CHUNK_FILENAME);
+	}
+}
+
+/**
+ * Extract all the files from the data.
+ */
+
+void nbl_extract_all(char* pstrBuffer, int iHeaderChunksPos, char* pstrData, char* pstrDestPath, struct manifest_ctx* pManifest)
+{
+	char* pstrChunk;
+	int i, iNbChunks, iLen;
+	FILE* pFile;
+	char* pstrFilename;
+
+	if (pstrDestPath == NULL) {
+		iLen = 0;
+		pstrFilename = malloc(iLen + NBL_CHUNK_FILENAME_SIZE + 1);
+	} else {
+		iLen = strlen(pstrDestPath);
+		pstrFilename = malloc(iLen + NBL_CHUNK_FILENAME_SIZE + 2);
+		/* TODO: check return value */
+		strcpy(pstrFilename, pstrDestPath);
+		if (pstrDestPath[iLen - 1] != '/' && pstrDestPath[iLen - 1] != '\\')
+			pstrFilename[iLen++] = '/';
+	}
+
+	iNbChunks = NBL_READ_INT(pstrBuffer, NBL_HEADER_NB_CHUNKS);
+	NBL_PROBE2(extract__start, pstrBuffer, iNbChunks);
+
+	for (i = 0; i < iNbChunks; i++) {
+		pstrChunk = pstrBuffer + iHeaderChunksPos + i * NBL_CHUNK_SIZE;
+		strncpy(pstrFilename + iLen, pstrChunk + NBL_CHUNK_FILENAME, NBL_CHUNK_FILENAME_SIZE);
+		pstrFilename[iLen + NBL_CHUNK_FILENAME_SIZE] = 0;
+
+		pFile = fopen(pstrFilename, "wb");
+		if (pFile) {
+			fwrite(pstrData + NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_POS), 1, NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_SIZE), pFile);
+			fclose(pFile);
+
+			/* Hash the entry while it is still in cache. */
+			if (pManifest)
+				manifest_add_buffer(pManifest, pstrFilename + iLen, NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_POS),
+					pstrData + NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_POS), NBL_READ_UINT(pstrChunk, NBL_CHUNK_FILE_SIZE));
+		}
+	}
+
+	NBL_PROBE2(extract__end, pstrBuffer, iNbChunks);
+
+	free(pstrFilename);
+}
+
+/**
+ * Streaming extraction.
+ *
+ * The archive is read in a single pass and never held whole. The data section
+ * is read and decrypted by blocks, and the decoder writes into a work buffer
+ * that starts with the last NBL_WINDOW_SIZE bytes of output, which is as far
+ * as back-references reach. Each time NBL_STREAM_CHUNK_SIZE new bytes have been
+ * decoded they are handed to a callback, which writes them to the entries they
+ * belong to when extracting, and the history slides back to the start of the
+ * work buffer.
+ */
+
+#define NBL_STREAM_CHUNK_SIZE	0x10000
+#define NBL_STREAM_WORK_SIZE	(NBL_WINDOW_SIZE + NBL_STREAM_CHUNK_SIZE + NBL_MAX_COUNT)
+#define NBL_STREAM_SKIP_SIZE	0x1000
+
+/* A round of the decoder takes at most one token per byte of output plus the end marker.
+   With a full source buffer it can't run out of data before the round ends, even with
+   the last incomplete block not decrypted yet. */
+#define NBL_STREAM_SRC_SIZE		(NBL_MAX_TOKEN_SRC * (NBL_STREAM_CHUNK_SIZE + 1) + 8)
+
+typedef struct {
+	char strName[NBL_CHUNK_FILENAME_SIZE + 1];
+	unsigned int uPos;
+	unsigned int uSize;
+	unsigned int uWritten;
+	int iDone;
+	FILE* pFile;
+	struct manifest_sum sum;
+} nbl_stream_entry;
+
+typedef struct {
+	FILE* pFile;
+	struct bf_ctx* pCtx;
+	char* pstrBuffer;
+	unsigned int uBase; /* Data position of the first byte of the buffer. */
+	unsigned int uLen;
+	unsigned int uDecrypted; /* Data position up to which the buffer is decrypted. */
+	unsigned int uUsable; /* Data position up to which the buffer can be decoded. */
+	unsigned int uSize; /* Size of the data section in the file. */
+} nbl_stream_src;
+
+typedef struct {
+	nbl_stream_entry* pEntries; /* Sorted by position. */
+	int iNbEntries;
+	int iFirst; /* First entry not written completely. */
+	char* pstrFilename;
+	int iLen; /* Length of the destination path in pstrFilename. */
+	struct manifest_ctx* pManifest;
+	int ret;
+} nbl_stream_out;
+
+static int nbl_stream_compare_entries(const void* pA, const void* pB)
+{
+	const nbl_stream_entry* pEntryA = pA;
+	const nbl_stream_entry* pEntryB = pB;
+
+	if (pEntryA->uPos != pEntryB->uPos)
+		return pEntryA->uPos < pEntryB->uPos ? -1 : 1;
+	return 0;
+}
+
+/**
+ * Drop the source bytes before the data position uKeep and fill the rest of the buffer.
+ * The buffer stays aligned on blocks, of which only whole ones are decrypted;
+ * the incomplete last block of the data is left as is.
+ * Returns 0 or NBL_ERROR_TRUNCATED if the file ends before the data.
+ */
+
+static int nbl_stream_read(nbl_stream_src* s, unsigned int uKeep)
+{
+	unsigned int uCount, uEnd;
+
+	uKeep &= ~7u;
+	memmove(s->pstrBuffer, s->pstrBuffer + (uKeep - s->uBase), s->uBase + s->uLen - uKeep);
+	s->uLen -= uKeep - s->uBase;
+	s->uBase = uKeep;
+
+	uCount = NBL_STREAM_SRC_SIZE - s->uLen;
+	if (uCount > s->uSize - (s->uBase + s->uLen))
+		uCount = s->uSize - (s->uBase + s->uLen);
+
+	if (uCount > 0) {
+		if (fread(s->pstrBuffer + s->uLen, 1, uCount, s->pFile) != uCount)
+			return NBL_ERROR_TRUNCATED;
+		s->uLen += uCount;
+	}
+
+	uEnd = s->uBase + s->uLen;
+	if (s->pCtx) {
+		nbl_decrypt_buffer(s->pCtx, s->pstrBuffer + (s->uDecrypted - s->uBase), uEnd - s->uDecrypted);
+		s->uDecrypted += (uEnd - s->uDecrypted) & ~7u;
+	} else
+		s->uDecrypted = uEnd;
+
+	s->uUsable = uEnd == s->uSize ? uEnd : s->uDecrypted;
+	return 0;
+}
+
+/**
+ * Decode the data of a section while reading it from the stream, handing it to pFunc
+ * in order, one block at a time, then once more with no data at the end of the data.
+ * The stream must be at the end of the headers of the section, NBL_HEADER_SIZE bytes
+ * after its start. pstrHeader holds at least its first NBL_HEADER_CHUNKS bytes and
+ * pCtx is NULL when the data isn't encrypted.
+ * Returns 0, a negative NBL_ERROR_* value or the first negative value returned by pFunc.
+ */
+
+int nbl_decode_stream(FILE* pFile, char* pstrHeader, struct bf_ctx* pCtx, nbl_stream_func pFunc, void* pArg)
+{
+	nbl_decompress_struct p;
+	nbl_stream_src s;
+	char* pstrWork;
+	unsigned int uDataSize, uOut, uCount;
+	int iDestPos, iDestSize;
+	int ret = 0;
+
+	memset(&s, 0, sizeof(s));
+	s.pFile = pFile;
+	s.pCtx = pCtx;
+	uDataSize = NBL_READ_UINT(pstrHeader, NBL_HEADER_DATA_SIZE);
+	s.uSize = nbl_is_compressed(pstrHeader) ? NBL_READ_UINT(pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE) : uDataSize;
+
+	s.pstrBuffer = malloc(NBL_STREAM_SRC_SIZE);
+	pstrWork = malloc(NBL_STREAM_WORK_SIZE);
+	if (s.pstrBuffer == NULL || pstrWork == NULL) {
+		ret = NBL_ERROR_MEMORY;
+		goto nbl_decode_stream_ret;
+	}
+
+	/* The data starts at the first 16-byte word after the header that doesn't begin with zero. See nbl_get_data_pos. */
+	if (s.uSize > 0) {
+		do {
+			s.uLen = fread(s.pstrBuffer, 1, 16, pFile);
+			if (s.uLen < 4) {
+				ret = NBL_ERROR_TRUNCATED;
+				goto nbl_decode_stream_ret;
+			}
+		} while (NBL_READ_UINT(s.pstrBuffer, 0) == 0);
+
+		if (s.uLen > s.uSize)
+			s.uLen = s.uSize;
+	}
+
+	uOut = 0;
+
+	if (nbl_is_compressed(pstrHeader)) {
+		nbl_decompress_init(&p, s.pstrBuffer, 0);
+		p.iDestMin = NBL_WINDOW_SIZE;
+
+		while (!p.iEnded) {
+			uCount = s.uBase + p.iSrcPos;
+			ret = nbl_stream_read(&s, uCount);
+			if (ret < 0)
+				goto nbl_decode_stream_ret;
+			p.iSrcPos = uCount - s.uBase;
+			p.iSrcSize = s.uUsable - s.uBase;
+
+			/* Output past the size from the header is an error, as with nbl_decompress. */
+			uCount = uDataSize - uOut;
+			iDestSize = uCount < NBL_STREAM_CHUNK_SIZE + NBL_MAX_COUNT ? (int)(NBL_WINDOW_SIZE + uCount) : NBL_STREAM_WORK_SIZE;
+
+			iDestPos = nbl_decompress_tokens(&p, pstrWork, NBL_WINDOW_SIZE, NBL_WINDOW_SIZE + NBL_STREAM_CHUNK_SIZE, iDestSize);
+			if (iDestPos < 0) {
+				ret = iDestPos;
+				goto nbl_decode_stream_ret;
+			}
+
+			uCount = iDestPos - NBL_WINDOW_SIZE;
+			ret = pFunc(pArg, uOut, pstrWork + NBL_WINDOW_SIZE, uCount);
+			if (ret < 0)
+				goto nbl_decode_stream_ret;
+
+			memmove(pstrWork, pstrWork + uCount, NBL_WINDOW_SIZE);
+			uOut += uCount;
+			p.iDestMin = uOut < NBL_WINDOW_SIZE ? (int)(NBL_WINDOW_SIZE - uOut) : 0;
+		}
+
+		/* Data not covered by the stream reads as zero. */
+		memset(pstrWork, 0, NBL_STREAM_CHUNK_SIZE);
+		while (uOut < uDataSize) {
+			uCount = uDataSize - uOut < NBL_STREAM_CHUNK_SIZE ? uDataSize - uOut : NBL_STREAM_CHUNK_SIZE;
+			ret = pFunc(pArg, uOut, pstrWork, uCount);
+			if (ret < 0)
+				goto nbl_decode_stream_ret;
+			uOut += uCount;
+		}
+	} else {
+		while (uOut < uDataSize) {
+			ret = nbl_stream_read(&s, uOut);
+			if (ret < 0)
+				goto nbl_decode_stream_ret;
+
+			uCount = s.uUsable - uOut;
+			ret = pFunc(pArg, uOut, s.pstrBuffer + (uOut - s.uBase), uCount);
+			if (ret < 0)
+				goto nbl_decode_stream_ret;
+			uOut += uCount;
+		}
+	}
+
+	/* Empty entries found at the very end of the data. */
+	ret = pFunc(pArg, uDataSize, NULL, 0);
+
+nbl_decode_stream_ret:
+	free(pstrWork);
+	free(s.pstrBuffer);
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Write the data found at position uPos to the entries it covers; a nbl_stream_func.
+ * Entries are opened when their first byte is reached and closed after their last one.
+ * Errors are kept in the output so that the other entries are still written.
+ */
+
+static int nbl_stream_write(void* pArg, unsigned int uPos, char* pstrData, unsigned int uSize)
+{
+	nbl_stream_out* o = pArg;
+	nbl_stream_entry* pEntry;
+	unsigned int uStart, uEnd;
+	int i;
+
+	for (i = o->iFirst; i < o->iNbEntries && o->pEntries[i].uPos <= uPos + uSize; i++) {
+		pEntry = o->pEntries + i;
+		if (pEntry->iDone)
+			continue;
+
+		uStart = pEntry->uPos > uPos ? pEntry->uPos : uPos;
+		uEnd = pEntry->uPos + pEntry->uSize < uPos + uSize ? pEntry->uPos + pEntry->uSize : uPos + uSize;
+		if (uStart >= uEnd && pEntry->uSize != 0)
+			continue;
+
+		if (pEntry->pFile == NULL) {
+			strcpy(o->pstrFilename + o->iLen, pEntry->strName);
+			pEntry->pFile = fopen(o->pstrFilename, "wb");
+			if (pEntry->pFile == NULL) {
+				pEntry->iDone = 1;
+				o->ret = NBL_ERROR_IO;
+				continue;
+			}
+			manifest_sum_init(&pEntry->sum);
+		}
+
+		if (uStart < uEnd) {
+			if (fwrite(pstrData + (uStart - uPos), 1, uEnd - uStart, pEntry->pFile) != uEnd - uStart)
+				o->ret = NBL_ERROR_IO;
+			if (o->pManifest)
+				manifest_sum_update(o->pManifest, &pEntry->sum, pstrData + (uStart - uPos), uEnd - uStart);
+			pEntry->uWritten += uEnd - uStart;
+		}
+
+		if (pEntry->uWritten == pEntry->uSize) {
+			if (fclose(pEntry->pFile) != 0)
+				o->ret = NBL_ERROR_IO;
+			pEntry->pFile = NULL;
+			pEntry->iDone = 1;
+
+			if (o->pManifest)
+				manifest_add(o->pManifest, pEntry->strName, pEntry->uPos, &pEntry->sum);
+		}
+	}
+
+	while (o->iFirst < o->iNbEntries && o->pEntries[o->iFirst].iDone)
+		o->iFirst++;
+
+	return 0;
+}
+
+/**
+ * Extract all the files of the NMLL section while reading the archive from the stream.
+ * Memory use depends on the number of entries but not on the size of the archive.
+ * A TMLL section following the NMLL data is left unread.
+ * Returns 0 or a negative NBL_ERROR_* value.
+ */
+
+int nbl_extract_stream(FILE* pFile, char* pstrDestPath, struct manifest_ctx* pManifest)
+{
+	nbl_stream_out o;
+	struct bf_ctx ctx;
+	struct bf_ctx* pCtx = NULL;
+	char pstrSkip[NBL_STREAM_SKIP_SIZE];
+	char* pstrHeaders = NULL;
+	char* pstrTmp;
+	unsigned int uHeaderSize, uTableSize, uDataSize, uCount;
+	int i, iNbChunks;
+	int ret = 0;
+
+	memset(&o, 0, sizeof(o));
+	o.pManifest = pManifest;
+
+	pstrHeaders = malloc(NBL_HEADER_CHUNKS);
+	if (pstrHeaders == NULL)
+		return NBL_ERROR_MEMORY;
+
+	if (fread(pstrHeaders, 1, NBL_HEADER_CHUNKS, pFile) != NBL_HEADER_CHUNKS || !nbl_is_nmll(pstrHeaders)) {
+		ret = NBL_ERROR_ARGS;
+		goto nbl_extract_stream_ret;
+	}
+
+	/* The chunk table must be read before the data since the stream can't go back. */
+	uHeaderSize = NBL_READ_UINT(pstrHeaders, NBL_HEADER_SIZE);
+	iNbChunks = NBL_READ_INT(pstrHeaders, NBL_HEADER_NB_CHUNKS);
+	if (iNbChunks < 0 || iNbChunks > (INT_MAX - NBL_HEADER_CHUNKS) / NBL_CHUNK_SIZE
+		|| (unsigned int)(NBL_HEADER_CHUNKS + iNbChunks * NBL_CHUNK_SIZE) > uHeaderSize) {
+		ret = NBL_ERROR_ARGS;
+		goto nbl_extract_stream_ret;
+	}
+
+	uTableSize = NBL_HEADER_CHUNKS + iNbChunks * NBL_CHUNK_SIZE;
+	uDataSize = NBL_READ_UINT(pstrHeaders, NBL_HEADER_DATA_SIZE);
+
+	o.iNbEntries = iNbChunks;
+	o.pEntries = calloc(iNbChunks + 1, sizeof(nbl_stream_entry));
+	o.pstrFilename = malloc((pstrDestPath ? strlen(pstrDestPath) : 0) + NBL_CHUNK_FILENAME_SIZE + 2);
+	pstrTmp = realloc(pstrHeaders, uTableSize);
+	if (pstrTmp)
+		pstrHeaders = pstrTmp;
+	if (o.pEntries == NULL || o.pstrFilename == NULL || pstrTmp == NULL) {
+		ret = NBL_ERROR_MEMORY;
+		goto nbl_extract_stream_ret;
+	}
+
+	if (fread(pstrHeaders + NBL_HEADER_CHUNKS, 1, uTableSize - NBL_HEADER_CHUNKS, pFile) != uTableSize - NBL_HEADER_CHUNKS) {
+		ret = NBL_ERROR_TRUNCATED;
+		goto nbl_extract_stream_ret;
+	}
+
+	for (uCount = uHeaderSize - uTableSize; uCount > 0; uCount -= i) {
+		i = uCount < NBL_STREAM_SKIP_SIZE ? uCount : NBL_STREAM_SKIP_SIZE;
+		if (fread(pstrSkip, 1, i, pFile) != (size_t)i) {
+			ret = NBL_ERROR_TRUNCATED;
+			goto nbl_extract_stream_ret;
+		}
+	}
+
+	if (NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED) != 0) {
+		pCtx = &ctx;
+		nbl_setkey(pCtx, NBL_READ_UINT(pstrHeaders, NBL_HEADER_KEY_SEED));
+		nbl_decrypt_headers(pCtx, pstrHeaders, NBL_HEADER_CHUNKS);
+	}
+
+	for (i = 0; i < iNbChunks; i++) {
+		strncpy(o.pEntries[i].strName, pstrHeaders + NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILENAME, NBL_CHUNK_FILENAME_SIZE);
+		o.pEntries[i].strName[NBL_CHUNK_FILENAME_SIZE] = 0;
+		o.pEntries[i].uPos = NBL_READ_UINT(pstrHeaders, NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_POS);
+		o.pEntries[i].uSize = NBL_READ_UINT(pstrHeaders, NBL_HEADER_CHUNKS + i * NBL_CHUNK_SIZE + NBL_CHUNK_FILE_SIZE);
+
+		if ((unsigned long long)o.pEntries[i].uPos + o.pEntries[i].uSize > uDataSize) {
+			ret = NBL_ERROR_OVERFLOW;
+			goto nbl_extract_stream_ret;
+		}
+	}
+
+	qsort(o.pEntries, iNbChunks, sizeof(nbl_stream_entry), nbl_stream_compare_entries);
+
+	if (pstrDestPath == NULL || pstrDestPath[0] == 0)
+		o.iLen = 0;
+	else {
+		strcpy(o.pstrFilename, pstrDestPath);
+		o.iLen = strlen(pstrDestPath);
+		if (pstrDestPath[o.iLen - 1] != '/' && pstrDestPath[o.iLen - 1] != '\\')
+			o.pstrFilename[o.iLen++] = '/';
+	}
+
+	NBL_PROBE2(extract__start, pstrHeaders, iNbChunks);
+
+	ret = nbl_decode_stream(pFile, pstrHeaders, pCtx, nbl_stream_write, &o);
+	if (ret == 0)
+		ret = o.ret;
+
+	NBL_PROBE2(extract__end, pstrHeaders, iNbChunks);
+
+nbl_extract_stream_ret:
+	if (o.pEntries) {
+		for (i = o.iFirst; i < iNbChunks; i++)
+			if (o.pEntries[i].pFile)
+				fclose(o.pEntries[i].pFile);
+		free(o.pEntries);
+	}
+	free(o.pstrFilename);
+	free(pstrHeaders);
+
+	return ret;
+}
+
+/**
+ * In-place loading.
+ */
+
+/* Room left between the output and the compressed data at first. Streams
+   that get ahead of their average ratio by more than this are moved;
+   it is a few percent of the compressed size for the game's archives. */
+#define NBL_INPLACE_MARGIN(size)	(0x1000 + (size) / 32)
+
+/**
+ * Return the position in the file of the data of the section starting at iSectionPos,
+ * reading it the way nbl_get_data_pos does, or -1 on error.
+ */
+
+off_t nbl_find_data_pos(FILE* pFile, off_t iSectionPos, char* pstrHeader)
+{
+	unsigned int uValue = 0;
+	off_t iPos;
+
+	for (iPos = iSectionPos + NBL_READ_UINT(pstrHeader, NBL_HEADER_SIZE); uValue == 0; iPos += 16) {
+		if (fseeko(pFile, iPos, SEEK_SET) != 0 || fread(&uValue, 1, 4, pFile) != 4)
+			return -1;
+	}
+
+	return iPos - 16;
+}
+
+/**
+ * Read, decrypt and decompress the data of the section starting at iSectionPos
+ * using a single buffer. The compressed data is read at the end of a buffer of
+ * the size given by nbl_decompress_inplace_size and decompressed to its start,
+ * so the memory needed is about the size of the decompressed data.
+ * The buffer is first allocated with a small margin; the compressed data is
+ * moved if the stream turns out to need more.
+ * *piRet is set to the size of the decompressed data or a negative NBL_ERROR_*
+ * value, in which case NULL is returned.
+ * Returns a new pointer with the data.
+ */
+
+char* nbl_load_data_inplace(FILE* pFile, off_t iSectionPos, char* pstrHeader, struct bf_ctx* pCtx, int* piRet)
+{
+	char* pstrBuffer = NULL;
+	char* pstrTmp;
+	off_t iDataPos;
+	int iSrcSize, iDestSize, iSrcPos, iBufferSize;
+
+	iDataPos = nbl_find_data_pos(pFile, iSectionPos, pstrHeader);
+	iDestSize = NBL_READ_INT(pstrHeader, NBL_HEADER_DATA_SIZE);
+	iSrcSize = nbl_is_compressed(pstrHeader) ? NBL_READ_INT(pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE) : iDestSize;
+
+	*piRet = NBL_ERROR_ARGS;
+	if (iDataPos < 0 || iDestSize <= 0 || iSrcSize <= 0 || iDestSize > INT_MAX - NBL_INPLACE_MARGIN(iSrcSize) - 8)
+		return NULL;
+
+	/* The start of the compressed data must stay aligned for the decryption. */
+	iSrcPos = iDestSize > iSrcSize ? iDestSize - iSrcSize : 0;
+	iSrcPos = NBL_ALIGN(iSrcPos + NBL_INPLACE_MARGIN(iSrcSize), 8);
+	if (!nbl_is_compressed(pstrHeader))
+		iSrcPos = 0;
+
+	*piRet = NBL_ERROR_MEMORY;
+	if (iSrcSize > INT_MAX - iSrcPos)
+		return NULL;
+	iBufferSize = iSrcPos + iSrcSize;
+
+	pstrBuffer = malloc(iBufferSize);
+	if (pstrBuffer == NULL)
+		return NULL;
+
+	*piRet = NBL_ERROR_TRUNCATED;
+	if (fseeko(pFile, iDataPos, SEEK_SET) != 0 || fread(pstrBuffer + iSrcPos, 1, iSrcSize, pFile) != (size_t)iSrcSize)
+		goto nbl_load_data_inplace_err;
+
+	if (pCtx)
+		nbl_decrypt_buffer(pCtx, pstrBuffer + iSrcPos, iSrcSize);
+
+	if (!nbl_is_compressed(pstrHeader)) {
+		*piRet = iDestSize;
+		return pstrBuffer;
+	}
+
+	*piRet = nbl_decompress_inplace_size(pstrBuffer + iSrcPos, iSrcSize, iDestSize);
+	if (*piRet < 0)
+		goto nbl_load_data_inplace_err;
+
+	if (*piRet > iBufferSize) {
+		iBufferSize = NBL_ALIGN(*piRet - iSrcSize, 8);
+		if (iSrcSize > INT_MAX - iBufferSize) {
+			*piRet = NBL_ERROR_MEMORY;
+			goto nbl_load_data_inplace_err;
+		}
+		iBufferSize += iSrcSize;
+
+		pstrTmp = realloc(pstrBuffer, iBufferSize);
+		if (pstrTmp == NULL) {
+			*piRet = NBL_ERROR_MEMORY;
+			goto nbl_load_data_inplace_err;
+		}
+		pstrBuffer = pstrTmp;
+
+		memmove(pstrBuffer + iBufferSize - iSrcSize, pstrBuffer + iSrcPos, iSrcSize);
+		iSrcPos = iBufferSize - iSrcSize;
+	}
+
+	*piRet = nbl_decompress(pstrBuffer + iSrcPos, iSrcSize, pstrBuffer, iDestSize);
+	if (*piRet >= 0)
+		return pstrBuffer;
+
+nbl_load_data_inplace_err:
+	free(pstrBuffer);
+	return NULL;
+}
+
+/**
+ * Cache of decoded data.
+ */
+
+/**
+ * Return the cache key of a section: the hash of its headers as stored in the archive,
+ * then of the device, inode, size and modification time of the archive file when
+ * pStat is given, or else of its data, which is then read whole.
+ * It must be computed before anything is decrypted.
+ */
+
+unsigned long long nbl_cache_key(char* pstrHeader, struct stat* pStat)
+{
+	unsigned long long ullKey, aIdentity[4];
+	int iSize;
+
+	if (pStat == NULL) {
+		iSize = nbl_is_compressed(pstrHeader) ? NBL_READ_INT(pstrHeader, NBL_HEADER_COMPRESSED_DATA_SIZE) : NBL_READ_INT(pstrHeader, NBL_HEADER_DATA_SIZE);
+		return manifest_hash64(MANIFEST_HASH64_INIT, pstrHeader, nbl_get_data_pos(pstrHeader) + iSize);
+	}
+
+	aIdentity[0] = pStat->st_dev;
+	aIdentity[1] = pStat->st_ino;
+	aIdentity[2] = pStat->st_size;
+	aIdentity[3] = pStat->st_mtime;
+
+	ullKey = manifest_hash64(MANIFEST_HASH64_INIT, pstrHeader, nbl_get_data_pos(pstrHeader));
+	return manifest_hash64(ullKey, (char*)aIdentity, sizeof(aIdentity));
+}
+
+#ifndef _WIN32
+
+static void nbl_cache_filename(char* pstrFilename, char* pstrCachePath, unsigned long long ullKey, char* pstrSection)
+{
+	snprintf(pstrFilename, FILENAME_MAX, "%s/%016llx-%s" NBL_CACHE_SUFFIX, pstrCachePath, ullKey, pstrSection);
+}
+
+/**
+ * Return the decoded data of the section from the cache, mapped in memory,
+ * or NULL if it isn't there. The entry becomes the most recently used.
+ * The data must be released with nbl_cache_release.
+ */
+
+char* nbl_cache_get(char* pstrCachePath, unsigned long long ullKey, char* pstrSection, int iSize)
+{
+	struct stat st;
+	char pstrFilename[FILENAME_MAX];
+	void* pData = NULL;
+	int iFd;
+
+	nbl_cache_filename(pstrFilename, pstrCachePath, ullKey, pstrSection);
+
+	iFd = open(pstrFilename, O_RDONLY);
+	if (iFd < 0)
+		return NULL;
+
+	if (iSize > 0 && fstat(iFd, &st) == 0 && st.st_size == iSize) {
+		pData = mmap(NULL, iSize, PROT_READ, MAP_PRIVATE, iFd, 0);
+		if (pData == MAP_FAILED)
+			pData = NULL;
+	}
+
+	close(iFd);
+
+	if (pData)
+		utime(pstrFilename, NULL);
+
+	return pData;
+}
+
+/**
+ * Release data returned by nbl_cache_get.
+ */
+
+void nbl_cache_release(char* pstrData, int iSize)
+{
+	munmap(pstrData, iSize);
+}
+
+/**
+ * Entry found while evicting.
+ */
+
+typedef struct {
+	time_t iTime;
+	off_t iSize;
+	char strName[64];
+} nbl_cache_entry;
+
+static int nbl_cache_compare_entries(const void* pA, const void* pB)
+{
+	const nbl_cache_entry* a = pA;
+	const nbl_cache_entry* b = pB;
+
+	if (a->iTime != b->iTime)
+		return a->iTime < b->iTime ? -1 : 1;
+	return strcmp(a->strName, b->strName);
+}
+
+/**
+ * Remove the least recently used entries until the cache takes at most ullMaxSize bytes.
+ */
+
+int nbl_cache_evict(char* pstrCachePath, unsigned long long ullMaxSize)
+{
+	struct dirent* pDirEntry;
+	struct stat st;
+	nbl_cache_entry* pEntries = NULL;
+	nbl_cache_entry* pTmp;
+	DIR* pDir;
+	char pstrFilename[FILENAME_MAX];
+	unsigned long long ullSize = 0;
+	size_t iLen;
+	int i, iNbEntries = 0, iMaxEntries = 0;
+	int ret = 0;
+
+	pDir = opendir(pstrCachePath);
+	if (pDir == NULL)
+		return NBL_ERROR_IO;
+
+	while ((pDirEntry = readdir(pDir)) != NULL) {
+		iLen = strlen(pDirEntry->d_name);
+		if (iLen >= sizeof(pEntries->strName) || iLen < sizeof(NBL_CACHE_SUFFIX)
+			|| strcmp(pDirEntry->d_name + iLen - sizeof(NBL_CACHE_SUFFIX) + 1, NBL_CACHE_SUFFIX) != 0)
+			continue;
+
+		snprintf(pstrFilename, FILENAME_MAX, "%s/%s", pstrCachePath, pDirEntry->d_name);
+		if (stat(pstrFilename, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (iNbEntries == iMaxEntries) {
+			iMaxEntries = iMaxEntries ? iMaxEntries * 2 : 64;
+			pTmp = realloc(pEntries, iMaxEntries * sizeof(nbl_cache_entry));
+			if (pTmp == NULL) {
+				ret = NBL_ERROR_MEMORY;
+				goto nbl_cache_evict_ret;
+			}
+			pEntries = pTmp;
+		}
+
+		pEntries[iNbEntries].iTime = st.st_mtime;
+		pEntries[iNbEntries].iSize = st.st_size;
+		strcpy(pEntries[iNbEntries].strName, pDirEntry->d_name);
+		ullSize += st.st_size;
+		iNbEntries++;
+	}
+
+	if (ullSize <= ullMaxSize)
+		goto nbl_cache_evict_ret;
+
+	qsort(pEntries, iNbEntries, sizeof(nbl_cache_entry), nbl_cache_compare_entries);
+
+	for (i = 0; i < iNbEntries && ullSize > ullMaxSize; i++) {
+		snprintf(pstrFilename, FILENAME_MAX, "%s/%s", pstrCachePath, pEntries[i].strName);
+		if (unlink(pstrFilename) == 0)
+			ullSize -= pEntries[i].iSize;
+	}
+
+nbl_cache_evict_ret:
+	closedir(pDir);
+	free(pEntries);
+
+	return ret;
+}
+
+/**
+ * Save the decoded data of the section in the cache, creating the cache directory
+ * if needed. The entry is written to a temporary file first, so that other
+ * processes only ever see complete entries. Sections saved together are
+ * followed by a single call to nbl_cache_evict.
+ */
+
+int nbl_cache_put(char* pstrCachePath, unsigned long long ullKey, char* pstrSection, char* pstrData, int iSize)
+{
+	FILE* pFile;
+	char pstrFilename[FILENAME_MAX];
+	char pstrTmp[FILENAME_MAX];
+	int ret = 0;
+
+	mkdir(pstrCachePath, 0777);
+
+	nbl_cache_filename(pstrFilename, pstrCachePath, ullKey, pstrSection);
+	if (snprintf(pstrTmp, FILENAME_MAX, "%s.%d.tmp", pstrFilename, (int)getpid()) >= FILENAME_MAX)
+		return NBL_ERROR_ARGS;
+
+	pFile = fopen(pstrTmp, "wb");
+	if (pFile == NULL)
+		return NBL_ERROR_IO;
+
+	if (fwrite(pstrData, 1, iSize, pFile) != (size_t)iSize)
+		ret = NBL_ERROR_IO;
+	if (fclose(pFile) != 0)
+		ret = NBL_ERROR_IO;
+	if (ret == 0 && rename(pstrTmp, pstrFilename) != 0)
+		ret = NBL_ERROR_IO;
+
+	if (ret < 0)
+		unlink(pstrTmp);
+
+	return ret;
+}
+
+#else
+
+/**
+ * Without mmap there is no cache: nothing is found in it and nothing can be saved.
+ */
+
+char* nbl_cache_get(char* pstrCachePath, unsigned long long ullKey, char* pstrSection, int iSize)
+{
+	(void)pstrCachePath;
+	(void)ullKey;
+	(void)pstrSection;
+	(void)iSize;
+
+	return NULL;
+}
+
+void nbl_cache_release(char* pstrData, int iSize)
+{
+	(void)pstrData;
+	(void)iSize;
+}
+
+int nbl_cache_evict(char* pstrCachePath, unsigned long long ullMaxSize)
+{
+	(void)pstrCachePath;
+	(void)ullMaxSize;
+
+	return 0;
+}
+
+int nbl_cache_put(char* pstrCachePath, unsigned long long ullKey, char* pstrSection, char* pstrData, int iSize)
+{
+	(void)pstrCachePath;
+	(void)ullKey;
+	(void)pstrSection;
+	(void)pstrData;
+	(void)iSize;
+
+	return NBL_ERROR_IO;
+}
+
+#endif
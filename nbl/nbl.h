@@ -26,6 +26,7 @@
 #define NBL_ID_NMLL	0x4C4C4D4E /* Low endian. */
 #define NBL_ID_NMLB	0x424C4D4E /* Big endian. Currently unsupported. */
 #define NBL_ID_TMLL	0x4C4C4D54 /* Unknown. */
+#define NBL_ID_STD	0x00445453 /* Standard chunk. */
 
 /* Positions */
 
@@ -82,23 +83,140 @@ int nbl_get_data_pos(char* pstrBuffer);
 int nbl_get_tmll_pos(char* pstrBuffer);
 char* nbl_load(char* pstrFilename);
 
+#include <stdio.h>
+char* nbl_load_stream(FILE* pFile);
+
+#define NBL_LOAD_WINDOW_SIZE 0x10000 /* Read size when searching the file. */
+
+char* nbl_load_headers(char* pstrFilename, char** ppstrTMLL, int* piTMLLPos);
+
 #define NBL_READ_INT(buf, pos) (*((int*)(buf + pos)))
 #define NBL_READ_UINT(buf, pos) (*((unsigned int*)(buf + pos)))
+#define NBL_WRITE_UINT(buf, pos, val) (*((unsigned int*)(buf + pos)) = (val))
 
-/* Decryption */
+/* Encryption and decryption */
 
 #include "fakefish.h"
+void nbl_setkey(struct bf_ctx *pCtx, unsigned int uKeySeed);
 void nbl_decrypt_buffer(struct bf_ctx *pCtx, char* pstrBuffer, int iSize);
 void nbl_decrypt_headers(struct bf_ctx *pCtx, char* pstrBuffer, int iHeaderChunksPos);
+void nbl_encrypt_buffer(struct bf_ctx *pCtx, char* pstrBuffer, int iSize);
+void nbl_encrypt_headers(struct bf_ctx *pCtx, char* pstrBuffer, int iHeaderChunksPos);
+void nbl_rekey_buffer(struct bf_ctx *pOldCtx, struct bf_ctx *pNewCtx, char* pstrBuffer, int iSize);
+void nbl_rekey_headers(struct bf_ctx *pOldCtx, struct bf_ctx *pNewCtx, char* pstrBuffer, int iHeaderChunksPos);
 
 /* Decompression */
 
+#define NBL_ERROR_ARGS		-1 /* Invalid arguments. */
+#define NBL_ERROR_TRUNCATED	-2 /* The source ended before the end marker. */
+#define NBL_ERROR_OVERFLOW	-3 /* The output doesn't fit in the destination. */
+#define NBL_ERROR_BACKREF	-4 /* A back-reference points before the start of the output. */
+#define NBL_ERROR_MEMORY	-5
+#define NBL_ERROR_IO		-6 /* An extracted file couldn't be written. */
+
 int nbl_is_compressed(char* pstrBuffer);
 int nbl_decompress(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize);
+int nbl_decompress_inplace_size(char* pstrSrc, int iSrcSize, int iDestSize);
+
+#include <sys/types.h>
+off_t nbl_find_data_pos(FILE* pFile, off_t iSectionPos, char* pstrHeader);
+char* nbl_load_data_inplace(FILE* pFile, off_t iSectionPos, char* pstrHeader, struct bf_ctx* pCtx, int* piRet);
+
+/* Random access into compressed data */
+
+#define NBL_ID_INDEX			0x494C424E /* Checkpoint index file. */
+#define NBL_INDEX_HEADER_SIZE	0x20
+#define NBL_WINDOW_SIZE			0x2000 /* Farthest back-reference. */
+#define NBL_MAX_COUNT			0x100 /* Longest back-reference. */
+
+typedef struct {
+	unsigned int uSrcPos;
+	unsigned int uDestPos;
+	unsigned int uControlByteCounter;
+	unsigned int uControlByte;
+	unsigned char aWindow[NBL_WINDOW_SIZE]; /* Output preceding uDestPos. */
+} nbl_checkpoint;
+
+/* Identifies the archive an index was built from. */
+#define NBL_INDEX_STAMP_BLOCKS		16
+#define NBL_INDEX_STAMP_BLOCK_SIZE	0x1000
+
+typedef struct {
+	unsigned int uDataSize;
+	unsigned int uCompressedSize;
+	unsigned int uCrc; /* CRC32C of the headers and of sampled blocks of the data, as stored. */
+} nbl_index_stamp;
+
+nbl_checkpoint* nbl_decompress_index(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize, int iInterval, int* piCount);
+nbl_checkpoint* nbl_find_checkpoint(nbl_checkpoint* pCheckpoints, int iCount, int iPos);
+int nbl_decompress_range(char* pstrSrc, int iSrcSize, nbl_checkpoint* pCheckpoint, char* pstrDest, int iPos, int iSize);
+void nbl_index_stamp_init(char* pstrBuffer, nbl_index_stamp* pStamp);
+int nbl_index_save(char* pstrFilename, nbl_index_stamp* pStamp, nbl_checkpoint* pCheckpoints, int iCount, int iInterval);
+nbl_checkpoint* nbl_index_load(char* pstrFilename, nbl_index_stamp* pStamp, int* piCount);
+
+/* Stream profiling */
+
+#define NBL_PROFILE_BUCKETS 24 /* Bucket i counts values from 2^i to 2^(i+1) - 1. */
+
+typedef struct {
+	unsigned long long ullStreams;
+	unsigned long long ullSrcSize; /* Bytes consumed, up to the end marker. */
+	unsigned long long ullDestSize; /* Bytes produced. */
+	unsigned long long ullLiterals;
+	unsigned long long ullShortMatches;
+	unsigned long long ullLongMatches;
+	unsigned long long ullExtendedMatches; /* Long matches with a count byte. */
+	unsigned long long ullEndMarkers;
+	unsigned long long aLiteralRuns[NBL_PROFILE_BUCKETS];
+	unsigned long long aMatchLengths[NBL_MAX_COUNT + 1];
+	unsigned long long aShortDistances[NBL_PROFILE_BUCKETS];
+	unsigned long long aLongDistances[NBL_PROFILE_BUCKETS];
+	unsigned int uLiteralRun; /* Run in progress while decoding. */
+} nbl_profile;
+
+int nbl_decompress_profile(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize, nbl_profile* pProfile);
+void nbl_profile_merge(nbl_profile* pTotal, nbl_profile* pProfile);
+
+/* Threads */
+
+#include "compat.h"
+
+/* Compression */
+
+#define NBL_COMPRESS_BOUND(size) ((size) + (size) / 8 + 16)
+
+int nbl_compress(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize);
+int nbl_compress_parallel(char* pstrSrc, int iSrcSize, char* pstrDest, int iDestSize, int iNbThreads, int iSeed);
+
+/* Creation */
+
+char* nbl_build(char** ppstrNames, char** ppstrFiles, int* piFileSizes, int iNbFiles, unsigned int uKeySeed, int iCompress, int* piSize);
 
 /* List and extract contents */
 
+#include "manifest.h"
+
+int nbl_find_file(char* pstrBuffer, int iHeaderChunksPos, char* pstrName);
 void nbl_list_files(char* pstrBuffer, int iHeaderChunksPos);
-void nbl_extract_all(char* pstrBuffer, char* pstrData, char* pstrDestPath);
+void nbl_list_files_details(char* pstrBuffer, int iHeaderChunksPos);
+void nbl_extract_all(char* pstrBuffer, int iHeaderChunksPos, char* pstrData, char* pstrDestPath, struct manifest_ctx* pManifest);
+int nbl_extract_stream(FILE* pFile, char* pstrDestPath, struct manifest_ctx* pManifest);
+
+/* Streaming decoding */
+
+typedef int (*nbl_stream_func)(void* pArg, unsigned int uPos, char* pstrData, unsigned int uSize);
+
+int nbl_decode_stream(FILE* pFile, char* pstrHeader, struct bf_ctx* pCtx, nbl_stream_func pFunc, void* pArg);
+
+/* Cache of decoded data */
+
+#define NBL_CACHE_SUFFIX		".nbd"
+#define NBL_CACHE_DEFAULT_SIZE	1024 /* In MB. */
+
+unsigned long long nbl_cache_key(char* pstrHeader, struct stat* pStat);
+char* nbl_cache_get(char* pstrCachePath, unsigned long long ullKey, char* pstrSection, int iSize);
+void nbl_cache_release(char* pstrData, int iSize);
+int nbl_cache_evict(char* pstrCachePath, unsigned long long ullMaxSize);
+int nbl_cache_put(char* pstrCachePath, unsigned long long ullKey, char* pstrSection, char* pstrData, int iSize);
 
 #endif /* __GASETOOLS_NBL_H__ */
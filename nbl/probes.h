@@ -0,0 +1,66 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GASETOOLS_PROBES_H__
+#define __GASETOOLS_PROBES_H__
+
+/*
+ * Static tracepoints (USDT) of the gasetools provider, for bpftrace or perf:
+ *
+ *   load__start(filename)                     load__end(filename, size or -1)
+ *   decrypt_headers__start(buffer, chunks)    decrypt_headers__end(buffer, chunks)
+ *   decrypt__start(buffer, size)              decrypt__end(buffer, size)
+ *   decompress__start(src, srcsize, destsize) decompress__end(src, result)
+ *   extract__start(buffer, chunks)            extract__end(buffer, chunks)
+ *   afs_extract_all__start(buffer, chunks)    afs_extract_all__end(buffer, chunks)
+ *   afs_extract__start(filename)              afs_extract__end(filename, result)
+ *   fpb_scan__start(filename)                 fpb_scan__end(filename, files, size)
+ *
+ * The buffer or filename identifies the archive. For example:
+ *   bpftrace -e 'usdt:./nbl:gasetools:decompress__start { @t[arg0] = nsecs; }
+ *     usdt:./nbl:gasetools:decompress__end { @us = hist((nsecs - @t[arg0]) / 1000); }'
+ *
+ * A probe is a single nop until a tracer attaches to it. Without sys/sdt.h,
+ * or with GASETOOLS_NO_PROBES defined, the probes compile to nothing.
+ */
+
+#if !defined(GASETOOLS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define GASETOOLS_PROBES
+#endif
+#endif
+
+#ifdef GASETOOLS_PROBES
+
+#include <sys/sdt.h>
+
+#define NBL_PROBE1(name, a)			DTRACE_PROBE1(gasetools, name, a)
+#define NBL_PROBE2(name, a, b)		DTRACE_PROBE2(gasetools, name, a, b)
+#define NBL_PROBE3(name, a, b, c)	DTRACE_PROBE3(gasetools, name, a, b, c)
+
+#else
+
+#define NBL_PROBE1(name, a)			do { } while (0)
+#define NBL_PROBE2(name, a, b)		do { } while (0)
+#define NBL_PROBE3(name, a, b, c)	do { } while (0)
+
+#endif
+
+#endif /* __GASETOOLS_PROBES_H__ */
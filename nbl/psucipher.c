@@ -0,0 +1,132 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "psucipher.h"
+
+/*
+ * Fill the state from the seed then shuffle it four times.
+ * Indexes 0 and 56 are never used by the keystream.
+ */
+void psu_cipher_init(struct psu_cipher_ctx *ctx, unsigned int seed)
+{
+	unsigned int next = 1, tmp;
+	int count;
+
+	memset(ctx->s, 0, sizeof(ctx->s));
+	ctx->s[55] = seed;
+	ctx->s[56] = seed;
+
+	for (count = 21; count <= 1134; count += 21) {
+		ctx->s[count % 55] = next;
+		tmp = seed - next;
+		seed = next;
+		next = tmp;
+	}
+
+	psu_cipher_shuffle(ctx->s);
+	psu_cipher_shuffle(ctx->s);
+	psu_cipher_shuffle(ctx->s);
+	psu_cipher_shuffle(ctx->s);
+
+	ctx->acc = PSU_CIPHER_ACC_INIT;
+}
+
+void psu_cipher_shuffle(unsigned int *s)
+{
+	int i;
+
+	for (i = 1; i < 25; i++)
+		s[i] -= s[i + 31];
+	for (i = 25; i < 56; i++)
+		s[i] -= s[i - 24];
+}
+
+/*
+ * XOR a run of little-endian 32-bit words with the keystream words.
+ * Written as a plain loop over 64-bit words so that the compiler vectorizes it.
+ */
+static void psu_cipher_xor(unsigned char *dst, const unsigned char *src, const unsigned int *key, unsigned int words)
+{
+	unsigned long long a, b;
+	unsigned int i;
+
+	for (i = 0; i + 2 <= words; i += 2) {
+		memcpy(&a, src + i * 4, 8);
+		memcpy(&b, key + i, 8);
+		a ^= b;
+		memcpy(dst + i * 4, &a, 8);
+	}
+
+	if (i < words) {
+		memcpy(&a, src + i * 4, 4);
+		a ^= key[i];
+		memcpy(dst + i * 4, &a, 4);
+	}
+}
+
+/*
+ * Encrypt or decrypt len bytes from src into dst, which may be the same buffer.
+ * Returns the number of bytes written: like the Erlang version, a trailing
+ * incomplete word is dropped.
+ *
+ * NOTE: The Erlang version only keeps the state shuffled when a packet starts
+ * a new round. Rounds started in the middle of a packet use a shuffled copy
+ * that is thrown away afterwards, and a packet ending exactly on a round
+ * boundary restarts at 1 without shuffling. This is reproduced here.
+ */
+unsigned int psu_cipher(struct psu_cipher_ctx *ctx, unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+	unsigned int tmp[PSU_CIPHER_STATE_SIZE];
+	const unsigned int *key = ctx->s;
+	unsigned int acc = ctx->acc;
+	unsigned int words = len / 4;
+	unsigned int run;
+
+	if (acc == PSU_CIPHER_ACC_INIT) {
+		psu_cipher_shuffle(ctx->s);
+		acc = 1;
+	}
+
+	while (words > 0) {
+		if (acc == PSU_CIPHER_ACC_INIT) {
+			if (key == ctx->s) {
+				memcpy(tmp, ctx->s, sizeof(tmp));
+				key = tmp;
+			}
+			psu_cipher_shuffle(tmp);
+			acc = 1;
+		}
+
+		/* The keystream for a round is the state words from acc to 55. */
+		run = PSU_CIPHER_ACC_INIT - acc;
+		if (run > words)
+			run = words;
+
+		psu_cipher_xor(dst, src, key + acc, run);
+		dst += run * 4;
+		src += run * 4;
+		words -= run;
+		acc += run;
+	}
+
+	ctx->acc = acc == PSU_CIPHER_ACC_INIT ? 1 : acc;
+	return len & ~3;
+}
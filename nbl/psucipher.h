@@ -0,0 +1,42 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __PSUCIPHER_H__
+#define __PSUCIPHER_H__
+
+/*
+ * Subtractive generator stream cipher used by the PSU patch and download servers.
+ * This is a port of cipher_init/cipher_shuffle/cipher from proxy/psu_patch.erl
+ * and must stay byte-identical to it.
+ */
+
+#define PSU_CIPHER_STATE_SIZE	57
+#define PSU_CIPHER_ACC_INIT		56 /* Accumulator value starting a new round. */
+
+struct psu_cipher_ctx {
+	unsigned int s[PSU_CIPHER_STATE_SIZE];
+	unsigned int acc;
+};
+
+void psu_cipher_init(struct psu_cipher_ctx *ctx, unsigned int seed);
+void psu_cipher_shuffle(unsigned int *s);
+unsigned int psu_cipher(struct psu_cipher_ctx *ctx, unsigned char *dst, const unsigned char *src, unsigned int len);
+
+#endif /* __PSUCIPHER_H__ */
@@ -0,0 +1,571 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "watch.h"
+
+#ifdef __linux__
+
+#include <ftw.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#define WATCH_BUFFER_SIZE 0x10000 /* Read size for inotify events. */
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR)
+
+/**
+ * File waiting for its writes to settle before being extracted.
+ */
+
+typedef struct {
+	char* pstrName; /* Relative to the source path. */
+	long long llDeadline; /* In ms. */
+} watch_pending;
+
+/**
+ * Watcher state. Names are relative to the source and destination paths,
+ * the root being the empty string.
+ */
+
+typedef struct {
+	char* pstrSrcPath;
+	char* pstrDestPath;
+	watch_extract_func pExtract;
+	void* pArg;
+	int iVerbose;
+	int iFd;
+	char** ppstrDirs; /* Directory of each watch descriptor, or NULL. */
+	int iNbDirs;
+	watch_pending* pPending;
+	int iNbPending;
+	int iMaxPending;
+} watch_ctx;
+
+static long long watch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Build the path of a name below a base path, returning -1 if it doesn't fit.
+ * An empty base gives a relative name.
+ */
+
+static int watch_path(char* pstrPath, char* pstrBase, char* pstrName)
+{
+	int iLen;
+
+	if (*pstrBase == 0)
+		iLen = snprintf(pstrPath, FILENAME_MAX, "%s", pstrName);
+	else if (*pstrName == 0)
+		iLen = snprintf(pstrPath, FILENAME_MAX, "%s", pstrBase);
+	else
+		iLen = snprintf(pstrPath, FILENAME_MAX, "%s/%s", pstrBase, pstrName);
+
+	return iLen < FILENAME_MAX ? 0 : -1;
+}
+
+static int watch_remove_entry(const char* pstrPath, const struct stat* pStat, int iFlag, struct FTW* pFtw)
+{
+	(void)pStat;
+	(void)iFlag;
+	(void)pFtw;
+
+	return remove(pstrPath);
+}
+
+/**
+ * Remove a file or a directory and its contents, if it exists.
+ */
+
+static void watch_remove(char* pstrPath)
+{
+	struct stat st;
+
+	if (lstat(pstrPath, &st) == 0)
+		nftw(pstrPath, watch_remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Create a directory and its missing parents.
+ */
+
+static void watch_mkdirs(char* pstrPath)
+{
+	char pstrTmp[FILENAME_MAX];
+	char* p;
+
+	snprintf(pstrTmp, FILENAME_MAX, "%s", pstrPath);
+	for (p = pstrTmp + 1; *p; p++) {
+		if (*p == '/') {
+			*p = 0;
+			mkdir(pstrTmp, 0777);
+			*p = '/';
+		}
+	}
+
+	mkdir(pstrTmp, 0777);
+}
+
+static void watch_log(watch_ctx* w, char* pstrAction, char* pstrName)
+{
+	if (w->iVerbose) {
+		printf("%s %s\n", pstrAction, pstrName);
+		fflush(stdout);
+	}
+}
+
+/**
+ * Remove the output of a name of the source tree.
+ */
+
+static void watch_remove_output(watch_ctx* w, char* pstrName)
+{
+	char pstrDest[FILENAME_MAX];
+
+	if (watch_path(pstrDest, w->pstrDestPath, pstrName) == 0 && access(pstrDest, F_OK) == 0) {
+		watch_remove(pstrDest);
+		watch_log(w, "removed", pstrName);
+	}
+}
+
+/**
+ * Extract a file of the source tree next to its output, then replace the output,
+ * so that entries gone from the archive don't stay around. The output of a file
+ * that is gone or isn't an archive is removed.
+ */
+
+static int watch_extract(watch_ctx* w, char* pstrName)
+{
+	struct stat st;
+	char pstrSrc[FILENAME_MAX];
+	char pstrDest[FILENAME_MAX];
+	char pstrTmp[FILENAME_MAX];
+	int ret;
+
+	if (watch_path(pstrSrc, w->pstrSrcPath, pstrName) != 0 || watch_path(pstrDest, w->pstrDestPath, pstrName) != 0
+		|| snprintf(pstrTmp, FILENAME_MAX, "%s" WATCH_TMP_SUFFIX, pstrDest) >= FILENAME_MAX) {
+		fprintf(stderr, "Path too long: %s\n", pstrName);
+		return -1;
+	}
+
+	if (stat(pstrSrc, &st) != 0) {
+		if (errno == ENOENT)
+			watch_remove_output(w, pstrName);
+		return 0;
+	}
+
+	if (!S_ISREG(st.st_mode))
+		return 0;
+
+	watch_remove(pstrTmp);
+	watch_mkdirs(pstrTmp);
+
+	ret = w->pExtract(pstrSrc, pstrTmp, w->pArg);
+	if (ret == 0) {
+		watch_remove(pstrDest);
+		if (rename(pstrTmp, pstrDest) != 0)
+			ret = -1;
+	}
+
+	if (ret != 0)
+		watch_remove(pstrTmp);
+
+	if (ret == 0)
+		watch_log(w, "extracted", pstrName);
+	else if (ret == WATCH_SKIP)
+		watch_remove_output(w, pstrName);
+	else
+		fprintf(stderr, "Error extracting %s\n", pstrSrc);
+
+	return ret;
+}
+
+/**
+ * Extract the file once no event was received for it during the debounce time.
+ * Files that were modified but not closed yet get a longer time.
+ */
+
+static void watch_queue(watch_ctx* w, char* pstrName, int iOpen)
+{
+	watch_pending* pTmp;
+	int i;
+
+	for (i = 0; i < w->iNbPending; i++)
+		if (strcmp(w->pPending[i].pstrName, pstrName) == 0)
+			break;
+
+	if (i == w->iNbPending) {
+		if (w->iNbPending == w->iMaxPending) {
+			pTmp = realloc(w->pPending, (w->iMaxPending ? w->iMaxPending * 2 : 64) * sizeof(watch_pending));
+			if (pTmp == NULL)
+				return;
+			w->pPending = pTmp;
+			w->iMaxPending = w->iMaxPending ? w->iMaxPending * 2 : 64;
+		}
+
+		w->pPending[i].pstrName = strdup(pstrName);
+		if (w->pPending[i].pstrName == NULL)
+			return;
+		w->iNbPending++;
+	}
+
+	w->pPending[i].llDeadline = watch_now() + (iOpen ? WATCH_DEBOUNCE_OPEN : WATCH_DEBOUNCE);
+}
+
+static void watch_unqueue_at(watch_ctx* w, int i)
+{
+	free(w->pPending[i].pstrName);
+	w->pPending[i] = w->pPending[--w->iNbPending];
+}
+
+/**
+ * Return whether pstrName is pstrDir or below it.
+ */
+
+static int watch_is_below(char* pstrName, char* pstrDir)
+{
+	size_t iLen = strlen(pstrDir);
+
+	return strncmp(pstrName, pstrDir, iLen) == 0 && (pstrName[iLen] == 0 || pstrName[iLen] == '/');
+}
+
+/**
+ * Forget the files pending below the name and stop watching the directories there.
+ */
+
+static void watch_forget(watch_ctx* w, char* pstrName)
+{
+	int i;
+
+	for (i = 0; i < w->iNbPending; ) {
+		if (watch_is_below(w->pPending[i].pstrName, pstrName))
+			watch_unqueue_at(w, i);
+		else
+			i++;
+	}
+
+	for (i = 0; i < w->iNbDirs; i++)
+		if (w->ppstrDirs[i] && *w->ppstrDirs[i] && watch_is_below(w->ppstrDirs[i], pstrName))
+			inotify_rm_watch(w->iFd, i);
+}
+
+static int watch_add(watch_ctx* w, char* pstrName, char* pstrPath)
+{
+	char** ppTmp;
+	char* pstrDir;
+	int iWd;
+
+	iWd = inotify_add_watch(w->iFd, pstrPath, WATCH_EVENTS);
+	if (iWd < 0)
+		return -1;
+
+	if (iWd >= w->iNbDirs) {
+		ppTmp = realloc(w->ppstrDirs, (iWd + 64) * sizeof(char*));
+		if (ppTmp == NULL)
+			return -1;
+		memset(ppTmp + w->iNbDirs, 0, (iWd + 64 - w->iNbDirs) * sizeof(char*));
+		w->ppstrDirs = ppTmp;
+		w->iNbDirs = iWd + 64;
+	}
+
+	/* A directory moved inside the tree keeps its watch descriptor. */
+	pstrDir = strdup(pstrName);
+	if (pstrDir == NULL)
+		return -1;
+	free(w->ppstrDirs[iWd]);
+	w->ppstrDirs[iWd] = pstrDir;
+
+	return 0;
+}
+
+/**
+ * Remove the outputs in the destination directory whose source is gone.
+ */
+
+static void watch_prune(watch_ctx* w, char* pstrName)
+{
+	struct dirent* pEntry;
+	struct stat st;
+	DIR* pDir;
+	char pstrPath[FILENAME_MAX];
+	char pstrChild[FILENAME_MAX];
+
+	if (watch_path(pstrPath, w->pstrDestPath, pstrName) != 0)
+		return;
+
+	pDir = opendir(pstrPath);
+	if (pDir == NULL)
+		return;
+
+	while ((pEntry = readdir(pDir)) != NULL) {
+		if (strcmp(pEntry->d_name, ".") == 0 || strcmp(pEntry->d_name, "..") == 0)
+			continue;
+
+		if (watch_path(pstrChild, pstrName, pEntry->d_name) != 0 || watch_path(pstrPath, w->pstrSrcPath, pstrChild) != 0)
+			continue;
+
+		if (lstat(pstrPath, &st) != 0 && errno == ENOENT)
+			watch_remove_output(w, pstrChild);
+	}
+
+	closedir(pDir);
+}
+
+/**
+ * Watch the directory and the directories below it, then extract the files found there
+ * and remove the outputs whose source is gone. The directory is watched before being
+ * read so that no change is missed. Outputs at least as recent as their file are kept,
+ * so that only what changed is extracted again when the watcher is restarted.
+ * With iQueue the files are queued instead, as they may still be written.
+ */
+
+static int watch_scan(watch_ctx* w, char* pstrName, int iQueue)
+{
+	struct dirent* pEntry;
+	struct stat st, stDest;
+	DIR* pDir;
+	char pstrPath[FILENAME_MAX];
+	char pstrChild[FILENAME_MAX];
+
+	if (watch_path(pstrPath, w->pstrSrcPath, pstrName) != 0 || watch_add(w, pstrName, pstrPath) != 0) {
+		fprintf(stderr, "Error watching %s\n", pstrPath);
+		return -1;
+	}
+
+	pDir = opendir(pstrPath);
+	if (pDir == NULL)
+		return -1;
+
+	while ((pEntry = readdir(pDir)) != NULL) {
+		if (strcmp(pEntry->d_name, ".") == 0 || strcmp(pEntry->d_name, "..") == 0)
+			continue;
+
+		if (watch_path(pstrChild, pstrName, pEntry->d_name) != 0 || watch_path(pstrPath, w->pstrSrcPath, pstrChild) != 0
+			|| stat(pstrPath, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			watch_scan(w, pstrChild, iQueue);
+		else if (!S_ISREG(st.st_mode))
+			continue;
+		else if (iQueue)
+			watch_queue(w, pstrChild, 0);
+		else if (watch_path(pstrPath, w->pstrDestPath, pstrChild) != 0 || stat(pstrPath, &stDest) != 0 || !S_ISDIR(stDest.st_mode)
+			|| stDest.st_mtim.tv_sec < st.st_mtim.tv_sec
+			|| (stDest.st_mtim.tv_sec == st.st_mtim.tv_sec && stDest.st_mtim.tv_nsec < st.st_mtim.tv_nsec))
+			watch_extract(w, pstrChild);
+	}
+
+	closedir(pDir);
+
+	watch_prune(w, pstrName);
+	return 0;
+}
+
+/**
+ * Handle an inotify event. Returns -1 when the source path itself is gone.
+ */
+
+static int watch_event(watch_ctx* w, struct inotify_event* pEvent)
+{
+	char pstrName[FILENAME_MAX];
+
+	/* Events were lost; compare the whole tree again. */
+	if (pEvent->mask & IN_Q_OVERFLOW)
+		return watch_scan(w, "", 0);
+
+	if (pEvent->wd < 0 || pEvent->wd >= w->iNbDirs || w->ppstrDirs[pEvent->wd] == NULL)
+		return 0;
+
+	if (pEvent->mask & IN_IGNORED) {
+		if (*w->ppstrDirs[pEvent->wd] == 0)
+			return -1;
+
+		free(w->ppstrDirs[pEvent->wd]);
+		w->ppstrDirs[pEvent->wd] = NULL;
+		return 0;
+	}
+
+	if (pEvent->len == 0 || watch_path(pstrName, w->ppstrDirs[pEvent->wd], pEvent->name) != 0)
+		return 0;
+
+	if (pEvent->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		watch_forget(w, pstrName);
+		watch_remove_output(w, pstrName);
+	} else if (pEvent->mask & IN_ISDIR) {
+		if (pEvent->mask & (IN_CREATE | IN_MOVED_TO))
+			watch_scan(w, pstrName, 1);
+	} else if (pEvent->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+		watch_queue(w, pstrName, 0);
+	else if (pEvent->mask & (IN_CREATE | IN_MODIFY))
+		watch_queue(w, pstrName, 1);
+
+	return 0;
+}
+
+/**
+ * Wait for events, extracting the files whose writes have settled in the meantime.
+ */
+
+static int watch_loop(watch_ctx* w)
+{
+	struct inotify_event* pEvent;
+	struct pollfd pfd;
+	char* pstrBuffer;
+	char pstrName[FILENAME_MAX];
+	long long llNow, llNext;
+	ssize_t iRead, i;
+	int j;
+	int ret = 0;
+
+	pstrBuffer = malloc(WATCH_BUFFER_SIZE);
+	if (pstrBuffer == NULL)
+		return -3;
+
+	pfd.fd = w->iFd;
+	pfd.events = POLLIN;
+
+	while (ret == 0) {
+		llNext = -1;
+		for (j = 0; j < w->iNbPending; ) {
+			llNow = watch_now();
+			if (w->pPending[j].llDeadline <= llNow) {
+				snprintf(pstrName, FILENAME_MAX, "%s", w->pPending[j].pstrName);
+				watch_unqueue_at(w, j);
+				watch_extract(w, pstrName);
+				continue;
+			}
+
+			if (llNext < 0 || w->pPending[j].llDeadline < llNext)
+				llNext = w->pPending[j].llDeadline;
+			j++;
+		}
+
+		llNow = watch_now();
+		if (poll(&pfd, 1, llNext < 0 ? -1 : llNext > llNow ? (int)(llNext - llNow) : 0) < 0) {
+			if (errno != EINTR)
+				ret = -1;
+			continue;
+		}
+
+		if (!(pfd.revents & POLLIN))
+			continue;
+
+		iRead = read(w->iFd, pstrBuffer, WATCH_BUFFER_SIZE);
+		if (iRead < 0) {
+			if (errno != EINTR)
+				ret = -1;
+			continue;
+		}
+
+		for (i = 0; i < iRead && ret == 0; i += sizeof(struct inotify_event) + pEvent->len) {
+			pEvent = (struct inotify_event*)(pstrBuffer + i);
+			if (watch_event(w, pEvent) < 0) {
+				fprintf(stderr, "Source path %s is gone\n", w->pstrSrcPath);
+				ret = -1;
+			}
+		}
+	}
+
+	free(pstrBuffer);
+	return ret;
+}
+
+/**
+ * Extract the archives of the source tree to the destination tree, then keep
+ * the destination up to date until the source path is removed or an error occurs.
+ * Archives created or modified are extracted again once their writes have settled,
+ * and the outputs of those removed are removed. Work depends on what changed only.
+ * Returns a negative value on error.
+ */
+
+int watch_tree(char* pstrSrcPath, char* pstrDestPath, watch_extract_func pExtract, void* pArg, int iVerbose)
+{
+	watch_ctx w;
+	char pstrSrc[PATH_MAX];
+	char pstrDest[PATH_MAX];
+	int i, ret;
+
+	/* Outputs written below the source path would be seen as changes. */
+	watch_mkdirs(pstrDestPath);
+	if (realpath(pstrSrcPath, pstrSrc) == NULL || realpath(pstrDestPath, pstrDest) == NULL) {
+		fprintf(stderr, "Error opening %s or %s\n", pstrSrcPath, pstrDestPath);
+		return -1;
+	}
+	if (watch_is_below(pstrDest, pstrSrc)) {
+		fprintf(stderr, "The destination path can't be inside the source path.\n");
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.pstrSrcPath = pstrSrcPath;
+	w.pstrDestPath = pstrDestPath;
+	w.pExtract = pExtract;
+	w.pArg = pArg;
+	w.iVerbose = iVerbose;
+
+	w.iFd = inotify_init();
+	if (w.iFd < 0)
+		return -1;
+
+	ret = watch_scan(&w, "", 0);
+	if (ret == 0) {
+		watch_log(&w, "watching", pstrSrcPath);
+		ret = watch_loop(&w);
+	}
+
+	close(w.iFd);
+	for (i = 0; i < w.iNbDirs; i++)
+		free(w.ppstrDirs[i]);
+	free(w.ppstrDirs);
+	for (i = 0; i < w.iNbPending; i++)
+		free(w.pPending[i].pstrName);
+	free(w.pPending);
+
+	return ret;
+}
+
+#else
+
+int watch_tree(char* pstrSrcPath, char* pstrDestPath, watch_extract_func pExtract, void* pArg, int iVerbose)
+{
+	(void)pstrDestPath;
+	(void)pExtract;
+	(void)pArg;
+	(void)iVerbose;
+
+	fprintf(stderr, "Watching %s requires inotify, which isn't available on this system.\n", pstrSrcPath);
+	return -1;
+}
+
+#endif
@@ -0,0 +1,43 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __GASETOOLS_WATCH_H__
+#define __GASETOOLS_WATCH_H__
+
+/*
+ * Watch a tree of archives and keep their extracted copies up to date.
+ * The files of the source tree are extracted to directories of the same name
+ * in the destination tree, e.g. data/a/b.nbl to out/a/b.nbl/.
+ */
+
+#define WATCH_SKIP 1 /* Returned by the extract function for files that aren't archives. */
+
+#define WATCH_DEBOUNCE		300		/* In ms; time without events before a closed file is extracted. */
+#define WATCH_DEBOUNCE_OPEN	5000	/* In ms; same for files that are still open for writing. */
+
+#define WATCH_TMP_SUFFIX ".tmp~" /* Directory receiving an extraction in progress. */
+
+/* Extract the archive to the existing directory pstrDestPath.
+   Returns 0, WATCH_SKIP or a negative value on error. */
+typedef int (*watch_extract_func)(char* pstrFilename, char* pstrDestPath, void* pArg);
+
+int watch_tree(char* pstrSrcPath, char* pstrDestPath, watch_extract_func pExtract, void* pArg, int iVerbose);
+
+#endif /* __GASETOOLS_WATCH_H__ */
@@ -0,0 +1,74 @@
+-module(psu_capture).
+-export([open/1, attach/2, write/5]).
+
+% Append-only capture log for one proxy session.
+%
+% A single process owns the file and writes through a large delayed_write
+% buffer, so proxies never wait on the disk. The file is closed and indexed
+% once every attached process has exited. All integers are little endian:
+%
+%   header:  "PSUC", version:32
+%   record:  timestamp:64 (microseconds), number:32, direction:8, padding:24,
+%            raw size:32, decrypted size:32, raw data, decrypted data
+%   index:   record offset:64 for each record
+%   footer:  index offset:64, record count:32, "PSUI"
+
+-define(FILE_MAGIC, "PSUC").
+-define(INDEX_MAGIC, "PSUI").
+-define(VERSION, 1).
+-define(HEADER_SIZE, 8).
+
+-define(BUFFER_SIZE, 1048576).
+-define(BUFFER_DELAY, 2000).
+
+% open: start the process writing Name-Timestamp.psucap
+
+open(Name) ->
+	{Mega, Sec, Micro} = os:timestamp(),
+	Filename = lists:concat([Name, "-", Mega * 1000000 + Sec, "-", Micro, ".psucap"]),
+	spawn(fun() -> init(Filename) end).
+
+% attach: keep the capture open until Pid exits
+
+attach(Capture, Pid) ->
+	Capture ! {attach, Pid},
+	ok.
+
+% write: Direction is client for packets sent by the client, server otherwise
+
+write(Capture, Direction, Number, Raw, Decrypted) ->
+	{Mega, Sec, Micro} = os:timestamp(),
+	Capture ! {write, (Mega * 1000000 + Sec) * 1000000 + Micro, Direction, Number, Raw, Decrypted},
+	ok.
+
+init(Filename) ->
+	{ok, File} = file:open(Filename, [write, raw, binary, {delayed_write, ?BUFFER_SIZE, ?BUFFER_DELAY}]),
+	ok = file:write(File, <<?FILE_MAGIC, ?VERSION:32/little-unsigned-integer>>),
+	loop(File, ?HEADER_SIZE, [], 0).
+
+loop(File, Offset, Index, Attached) ->
+	receive
+		{attach, Pid} ->
+			erlang:monitor(process, Pid),
+			loop(File, Offset, Index, Attached + 1);
+		{write, Timestamp, Direction, Number, Raw, Decrypted} ->
+			Record = <<Timestamp:64/little-unsigned-integer, Number:32/little-unsigned-integer,
+				(direction(Direction)):8, 0:24,
+				(byte_size(Raw)):32/little-unsigned-integer, (byte_size(Decrypted)):32/little-unsigned-integer,
+				Raw/binary, Decrypted/binary>>,
+			ok = file:write(File, Record),
+			loop(File, Offset + byte_size(Record), [Offset|Index], Attached);
+		{'DOWN', _, process, _, _} when Attached > 1 ->
+			loop(File, Offset, Index, Attached - 1);
+		{'DOWN', _, process, _, _} ->
+			close(File, Offset, Index)
+	end.
+
+close(File, Offset, Index) ->
+	Offsets = << <<O:64/little-unsigned-integer>> || O <- lists:reverse(Index) >>,
+	ok = file:write(File, <<Offsets/binary, Offset:64/little-unsigned-integer,
+		(length(Index)):32/little-unsigned-integer, ?INDEX_MAGIC>>),
+	file:close(File).
+
+direction(client) -> 0;
+direction(server) -> 1.
@@ -0,0 +1,55 @@
+-module(psu_cipher).
+-export([init/1, cipher/3]).
+-on_load(load_nif/0).
+
+% Stream cipher used by the patch and download servers.
+% The NIF in psu_cipher_nif.c replaces init/1 and cipher/3 when it can be loaded;
+% the Erlang versions below are used otherwise and both give identical results.
+
+load_nif() ->
+	Path = filename:join(filename:dirname(code:which(?MODULE)), "psu_cipher_nif"),
+	case erlang:load_nif(Path, 0) of
+		ok ->
+			ok;
+		{error, {Reason, Text}} ->
+			io:format("psu_cipher: using the Erlang cipher (~p: ~s)~n", [Reason, Text]),
+			ok
+	end.
+
+% init
+
+init(Seed) ->
+	State = array:set(56, Seed, array:set(55, Seed, array:new(57))),
+	shuffle(shuffle(shuffle(shuffle(init(Seed, 1, 21, State))))).
+
+init(Seed, Next, Count, State) when Count =< 1134 ->
+	init(Next, sub32(Seed, Next), Count + 21, array:set(Count rem 55, Next, State));
+init(_, _, _, State) ->
+	State.
+
+% shuffle
+
+shuffle(State) ->
+	shuffle(shuffle(State, 1, 24, 31), 25, 31, -24).
+
+shuffle(State, Index, Count, Inc) when Count > 0 ->
+	shuffle(array:set(Index, sub32(array:get(Index, State), array:get(Index + Inc, State)), State), Index + 1, Count - 1, Inc);
+shuffle(State, _, _, _) ->
+	State.
+
+% sub32 (32bit round sub)
+
+sub32(A, B) when B > A ->
+	16#100000000 + A - B;
+sub32(A, B) ->
+	A - B.
+
+% cipher
+
+cipher(Data, State, Acc) when Acc == 56 ->
+	cipher(Data, shuffle(State), 1);
+cipher(<<Value:32/little-unsigned-integer, Rest/bits>>, State, Acc) ->
+	{RData, _, RAcc} = cipher(Rest, State, Acc + 1),
+	{<<(Value bxor array:get(Acc, State)):32/little-unsigned-integer, (RData)/bits>>, State, RAcc};
+cipher(_, State, Acc) ->
+	{<<>>, State, Acc}.
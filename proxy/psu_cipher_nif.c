@@ -0,0 +1,88 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "erl_nif.h"
+#include "../nbl/psucipher.h"
+
+/**
+ * NIF versions of psu_cipher:init/1 and psu_cipher:cipher/3.
+ * The state is kept in a binary so that the Erlang API stays functional:
+ * the NIF never modifies the state it was given.
+ */
+
+#define STATE_SIZE (PSU_CIPHER_STATE_SIZE * sizeof(unsigned int))
+
+/* Packets larger than this run on a dirty scheduler. */
+#define DIRTY_THRESHOLD 0x40000
+
+static ERL_NIF_TERM init_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct psu_cipher_ctx ctx;
+	ERL_NIF_TERM state;
+	unsigned int seed;
+
+	if (argc != 1 || !enif_get_uint(env, argv[0], &seed))
+		return enif_make_badarg(env);
+
+	psu_cipher_init(&ctx, seed);
+	memcpy(enif_make_new_binary(env, STATE_SIZE, &state), ctx.s, STATE_SIZE);
+
+	return state;
+}
+
+static ERL_NIF_TERM cipher_nif(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+	struct psu_cipher_ctx ctx;
+	ErlNifBinary data, bin;
+	ERL_NIF_TERM out, state;
+	unsigned char* dst;
+
+	if (argc != 3 || !enif_inspect_binary(env, argv[0], &data)
+		|| !enif_inspect_binary(env, argv[1], &bin) || bin.size != STATE_SIZE
+		|| !enif_get_uint(env, argv[2], &ctx.acc) || ctx.acc == 0 || ctx.acc > PSU_CIPHER_ACC_INIT)
+		return enif_make_badarg(env);
+
+	memcpy(ctx.s, bin.data, STATE_SIZE);
+
+	dst = enif_make_new_binary(env, data.size & ~3, &out);
+	psu_cipher(&ctx, dst, data.data, data.size);
+
+	memcpy(enif_make_new_binary(env, STATE_SIZE, &state), ctx.s, STATE_SIZE);
+
+	return enif_make_tuple3(env, out, state, enif_make_uint(env, ctx.acc));
+}
+
+static ERL_NIF_TERM cipher_nif_dispatch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+{
+	ErlNifBinary data;
+
+	if (argc == 3 && enif_inspect_binary(env, argv[0], &data) && data.size > DIRTY_THRESHOLD)
+		return enif_schedule_nif(env, "cipher", ERL_NIF_DIRTY_JOB_CPU_BOUND, cipher_nif, argc, argv);
+
+	return cipher_nif(env, argc, argv);
+}
+
+static ErlNifFunc nif_funcs[] = {
+	{"init", 1, init_nif, 0},
+	{"cipher", 3, cipher_nif_dispatch, 0}
+};
+
+ERL_NIF_INIT(psu_cipher, nif_funcs, NULL, NULL, NULL, NULL)
@@ -0,0 +1,345 @@
+-module(psu_mirror).
+-export([start/4, listen/3]).
+
+% Caching mirror of the download server.
+%
+% Both directions of each session are split into packets, following the
+% size:32 at the start of every packet, and each packet is deciphered and
+% ciphered again by a single psu_cipher:cipher/3 call, see decipher/2. The
+% server packets received between two client packets are the reply to the
+% client packets so far: they are written to Cache/data/<md5 of the data> and
+% indexed under the md5 of the client packets that led to it, so identical
+% replies are stored once.
+%
+% The cache holds these replies as they were sent, not the files they carry:
+% the download commands aren't documented in this tree, so the transferred
+% files can't be reassembled. A file is only found in the cache when it is
+% requested by the same conversation as when it was recorded.
+%
+% A session is answered from the cache for as long as it follows a recorded
+% conversation; the upstream server isn't even connected. Replies are ciphered
+% again with the keys of the session. On the first packet without a cached
+% reply the upstream server is connected, the client packets so far are sent
+% to it, as much of its output as was already served is dropped, and the
+% session goes on as a caching proxy until it is closed.
+%
+% The hello packet is cached as Cache/hello. The seeds it gives are only used
+% between the mirror and the client, so every session answered from the cache
+% gets new ones.
+
+-define(TCP_OPTIONS, [binary, {packet, 0}, {active, false}, {reuseaddr, true}]).
+
+-define(CHUNK_SIZE, 1048576).
+-define(RECORD_DELAY, 2000).
+
+-record(mirror, {
+	client,			% client socket
+	server,			% upstream socket, undefined while every reply came from the cache
+	upstream,		% {Host, Port} of the upstream server
+	cache,			% cache directory
+	capture,
+	key,			% md5 of the client packets so far
+	history = [],	% client packets answered from the cache, newest first
+	served = 0,		% bytes answered from the cache
+	skip = 0,		% upstream bytes to drop, already answered from the cache
+	record,			% {File, Filename, Md5} of the reply being recorded
+	cin,			% {State, Acc, Buffer} ciphers of each direction, see decipher/2
+	cout,
+	sin,
+	sout,
+	number = 1
+}).
+
+% start: listen on Port and mirror the upstream server at Host:UpstreamPort
+% This is also how to run the mirror against a local stand-in server, see psu_mirror_test.
+
+start(Cache, Port, Host, UpstreamPort) ->
+	spawn(fun() -> listen(Cache, Port, {Host, UpstreamPort}) end).
+
+listen(Cache, Port, Upstream) ->
+	ok = filelib:ensure_dir(filename:join([Cache, "data", "x"])),
+	{ok, LSocket} = gen_tcp:listen(Port, ?TCP_OPTIONS),
+	accept(LSocket, Cache, Upstream).
+
+% accept: the session process receives the client socket's messages,
+% so it must own the socket before it starts reading
+
+accept(LSocket, Cache, Upstream) ->
+	{ok, CSocket} = gen_tcp:accept(LSocket),
+	Capture = psu_capture:open("mirror"),
+	Pid = spawn(fun() -> receive go -> init(CSocket, Cache, Upstream, Capture) end end),
+	ok = gen_tcp:controlling_process(CSocket, Pid),
+	psu_capture:attach(Capture, Pid),
+	Pid ! go,
+	accept(LSocket, Cache, Upstream).
+
+% init: send the hello packet and the reply to the connection itself, if any
+
+init(CSocket, Cache, Upstream, Capture) ->
+	M = #mirror{client = CSocket, upstream = Upstream, cache = Cache, capture = Capture, key = erlang:md5(<<>>)},
+	HelloFilename = filename:join(Cache, "hello"),
+	M2 = case file:read_file(HelloFilename) of
+		{ok, Hello} ->
+			io:format("hello packet from the cache~n"),
+			M1 = hello(fresh_hello(Hello), M),
+			case lookup(Cache, M1#mirror.key) of
+				{ok, Hash, Close} ->
+					serve(Hash, Close, M1);
+				error ->
+					record_start(resync(M1))
+			end;
+		{error, _} ->
+			{Hello, M1} = connect(M),
+			ok = write_file(HelloFilename, Hello),
+			record_start(hello(Hello, M1))
+	end,
+	ok = inet:setopts(CSocket, [{active, once}]),
+	loop(M2).
+
+hello(Hello, M) ->
+	ok = gen_tcp:send(M#mirror.client, Hello),
+	psu_capture:write(M#mirror.capture, server, 0, Hello, Hello),
+	{ServerSeed, ClientSeed} = seeds(Hello),
+	M#mirror{cin = cipher_init(ClientSeed), cout = cipher_init(ServerSeed)}.
+
+% fresh_hello: the cached hello packet with new random seeds
+
+fresh_hello(<<Head:96/bits, _:64, Rest/bits>>) ->
+	<<Head/bits, (crypto:strong_rand_bytes(8))/binary, Rest/bits>>.
+
+% seeds: see psu_patch:patch_proxy_hello/3 for the hello packet layout
+
+seeds(<<_:96, ServerSeed:32/little-unsigned-integer, ClientSeed:32/little-unsigned-integer, _/bits>>) ->
+	{ServerSeed, ClientSeed}.
+
+% connect: the hello packet is read by its size so the data following it isn't lost
+
+connect(M) ->
+	{Host, Port} = M#mirror.upstream,
+	{ok, SSocket} = gen_tcp:connect(Host, Port, ?TCP_OPTIONS),
+	{ok, <<Size:32/little-unsigned-integer>> = Head} = gen_tcp:recv(SSocket, 4),
+	{ok, Body} = gen_tcp:recv(SSocket, Size - 4),
+	{ServerSeed, ClientSeed} = seeds(<<Head/binary, Body/binary>>),
+	ok = inet:setopts(SSocket, [{active, once}]),
+	{<<Head/binary, Body/binary>>, M#mirror{server = SSocket, sin = cipher_init(ServerSeed), sout = cipher_init(ClientSeed)}}.
+
+% resync: bring a new upstream session to where the client is
+
+resync(M) ->
+	io:format("cache miss, connecting to the download server~n"),
+	{_, M2} = connect(M),
+	M3 = lists:foldl(fun send_server/2, M2, lists:reverse(M2#mirror.history)),
+	M3#mirror{history = [], skip = M3#mirror.served}.
+
+loop(M) ->
+	CSocket = M#mirror.client,
+	SSocket = M#mirror.server,
+	receive
+		{tcp, CSocket, Data} ->
+			ok = inet:setopts(CSocket, [{active, once}]),
+			loop(client(Data, M));
+		{tcp, SSocket, Data} ->
+			ok = inet:setopts(SSocket, [{active, once}]),
+			loop(server(Data, M));
+		{tcp_closed, CSocket} ->
+			io:format("socket client closed~n"),
+			record_discard(M),
+			close(SSocket);
+		{tcp_closed, SSocket} ->
+			io:format("socket server closed~n"),
+			record_finish(true, M),
+			gen_tcp:close(CSocket)
+	end.
+
+close(undefined) ->
+	ok;
+close(Socket) ->
+	gen_tcp:close(Socket).
+
+% client: data from the client, handled packet by packet
+
+client(Data, M) ->
+	io:format("handling dl packet: client-~.10B~n", [M#mirror.number]),
+	{Packets, CIn} = decipher(Data, M#mirror.cin),
+	psu_capture:write(M#mirror.capture, client, M#mirror.number, Data, list_to_binary(Packets)),
+	lists:foldl(fun request/2, M#mirror{cin = CIn, number = M#mirror.number + 1}, Packets).
+
+% packets: split deciphered data, as stored in the cache
+
+packets(<<Size:32/little-unsigned-integer, _/bits>> = Buffer, Acc) when Size >= 8, byte_size(Buffer) >= Size ->
+	<<Packet:Size/binary, Rest/binary>> = Buffer,
+	packets(Rest, [Packet|Acc]);
+packets(<<Size:32/little-unsigned-integer, _/bits>> = Buffer, Acc) when Size < 8 ->
+	% not a packet header; keep the data as is rather than waiting forever
+	{lists:reverse([Buffer|Acc]), <<>>};
+packets(Buffer, Acc) ->
+	{lists:reverse(Acc), Buffer}.
+
+request(Packet, M) ->
+	M2 = record_finish(false, M),
+	Key = erlang:md5(<<(M2#mirror.key)/binary, Packet/binary>>),
+	case M2#mirror.server of
+		undefined ->
+			case lookup(M2#mirror.cache, Key) of
+				{ok, Hash, Close} ->
+					serve(Hash, Close, M2#mirror{key = Key, history = [Packet|M2#mirror.history]});
+				error ->
+					record_start(send_server(Packet, resync(M2#mirror{key = Key})))
+			end;
+		_ ->
+			record_start(send_server(Packet, M2#mirror{key = Key}))
+	end.
+
+% server: data from the upstream server, recorded and sent to the client packet by packet
+
+server(Data, M) ->
+	io:format("handling dl packet: server-~.10B~n", [M#mirror.number]),
+	{Packets, SIn} = decipher(Data, M#mirror.sin),
+	psu_capture:write(M#mirror.capture, server, M#mirror.number, Data, list_to_binary(Packets)),
+	lists:foldl(fun reply/2, M#mirror{sin = SIn, number = M#mirror.number + 1}, Packets).
+
+% reply: the packets that were already answered from the cache are dropped
+
+reply(Packet, #mirror{skip = Skip} = M) when Skip >= byte_size(Packet) ->
+	M#mirror{skip = Skip - byte_size(Packet)};
+reply(Packet, #mirror{skip = Skip} = M) ->
+	<<_:Skip/binary, Reply/binary>> = Packet,
+	send_client(Reply, record_reply(Reply, M#mirror{skip = 0})).
+
+send_client(Packet, M) ->
+	{Encrypted, COut} = encipher(Packet, M#mirror.cout),
+	ok = gen_tcp:send(M#mirror.client, Encrypted),
+	M#mirror{cout = COut}.
+
+send_server(Packet, M) ->
+	{Encrypted, SOut} = encipher(Packet, M#mirror.sout),
+	ok = gen_tcp:send(M#mirror.server, Encrypted),
+	M#mirror{sout = SOut}.
+
+% serve: send a cached reply, closing the session if the server did
+
+serve(Hash, Close, M) ->
+	io:format("reply from the cache: ~s~n", [Hash]),
+	{ok, File} = file:open(data_filename(M#mirror.cache, Hash), [read, raw, binary]),
+	M2 = serve_file(File, <<>>, M),
+	ok = file:close(File),
+	case Close of
+		true ->
+			gen_tcp:close(M2#mirror.client),
+			exit(normal);
+		false ->
+			M2
+	end.
+
+% serve_file: the reply is read by chunks and sent packet by packet
+
+serve_file(File, Buffer, M) ->
+	case file:read(File, ?CHUNK_SIZE) of
+		{ok, Data} ->
+			{Packets, Rest} = packets(<<Buffer/binary, Data/binary>>, []),
+			serve_file(File, Rest, lists:foldl(fun serve_packet/2, M, Packets));
+		eof when Buffer =:= <<>> ->
+			M;
+		eof ->
+			serve_packet(Buffer, M)
+	end.
+
+serve_packet(Packet, M) ->
+	send_client(Packet, M#mirror{served = M#mirror.served + byte_size(Packet)}).
+
+% decipher, encipher: psu_cipher:cipher/3 only keeps its state when a call
+% starts a new round (see the NOTE in nbl/psucipher.c), so its keystream
+% depends on where the calls split the data. Each packet is ciphered by a
+% single call, as the other side does: the raw data is kept until it holds
+% a whole packet, whose size is found by deciphering its first word alone.
+
+cipher_init(Seed) ->
+	{psu_cipher:init(Seed), 56, <<>>}.
+
+decipher(Data, {State, Acc, Buffer}) ->
+	decipher(<<Buffer/binary, Data/binary>>, State, Acc, []).
+
+decipher(<<Head:4/binary, _/bits>> = Buffer, State, Acc, Packets) ->
+	{<<Size:32/little-unsigned-integer>>, _, _} = psu_cipher:cipher(Head, State, Acc),
+	if
+		Size < 8; Size rem 4 =/= 0 ->
+			% not a packet header; decipher the data as is rather than waiting forever
+			Words = byte_size(Buffer) band (bnot 3),
+			<<Data:Words/binary, Rest/binary>> = Buffer,
+			{Out, RState, RAcc} = psu_cipher:cipher(Data, State, Acc),
+			{lists:reverse([Out|Packets]), {RState, RAcc, Rest}};
+		byte_size(Buffer) >= Size ->
+			<<Packet:Size/binary, Rest/binary>> = Buffer,
+			{Out, RState, RAcc} = psu_cipher:cipher(Packet, State, Acc),
+			decipher(Rest, RState, RAcc, [Out|Packets]);
+		true ->
+			{lists:reverse(Packets), {State, Acc, Buffer}}
+	end;
+decipher(Buffer, State, Acc, Packets) ->
+	{lists:reverse(Packets), {State, Acc, Buffer}}.
+
+encipher(Packet, {State, Acc, Buffer}) ->
+	{Out, RState, RAcc} = psu_cipher:cipher(Packet, State, Acc),
+	{Out, {RState, RAcc, Buffer}}.
+
+% lookup: the index file of a key holds the data hash and whether the server closed after it
+
+lookup(Cache, Key) ->
+	case file:read_file(filename:join(Cache, hex(Key))) of
+		{ok, Index} ->
+			{Hash, Close} = binary_to_term(Index),
+			{ok, Hash, Close};
+		{error, _} ->
+			error
+	end.
+
+% record_start, record_reply, record_finish, record_discard: save a reply while it is sent
+% The data goes to a temporary file, renamed after its md5 once complete.
+
+record_start(M) ->
+	Filename = tmp_filename(M#mirror.cache),
+	{ok, File} = file:open(Filename, [write, raw, binary, {delayed_write, ?CHUNK_SIZE, ?RECORD_DELAY}]),
+	M#mirror{record = {File, Filename, erlang:md5_init()}}.
+
+record_reply(_, #mirror{record = undefined} = M) ->
+	M;
+record_reply(Data, #mirror{record = {File, Filename, Md5}} = M) ->
+	ok = file:write(File, Data),
+	M#mirror{record = {File, Filename, erlang:md5_update(Md5, Data)}}.
+
+record_finish(_, #mirror{record = undefined} = M) ->
+	M;
+record_finish(Close, #mirror{record = {File, Filename, Md5}, cache = Cache} = M) ->
+	ok = file:close(File),
+	Hash = hex(erlang:md5_final(Md5)),
+	DataFilename = data_filename(Cache, Hash),
+	case filelib:is_regular(DataFilename) of
+		true ->
+			file:delete(Filename);
+		false ->
+			ok = file:rename(Filename, DataFilename)
+	end,
+	ok = write_file(filename:join(Cache, hex(M#mirror.key)), term_to_binary({Hash, Close})),
+	M#mirror{record = undefined}.
+
+record_discard(#mirror{record = undefined}) ->
+	ok;
+record_discard(#mirror{record = {File, Filename, _}}) ->
+	file:close(File),
+	file:delete(Filename).
+
+% write_file: write then rename, so that concurrent sessions never read a partial file
+
+write_file(Filename, Data) ->
+	Tmp = Filename ++ ".tmp" ++ integer_to_list(erlang:phash2({self(), os:timestamp()})),
+	ok = file:write_file(Tmp, Data),
+	file:rename(Tmp, Filename).
+
+tmp_filename(Cache) ->
+	filename:join(Cache, "tmp" ++ integer_to_list(erlang:phash2({self(), os:timestamp()}))).
+
+data_filename(Cache, Hash) ->
+	filename:join([Cache, "data", Hash]).
+
+hex(Binary) ->
+	lists:flatten([io_lib:format("~2.16.0b", [B]) || <<B>> <= Binary]).
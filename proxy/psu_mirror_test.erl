@@ -0,0 +1,137 @@
+-module(psu_mirror_test).
+-export([run/0]).
+
+% Test of psu_mirror against a local stand-in for the download server.
+%
+% The stand-in answers any request with a file larger than the mirror's read
+% size, in packets, then closes the connection. The file is fetched twice
+% through the mirror: the first time from the stand-in, the second from the
+% cache. Both times the bytes the client receives must be the file, and the
+% stand-in must only be connected once. It ciphers every packet by a single
+% psu_cipher:cipher/3 call, independently of psu_mirror.
+%
+% run: returns ok, or fails with a badmatch. The cache and the capture files
+% go to a new directory under the system's temporary directory.
+
+-define(TCP_OPTIONS, [binary, {packet, 0}, {active, false}, {reuseaddr, true}]).
+
+-define(FILE_SIZE, 1572868).	% more than 1 MB, in whole words
+-define(DATA_SIZE, 16#7ff8).	% file data per reply packet
+-define(TIMEOUT, 30000).
+
+run() ->
+	Dir = filename:join(tmp_dir(), "psu_mirror_test-" ++ os:getpid()),
+	Cache = filename:join(Dir, "cache"),
+	ok = filelib:ensure_dir(filename:join(Cache, "x")),
+	{ok, Cwd} = file:get_cwd(),
+	ok = file:set_cwd(Dir),
+	try
+		run(Cache)
+	after
+		file:set_cwd(Cwd),
+		file:del_dir_r(Dir)
+	end.
+
+run(Cache) ->
+	Data = crypto:strong_rand_bytes(?FILE_SIZE),
+	{ok, LSocket} = gen_tcp:listen(0, ?TCP_OPTIONS),
+	{ok, UpstreamPort} = inet:port(LSocket),
+	Self = self(),
+	Upstream = spawn_link(fun() -> upstream(LSocket, Data, Self) end),
+	ok = gen_tcp:controlling_process(LSocket, Upstream),
+	Port = free_port(),
+	psu_mirror:start(Cache, Port, "localhost", UpstreamPort),
+	timer:sleep(500),
+	{Seeds1, Data} = fetch(Port),
+	{Seeds2, Data} = fetch(Port),
+	true = Seeds1 =/= Seeds2,
+	1 = upstream_sessions(0),
+	unlink(Upstream),
+	exit(Upstream, kill),
+	io:format("psu_mirror_test: ok~n"),
+	ok.
+
+tmp_dir() ->
+	case os:getenv("TMPDIR") of
+		false -> "/tmp";
+		Dir -> Dir
+	end.
+
+free_port() ->
+	{ok, Socket} = gen_tcp:listen(0, ?TCP_OPTIONS),
+	{ok, Port} = inet:port(Socket),
+	ok = gen_tcp:close(Socket),
+	Port.
+
+upstream_sessions(Count) ->
+	receive
+		upstream_session ->
+			upstream_sessions(Count + 1)
+	after 0 ->
+		Count
+	end.
+
+% upstream: the stand-in server, see psu_patch:patch_proxy_hello/3 for the hello packet layout
+
+upstream(LSocket, Data, Parent) ->
+	{ok, Socket} = gen_tcp:accept(LSocket),
+	Parent ! upstream_session,
+	<<ServerSeed:32/little-unsigned-integer, ClientSeed:32/little-unsigned-integer>> = crypto:strong_rand_bytes(8),
+	ok = gen_tcp:send(Socket, <<40:32/little-unsigned-integer, 16#0202:16, 0:16, 0:32,
+		ServerSeed:32/little-unsigned-integer, ClientSeed:32/little-unsigned-integer, 0:160>>),
+	{_Request, _} = recv_packet(Socket, {psu_cipher:init(ClientSeed), 56}),
+	% a single send, so that TCP splits the packets wherever it likes
+	{Reply, _} = cipher_packets(file_packets(Data, []), {psu_cipher:init(ServerSeed), 56}, []),
+	ok = gen_tcp:send(Socket, Reply),
+	ok = gen_tcp:close(Socket),
+	upstream(LSocket, Data, Parent).
+
+file_packets(<<Chunk:?DATA_SIZE/binary, Rest/binary>>, Acc) ->
+	file_packets(Rest, [file_packet(Chunk)|Acc]);
+file_packets(<<>>, Acc) ->
+	lists:reverse(Acc);
+file_packets(Chunk, Acc) ->
+	lists:reverse([file_packet(Chunk)|Acc]).
+
+file_packet(Chunk) ->
+	<<(byte_size(Chunk) + 8):32/little-unsigned-integer, 16#0c02:16, 0:16, Chunk/binary>>.
+
+cipher_packets([Packet|Tail], {State, Acc}, Out) ->
+	{Encrypted, RState, RAcc} = psu_cipher:cipher(Packet, State, Acc),
+	cipher_packets(Tail, {RState, RAcc}, [Encrypted|Out]);
+cipher_packets([], Cipher, Out) ->
+	{lists:reverse(Out), Cipher}.
+
+% fetch: request the file through the mirror and return the seeds and the file received
+
+fetch(Port) ->
+	{ok, Socket} = gen_tcp:connect("localhost", Port, ?TCP_OPTIONS),
+	{ok, <<Size:32/little-unsigned-integer>> = Head} = gen_tcp:recv(Socket, 4, ?TIMEOUT),
+	{ok, Body} = gen_tcp:recv(Socket, Size - 4, ?TIMEOUT),
+	<<_:96, ServerSeed:32/little-unsigned-integer, ClientSeed:32/little-unsigned-integer, _/bits>> = <<Head/binary, Body/binary>>,
+	{[Request], _} = cipher_packets([<<12:32/little-unsigned-integer, 16#0b02:16, 0:16, 1:32>>], {psu_cipher:init(ClientSeed), 56}, []),
+	ok = gen_tcp:send(Socket, Request),
+	Data = recv_file(Socket, {psu_cipher:init(ServerSeed), 56}, []),
+	gen_tcp:close(Socket),
+	{{ServerSeed, ClientSeed}, Data}.
+
+recv_file(Socket, Cipher, Acc) ->
+	case recv_packet(Socket, Cipher) of
+		{<<_:64, Chunk/binary>>, RCipher} ->
+			recv_file(Socket, RCipher, [Chunk|Acc]);
+		closed ->
+			list_to_binary(lists:reverse(Acc))
+	end.
+
+% recv_packet: the size is found by deciphering the first word alone
+
+recv_packet(Socket, {State, Acc}) ->
+	case gen_tcp:recv(Socket, 4, ?TIMEOUT) of
+		{ok, Head} ->
+			{<<Size:32/little-unsigned-integer>>, _, _} = psu_cipher:cipher(Head, State, Acc),
+			{ok, Body} = gen_tcp:recv(Socket, Size - 4, ?TIMEOUT),
+			{Packet, RState, RAcc} = psu_cipher:cipher(<<Head/binary, Body/binary>>, State, Acc),
+			{Packet, {RState, RAcc}};
+		{error, closed} ->
+			closed
+	end.
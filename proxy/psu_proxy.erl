@@ -27,8 +27,9 @@ login_accept(LSocket) ->
 	{ok, CSocket} = ssl:transport_accept(LSocket),
 	ok = ssl:ssl_accept(CSocket),
 	{ok, SSocket} = ssl:connect(?LOGIN_HOST, ?LOGIN_PORT, ?CONNECT_OPTIONS),
-	spawn(fun() -> login_proxy(CSocket, SSocket, "login-client", 1) end),
-	spawn(fun() -> login_proxy(SSocket, CSocket, "login-server", 1) end),
+	Capture = psu_capture:open("login"),
+	psu_capture:attach(Capture, spawn(fun() -> login_proxy(CSocket, SSocket, Capture, client, 1) end)),
+	psu_capture:attach(Capture, spawn(fun() -> login_proxy(SSocket, CSocket, Capture, server, 1) end)),
 	login_accept(LSocket).
 
 login_spoof_game(SocketSend, Packet) ->
@@ -39,24 +40,24 @@ login_spoof_game(SocketSend, Packet) ->
 	spawn(fun() -> game_listen(GameIP, GamePort) end),
 	ssl:send(SocketSend, SpoofedPacket).
 
-login_proxy(SocketRecv, SocketSend, Name, Number) ->
+login_proxy(SocketRecv, SocketSend, Capture, Direction, Number) ->
 	case ssl:recv(SocketRecv, 0, 50) of
 		{ok, Packet} ->
 			<<_:32, Command:24/unsigned-integer, _/bits>> = Packet,
-			io:format("handling login packet: ~s-~.10B~n", [Name, Number]),
-			file:write_file(lists:concat([Name, "-packet-", Number, ".bin"]), Packet),
+			io:format("handling login packet: ~s-~.10B~n", [Direction, Number]),
+			psu_capture:write(Capture, Direction, Number, Packet, Packet),
 			case Command of
 				16#021603 ->
 					login_spoof_game(SocketSend, Packet);
 				_ ->
 					ssl:send(SocketSend, Packet),
-					login_proxy(SocketRecv, SocketSend, Name, Number + 1)
+					login_proxy(SocketRecv, SocketSend, Capture, Direction, Number + 1)
 			end;
 		{error, closed} ->
-			io:format("socket ~s closed~n", [Name]),
+			io:format("socket ~s closed~n", [Direction]),
 			ssl:close(SocketSend); % close other socket
 		{error, timeout} ->
-			login_proxy(SocketRecv, SocketSend, Name, Number)
+			login_proxy(SocketRecv, SocketSend, Capture, Direction, Number)
 	end.
 
 game_listen(GameIP, GamePort) ->
@@ -69,20 +70,21 @@ game_accept(LSocket, GameIP, GamePort) ->
 	<<A:8/little-unsigned-integer, B:8/little-unsigned-integer, C:8/little-unsigned-integer, D:8/little-unsigned-integer>> = GameIP,
 	{ok, SSocket} = ssl:connect({A, B, C, D}, GamePort, ?CONNECT_OPTIONS),
 	io:format("game server ~.10B.~.10B.~.10B.~.10B:~.10B connected!~n", [A, B, C, D, GamePort]),
-	spawn(fun() -> game_proxy(CSocket, SSocket, << 16#43, 16#4c, 16#4e, 16#54 >>, 1) end),
-	spawn(fun() -> game_proxy(SSocket, CSocket, << 16#53, 16#45, 16#52, 16#56 >>, 1) end),
+	Capture = psu_capture:open("game"),
+	psu_capture:attach(Capture, spawn(fun() -> game_proxy(CSocket, SSocket, Capture, client, 1) end)),
+	psu_capture:attach(Capture, spawn(fun() -> game_proxy(SSocket, CSocket, Capture, server, 1) end)),
 	game_accept(LSocket, GameIP, GamePort).
 
-game_proxy(SocketRecv, SocketSend, Name, Number) ->
+game_proxy(SocketRecv, SocketSend, Capture, Direction, Number) ->
 	case ssl:recv(SocketRecv, 0, 50) of
 		{ok, Packet} ->
-			io:format("handling game packet: ~s-~.10B~n", [Name, Number]),
-			file:write_file("log.bin", << Name/binary, Number:32/little-unsigned-integer, Packet/binary >>, [append]),
+			io:format("handling game packet: ~s-~.10B~n", [Direction, Number]),
+			psu_capture:write(Capture, Direction, Number, Packet, Packet),
 			ssl:send(SocketSend, Packet),
-			game_proxy(SocketRecv, SocketSend, Name, Number + 1);
+			game_proxy(SocketRecv, SocketSend, Capture, Direction, Number + 1);
 		{error, closed} ->
-			io:format("socket ~s closed~n", [Name]),
+			io:format("socket ~s closed~n", [Direction]),
 			ssl:close(SocketSend); % close other socket
 		{error, timeout} ->
-			game_proxy(SocketRecv, SocketSend, Name, Number)
+			game_proxy(SocketRecv, SocketSend, Capture, Direction, Number)
 	end.
@@ -0,0 +1,152 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../nbl/capture.h"
+#include "../nbl/compat.h"
+
+/**
+ * Prototypes.
+ */
+
+int dump_record(int iFd, long long llPos, int iRaw);
+
+/**
+ * Write the decrypted or raw payload of the record at the given position to stdout.
+ */
+
+int dump_record(int iFd, long long llPos, int iRaw)
+{
+	char pstrHeader[CAP_RECORD_HEADER_SIZE];
+	char* pstrBuffer;
+	unsigned int uSize;
+	off_t iPos;
+
+	if (pread(iFd, pstrHeader, CAP_RECORD_HEADER_SIZE, llPos) != CAP_RECORD_HEADER_SIZE)
+		return -1;
+
+	iPos = llPos + CAP_RECORD_HEADER_SIZE;
+	if (iRaw)
+		uSize = CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE);
+	else {
+		uSize = CAP_READ_UINT(pstrHeader, CAP_RECORD_DEC_SIZE);
+		iPos += CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE);
+	}
+
+	pstrBuffer = malloc(uSize + 1);
+	if (pstrBuffer == NULL)
+		return -3;
+
+	if (pread(iFd, pstrBuffer, uSize, iPos) != (ssize_t)uSize || fwrite(pstrBuffer, 1, uSize, stdout) != uSize) {
+		free(pstrBuffer);
+		return -1;
+	}
+
+	free(pstrBuffer);
+	return 0;
+}
+
+/**
+ * List the records of a capture, or write one record's payload to stdout.
+ */
+
+int main(int argc, char** argv)
+{
+	char pstrHeader[CAP_RECORD_HEADER_SIZE];
+	long long* pIndex;
+	unsigned int i, uNbRecords;
+	int iFd, iRecord = -1, iRaw = 0;
+	int ret = 0;
+
+	opterr = 0;
+	while ((ret = getopt(argc, argv, "n:r")) != -1) {
+		switch (ret) {
+			case 'n':
+				iRecord = atoi(optarg);
+				break;
+
+			case 'r':
+				iRaw = 1;
+				break;
+
+			case '?':
+				if (optopt == 'n')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 1;
+
+			default:
+				abort();
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Usage: %s [-n record [-r]] file.psucap\n", argv[0]);
+		return 2;
+	}
+
+	iFd = open(argv[optind], O_RDONLY | O_BINARY);
+	if (iFd < 0) {
+		fprintf(stderr, "Error opening file %s\n", argv[optind]);
+		return -1;
+	}
+
+	pIndex = capture_load_index(iFd, &uNbRecords);
+	if (pIndex == NULL) {
+		fprintf(stderr, "Invalid capture file %s\n", argv[optind]);
+		close(iFd);
+		return -1;
+	}
+
+	ret = 0;
+	if (iRecord >= 0) {
+		if ((unsigned int)iRecord >= uNbRecords) {
+			fprintf(stderr, "Record %d not found\n", iRecord);
+			ret = -2;
+		} else
+			ret = dump_record(iFd, pIndex[iRecord], iRaw);
+	} else {
+		for (i = 0; i < uNbRecords; i++) {
+			if (pread(iFd, pstrHeader, CAP_RECORD_HEADER_SIZE, pIndex[i]) != CAP_RECORD_HEADER_SIZE) {
+				ret = -1;
+				break;
+			}
+
+			printf("%u\t%llu\t%s-%u\traw=%u\tdecrypted=%u\n", i,
+				CAP_READ_ULONG(pstrHeader, CAP_RECORD_TIMESTAMP),
+				pstrHeader[CAP_RECORD_DIRECTION] ? "server" : "client",
+				CAP_READ_UINT(pstrHeader, CAP_RECORD_NUMBER),
+				CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE),
+				CAP_READ_UINT(pstrHeader, CAP_RECORD_DEC_SIZE));
+		}
+	}
+
+	free(pIndex);
+	close(iFd);
+	return ret;
+}
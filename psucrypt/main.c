@@ -0,0 +1,300 @@
+/*
+	gasetools: a set of tools to manipulate SEGA games file formats
+	Copyright (C) 2010  Loic Hoguin
+
+	This file is part of gasetools.
+
+	gasetools is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	gasetools is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with gasetools.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../nbl/capture.h"
+#include "../nbl/compat.h"
+#include "../nbl/psucipher.h"
+
+/**
+ * Prototypes.
+ */
+
+char* read_payload(int iFd, long long llPos, char* pstrHeader, int iRaw);
+int read_seed(int iFd, long long* pIndex, unsigned int uNbRecords, int iClient, unsigned int* puSeed);
+int decrypt_capture(int iFd, long long* pIndex, unsigned int uNbRecords, int iClient, unsigned int uSeed, char* pstrPrefix);
+
+/**
+ * Positions in the hello packet.
+ */
+
+#define HELLO_SERVER_SEED	0x0C
+#define HELLO_CLIENT_SEED	0x10
+#define HELLO_SIZE			0x14
+
+/**
+ * Packet number of the hello packet, sent in clear by the server.
+ */
+
+#define HELLO_NUMBER 0
+
+/**
+ * Read the record header at the given position and its raw or decrypted payload.
+ * Returns a new buffer with the payload, or NULL on error.
+ */
+
+char* read_payload(int iFd, long long llPos, char* pstrHeader, int iRaw)
+{
+	char* pstrBuffer;
+	unsigned int uSize;
+	off_t iPos;
+
+	if (pread(iFd, pstrHeader, CAP_RECORD_HEADER_SIZE, llPos) != CAP_RECORD_HEADER_SIZE)
+		return NULL;
+
+	iPos = llPos + CAP_RECORD_HEADER_SIZE;
+	if (iRaw)
+		uSize = CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE);
+	else {
+		uSize = CAP_READ_UINT(pstrHeader, CAP_RECORD_DEC_SIZE);
+		iPos += CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE);
+	}
+
+	pstrBuffer = malloc(uSize + 1);
+	if (pstrBuffer == NULL)
+		return NULL;
+
+	if (pread(iFd, pstrBuffer, uSize, iPos) != (ssize_t)uSize) {
+		free(pstrBuffer);
+		return NULL;
+	}
+
+	return pstrBuffer;
+}
+
+/**
+ * Read the seed of one direction from the hello packet of the capture.
+ */
+
+int read_seed(int iFd, long long* pIndex, unsigned int uNbRecords, int iClient, unsigned int* puSeed)
+{
+	char pstrHeader[CAP_RECORD_HEADER_SIZE];
+	unsigned char* pHello;
+	unsigned int i;
+	int iPos;
+
+	for (i = 0; i < uNbRecords; i++) {
+		if (pread(iFd, pstrHeader, CAP_RECORD_HEADER_SIZE, pIndex[i]) != CAP_RECORD_HEADER_SIZE)
+			return -1;
+
+		if (pstrHeader[CAP_RECORD_DIRECTION] == 1 && CAP_READ_UINT(pstrHeader, CAP_RECORD_NUMBER) == HELLO_NUMBER
+			&& CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE) >= HELLO_SIZE)
+			break;
+	}
+
+	if (i == uNbRecords)
+		return -2;
+
+	pHello = (unsigned char*)read_payload(iFd, pIndex[i], pstrHeader, 1);
+	if (pHello == NULL)
+		return -1;
+
+	iPos = iClient ? HELLO_CLIENT_SEED : HELLO_SERVER_SEED;
+	*puSeed = pHello[iPos] | (pHello[iPos + 1] << 8) | (pHello[iPos + 2] << 16) | ((unsigned int)pHello[iPos + 3] << 24);
+
+	free(pHello);
+	return 0;
+}
+
+/**
+ * Decrypt the raw packets sent in one direction, in the order they were captured.
+ * Each packet is saved as prefix-R.dec, R being its record number as listed by psucap.
+ *
+ * The proxy may record a packet a second time after rewriting it, with the same
+ * packet number; both copies are encrypted from the same point of the stream.
+ * Returns the number of packets that differ from the proxy's own decryption,
+ * or a negative value on error.
+ */
+
+int decrypt_capture(int iFd, long long* pIndex, unsigned int uNbRecords, int iClient, unsigned int uSeed, char* pstrPrefix)
+{
+	struct psu_cipher_ctx ctx, prev;
+	FILE* pFile;
+	char pstrHeader[CAP_RECORD_HEADER_SIZE];
+	char pstrOut[FILENAME_MAX];
+	char* pstrRaw = NULL;
+	char* pstrDecrypted = NULL;
+	unsigned int i, uNumber, uPrevNumber = HELLO_NUMBER, uSize;
+	int ret = 0;
+
+	psu_cipher_init(&ctx, uSeed);
+	prev = ctx;
+
+	for (i = 0; i < uNbRecords; i++) {
+		if (pread(iFd, pstrHeader, CAP_RECORD_HEADER_SIZE, pIndex[i]) != CAP_RECORD_HEADER_SIZE) {
+			ret = -1;
+			goto decrypt_capture_ret;
+		}
+
+		uNumber = CAP_READ_UINT(pstrHeader, CAP_RECORD_NUMBER);
+		if (pstrHeader[CAP_RECORD_DIRECTION] != !iClient || uNumber == HELLO_NUMBER)
+			continue;
+
+		if (uNumber == uPrevNumber)
+			ctx = prev;
+		else
+			prev = ctx;
+		uPrevNumber = uNumber;
+
+		pstrRaw = read_payload(iFd, pIndex[i], pstrHeader, 1);
+		pstrDecrypted = read_payload(iFd, pIndex[i], pstrHeader, 0);
+		if (pstrRaw == NULL || pstrDecrypted == NULL) {
+			ret = -1;
+			goto decrypt_capture_ret;
+		}
+
+		uSize = CAP_READ_UINT(pstrHeader, CAP_RECORD_RAW_SIZE);
+		uSize = psu_cipher(&ctx, (unsigned char*)pstrRaw, (unsigned char*)pstrRaw, uSize);
+
+		if (uSize != CAP_READ_UINT(pstrHeader, CAP_RECORD_DEC_SIZE) || memcmp(pstrRaw, pstrDecrypted, uSize) != 0)
+			ret++;
+
+		if (snprintf(pstrOut, FILENAME_MAX, "%s-%u.dec", pstrPrefix, i) >= FILENAME_MAX) {
+			ret = -2;
+			goto decrypt_capture_ret;
+		}
+
+		pFile = fopen(pstrOut, "wb");
+		if (pFile == NULL || fwrite(pstrRaw, 1, uSize, pFile) != uSize) {
+			fprintf(stderr, "Error writing file %s\n", pstrOut);
+			if (pFile)
+				fclose(pFile);
+			ret = -1;
+			goto decrypt_capture_ret;
+		}
+		fclose(pFile);
+
+		free(pstrRaw);
+		free(pstrDecrypted);
+		pstrRaw = NULL;
+		pstrDecrypted = NULL;
+	}
+
+decrypt_capture_ret:
+	free(pstrRaw);
+	free(pstrDecrypted);
+	return ret;
+}
+
+/**
+ * Decrypt the packets of one side of a connection from a capture written by the proxy.
+ * The seed is given directly or read from the hello packet; -c selects the packets
+ * sent by the client.
+ */
+
+int main(int argc, char** argv)
+{
+	char pstrPrefix[FILENAME_MAX];
+	char* pstrDestPath = NULL;
+	char* pstrBase;
+	char* pstrExt;
+	long long* pIndex;
+	unsigned int uNbRecords, uSeed = 0;
+	int iFd, iHasSeed = 0, iClient = 0;
+	int i, ret = 0;
+
+	opterr = 0;
+	while ((i = getopt(argc, argv, "co:s:")) != -1) {
+		switch (i) {
+			case 'c':
+				iClient = 1;
+				break;
+
+			case 'o':
+				pstrDestPath = optarg;
+				break;
+
+			case 's':
+				uSeed = strtoul(optarg, NULL, 16);
+				iHasSeed = 1;
+				break;
+
+			case '?':
+				if (optopt == 'o' || optopt == 's')
+					fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+				else if (isprint(optopt))
+					fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+				else
+					fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+				return 1;
+
+			default:
+				abort();
+		}
+	}
+
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Usage: %s [-c] [-s seed] [-o destpath] file.psucap\n", argv[0]);
+		return 2;
+	}
+
+	/* Outputs are named after the capture, next to it or in destpath. */
+	pstrBase = strrchr(argv[optind], '/');
+	pstrBase = pstrBase ? pstrBase + 1 : argv[optind];
+	if (pstrDestPath)
+		i = snprintf(pstrPrefix, FILENAME_MAX, "%s/%s", pstrDestPath, pstrBase);
+	else
+		i = snprintf(pstrPrefix, FILENAME_MAX, "%s", argv[optind]);
+	if (i >= FILENAME_MAX - (int)sizeof("-server")) {
+		fprintf(stderr, "Path too long: %s\n", argv[optind]);
+		return -2;
+	}
+
+	pstrExt = strrchr(pstrPrefix, '.');
+	if (pstrExt && strcmp(pstrExt, ".psucap") == 0)
+		*pstrExt = 0;
+	strcat(pstrPrefix, iClient ? "-client" : "-server");
+
+	iFd = open(argv[optind], O_RDONLY | O_BINARY);
+	if (iFd < 0) {
+		fprintf(stderr, "Error opening file %s\n", argv[optind]);
+		return -1;
+	}
+
+	pIndex = capture_load_index(iFd, &uNbRecords);
+	if (pIndex == NULL) {
+		fprintf(stderr, "Invalid capture file %s\n", argv[optind]);
+		close(iFd);
+		return -1;
+	}
+
+	if (!iHasSeed && read_seed(iFd, pIndex, uNbRecords, iClient, &uSeed) != 0) {
+		fprintf(stderr, "No hello packet in %s; give the seed with -s\n", argv[optind]);
+		ret = -2;
+		goto main_ret;
+	}
+
+	ret = decrypt_capture(iFd, pIndex, uNbRecords, iClient, uSeed, pstrPrefix);
+	if (ret > 0) {
+		fprintf(stderr, "%d packets differ from the proxy's decryption\n", ret);
+		ret = 1;
+	} else if (ret < 0)
+		fprintf(stderr, "Error decrypting file %s\n", argv[optind]);
+
+main_ret:
+	free(pIndex);
+	close(iFd);
+	return ret;
+}